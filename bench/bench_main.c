@@ -0,0 +1,528 @@
+/* *********************** INFO *****************************
+
+            "CONCURRENT TCP SERVER"
+            (benchmark)
+
+************ BRIEF EXPLANATION OF THE ALGORITHM **************
+ The benchmark is a load generator for server2: it drives many concurrent connections against a running server and measures how the server mode (fork, prefork, epoll, uring, with or without the cache) behaves, so that the modes can be compared run over run.
+
+ The address and the port of the server are the first two command line parameters; the files requested follow them. Without files the size mix (-m, --mix) is used: it is a list of size classes with their weights, e.g. "tiny:90,1m:9,big:1", where tiny is a 512 byte file, 1m a 1 MB file and big a 5 GB (sparse) file. The files of the classes are created in the directory served by the server with the -p (--prepare) option, that creates them and exits.
+
+ -c (--concurrency) threads are started, each one with its own connection. A thread sends one request at a time: the command is built by formatGetRequest() and the reply header is parsed by readReplyHeader() (protocol.c, the same code of the client), then the body is read and discarded. -k (--reuse) sets how many requests are sent on a connection before opening a new one (0, the default, keeps the first connection for the whole run; 1 opens a connection per request). The run ends after -n (--requests) requests or, with -d (--duration), after the given number of seconds.
+
+ For every request the latency to the first byte (from the send of the command to the reply header) and to the completion (the last byte of the body) are recorded in per thread arrays (latency.c), merged at the end. The report contains the requests, errors, connections, bytes, the throughput, the requests and the connections per second and the mean, p50, p99 and p999 of the two latencies. -o (--format) selects text, json (one object per run, one line) or csv (a header line and a row); -L (--label) adds a free label to the report (e.g. the server mode), -l uses the GET command of the old servers instead of GET64.
+ 
+ With -t (--tls) user or ktls every connection starts with a TLS handshake (tlswrap.c, built with -DHAVE_OPENSSL -lssl -lcrypto; the certificate of the server is not verified), against a server started with the same --tls mode: the three transports are compared on the same files by running the benchmark once per mode. The report shows the transport and how many connections had their records taken by the kernel (kernel TLS): with ktls requested and no tls module in the kernel the connections fall back to the user space relay, and the count says so.
+************************************************************ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "./../errlib.h"
+#include "./../sockwrap.h"
+#include "./../protocol.h"
+#include "./../tlswrap.h"
+#include "latency.h"
+
+#define SNDBUFFERLENGTH     4097                //send buffer length
+#define BODYBUFFERLENGTH    (256*1024)          //bytes of the body read (and discarded) at a time
+#define WAITINGTIME         60                  //waiting time on each read from the server
+#define MAXCONCURRENCY      1024
+#define MAXFILES            256
+
+typedef enum {FORMAT_TEXT, FORMAT_JSON, FORMAT_CSV} reportFormat;
+
+//size classes of the mix, created by --prepare
+static const struct sizeClass {
+    const char *name;
+    const char *filename;
+    uint64_t size;
+} sizeClasses[] = {
+    {"tiny", "bench_tiny.bin", 512},
+    {"1m",   "bench_1m.bin",   1024*1024},
+    {"big",  "bench_big.bin",  5ULL*1024*1024*1024},
+};
+#define NCLASSES            (sizeof(sizeClasses)/sizeof(sizeClasses[0]))
+
+//statistics of one thread
+struct benchThread {
+    pthread_t tid;
+    unsigned int seed;                  //rand_r() state for the choice of the files
+    uint64_t requests, errors, connections, bytes;
+    uint64_t offloaded;                 //-t: connections whose TLS records the kernel took
+    struct latencySamples firstByte;    //microseconds to the reply header
+    struct latencySamples complete;     //microseconds to the last byte of the body
+};
+
+char *prog_name;
+static struct sockaddr_in saddr;                //server address structure
+static int concurrency = 4;                     //-c: connections in parallel
+static long totalRequests = 1000;               //-n: requests of the whole run
+static double duration = 0;                     //-d: seconds of the run, instead of -n
+static int reuse = 0;                           //-k: requests per connection, 0 = all
+static int legacyGet = 0;                       //-l: GET instead of GET64
+static reportFormat format = FORMAT_TEXT;       //-o
+static const char *label = "";                  //-L
+static const char *transport = "plain";         //-t: plain, user or ktls
+static void *tlsContext = NULL;                 //-t: every connection starts with a handshake
+static const char *files[MAXFILES];             //files requested and their weights
+static int weights[MAXFILES];
+static int nfiles, totalWeight;
+static long requestsLeft;                       //shared by the threads when -n is used
+static struct timespec deadline;                //end of the run when -d is used
+
+static void usage(void);
+static int parseMix(const char *mix);
+static int prepareFiles(const char *dir);
+static void *benchThreadFunction(void *arg);
+static int benchConnect(struct benchThread *bt);
+static int benchRequest(int s, Rbuf *rb, const char *filename, struct benchThread *bt);
+static int takeRequest(void);
+static const char *pickFile(struct benchThread *bt);
+static double elapsedUs(const struct timespec *from, const struct timespec *to);
+static void printReport(struct benchThread *threads, double elapsed);
+
+static const struct option longOptions[] = {
+    {"concurrency", required_argument, NULL, 'c'},
+    {"requests",    required_argument, NULL, 'n'},
+    {"duration",    required_argument, NULL, 'd'},
+    {"reuse",       required_argument, NULL, 'k'},
+    {"mix",         required_argument, NULL, 'm'},
+    {"prepare",     required_argument, NULL, 'p'},
+    {"format",      required_argument, NULL, 'o'},
+    {"label",       required_argument, NULL, 'L'},
+    {"legacy",      no_argument,       NULL, 'l'},
+    {"tls",         required_argument, NULL, 't'},
+    {NULL, 0, NULL, 0}
+};
+
+
+
+int main(int argc, char **argv){
+    
+    //defining variables
+    uint16_t tport_h;                   //server port number (host order)
+    struct in_addr sIPaddr;             //server IP address structure
+    struct benchThread *threads;
+    struct timespec start, end;
+    const char *mix = "tiny:90,1m:10";
+    int opt, i;
+    
+    //assigning program name
+    prog_name = argv[0];
+    
+    //reading options passed by command line
+    while((opt = getopt_long(argc, argv, "c:n:d:k:m:p:o:L:lt:", longOptions, NULL)) != -1){
+        switch(opt){
+            case 'c':
+                if(sscanf(optarg, "%d", &concurrency)!=1 || concurrency<=0 || concurrency>MAXCONCURRENCY){
+                    usage();
+                }
+                break;
+            case 'n':
+                if(sscanf(optarg, "%ld", &totalRequests)!=1 || totalRequests<=0){
+                    usage();
+                }
+                break;
+            case 'd':
+                if(sscanf(optarg, "%lf", &duration)!=1 || duration<=0){
+                    usage();
+                }
+                break;
+            case 'k':
+                if(sscanf(optarg, "%d", &reuse)!=1 || reuse<0){
+                    usage();
+                }
+                break;
+            case 'm':
+                mix = optarg;
+                break;
+            case 'p':
+                return prepareFiles(optarg) < 0 ? 1 : 0;
+            case 'o':
+                if(strcmp(optarg, "text")==0){
+                    format = FORMAT_TEXT;
+                }else if(strcmp(optarg, "json")==0){
+                    format = FORMAT_JSON;
+                }else if(strcmp(optarg, "csv")==0){
+                    format = FORMAT_CSV;
+                }else{
+                    usage();
+                }
+                break;
+            case 'L':
+                label = optarg;
+                break;
+            case 'l':
+                legacyGet = 1;
+                break;
+            case 't':
+                if(strcmp(optarg, "user")!=0 && strcmp(optarg, "ktls")!=0){
+                    usage();
+                }
+                transport = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if(argc-optind < 2){
+        usage();
+    }
+    
+    //getting address and port of the server from command line
+    if(inet_aton(argv[optind], &sIPaddr) == 0 || sscanf(argv[optind+1], "%" SCNu16, &tport_h)!=1){
+        usage();
+    }
+    bzero(&saddr, sizeof(saddr));
+    saddr.sin_family    =   AF_INET;
+    saddr.sin_port      =   htons(tport_h);
+    saddr.sin_addr      =   sIPaddr;
+    
+    //-t: the handshake is part of the cost of a connection, the certificate is not verified
+    if(strcmp(transport, "plain")!=0 &&
+       (tlsContext = tls_context(TLS_NOVERIFY | (strcmp(transport, "ktls")==0 ? TLS_KTLS : 0), NULL, NULL, NULL)) == NULL){
+        err_quit("(%s) error - TLS not available: %s", prog_name, tls_strerror());
+    }
+    
+    //files of the command line (same weight) or the size mix
+    if(argc-optind > 2){
+        for(i=optind+2; i<argc && nfiles<MAXFILES; i++){
+            files[nfiles] = argv[i];
+            weights[nfiles++] = 1;
+        }
+        totalWeight = nfiles;
+    }else if(parseMix(mix) < 0){
+        usage();
+    }
+    
+    //starting the threads, each one with its own connection
+    if((threads = calloc(concurrency, sizeof(*threads))) == NULL){
+        err_sys("(%s) error - out of memory", prog_name);
+    }
+    requestsLeft = totalRequests;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(duration > 0){
+        deadline = start;
+        deadline.tv_sec += (time_t)duration;
+        deadline.tv_nsec += (long)((duration - (time_t)duration) * 1e9);
+        if(deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    for(i=0; i<concurrency; i++){
+        threads[i].seed = (unsigned int)(start.tv_nsec + i);
+        latencyInit(&threads[i].firstByte);
+        latencyInit(&threads[i].complete);
+        if((errno = pthread_create(&threads[i].tid, NULL, benchThreadFunction, &threads[i])) != 0){
+            err_sys("(%s) error - pthread_create() failed", prog_name);
+        }
+    }
+    for(i=0; i<concurrency; i++){
+        pthread_join(threads[i].tid, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    tls_drain();
+    
+    printReport(threads, elapsedUs(&start, &end) / 1e6);
+    return(0);
+    
+}
+
+
+static void usage(void){
+    
+    size_t i;
+    
+    printf("Usage: %s [-c concurrency] [-n requests | -d seconds] [-k requests per connection] [-m class:weight,...]\n"
+           "\t[-o text|json|csv] [-L label] [-l] [-t user|ktls] <address> <port> [file...]\n"
+           "       %s -p <directory>    (creates the files of the size classes:", prog_name, prog_name);
+    for(i=0; i<NCLASSES; i++){
+        printf(" %s=%s", sizeClasses[i].name, sizeClasses[i].filename);
+    }
+    printf(")\n");
+    exit(1);
+}
+
+
+//"tiny:90,1m:10": files of the size classes with their weights, returns -1 if malformed
+static int parseMix(const char *mix){
+    
+    char name[32];
+    int weight, n;
+    size_t i;
+    
+    while(*mix != '\0'){
+        if(sscanf(mix, "%31[^:]:%d%n", name, &weight, &n) != 2 || weight < 0){
+            return -1;
+        }
+        for(i=0; i<NCLASSES && strcmp(name, sizeClasses[i].name)!=0; i++);
+        if(i == NCLASSES || nfiles == MAXFILES){
+            return -1;
+        }
+        files[nfiles] = sizeClasses[i].filename;
+        weights[nfiles++] = weight;
+        totalWeight += weight;
+        mix += n;
+        if(*mix == ','){
+            mix++;
+        }
+    }
+    return totalWeight > 0 ? 0 : -1;
+}
+
+
+//creates the files of the size classes in dir (the big one is sparse)
+static int prepareFiles(const char *dir){
+    
+    char path[4096], block[4096];
+    uint64_t done;
+    size_t i, j;
+    int fd;
+    
+    for(j=0; j<sizeof(block); j++){
+        block[j] = (char)('a' + j % 26);
+    }
+    for(i=0; i<NCLASSES; i++){
+        snprintf(path, sizeof(path), "%s/%s", dir, sizeClasses[i].filename);
+        printf("Creating %s (%" PRIu64 " bytes)\t\t", path, sizeClasses[i].size);
+        if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+            printf("-> Failed: %s\n", strerror(errno));
+            return -1;
+        }
+        //up to 1 MB of real content, a hole after it
+        for(done=0; done<sizeClasses[i].size && done<1024*1024; done+=j){
+            j = sizeClasses[i].size-done < sizeof(block) ? sizeClasses[i].size-done : sizeof(block);
+            if(write(fd, block, j) != (ssize_t)j){
+                printf("-> Failed: %s\n", strerror(errno));
+                close(fd);
+                return -1;
+            }
+        }
+        if(ftruncate(fd, sizeClasses[i].size) < 0){
+            printf("-> Failed: %s\n", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        close(fd);
+        printf("-> Done\n");
+    }
+    return 0;
+}
+
+
+//one connection: requests until the run is over, reconnecting every reuse requests
+static void *benchThreadFunction(void *arg){
+    
+    struct benchThread *bt = arg;
+    Rbuf rb;
+    int s = -1, onConnection = 0;
+    const char *filename;
+    
+    while(takeRequest()){
+        if(s >= 0 && reuse > 0 && onConnection >= reuse){
+            close(s);
+            s = -1;
+        }
+        if(s < 0){
+            if((s = benchConnect(bt)) < 0){
+                bt->errors++;
+                continue;
+            }
+            bt->connections++;
+            rbuf_init(&rb, s);
+            onConnection = 0;
+        }
+        filename = pickFile(bt);
+        onConnection++;
+        if(benchRequest(s, &rb, filename, bt) < 0){
+            //the server closes the connection after an error
+            bt->errors++;
+            close(s);
+            s = -1;
+        }
+    }
+    if(s >= 0){
+        sendn(s, "QUIT\r\n", 6, MSG_NOSIGNAL);
+        close(s);
+    }
+    return NULL;
+}
+
+
+//blocking connection with a receive timeout (after the handshake with -t), -1 on failure
+static int benchConnect(struct benchThread *bt){
+    
+    struct timeval tval;
+    int s, t, offloaded;
+    
+    if((s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0){
+        return -1;
+    }
+    if(connect(s, (struct sockaddr *)&saddr, sizeof(saddr)) < 0){
+        close(s);
+        return -1;
+    }
+    if(tlsContext != NULL){
+        if((t = tls_start(tlsContext, s, NULL, WAITINGTIME, &offloaded)) < 0){
+            close(s);
+            return -1;
+        }
+        bt->offloaded += offloaded;
+        s = t;
+    }
+    tval.tv_sec = WAITINGTIME;
+    tval.tv_usec = 0;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tval, sizeof(tval));
+    return s;
+}
+
+
+//one GET: latencies recorded, body discarded. Returns -1 on error or ERR reply
+static int benchRequest(int s, Rbuf *rb, const char *filename, struct benchThread *bt){
+    
+    static __thread char body[BODYBUFFERLENGTH];
+    char sndbuffer[SNDBUFFERLENGTH];
+    char fields[GET64FIELDSLENGTH];
+    struct fileInfo info;
+    struct timespec t0, t1, t2;
+    uint64_t left;
+    ssize_t n;
+    int len;
+    
+    if((len = formatGetRequest(sndbuffer, SNDBUFFERLENGTH, filename, !legacyGet)) < 0){
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if(sendn(s, sndbuffer, len, MSG_NOSIGNAL) != len){
+        return -1;
+    }
+    if(readReplyHeader(rb, fields, legacyGet ? LEGACYFIELDSLENGTH : GET64FIELDSLENGTH) != 1){
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    decodeFileInfo(fields, &info, !legacyGet);
+    for(left=info.size; left>0; left-=n){
+        if((n = rbuf_read(rb, body, left < sizeof(body) ? left : sizeof(body))) <= 0){
+            return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    
+    bt->requests++;
+    bt->bytes += info.size;
+    latencyAdd(&bt->firstByte, elapsedUs(&t0, &t1));
+    latencyAdd(&bt->complete, elapsedUs(&t0, &t2));
+    return 0;
+}
+
+
+//1 if the run goes on: requests left (-n) or time left (-d)
+static int takeRequest(void){
+    
+    struct timespec now;
+    
+    if(duration > 0){
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec < deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec);
+    }
+    return __atomic_sub_fetch(&requestsLeft, 1, __ATOMIC_RELAXED) >= 0;
+}
+
+
+//file of the next request, chosen with the weights
+static const char *pickFile(struct benchThread *bt){
+    
+    int r = rand_r(&bt->seed) % totalWeight;
+    int i;
+    
+    for(i=0; r >= weights[i]; i++){
+        r -= weights[i];
+    }
+    return files[i];
+}
+
+
+static double elapsedUs(const struct timespec *from, const struct timespec *to){
+    return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+
+//merges the statistics of the threads and prints them in the selected format
+static void printReport(struct benchThread *threads, double elapsed){
+    
+    struct latencySamples firstByte, complete;
+    uint64_t requests = 0, errors = 0, connections = 0, bytes = 0, offloaded = 0;
+    double fb[4], cp[4];                //mean, p50, p99, p999
+    int i;
+    
+    latencyInit(&firstByte);
+    latencyInit(&complete);
+    for(i=0; i<concurrency; i++){
+        requests += threads[i].requests;
+        errors += threads[i].errors;
+        connections += threads[i].connections;
+        bytes += threads[i].bytes;
+        offloaded += threads[i].offloaded;
+        latencyMerge(&firstByte, &threads[i].firstByte);
+        latencyMerge(&complete, &threads[i].complete);
+        latencyFree(&threads[i].firstByte);
+        latencyFree(&threads[i].complete);
+    }
+    fb[0] = latencyMean(&firstByte);
+    fb[1] = latencyPercentile(&firstByte, 50);
+    fb[2] = latencyPercentile(&firstByte, 99);
+    fb[3] = latencyPercentile(&firstByte, 99.9);
+    cp[0] = latencyMean(&complete);
+    cp[1] = latencyPercentile(&complete, 50);
+    cp[2] = latencyPercentile(&complete, 99);
+    cp[3] = latencyPercentile(&complete, 99.9);
+    
+    switch(format){
+        case FORMAT_JSON:
+            printf("{\"label\":\"%s\",\"concurrency\":%d,\"reuse\":%d,\"requests\":%" PRIu64 ",\"errors\":%" PRIu64
+                   ",\"connections\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"elapsed_s\":%.6f,\"throughput_MBps\":%.3f"
+                   ",\"requests_per_s\":%.1f,\"connections_per_s\":%.1f"
+                   ",\"first_byte_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f}"
+                   ",\"complete_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f}"
+                   ",\"transport\":\"%s\",\"ktls_connections\":%" PRIu64 "}\n",
+                   label, concurrency, reuse, requests, errors, connections, bytes, elapsed, bytes / elapsed / 1e6,
+                   requests / elapsed, connections / elapsed, fb[0], fb[1], fb[2], fb[3], cp[0], cp[1], cp[2], cp[3],
+                   transport, offloaded);
+            break;
+        case FORMAT_CSV:
+            printf("label,concurrency,reuse,requests,errors,connections,bytes,elapsed_s,throughput_MBps,requests_per_s,connections_per_s,"
+                   "first_byte_mean_us,first_byte_p50_us,first_byte_p99_us,first_byte_p999_us,"
+                   "complete_mean_us,complete_p50_us,complete_p99_us,complete_p999_us,transport,ktls_connections\n");
+            printf("%s,%d,%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.6f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%s,%" PRIu64 "\n",
+                   label, concurrency, reuse, requests, errors, connections, bytes, elapsed, bytes / elapsed / 1e6,
+                   requests / elapsed, connections / elapsed, fb[0], fb[1], fb[2], fb[3], cp[0], cp[1], cp[2], cp[3],
+                   transport, offloaded);
+            break;
+        default:
+            printf("Benchmark %s\n", label);
+            printf("\t->Concurrency: %d, requests per connection: %d (0 = all)\n", concurrency, reuse);
+            printf("\t->Requests: %" PRIu64 ", errors: %" PRIu64 ", connections: %" PRIu64 "\n", requests, errors, connections);
+            printf("\t->Transport: %s, kernel TLS connections: %" PRIu64 "\n", transport, offloaded);
+            printf("\t->Bytes: %" PRIu64 " in %.3f s\n", bytes, elapsed);
+            printf("\t->Throughput: %.2f MB/s, %.1f requests/s, %.1f connections/s\n",
+                   bytes / elapsed / 1e6, requests / elapsed, connections / elapsed);
+            printf("\t->First byte (us): mean %.1f, p50 %.1f, p99 %.1f, p999 %.1f\n", fb[0], fb[1], fb[2], fb[3]);
+            printf("\t->Complete (us): mean %.1f, p50 %.1f, p99 %.1f, p999 %.1f\n", cp[0], cp[1], cp[2], cp[3]);
+            break;
+    }
+    latencyFree(&firstByte);
+    latencyFree(&complete);
+}
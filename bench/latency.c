@@ -0,0 +1,103 @@
+/*
+ 
+ module: latency.c
+ 
+ purpose: latency samples of the benchmark and their percentiles.
+ 
+          Every thread of the benchmark keeps its own array (no locking on
+          the hot path); the arrays are merged once the run is over and
+          sorted when the first percentile is asked.
+ 
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "latency.h"
+
+#define INITIALSAMPLES      4096
+
+
+static int compareSamples(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+void latencyInit(struct latencySamples *ls){
+    memset(ls, 0, sizeof(*ls));
+}
+
+
+//returns -1 if the array cannot grow
+int latencyAdd(struct latencySamples *ls, double us){
+    
+    double *v;
+    size_t cap;
+    
+    if(ls->n == ls->cap){
+        cap = ls->cap ? ls->cap*2 : INITIALSAMPLES;
+        if((v = realloc(ls->v, cap*sizeof(*v))) == NULL){
+            return -1;
+        }
+        ls->v = v;
+        ls->cap = cap;
+    }
+    ls->v[ls->n++] = us;
+    ls->sorted = 0;
+    return 0;
+}
+
+
+int latencyMerge(struct latencySamples *dst, const struct latencySamples *src){
+    
+    size_t i;
+    
+    for(i=0; i<src->n; i++){
+        if(latencyAdd(dst, src->v[i]) < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+//nearest rank percentile, p between 0 and 100 (0 if there are no samples)
+double latencyPercentile(struct latencySamples *ls, double p){
+    
+    size_t rank;
+    
+    if(ls->n == 0){
+        return 0;
+    }
+    if(!ls->sorted){
+        qsort(ls->v, ls->n, sizeof(*ls->v), compareSamples);
+        ls->sorted = 1;
+    }
+    rank = (size_t)(p / 100.0 * ls->n + 0.999999);
+    if(rank < 1){
+        rank = 1;
+    }
+    if(rank > ls->n){
+        rank = ls->n;
+    }
+    return ls->v[rank-1];
+}
+
+
+double latencyMean(const struct latencySamples *ls){
+    
+    double sum = 0;
+    size_t i;
+    
+    for(i=0; i<ls->n; i++){
+        sum += ls->v[i];
+    }
+    return ls->n ? sum / ls->n : 0;
+}
+
+
+void latencyFree(struct latencySamples *ls){
+    free(ls->v);
+    latencyInit(ls);
+}
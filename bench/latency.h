@@ -0,0 +1,30 @@
+/*
+ 
+ module: latency.h
+ 
+ purpose: definitions of functions in latency.c
+ 
+ */
+
+
+#ifndef _LATENCY_H
+
+#define _LATENCY_H
+
+#include <stddef.h>
+
+//latency samples (microseconds) collected by one thread, merged at the end of the run
+struct latencySamples {
+    double *v;
+    size_t n, cap;
+    int sorted;
+};
+
+void latencyInit(struct latencySamples *ls);
+int latencyAdd(struct latencySamples *ls, double us);
+int latencyMerge(struct latencySamples *dst, const struct latencySamples *src);
+double latencyPercentile(struct latencySamples *ls, double p);
+double latencyMean(const struct latencySamples *ls);
+void latencyFree(struct latencySamples *ls);
+
+#endif
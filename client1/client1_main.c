@@ -11,18 +11,29 @@
 In this exercise I am developing a client that connect to a TCP server, whose address and port number are specified as first and second command line parameter. After having established the connection the client requests the transfer of the files whose names are specified on the command line as third and subsequent parameter, and stores them locally in its working directory.
 
 What the program program does?
-First, it gets the TCP server IP address from command-line and converts it from dotted decimal notation to an internet address in network byte order. It proceeds by reading, still from command line, the server port number and converting it in network byte order. Once port and IP adress have been read, the program creates the socket through the Socket() function (using AF_INET for address family, SOCK_STREAM for the type and IPPROTO_TCP for the protocol that will be used). The address structure is prepared and the program proceeds by setting a non blocking socket connect() in order to check for timeout or success during the connect operation. If the connection to the target address complete immediately, without error or timeout, the clientServiceFunction() is invoked, otherwise an error is printed and program stops its execution.
+The -l option can be given before the address to talk to an old server that only knows the GET command; by default the client uses the GET64 command, whose reply carries a 64 bit file size, a 64 bit timestamp and its nanoseconds, so files larger than 4 GB can be received. If the very first GET64 is refused with an ERR message the client assumes an old server: it reconnects and goes on with GET. Until the server has answered a first GET64 (on every connection, and again after a fallback) that request is sent alone and the pipelined ones follow its reply, because the old server closes the connection after its ERR and a request written behind it could turn the close into a reset (and kill the client with SIGPIPE).
+Every received file gets the timestamp of the server copy, also when the transfer is interrupted (by an error, SIGINT or SIGTERM). With the -r (--resume) option a local file that already exists is taken as a partial copy: the client sends RGET with the local size as offset and the local timestamp as validator, and the server only sends the remaining bytes if its file still has that timestamp (otherwise the whole file is sent again). The client appends only when the reply starts exactly at the local size and carries the same timestamp, otherwise it rewrites the file from the beginning.
+With the -s (--sync) option a local file that already exists is taken as a complete copy to refresh: the client sends IFMOD with the local size and timestamp, and the server answers "+NM" without any body if its file still has both (the file is skipped and counted as unchanged), otherwise the whole file is sent with the GET64 reply and gets the server timestamp as usual. Since every received file carries the timestamp of the server copy, a repeated -s run only transfers the files changed in between. If the very first IFMOD is refused the server does not know it: the client reconnects and goes on without -s. -s takes precedence over -r.
+With the -d (--delta) option a local file of at least a block is taken as an older version to update: computeSignatures() reads it in 1 MB chunks and sends with DELTA the weak checksum and the strong hash of each block (delta.c), and the server answers "+NM" if nothing changed or with the literals and the copies of local blocks that make up the new version, checked against the digest of the reply by receiveDelta(). The new version is written to a temporary file renamed over the copy at the end (copy_file_range() lets the file system share the reused blocks); with -i (--in-place) the copy itself is rewritten, a block already at its offset is not touched at all, but the server can only reuse blocks at or after the offset they go to. A DELTA is written only when no reply is in flight, because its signatures may not fit in the socket buffers. If a DELTA is refused the client reconnects and goes on with GET64. -d takes precedence over -s and -r.
+When more than one file is given (and none of -l, -r, -s and -d), the files are asked with MGET commands: the sendBatch() function joins up to 64 names (as many as fit in a command line) with '/', and the reply is a single stream with one record per file (status, name, size, timestamp and bytes), read by readRecordHeader() (protocol.c) and received like a GET64 reply. A file the server cannot send is reported and skipped, the connection goes on. With MGET the -w window counts commands, and a new MGET is sent only when a whole batch of files is waiting (or when nothing else is in flight). If the very first MGET is refused the server does not know it: the client reconnects and asks the same files one command each.
+With the -L (--list) option the client first sends LIST on a connection of its own and prints name, size and timestamp of every file of the server directory, decoded from the reply with decodeListEntry() (protocol.c); the files given after the port, if any, are then received as usual.
+First, it gets the TCP server IP address from command-line and converts it from dotted decimal notation to an internet address in network byte order. It proceeds by reading, still from command line, the server port number and converting it in network byte order. Once port and IP adress have been read, the program creates the socket through the Socket() function (using AF_INET for address family, SOCK_STREAM for the type and IPPROTO_TCP for the protocol that will be used). The address structure is prepared and the connectToServer() function proceeds by setting a non blocking socket connect() in order to check for timeout or success during the connect operation. If the connection to the target address complete immediately, without error or timeout, the clientServiceFunction() is invoked, otherwise an error is printed and program stops its execution.
 
-The clientServiceFunction(), that receive as parameters the connected socket, the number and names of file received by command line, starts its execution by entering in a loop until all the file are received and saved locally. First, it checks the correctness of the filename passed by command line (it controls if it contains some invalid charcaters, e.g. if it is a directory), then it prepares the GET command by concatenating the GET_MSG string, the name of the file and the two characters CR and LF. Finally, that message is sent to the server through the sendn() function and a check on the sent bytes is done.
- The clientServiceFunction() now waits a reply from the server. A select structure is defined for every read in order to handle timeout. If a message is received from the server, the first character is read through the readn() function and it is compared to '+' or '-'; if it is '+', the client received a possible OK message and continue reading, if it is '-' the client received a possible ERR message and continue reading, otherwise an unexpected message is received and client stops its execution.
-If "+", client continues reading and checks if the rest of the message corresponds to the OK_MSG string expected; if this is true, the file size and timestamp are read and converted in a network byte order. The last things (read with the read() function) are the bytes of the requested file. These bytes are written at the same time within the file created just before. If something of the functions described above fails, an error is printed and clients stops its execution. The clients proceed by printing all the information of the file received and continues loop until all the file requests are satisfied.
+The clientServiceFunction(), that receive as parameters the connected socket, the number and names of file received by command line, starts its execution by entering in a loop until all the file are received and saved locally. The requests are pipelined: before waiting for a reply the client makes sure that up to -w (--window, 8 by default) commands are in flight, so on a long link the round trip time is paid once per window instead of once per file; the server reads them back to back and answers in the same order. Each command is sent by the sendRequest() function: it checks the correctness of the filename passed by command line (it controls if it contains some invalid charcaters, e.g. if it is a directory), then it prepares the GET command by concatenating the GET_CMDNAME string (formatGetRequest(), protocol.c), the name of the file and the two characters CR and LF, and remembers in a pendingRequest structure the layout of the expected reply. Finally, that message is sent to the server through the sendn() function and a check on the sent bytes is done. When all the files are received, printThroughput() prints the bytes per second and the bytes per round trip time (the RTT measured by the kernel, TCP_INFO), to compare the window sizes.
+With -j (--jobs) N the client opens N connections, each one served by a thread running clientServiceFunction(): the files are not split in advance, every connection takes the next file from a shared queue (takeFile(), an atomic counter) whenever it has room for a request, so the load balances itself when the sizes are very different. At the end the aggregate number of files, bytes and throughput is printed.
+ The clientServiceFunction() now waits a reply from the server. Every read goes through the per-connection Rbuf of sockwrap.c (one read() system call drains what the kernel has, the remaining bytes are kept for the next read), and the waitServer() function is used before every read in order to handle timeout: it skips the select when the bytes are already buffered. If a message is received from the server, the first character is read through the readn() function and it is compared to '+' or '-'; if it is '+', the client received a possible OK message and continue reading, if it is '-' the client received a possible ERR message and continue reading, otherwise an unexpected message is received and client stops its execution.
+If "+", client continues reading and checks if the rest of the message corresponds to the OK_MSG string expected; if this is true, the file size and timestamp are read and converted in a network byte order. The last things (read with the rbuf_read() function, never beyond the announced file size) are the bytes of the requested file. These bytes are written at the same time within the file created just before. The blocks of the file are reserved first with fallocate() (keeping the size, so a partial file can still be resumed); then, whenever no byte is left in the Rbuf, the body goes socket -> pipe -> file through the spliceToFile() function (splice(), up to 1 MB per call), so it is never copied in user space. If the socket or the file system does not support splice, or with the -c (--copy) option, the bytes are read in the buffer and written with pwrite() as before. If something of the functions described above fails, an error is printed and clients stops its execution. The clients proceed by printing all the information of the file received and continues loop until all the file requests are satisfied.
 If '-' is received, clients continues reading and checks if the rest of the message (read thhrough the readn() function) correspond to the ERR_MSG string expected; if this is true the socket is closed and clients stops its execution.
+A server at its connection limits (--max-conns, --max-per-ip) answers a new connection with "-ERR busy" before reading any command and closes it: the reconnectWhenBusy() function opens a new connection after a pause of 100 ms, doubled at every retry and spread at random so that the refused clients do not come back all together, and the requests in flight are sent again on it. After 5 retries the client gives up.
+With --tls=user or --tls=ktls every connection starts with a TLS handshake (tls_start(), tlswrap.c, built with -DHAVE_OPENSSL -lssl -lcrypto): the certificate of the server must be signed by the --tls-ca file (or by a CA of the system) and name the server address. With --tls=ktls the keys are handed to the kernel and the connection is read as before, splice() included; otherwise, or when the kernel cannot take them, a relay thread decrypts the records into a socketpair that the client reads instead of the socket, and the program waits with tls_drain() for the relays to send their last bytes before exiting. A server at its connection limits refuses a TLS connection before the handshake, so the client sees the handshake fail.
+With unix:<path> instead of address and port the client connects to the AF_UNIX socket of a server on the same host (--unix): the files are asked with FGET, and the reply header carries the descriptor of the server file (SCM_RIGHTS), read from the socket together with the bytes by the Rbuf (rbuf_init_fd(), sockwrap.c). receivePassedFile() checks that it is a regular file at least as large as announced and copies it with copy_file_range() (the file system may share the blocks, otherwise it is copied a piece at a time), so no byte of the file crosses the socket; the local file gets the server timestamp as usual. Several files are asked one FGET each (no MGET), pipelined as usual. If the very first FGET is refused the client reconnects and goes on with GET64. TLS is not used on a local socket.
 The last thing that the clientServiceFunction() does is to send to the server the QUIT_MSG command (through the sendn() function) and close connection.
  
 The errorHandler() function is used to print an error and close the connected socket.
 ************************************************************ */
 
 
+#define _GNU_SOURCE                                 //splice(), fallocate(), F_SETPIPE_SZ
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,22 +44,122 @@ The errorHandler() function is used to print an error and close the connected so
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include "./../errlib.h"
 #include "./../sockwrap.h"
+#include "./../protocol.h"
+#include "./../delta.h"
+#include "./../tlswrap.h"
 
 #define RCVBUFFERLENGTH     4098                //receive buffer length
 #define SNDBUFFERLENGTH     4097                //send buffer length
 #define WAITINGTIME         60                  //waiting time on each read from server
 #define CONNECTIONTIME      50                  //waiting time for the connect
+#define DEFAULTWINDOW       8                   //GET commands sent ahead of the replies
+#define MAXWINDOW           1024                //bounded: the commands must fit the socket buffers
+#define MAXJOBS             64                  //parallel connections (-j)
+#define MGETFILES           64                  //files asked by one MGET command
+#define SPLICECHUNK         (1024*1024)         //bytes moved by one splice() (pipe size)
+#define SIGNATURECHUNK      (1024*1024)         //bytes of the local copy read at a time for the signatures
+#define BUSYRETRIES         5                   //new connections after a busy server, then the client gives up
+#define BUSYPAUSEMS         100                 //pause before the first of them, doubled at each one
 
 static const char OK_MSG[]    =   "OK\r\n";     //Ok message string
 static const char ERR_MSG[]   =   "ERR\r\n";    //Error message string
+static const char NM_MSG[]    =   "NM\r\n";     //Not modified message string (IFMOD)
+static const char BUSY_MSG[]  =   "ERR busy\r\n"; //Busy message string (server at its connection limits)
 static const char QUIT_MSG[]  =   "QUIT\r\n";   //Quit message string
-static const char GET_MSG[]   =   "GET ";       //Get message string
 
 char *prog_name;
-void clientServiceFunction(int socket, int nfiles, char **files);
+static struct sockaddr_in saddr;                //server address structure
+static struct sockaddr_un uaddr;                //unix: local socket of the server
+static int localServer = 0;                     //unix: connections to the local socket of the server
+//the flags of the commands a server may refuse are downgraded by the job that sees the refusal while the others
+//read them (-j): they are only accessed with atomic operations once the jobs have started
+static int passMode = 0;                        //unix: the files are read from the descriptors passed (FGET)
+static int legacyGet = 0;                       //-l: only GET, for servers without GET64
+static int resumeMode = 0;                      //-r: complete partial local files with RGET
+static int syncMode = 0;                        //-s: skip the local files still equal to the server ones (IFMOD)
+static int listMode = 0;                        //-L: print the files of the server directory (LIST)
+static int deltaMode = 0;                       //-d: only the changes of the local files (DELTA)
+static int inPlace = 0;                         //-i: -d rebuilds the local copy in place
+static int batchGet = 0;                        //MGET: more than one file, none of -l, -r, -s, -d
+static int requestWindow = DEFAULTWINDOW;       //-w: requests in flight on the connection
+static int jobs = 1;                            //-j: connections working in parallel
+static void *tlsContext = NULL;                 //--tls: every connection starts with a handshake
+
+//work queue shared by the connections: each one takes the next file when it has room for a request
+static char **fileList;
+static int fileCount;
+static int nextFile = 0;
+
+//per connection: file being received (stamped if interrupted) and bytes received
+static volatile int partialFd[MAXJOBS];
+static struct timespec partialTimes[MAXJOBS][2];
+static uint64_t jobBytes[MAXJOBS];
+static int jobFiles[MAXJOBS];
+static int jobUnchanged[MAXJOBS];               //-s: files not downloaded, the local copy is up to date
+static int jobPipe[MAXJOBS][2];                 //splice() of the received bytes to the file
+static int spliceReceive = 1;                   //cleared by --copy or when splice is not supported (atomic in the jobs)
+
+//a request sent to the server whose reply has not been read yet
+struct pendingRequest {
+    int fileindex;                      //position of the file inside fileList
+    size_t fieldslen;                   //length of size and timestamp (and range) fields of the reply
+    off_t localsize;                    //bytes already present locally (-r), 0 if none
+    int conditional;                    //IFMOD sent (-s): the reply may be "+NM"
+    int record;                         //asked by a MGET: the reply is a record of the MGET one
+    uint32_t batchcount;                //first file of a MGET: records announced by the MGET reply, 0 otherwise
+    int delta;                          //DELTA sent (-d): the reply rebuilds the local copy
+    int passed;                         //FGET sent (unix:): the reply carries the descriptor of the file
+    uint32_t blocksize, blockcount;     //DELTA: blocks of the local copy...
+    uint64_t *strong;                   //...and their strong hashes, NULL if none
+    struct stat lst;                    //partial local copy of the file
+};
+int connectToServer(void);
+void clientServiceFunction(int socket, int job);
 void errorHandler(char *err, int s);
+static int takeFile(void);
+static void *jobThread(void *arg);
+static int waitServer(Rbuf *rb);
+static void receiveFiles(int socket, int job, struct pendingRequest *pending, unsigned int ringsize);
+static void initReplies(Rbuf *rb, int socket);
+static int sendRequest(int socket, const char *filename, struct pendingRequest *p);
+static int listDirectory(int socket);
+static char *computeSignatures(const char *filename, struct pendingRequest *p);
+static int sendBatch(int socket, struct pendingRequest *pending, unsigned int ringsize, unsigned int first, unsigned int last);
+static int receiveFile(int socket, Rbuf *rb, int job, const char *filename, const struct pendingRequest *p,
+                       const struct fileInfo *info, uint64_t rangeoff, uint64_t rangelen, uint64_t *received);
+static int receiveDelta(int socket, Rbuf *rb, int job, const char *filename, const struct pendingRequest *p,
+                        const struct fileInfo *info, uint64_t *received);
+static int receivePassedFile(int socket, Rbuf *rb, int job, const char *filename, const struct fileInfo *info, uint64_t *received);
+static int reconnectWhenBusy(int socket, int *retries);
+static int copyBlocks(int oldfd, int fd, unsigned char *buf, uint64_t src, uint64_t dst, uint64_t len);
+static void printThroughput(int socket, uint64_t bytes, const struct timespec *start);
+static void closeReceivedFile(int fd, int job);
+static ssize_t spliceToFile(int socket, int fd, off_t offset, uint64_t len, int job);
+static int drainPipe(int pipefd, int fd, off_t offset, size_t len);
+static ssize_t pwriten(int fd, const char *buf, size_t n, off_t offset);
+static void interruptHandler(int signo);
+
+static const struct option longOptions[] = {
+    {"legacy",  no_argument,    NULL, 'l'},
+    {"resume",  no_argument,    NULL, 'r'},
+    {"sync",    no_argument,    NULL, 's'},
+    {"window",  required_argument, NULL, 'w'},
+    {"jobs",    required_argument, NULL, 'j'},
+    {"copy",    no_argument,    NULL, 'c'},
+    {"list",    no_argument,    NULL, 'L'},
+    {"delta",   no_argument,    NULL, 'd'},
+    {"in-place", no_argument,   NULL, 'i'},
+    {"tls",     required_argument, NULL, 'T'},
+    {"tls-ca",  required_argument, NULL, 'A'},
+    {NULL, 0, NULL, 0}
+};
 
 
 
@@ -57,52 +168,226 @@ int main(int argc, char **argv){
     //defining variables
     int s;                              //socket
     uint16_t tport_n, tport_h;          //server port number (net/host ord)
-    struct sockaddr_in saddr;           //server address structure
     struct in_addr sIPaddr;             //server IP address structure
-    fd_set rset, wset;                  //set of sockets
-    struct timeval tval;                //timeval structure
-    socklen_t len;
-    int result, flags, n;
-    int error;
+    int result, opt;
+    pthread_t tids[MAXJOBS];            //one thread per connection with -j
+    struct timespec start, end;         //aggregate throughput with -j
+    uint64_t totalbytes;
+    int totalfiles, totalunchanged, i;
+    int tlsFlags = -1;                  //--tls: 0 or TLS_KTLS, -1 without TLS
+    const char *tlsCa = NULL;           //--tls-ca: certificates the server is verified with
    
     //assigning program name
     prog_name = argv[0];
     printf("\n");
+    srand((unsigned)getpid() ^ (unsigned)time(NULL));        //pauses after a busy server
     
-    //getting ip address of server from command line
-    result = inet_aton(argv[1], &sIPaddr);
-    if(result == 0){
-        printf("Invalid address. Stopping execution");
+    //reading options passed by command line
+    while((opt = getopt_long(argc, argv, "lrsw:j:cLdiT:A:", longOptions, NULL)) != -1){
+        switch(opt){
+            case 'l':
+                legacyGet = 1;
+                break;
+            case 'r':
+                resumeMode = 1;
+                break;
+            case 's':
+                syncMode = 1;
+                break;
+            case 'w':
+                if(sscanf(optarg, "%d", &requestWindow)!=1 || requestWindow<=0 || requestWindow>MAXWINDOW){
+                    printf("Invalid window, it must be between 1 and %d. Stopping execution\n", MAXWINDOW);
+                    exit(1);
+                }
+                break;
+            case 'j':
+                if(sscanf(optarg, "%d", &jobs)!=1 || jobs<=0 || jobs>MAXJOBS){
+                    printf("Invalid number of connections, it must be between 1 and %d. Stopping execution\n", MAXJOBS);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                spliceReceive = 0;
+                break;
+            case 'L':
+                listMode = 1;
+                break;
+            case 'd':
+                deltaMode = 1;
+                break;
+            case 'i':
+                inPlace = 1;
+                break;
+            case 'T':
+                if(strcmp(optarg, "user")==0){
+                    tlsFlags = 0;
+                }else if(strcmp(optarg, "ktls")==0){
+                    tlsFlags = TLS_KTLS;
+                }else{
+                    printf("Invalid TLS mode, it must be user or ktls. Stopping execution\n");
+                    exit(1);
+                }
+                break;
+            case 'A':
+                tlsCa = optarg;
+                break;
+            default:
+                printf("Usage: %s [-l] [-r] [-s] [-d [-i]] [-c] [-L] [-w window] [-j connections] [--tls=user|ktls [--tls-ca=pem]] {<address> <port> | unix:<path>} <file>...\n", prog_name);
+                exit(1);
+        }
+    }
+    //unix:path: the local socket of the server (--unix), no port follows
+    if(optind < argc && strncmp(argv[optind], "unix:", 5) == 0){
+        localServer = 1;
+        passMode = 1;
+    }
+    if(argc-optind < 2-localServer){
+        printf("Usage: %s [-l] [-r] [-s] [-d [-i]] [-c] [-L] [-w window] [-j connections] [--tls=user|ktls [--tls-ca=pem]] {<address> <port> | unix:<path>} <file>...\n", prog_name);
         exit(1);
     }
     
-    //getting port number of server from command line
-    if(sscanf(argv[2], "%" SCNu16, &tport_h)!=1){
-        printf("Invalid port number. Stopping execution");
+    if(localServer){
+        bzero(&uaddr, sizeof(uaddr));
+        uaddr.sun_family = AF_UNIX;
+        if(strlen(argv[optind]+5) == 0 || strlen(argv[optind]+5) >= sizeof(uaddr.sun_path)){
+            printf("Invalid local socket path. Stopping execution\n");
+            exit(1);
+        }
+        strcpy(uaddr.sun_path, argv[optind]+5);
+        if(tlsFlags >= 0){
+            printf("TLS is not used on a local socket. Stopping execution\n");
+            exit(1);
+        }
+    }else{
+        //getting ip address of server from command line
+        result = inet_aton(argv[optind], &sIPaddr);
+        if(result == 0){
+            printf("Invalid address. Stopping execution");
+            exit(1);
+        }
+        
+        //getting port number of server from command line
+        if(sscanf(argv[optind+1], "%" SCNu16, &tport_h)!=1){
+            printf("Invalid port number. Stopping execution");
+            exit(1);
+        }
+        tport_n = htons(tport_h);
+        
+        //preparing address structure
+        bzero(&saddr, sizeof(saddr));
+        saddr.sin_family    =   AF_INET;
+        saddr.sin_port      =   tport_n;
+        saddr.sin_addr      =   sIPaddr;
+    }
+    
+    //--tls: the server certificate must be signed by --tls-ca (or a CA of the system) and name its address
+    if(tlsFlags >= 0 && (tlsContext = tls_context(tlsFlags, NULL, NULL, tlsCa)) == NULL){
+        printf("TLS not available: %s. Stopping execution\n", tls_strerror());
         exit(1);
     }
-    tport_n = htons(tport_h);
+    
+    //an interrupted transfer keeps the server timestamp, so that it can be resumed later
+    Signal(SIGINT, interruptHandler);
+    Signal(SIGTERM, interruptHandler);
+    
+    fileList = argv+optind+2-localServer;
+    fileCount = argc-optind-2+localServer;
+    //several files of a plain download: a MGET asks for many of them in one command (an FGET each on a local socket)
+    batchGet = fileCount > 1 && !legacyGet && !resumeMode && !syncMode && !deltaMode && !passMode;
+    for(i=0; i<MAXJOBS; i++){
+        partialFd[i] = -1;
+        jobPipe[i][0] = jobPipe[i][1] = -1;
+    }
+    
+    //-L: the listing has a connection of its own, the files (if any) are asked afterwards
+    if(listMode){
+        if((s = connectToServer()) < 0 || listDirectory(s) < 0 || fileCount == 0){
+            tls_drain();
+            return(0);
+        }
+    }
+    
+    //connection done. Do client task and finish
+    if(jobs == 1){
+        if((s = connectToServer()) < 0){
+            return(0);
+        }
+        clientServiceFunction(s, 0);
+        tls_drain();
+        return(0);
+    }
+    
+    //-j: the connections take the files from the shared queue until it is empty,
+    //so a connection stuck on a large file does not hold back the small ones
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i=0; i<jobs; i++){
+        if((errno = pthread_create(&tids[i], NULL, jobThread, (void *)(intptr_t)i)) != 0){
+            err_sys("(%s) error - pthread_create() failed", prog_name);
+        }
+    }
+    totalbytes = 0;
+    totalfiles = 0;
+    totalunchanged = 0;
+    for(i=0; i<jobs; i++){
+        pthread_join(tids[i], NULL);
+        totalbytes += jobBytes[i];
+        totalfiles += jobFiles[i];
+        totalunchanged += jobUnchanged[i];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    tls_drain();
+    printf("\n");
+    printf("Aggregate statistics (%d connections)\n", jobs);
+    printf("\t->Files received: %d of %d\n", totalfiles, fileCount);
+    if(syncMode){
+        printf("\t->Files unchanged: %d\n", totalunchanged);
+    }
+    printf("\t->Bytes received: %" PRIu64 " in %.3f s\n", totalbytes,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    printf("\t->Throughput: %.2f MB/s\n", totalbytes / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9) / 1e6);
+    return(0);
+    
+}
+
+
+//create a socket and connect it to the server address, returns -1 on failure
+int connectToServer(void){
+    
+    int s;                              //socket
+    fd_set rset, wset;                  //set of sockets
+    struct timeval tval;                //timeval structure
+    socklen_t len;
+    int flags, n;
+    int error;
+    int t, offloaded;                   //--tls: socket of the plain bytes, kernel TLS
+    char peer[INET_ADDRSTRLEN];
+    
+    //unix: a local connect completes at once, or fails at once
+    if(localServer){
+        printf("Connecting to local socket %s\t\t\t", uaddr.sun_path);
+        s = Socket(AF_UNIX, SOCK_STREAM, 0);
+        if(connect(s, (struct sockaddr *)&uaddr, sizeof(uaddr)) < 0){
+            errorHandler("Error during connect. Closing socket\t\t\t", s);
+            return(-1);
+        }
+        printf("-> Done. Socket number: %d\n", s);
+        return(s);
+    }
     
     //creating the socket
     printf("Creating the socket \t\t\t\t\t");
     s = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     printf("-> Done. Socket number: %d\n", s);
     
-    //preparing address structure
-    bzero(&saddr, sizeof(saddr));
-    saddr.sin_family    =   AF_INET;
-    saddr.sin_port      =   tport_n;
-    saddr.sin_addr      =   sIPaddr;
-    
     //setting non blocking connection
     showAddr("Connecting to server address", &saddr);
     if((flags = fcntl(s, F_GETFL, 0)) == -1){
         errorHandler("File descriptor manipulation error. Closing socket\t", s);
-        return(0);
+        return(-1);
     }
     if(fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1){
         errorHandler("File descriptor manipulation error. Closing socket\t", s);
-        return(0);
+        return(-1);
     }
     error = 0;
     
@@ -110,7 +395,7 @@ int main(int argc, char **argv){
     if((n = connect(s, (struct sockaddr *)&saddr, sizeof(saddr))) < 0){
         if(errno != EINPROGRESS){
             errorHandler("Error during connect. Closing socket\t\t\t", s);
-            return(0);
+            return(-1);
         }
     }
     //if n==0 connection completed immediatly, no need of setting timeout
@@ -125,7 +410,7 @@ int main(int argc, char **argv){
     tval.tv_usec = 0;
     if((n=Select(s+1, &rset, &wset, NULL, &tval))==0){
         errorHandler("Timeout. Unreachable address. Closing socket\t\t", s);
-        return(0);
+        return(-1);
     }
     
     //checking error during select operation, socket not set
@@ -133,87 +418,209 @@ int main(int argc, char **argv){
         len = sizeof(error);
         if (getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &len) < 0){
             errorHandler("Error during connect. Closing socket\t\t\t", s);
-            return(0);
+            return(-1);
         }
     }else{
         errorHandler("Select error. Closing socket\t\t\t", s);
-        return(0);
+        return(-1);
     }
 
 connected:
     //restoring file status flags
     if(fcntl(s, F_SETFL, flags) == -1){
         errorHandler("File descriptor manipulation error. Closing socket\t", s);
-        return(0);
+        return(-1);
     }
     //error check
     if(error){
         errorHandler("Unreachable address. Closing socket\t\t\t", s);
-        return(0);
+        return(-1);
     }
-    //connection done. Do client task and finish
     printf("-> Done\n");
-    clientServiceFunction(s, argc-3, argv+3);
-    return(0);
     
+    //--tls: from now on the bytes go through kernel TLS (the same socket) or a relay thread
+    if(tlsContext != NULL){
+        printf("TLS handshake \t\t\t\t\t\t");
+        inet_ntop(AF_INET, &saddr.sin_addr, peer, sizeof(peer));
+        if((t = tls_start(tlsContext, s, peer, WAITINGTIME, &offloaded)) < 0){
+            printf("-> Failed: %s\n", tls_strerror());
+            Close(s);
+            return(-1);
+        }
+        printf("-> Done (%s)\n", offloaded ? "kernel TLS" : "user space relay");
+        s = t;
+    }
+    return(s);
 }
 
 
 
 
-void clientServiceFunction(int socket, int nfiles, char **files){
+void clientServiceFunction(int socket, int job){
+    
+    struct pendingRequest *pending;     //requests in flight, a ring
+    unsigned int ringsize, i;
     
-    int fileindex;                      //index of the position of the file inside files
+    //with MGET every command of the window asks for up to MGETFILES files
+    ringsize = requestWindow * (__atomic_load_n(&batchGet, __ATOMIC_RELAXED) ? MGETFILES : 1);
+    if((pending = calloc(ringsize, sizeof(struct pendingRequest))) == NULL){
+        errorHandler("Out of memory. Closing connection\t\t\t\t", socket);
+        return;
+    }
+    receiveFiles(socket, job, pending, ringsize);
+    for(i=0; i<ringsize; i++){
+        free(pending[i].strong);
+    }
+    free(pending);
+}
+
+
+static void receiveFiles(int socket, int job, struct pendingRequest *pending, unsigned int ringsize){
+    
+    unsigned int head, tail;            //oldest request in flight, next free slot of the ring
+    unsigned int sent;                  //requests of the ring already sent, the others wait
+    int probing = !__atomic_load_n(&legacyGet, __ATOMIC_RELAXED);           //only the first request is sent until the server proves it knows GET64
+    int drained = 0;                    //every file has been taken from the queue
+    int fileindex;                      //index of the position of the file inside fileList
     char *filename;                     //used to store the name of the file
-    size_t bufsize;                     //size of the sending buffer
     char rcvbuffer[RCVBUFFERLENGTH];    //receiving buffer
-    char sndbuffer[SNDBUFFERLENGTH];    //sending buffer
-    uint32_t filesize, timestamp;       //file size and timestamp variable
-    uint32_t numreceived, receivedsize; //used while reading file
-    uint32_t ret;                       //return value of fwrite() function
-    FILE *fp;                           //file pointer
-    fd_set cset;                        //set of sockets
-    struct timeval tval;                //timeval structure
+    int get64Confirmed = 0;             //the server has answered a GET64 with OK
+    struct pendingRequest *p;           //request whose reply is being read
+    struct fileInfo info;               //file size and timestamp
+    uint64_t rangeoff, rangelen;        //bytes of the file sent by the server
+    uint64_t totalreceived = 0;         //bytes of all the files, for the throughput
+    uint64_t receivedsize;              //bytes of the current file
+    struct timespec start;              //beginning of the transfers
+    Rbuf rb;                            //bytes received from the server, not yet consumed
+    uint32_t count;
     int n;
+    int busyRetries = 0;                //new connections opened because the server was busy
+    
     
+    initReplies(&rb, socket);
+    clock_gettime(CLOCK_MONOTONIC, &start);
     
     //enter client loop until all the files requests are sent and a reply is received
-    for(fileindex=0; fileindex<nfiles; fileindex++){
+    for(head=tail=sent=0; ; head++){
         
-        //checking if filename is correct or not, if it is a directory or a filename
-        filename = strdup(files[fileindex]);
-        if(filename[0] == '.' || filename[0] == '~' || (strchr(filename, '/') != NULL)){
-            //it is a directory, not a filename
-            errorHandler("Error: it is not a filename but a directory. Try again\t", socket);
-            return;
+        //keeping up to requestWindow commands in flight: the server reads them back to back
+        //and the replies come in the same order, so one RTT is paid for the whole window
+        while(tail - head < ringsize && !drained){
+            if((fileindex = takeFile()) < 0){
+                drained = 1;
+            }else{
+                pending[tail % ringsize].fileindex = fileindex;
+                tail++;
+            }
+        }
+        //a server that may refuse the command closes the connection after its ERR: while probing it
+        //nothing is written behind the first request, so the refusal is never lost in a reset
+        //with -d likewise: the signatures of a DELTA are written only while no reply is arriving,
+        //or both sides could block on full socket buffers
+        for( ; sent != tail && ((!probing && !__atomic_load_n(&deltaMode, __ATOMIC_RELAXED)) || sent == head); sent += n){
+            if(!__atomic_load_n(&batchGet, __ATOMIC_RELAXED)){
+                //one command per file (the ring is larger than the window after a MGET refusal)
+                if(sent - head >= (unsigned int)requestWindow){
+                    break;
+                }
+                if(sendRequest(socket, fileList[pending[sent % ringsize].fileindex], &pending[sent % ringsize]) < 0){
+                    return;
+                }
+                n = 1;
+            }else{
+                //whole MGETs: a shorter one only when the queue is empty or nothing else is in flight
+                if(tail - sent < MGETFILES && !drained && sent != head){
+                    break;
+                }
+                if((n = sendBatch(socket, pending, ringsize, sent, tail)) < 0){
+                    return;
+                }
+            }
         }
+        if(head == tail){
+            break;
+        }
+        p = &pending[head % ringsize];
+        filename = fileList[p->fileindex];
         
-        //preparing sendbuffer and sending GET message
-        printf("\n");
-        printf("Sending GET message\t\t\t\t\t");
-        bufsize = 0;
-        bzero(sndbuffer, SNDBUFFERLENGTH);
-        strncpy(sndbuffer, GET_MSG, sizeof(GET_MSG)-1);
-        strcat(sndbuffer, filename);
-        strcat(sndbuffer, "\r\n");
-        bufsize = sizeof(GET_MSG) - 1 + strlen(filename)*sizeof(char) + 2*sizeof(char);
-        if(sendn(socket, sndbuffer, bufsize, 0) != bufsize){
-            errorHandler("Error while sending GET message. Closing connection\t", socket);
-            return;
+        //first file of a MGET: "+OK\r\n" and the number of records come before its record
+        if(p->batchcount > 0){
+            if((n = waitServer(&rb)) > 0){
+                printf("Reading MGET reply from the server\t\t\t");
+                n = readReplyHeader(&rb, rcvbuffer, MGETFIELDSLENGTH);
+            }else{
+                errorHandler("No response received, timeout. Closing connection\t", socket);
+                return;
+            }
+            if(n == 3){
+                //refused before any command was read: the same requests on a new connection
+                if((socket = reconnectWhenBusy(socket, &busyRetries)) < 0){
+                    return;
+                }
+                initReplies(&rb, socket);
+                sent = head;
+                head--;
+                continue;
+            }
+            if(n == 0 && !get64Confirmed){
+                //the server does not know MGET: new connection, the same files one command each
+                printf("-> Received ERROR message\n");
+                printf("MGET refused, retrying with GET64\t\t\t");
+                __atomic_store_n(&batchGet, 0, __ATOMIC_RELAXED);
+                Close(socket);
+                printf("-> Connection closed\n");
+                if((socket = connectToServer()) < 0){
+                    return;
+                }
+                initReplies(&rb, socket);
+                sent = head;
+                probing = 1;
+                head--;
+                continue;
+            }
+            memcpy(&count, rcvbuffer, sizeof(count));
+            if(n != 1 || ntohl(count) != p->batchcount){
+                errorHandler("Wrong MGET reply received. Closing connection\t\t", socket);
+                return;
+            }
+            printf("-> Received OK message (%" PRIu32 " files)\n", p->batchcount);
+            get64Confirmed = 1;
+            probing = 0;
+        }
+        
+        //record of a MGET: name, then size, timestamp and bytes of the file, or nothing if the server cannot send it
+        if(p->record){
+            if((n = waitServer(&rb)) > 0){
+                printf("Reading MGET record from the server\t\t\t");
+                n = readRecordHeader(&rb, rcvbuffer, sizeof(rcvbuffer), &info);
+            }else{
+                errorHandler("No response received, timeout. Closing connection\t", socket);
+                return;
+            }
+            if(n < 0 || strcmp(rcvbuffer, filename) != 0){
+                errorHandler("Wrong MGET record received. Closing connection\t\t", socket);
+                return;
+            }
+            if(n == 0){
+                printf("-> File not available on the server\n");
+                printf("\t->File name: %s\n", filename);
+                continue;
+            }
+            printf("-> Received OK record\n");
+            if(receiveFile(socket, &rb, job, filename, p, &info, 0, info.size, &receivedsize) < 0){
+                return;
+            }
+            totalreceived += receivedsize;
+            continue;
         }
-        printf("-> Message sent\n");
         
         //reading reply (+ or -) message from server
         //if it is "+" -> possible OK MESSAGE
         //if it is "-" -> possible ERR MESSAGE
         //otherwise Unexpected Message, close connection
-        FD_ZERO(&cset);
-        FD_SET(socket, &cset);
-        tval.tv_sec = WAITINGTIME;
-        tval.tv_usec = 0;
-        if((n = Select(FD_SETSIZE, &cset, NULL, NULL, &tval)) > 0) {
+        if((n = waitServer(&rb)) > 0) {
             printf("Reading reply from the server\t\t\t\t");
-            if(readn(socket, rcvbuffer, 1) != 1){
+            if(rbuf_readn(&rb, rcvbuffer, 1) != 1){
                 errorHandler("Error while reading server reply. Closing connection\t", socket);
                 return;
             }
@@ -227,12 +634,8 @@ void clientServiceFunction(int socket, int nfiles, char **files){
             ////////////////////////////////
             //POSSIBLE OK MESSAGE RECEIVED//
             ////////////////////////////////
-            FD_ZERO(&cset);
-            FD_SET(socket, &cset);
-            tval.tv_sec = WAITINGTIME;
-            tval.tv_usec = 0;
-            if((n = Select(FD_SETSIZE, &cset, NULL, NULL, &tval)) > 0){
-                if(readn(socket, rcvbuffer, sizeof(OK_MSG)-1) != (sizeof(OK_MSG)-1)){
+            if((n = waitServer(&rb)) > 0){
+                if(rbuf_readn(&rb, rcvbuffer, sizeof(OK_MSG)-1) != (sizeof(OK_MSG)-1)){
                     errorHandler("Reading OK message error. Closing connection\t", socket);
                     return;
                 }
@@ -241,80 +644,62 @@ void clientServiceFunction(int socket, int nfiles, char **files){
                 return;
             }
             
+            //"+NM": the local copy has the size and timestamp of the server one, nothing follows
+            if(p->conditional && strncmp(rcvbuffer, NM_MSG, sizeof(NM_MSG)-1)==0){
+                printf("-> Received NOT MODIFIED message\n");
+                printf("\t->File name: %s (unchanged, not downloaded)\n", filename);
+                get64Confirmed = 1;
+                probing = 0;
+                jobUnchanged[job]++;
+                continue;
+            }
+            
             //comparing read message with the OK_MSG string expected
             if(strncmp(rcvbuffer, OK_MSG , sizeof(OK_MSG)-1)==0){
                 printf("-> Received OK message\n");
                 
-                //reading file size
-                FD_ZERO(&cset);
-                FD_SET(socket, &cset);
-                tval.tv_sec = WAITINGTIME;
-                tval.tv_usec = 0;
-                if((n = Select(FD_SETSIZE, &cset, NULL, NULL, &tval)) > 0){
-                    if(readn(socket, rcvbuffer, sizeof(uint32_t)) != sizeof(uint32_t)){
-                        errorHandler("Error while reading file size. Closing connection\t", socket);
+                get64Confirmed = p->fieldslen != LEGACYFIELDSLENGTH;
+                probing = 0;
+                
+                //reading file size and timestamp
+                if((n = waitServer(&rb)) > 0){
+                    if(rbuf_readn(&rb, rcvbuffer, p->fieldslen) != p->fieldslen){
+                        errorHandler("Error while reading file size and timestamp. Closing connection\t", socket);
                         return;
                     }
                 }else{
                     errorHandler("No response received, timeout. Closing connection\t", socket);
                     return;
                 }
-                filesize = ntohl(*(uint32_t *)rcvbuffer);
-              
-                //reading file timestamp
-                FD_ZERO(&cset);
-                FD_SET(socket, &cset);
-                tval.tv_sec = WAITINGTIME;
-                tval.tv_usec = 0;
-                if((n = Select(FD_SETSIZE, &cset, NULL, NULL, &tval)) > 0){
-                    if(readn(socket, rcvbuffer, sizeof(uint32_t)) != sizeof(uint32_t)){
-                        errorHandler("Error while reading file timestamp. Closing connection\t", socket);
+                decodeFileInfo(rcvbuffer, &info, p->fieldslen != LEGACYFIELDSLENGTH);
+                
+                //FGET: the bytes of the file are read from the descriptor that came with the reply
+                if(p->passed){
+                    if(receivePassedFile(socket, &rb, job, filename, &info, &receivedsize) < 0){
                         return;
                     }
-                }else{
-                    errorHandler("No response received, timeout. Closing connection\t", socket);
-                    return;
-                }
-                timestamp = ntohl(*(uint32_t *)rcvbuffer);
-                
-                //creating the file in the client directory
-                if((fp = fopen(filename, "w")) == NULL){
-                    errorHandler("Creating file error. Closing connection\t\t\t", socket);
-                    return;
+                    totalreceived += receivedsize;
+                    continue;
                 }
                 
-                //receiving file from server
-                printf("Receiving file from server\t\t\t\t");
-                receivedsize = 0;
-                while(receivedsize < filesize){
-                    
-                    FD_ZERO(&cset);
-                    FD_SET(socket, &cset);
-                    tval.tv_sec = WAITINGTIME;
-                    tval.tv_usec = 0;
-                    if((n = Select(FD_SETSIZE, &cset, NULL, NULL, &tval)) > 0){
-                        numreceived = (uint32_t)read(socket, rcvbuffer, RCVBUFFERLENGTH);
-                        if(numreceived <= 0){
-                            errorHandler("Error while receiving file. Closing connection\t\t", socket);
-                            return;
-                        }
-                    }else{
-                        errorHandler("No response received, timeout. Closing connection\t", socket);
+                //DELTA: literals and blocks of the local copy instead of the bytes of the file
+                if(p->delta){
+                    if(receiveDelta(socket, &rb, job, filename, p, &info, &receivedsize) < 0){
                         return;
                     }
-                    ret = (uint32_t)fwrite(rcvbuffer, sizeof(char), numreceived, fp);
-                    if(ret!=numreceived){
-                        errorHandler("Error while writing new file. Closing connection\t", socket);
-                        return;
-                    }
-                    receivedsize += numreceived;
-                    
+                    totalreceived += receivedsize;
+                    continue;
                 }
-                printf("-> File received\n");
-                printf("\t->File name: %s\n", filename);
-                printf("\t->File size: %" PRIu32 " byte\n" , filesize);
-                printf("\t->File timestamp: %" PRIu32 "\n", timestamp);
-                fclose(fp);
+                rangeoff = 0;
+                rangelen = info.size;
+                if(p->localsize > 0){
+                    decodeRange(rcvbuffer+GET64FIELDSLENGTH, &rangeoff, &rangelen);
+                }
+                
+                if(receiveFile(socket, &rb, job, filename, p, &info, rangeoff, rangelen, &receivedsize) < 0){
+                    return;
+                }
+                totalreceived += receivedsize;
             }else{
                 errorHandler("Wrong OK message received. Closing connection\t\t", socket);
                 return;
@@ -325,12 +710,8 @@ void clientServiceFunction(int socket, int nfiles, char **files){
             /////////////////////////////////
             //POSSIBLE ERR MESSAGE RECEIVED//
             /////////////////////////////////
-            FD_ZERO(&cset);
-            FD_SET(socket, &cset);
-            tval.tv_sec = WAITINGTIME;
-            tval.tv_usec = 0;
-            if((n = Select(FD_SETSIZE, &cset, NULL, NULL, &tval)) > 0){
-                if(readn(socket, rcvbuffer, sizeof(ERR_MSG)-1) != (sizeof(ERR_MSG)-1)){
+            if((n = waitServer(&rb)) > 0){
+                if(rbuf_readn(&rb, rcvbuffer, sizeof(ERR_MSG)-1) != (sizeof(ERR_MSG)-1)){
                     errorHandler("Error while reading error message. Closing connection\t", socket);
                     return;
                 }
@@ -339,8 +720,64 @@ void clientServiceFunction(int socket, int nfiles, char **files){
                 return;
             }
             
+            //"ERR b": the server refused the connection before reading any command, the requests in flight
+            //are sent again on a new one
+            if(strncmp(rcvbuffer, BUSY_MSG, sizeof(ERR_MSG)-1) == 0){
+                if(rbuf_readn(&rb, rcvbuffer, sizeof(BUSY_MSG)-sizeof(ERR_MSG)) != (sizeof(BUSY_MSG)-sizeof(ERR_MSG)) ||
+                   strncmp(rcvbuffer, BUSY_MSG+sizeof(ERR_MSG)-1, sizeof(BUSY_MSG)-sizeof(ERR_MSG)) != 0){
+                    errorHandler("Wrong ERR message received. Closing connection\t", socket);
+                    return;
+                }
+                if((socket = reconnectWhenBusy(socket, &busyRetries)) < 0){
+                    return;
+                }
+                initReplies(&rb, socket);
+                sent = head;
+                head--;
+                continue;
+            }
+            
             //comparing message received with the ERR_MSG string expected
-            if(strncmp(rcvbuffer, ERR_MSG, sizeof(ERR_MSG)-1) == 0){
+            if(strncmp(rcvbuffer, ERR_MSG, sizeof(ERR_MSG)-1) == 0 && p->delta){
+                //DELTA is not known (or not served by this engine of the server): new connection, GET64 from now on
+                printf("-> Received ERROR message\n");
+                printf("DELTA refused, retrying with GET64\t\t\t");
+                __atomic_store_n(&deltaMode, 0, __ATOMIC_RELAXED);
+                Close(socket);
+                printf("-> Connection closed\n");
+                if((socket = connectToServer()) < 0){
+                    return;
+                }
+                initReplies(&rb, socket);
+                sent = head;
+                probing = 1;
+                head--;
+                continue;
+            }else if(strncmp(rcvbuffer, ERR_MSG, sizeof(ERR_MSG)-1) == 0 && p->fieldslen != LEGACYFIELDSLENGTH && !get64Confirmed){
+                //the server may not know IFMOD, FGET or GET64 at all: new connection, same file without IFMOD or FGET,
+                //then with GET (the requests pipelined after it are lost with the connection and sent again)
+                printf("-> Received ERROR message\n");
+                if(p->conditional){
+                    printf("IFMOD refused, retrying with GET64\t\t\t");
+                    __atomic_store_n(&syncMode, 0, __ATOMIC_RELAXED);
+                }else if(p->passed){
+                    printf("FGET refused, retrying with GET64\t\t\t");
+                    __atomic_store_n(&passMode, 0, __ATOMIC_RELAXED);
+                }else{
+                    printf("GET64 refused, retrying with GET\t\t\t\t");
+                    __atomic_store_n(&legacyGet, 1, __ATOMIC_RELAXED);
+                }
+                Close(socket);
+                printf("-> Connection closed\n");
+                if((socket = connectToServer()) < 0){
+                    return;
+                }
+                initReplies(&rb, socket);
+                sent = head;
+                probing = 1;
+                head--;
+                continue;
+            }else if(strncmp(rcvbuffer, ERR_MSG, sizeof(ERR_MSG)-1) == 0){
                 printf("-> Received ERROR message\n");
                 printf("Closing connection\t\t\t\t\t");
                 Close(socket);
@@ -361,6 +798,10 @@ void clientServiceFunction(int socket, int nfiles, char **files){
             
         }
     }
+    printThroughput(socket, totalreceived, &start);
+    if(__atomic_load_n(&syncMode, __ATOMIC_RELAXED)){
+        printf("\t->Files unchanged: %d\n", jobUnchanged[job]);
+    }
 
     //sending QUIT message and close connection
     printf("\n");
@@ -378,6 +819,615 @@ void clientServiceFunction(int socket, int nfiles, char **files){
 }
 
 
+//unix: the replies are read with the descriptors the server passes, in the order they come
+static void initReplies(Rbuf *rb, int socket){
+    if(localServer){
+        rbuf_init_fd(rb, socket);
+    }else{
+        rbuf_init(rb, socket);
+    }
+}
+
+
+//send the GET64 (GET with -l, RGET for a partial local copy with -r, IFMOD for a local copy with -s,
+//DELTA and the signatures of a local copy with -d) command of a file and remember what its reply
+//will look like, returns -1 (connection closed) on failure
+static int sendRequest(int socket, const char *filename, struct pendingRequest *p){
+    
+    char sndbuffer[SNDBUFFERLENGTH];    //sending buffer
+    size_t bufsize;                     //size of the sending buffer
+    struct fileInfo local;              //-d: version of the local copy
+    char *sigs = NULL;                  //-d: signatures of the local copy
+    int legacy;                         //-l, or GET64 refused: read once, another job may set it meanwhile
+    
+    //checking if filename is correct or not, if it is a directory or a filename
+    if(filename[0] == '.' || filename[0] == '~' || (strchr(filename, '/') != NULL)){
+        //it is a directory, not a filename
+        errorHandler("Error: it is not a filename but a directory. Try again\t", socket);
+        return(-1);
+    }
+    
+    //preparing sendbuffer and sending GET message (GET64 unless the server is an old one)
+    printf("\n");
+    printf("Sending GET message\t\t\t\t\t");
+    legacy = __atomic_load_n(&legacyGet, __ATOMIC_RELAXED);
+    p->fieldslen = legacy ? LEGACYFIELDSLENGTH : GET64FIELDSLENGTH;
+    p->localsize = 0;
+    p->conditional = 0;
+    p->record = 0;
+    p->batchcount = 0;
+    p->delta = 0;
+    p->passed = 0;
+    free(p->strong);
+    p->strong = NULL;
+    if(__atomic_load_n(&deltaMode, __ATOMIC_RELAXED) && !legacy && stat(filename, &p->lst) == 0 && S_ISREG(p->lst.st_mode)
+       && (sigs = computeSignatures(filename, p)) != NULL){
+        //local copy of at least a block: only the changes, or "+NM" as for IFMOD
+        p->delta = 1;
+        p->conditional = 1;
+        local.size = p->lst.st_size;
+        local.mtime = p->lst.st_mtim.tv_sec;
+        local.mtimensec = p->lst.st_mtim.tv_nsec;
+        bufsize = formatDeltaRequest(sndbuffer, SNDBUFFERLENGTH, filename, &local, p->blocksize, p->blockcount, inPlace);
+    }else if(__atomic_load_n(&syncMode, __ATOMIC_RELAXED) && !legacy && stat(filename, &p->lst) == 0 && S_ISREG(p->lst.st_mode)){
+        //local copy: the file is sent only if the server one has a different size or timestamp
+        p->conditional = 1;
+        bufsize = snprintf(sndbuffer, SNDBUFFERLENGTH, "%s%" PRIu64 " %" PRIu64 " %" PRIu32 " %s\r\n", IFMOD_CMDNAME,
+                           (uint64_t)p->lst.st_size, (uint64_t)p->lst.st_mtim.tv_sec, (uint32_t)p->lst.st_mtim.tv_nsec, filename);
+    }else if(resumeMode && !legacy && stat(filename, &p->lst) == 0 && S_ISREG(p->lst.st_mode) && p->lst.st_size > 0){
+        //partial copy: only the bytes after it, if the server file still has its timestamp
+        p->localsize = p->lst.st_size;
+        p->fieldslen = GET64FIELDSLENGTH + RANGEFIELDSLENGTH;
+        bufsize = snprintf(sndbuffer, SNDBUFFERLENGTH, "%s%" PRIu64 " 0 %" PRIu64 " %" PRIu32 " %s\r\n", RGET_CMDNAME,
+                           (uint64_t)p->localsize, (uint64_t)p->lst.st_mtim.tv_sec, (uint32_t)p->lst.st_mtim.tv_nsec, filename);
+    }else if(__atomic_load_n(&passMode, __ATOMIC_RELAXED) && !legacy){
+        //the server passes the descriptor of the file with the reply, the bytes are copied from it here
+        p->passed = 1;
+        bufsize = snprintf(sndbuffer, SNDBUFFERLENGTH, "%s%s\r\n", FGET_CMDNAME, filename);
+    }else{
+        bufsize = formatGetRequest(sndbuffer, SNDBUFFERLENGTH, filename, !legacy);
+    }
+    if(bufsize >= SNDBUFFERLENGTH){
+        free(sigs);
+        errorHandler("Error: file name too long. Closing connection\t\t", socket);
+        return(-1);
+    }
+    if(sendn(socket, sndbuffer, bufsize, 0) != bufsize){
+        free(sigs);
+        errorHandler("Error while sending GET message. Closing connection\t", socket);
+        return(-1);
+    }
+    if(sigs != NULL){
+        if(sendn(socket, sigs, (size_t)p->blockcount*DELTASIGLENGTH, 0) != (ssize_t)((size_t)p->blockcount*DELTASIGLENGTH)){
+            free(sigs);
+            errorHandler("Error while sending block signatures. Closing connection\t", socket);
+            return(-1);
+        }
+        free(sigs);
+        printf("-> Message sent (DELTA, %" PRIu32 " blocks of %" PRIu32 " bytes)\n", p->blockcount, p->blocksize);
+        return(0);
+    }
+    printf("-> Message sent\n");
+    return(0);
+}
+
+
+//signatures of the whole blocks of a local copy, for a DELTA. The strong hashes are kept in p to
+//check the reply. Returns NULL if the file is too small (or too large) for a delta, or cannot be read
+static char *computeSignatures(const char *filename, struct pendingRequest *p){
+    
+    unsigned char *buf;                 //chunk of the file, a multiple of the block size
+    char *sigs;
+    uint32_t i, j, n;
+    ssize_t m;
+    size_t len, done;
+    int fd;
+    
+    p->blocksize = deltaBlockSize((uint64_t)p->lst.st_size);
+    if((uint64_t)p->lst.st_size / p->blocksize == 0 || (uint64_t)p->lst.st_size / p->blocksize > DELTAMAXBLOCKS){
+        return(NULL);
+    }
+    p->blockcount = (uint32_t)((uint64_t)p->lst.st_size / p->blocksize);
+    if((fd = open(filename, O_RDONLY)) < 0){
+        return(NULL);
+    }
+    buf = malloc(SIGNATURECHUNK);
+    sigs = malloc((size_t)p->blockcount * DELTASIGLENGTH);
+    p->strong = malloc((size_t)p->blockcount * sizeof(*p->strong));
+    if(buf == NULL || sigs == NULL || p->strong == NULL){
+        goto failed;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for(i=0; i<p->blockcount; i+=n){
+        n = SIGNATURECHUNK / p->blocksize;
+        if(n > p->blockcount - i){
+            n = p->blockcount - i;
+        }
+        len = (size_t)n * p->blocksize;
+        for(done=0; done<len; done+=m){
+            if((m = pread(fd, buf+done, len-done, (off_t)i*p->blocksize + done)) <= 0){
+                if(m < 0 && errno == EINTR){
+                    m = 0;
+                    continue;
+                }
+                //shorter than when it was stated: no delta
+                goto failed;
+            }
+        }
+        for(j=0; j<n; j++){
+            p->strong[i+j] = deltaStrong(buf + (size_t)j*p->blocksize, p->blocksize);
+            encodeDeltaSignature(sigs + (size_t)(i+j)*DELTASIGLENGTH, deltaWeak(buf + (size_t)j*p->blocksize, p->blocksize), p->strong[i+j]);
+        }
+    }
+    free(buf);
+    close(fd);
+    return(sigs);
+    
+failed:
+    free(buf);
+    free(sigs);
+    free(p->strong);
+    p->strong = NULL;
+    close(fd);
+    return(NULL);
+}
+
+
+//send one MGET for the files of the ring from first to last (at most MGETFILES, and as many as fit in a command line)
+//and remember that their replies are records, returns the number of files asked or -1 (connection closed) on failure
+static int sendBatch(int socket, struct pendingRequest *pending, unsigned int ringsize, unsigned int first, unsigned int last){
+    
+    char sndbuffer[SNDBUFFERLENGTH];    //sending buffer
+    size_t bufsize, len;
+    const char *filename;
+    struct pendingRequest *p;
+    unsigned int i;
+    
+    printf("\n");
+    printf("Sending MGET message\t\t\t\t\t");
+    memcpy(sndbuffer, MGET_CMDNAME, sizeof(MGET_CMDNAME)-1);
+    bufsize = sizeof(MGET_CMDNAME)-1;
+    for(i=first; i != last && i-first < MGETFILES; i++){
+        filename = fileList[pending[i % ringsize].fileindex];
+        //the separator of the names cannot be part of one
+        if(filename[0] == '.' || filename[0] == '~' || (strchr(filename, '/') != NULL)){
+            errorHandler("Error: it is not a filename but a directory. Try again\t", socket);
+            return(-1);
+        }
+        //the name, its separator and the final CR LF must fit in the command line
+        len = strlen(filename);
+        if(bufsize + (i != first) + len + 2 >= SNDBUFFERLENGTH){
+            if(i == first){
+                errorHandler("Error: file name too long. Closing connection\t\t", socket);
+                return(-1);
+            }
+            break;
+        }
+        if(i != first){
+            sndbuffer[bufsize++] = MGET_SEPARATOR;
+        }
+        memcpy(sndbuffer+bufsize, filename, len);
+        bufsize += len;
+        p = &pending[i % ringsize];
+        p->fieldslen = GET64FIELDSLENGTH;
+        p->localsize = 0;
+        p->conditional = 0;
+        p->record = 1;
+        p->batchcount = 0;
+    }
+    memcpy(sndbuffer+bufsize, "\r\n", 2);
+    bufsize += 2;
+    pending[first % ringsize].batchcount = i - first;
+    if(sendn(socket, sndbuffer, bufsize, 0) != bufsize){
+        errorHandler("Error while sending MGET message. Closing connection\t", socket);
+        return(-1);
+    }
+    printf("-> Message sent (%u files)\n", i - first);
+    return(i - first);
+}
+
+
+//receive the rangelen bytes of a file following its reply header (at rangeoff, appended to the
+//partial copy of a RGET when it is the same version), returns -1 (connection closed) on failure
+static int receiveFile(int socket, Rbuf *rb, int job, const char *filename, const struct pendingRequest *p,
+                       const struct fileInfo *info, uint64_t rangeoff, uint64_t rangelen, uint64_t *received){
+                       
+    char rcvbuffer[RCVBUFFERLENGTH];    //receiving buffer
+    uint64_t receivedsize, toread;      //used while reading file
+    ssize_t numreceived;                //bytes received by a single read
+    int fd;                             //file being received
+    int n;
+    
+    //appending to the partial copy only if it is the same version of the file
+    if(p->localsize > 0 && rangeoff == (uint64_t)p->localsize && info->mtime == (uint64_t)p->lst.st_mtim.tv_sec
+       && info->mtimensec == (uint32_t)p->lst.st_mtim.tv_nsec){
+        printf("Resuming file at byte %" PRIu64 "\t\t\t\t", rangeoff);
+        if((fd = open(filename, O_WRONLY)) < 0){
+            errorHandler("Opening partial file error. Closing connection\t\t", socket);
+            return(-1);
+        }
+        printf("-> Done\n");
+    }else if(rangeoff != 0){
+        errorHandler("Unexpected range received. Closing connection\t\t", socket);
+        return(-1);
+    }else if((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0){
+        //creating the file in the client directory
+        errorHandler("Creating file error. Closing connection\t\t\t", socket);
+        return(-1);
+    }
+    partialTimes[job][0].tv_sec = partialTimes[job][1].tv_sec = (time_t)info->mtime;
+    partialTimes[job][0].tv_nsec = partialTimes[job][1].tv_nsec = (long)info->mtimensec;
+    partialFd[job] = fd;
+    
+    //reserving the blocks of the whole file up front (the size is kept, so that an
+    //interrupted file still shows how much of it was received)
+    if(rangelen > 0){
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t)rangeoff, (off_t)rangelen);
+    }
+    
+    //receiving file from server
+    printf("Receiving file from server\t\t\t\t");
+    receivedsize = 0;
+    while(receivedsize < rangelen){
+        
+        if((n = waitServer(rb)) > 0){
+            //never reading past the end of the file: what follows belongs to the next reply
+            if(rbuf_pending(rb) == 0 && __atomic_load_n(&spliceReceive, __ATOMIC_RELAXED)){
+                //socket -> pipe -> file, the bytes never reach user space
+                numreceived = spliceToFile(socket, fd, (off_t)(rangeoff+receivedsize), rangelen-receivedsize, job);
+                if(numreceived < 0 && (errno == EINVAL || errno == ENOSYS)){
+                    //the socket or the file system does not support it: the copy path from now on
+                    __atomic_store_n(&spliceReceive, 0, __ATOMIC_RELAXED);
+                    continue;
+                }
+                if(numreceived <= 0){
+                    closeReceivedFile(fd, job);
+                    errorHandler("Error while receiving file. Closing connection\t\t", socket);
+                    return(-1);
+                }
+                receivedsize += numreceived;
+                continue;
+            }
+            toread = (rangelen - receivedsize < RCVBUFFERLENGTH) ? rangelen - receivedsize : RCVBUFFERLENGTH;
+            numreceived = rbuf_read(rb, rcvbuffer, toread);
+            if(numreceived <= 0){
+                closeReceivedFile(fd, job);
+                errorHandler("Error while receiving file. Closing connection\t\t", socket);
+                return(-1);
+            }
+        }else{
+            closeReceivedFile(fd, job);
+            errorHandler("No response received, timeout. Closing connection\t", socket);
+            return(-1);
+        }
+        if(pwriten(fd, rcvbuffer, numreceived, (off_t)(rangeoff+receivedsize)) < 0){
+            closeReceivedFile(fd, job);
+            errorHandler("Error while writing new file. Closing connection\t", socket);
+            return(-1);
+        }
+        receivedsize += numreceived;
+        
+    }
+    printf("-> File received\n");
+    printf("\t->File name: %s\n", filename);
+    printf("\t->File size: %" PRIu64 " byte\n" , info->size);
+    if(rangeoff != 0){
+        printf("\t->Bytes received: %" PRIu64 " (from byte %" PRIu64 ")\n", rangelen, rangeoff);
+    }
+    printf("\t->File timestamp: %" PRIu64 "\n", info->mtime);
+    closeReceivedFile(fd, job);
+    jobBytes[job] += receivedsize;
+    jobFiles[job]++;
+    *received = receivedsize;
+    return(0);
+}
+
+
+//rebuild a file from the operations of a DELTA reply: literals and blocks of the local copy. With -i the copy
+//is rewritten in place (a block already at its offset is not even touched), otherwise the new version is built
+//in a temporary file renamed over the copy at the end. Returns -1 (connection closed) on failure
+static int receiveDelta(int socket, Rbuf *rb, int job, const char *filename, const struct pendingRequest *p,
+                        const struct fileInfo *info, uint64_t *received){
+                        
+    char tmpname[RCVBUFFERLENGTH];      //new version, without -i
+    unsigned char *buf;                 //a literal or a block being copied
+    struct timespec times[2];           //server timestamp, given when the file is complete
+    uint64_t pos = 0;                   //bytes of the new version written so far
+    uint64_t arg, digest = 0, literal = 0, reused = 0, src;
+    uint32_t count, i;
+    int oldfd, fd, op;
+    char *err = NULL;
+    
+    printf("Rebuilding file from the local copy%s\t\t", inPlace ? " in place" : "");
+    snprintf(tmpname, sizeof(tmpname), ".%s.delta", filename);
+    if((buf = malloc(p->blocksize > DELTALITERALMAX ? p->blocksize : DELTALITERALMAX)) == NULL){
+        errorHandler("Out of memory. Closing connection\t\t\t\t", socket);
+        return(-1);
+    }
+    if(inPlace){
+        oldfd = fd = open(filename, O_RDWR);
+    }else if((oldfd = open(filename, O_RDONLY)) >= 0 && (fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0){
+        close(oldfd);
+        oldfd = -1;
+    }
+    if(oldfd < 0){
+        free(buf);
+        errorHandler("Opening local copy error. Closing connection\t\t", socket);
+        return(-1);
+    }
+    
+    for( ; ; ){
+        if(waitServer(rb) <= 0){
+            err = "No response received, timeout. Closing connection\t";
+            break;
+        }
+        if((op = readDeltaOp(rb, &arg, &count)) == DELTA_END){
+            //every byte written, and the same hashes in the same order as on the server
+            if(pos != info->size || arg != digest){
+                err = "Rebuilt file does not match. Closing connection\t\t";
+            }
+            break;
+        }else if(op == DELTA_LITERAL){
+            if(arg > DELTALITERALMAX || pos + arg > info->size || rbuf_readn(rb, buf, arg) != (ssize_t)arg){
+                err = "Wrong literal received. Closing connection\t\t";
+                break;
+            }
+            digest = deltaMix(digest, deltaStrong(buf, arg));
+            if(pwriten(fd, (char *)buf, arg, (off_t)pos) < 0){
+                err = "Error while writing new file. Closing connection\t";
+                break;
+            }
+            pos += arg;
+            literal += arg;
+        }else if(op == DELTA_COPY){
+            src = arg * p->blocksize;
+            //in place a block before the offset it is written to has been overwritten already
+            if(count == 0 || arg + count > p->blockcount || pos + (uint64_t)count*p->blocksize > info->size || (inPlace && src < pos)){
+                err = "Wrong block copy received. Closing connection\t\t";
+                break;
+            }
+            for(i=0; i<count; i++){
+                digest = deltaMix(digest, p->strong[arg+i]);
+            }
+            if(!(inPlace && src == pos) && copyBlocks(oldfd, fd, buf, src, pos, (uint64_t)count*p->blocksize) < 0){
+                err = "Error while copying local blocks. Closing connection\t";
+                break;
+            }
+            pos += (uint64_t)count*p->blocksize;
+            reused += (uint64_t)count*p->blocksize;
+        }else{
+            err = "Wrong delta received. Closing connection\t\t";
+            break;
+        }
+    }
+    free(buf);
+    
+    //the tail of a longer copy is cut, then the file gets the server timestamp
+    times[0].tv_sec = times[1].tv_sec = (time_t)info->mtime;
+    times[0].tv_nsec = times[1].tv_nsec = (long)info->mtimensec;
+    if(err == NULL && (ftruncate(fd, (off_t)info->size) < 0 || futimens(fd, times) < 0 || (!inPlace && rename(tmpname, filename) < 0))){
+        err = "Error while writing new file. Closing connection\t";
+    }
+    if(!inPlace){
+        close(oldfd);
+        if(err != NULL){
+            unlink(tmpname);
+        }
+    }
+    close(fd);
+    if(err != NULL){
+        errorHandler(err, socket);
+        return(-1);
+    }
+    printf("-> File received\n");
+    printf("\t->File name: %s\n", filename);
+    printf("\t->File size: %" PRIu64 " byte\n" , info->size);
+    printf("\t->Bytes received: %" PRIu64 ", reused from the local copy: %" PRIu64 "\n", literal, reused);
+    printf("\t->File timestamp: %" PRIu64 "\n", info->mtime);
+    jobBytes[job] += literal;
+    jobFiles[job]++;
+    *received = literal;
+    return(0);
+}
+
+
+//FGET: the descriptor of the server file came with the reply header, its first info->size bytes are copied
+//into the local file by the kernel (copy_file_range(), shared blocks if the file system can), nothing else
+//is read from the socket. Returns -1 (connection closed) on failure
+static int receivePassedFile(int socket, Rbuf *rb, int job, const char *filename, const struct fileInfo *info, uint64_t *received){
+    
+    int infd, fd;                       //file of the server, local file
+    struct stat st;
+    unsigned char *buf;                 //copy path, when the kernel cannot copy between the two
+    
+    if((infd = rbuf_takefd(rb)) < 0){
+        errorHandler("No file descriptor received. Closing connection\t\t", socket);
+        return(-1);
+    }
+    if(fstat(infd, &st) < 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size < info->size){
+        close(infd);
+        errorHandler("Wrong file descriptor received. Closing connection\t", socket);
+        return(-1);
+    }
+    if((buf = malloc(DELTALITERALMAX)) == NULL){
+        close(infd);
+        errorHandler("Out of memory. Closing connection\t\t\t\t", socket);
+        return(-1);
+    }
+    if((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0){
+        free(buf);
+        close(infd);
+        errorHandler("Creating file error. Closing connection\t\t\t", socket);
+        return(-1);
+    }
+    partialTimes[job][0].tv_sec = partialTimes[job][1].tv_sec = (time_t)info->mtime;
+    partialTimes[job][0].tv_nsec = partialTimes[job][1].tv_nsec = (long)info->mtimensec;
+    partialFd[job] = fd;
+    
+    printf("Copying file from the descriptor passed\t\t\t");
+    if(copyBlocks(infd, fd, buf, 0, 0, info->size) < 0){
+        free(buf);
+        close(infd);
+        closeReceivedFile(fd, job);
+        errorHandler("Error while copying file. Closing connection\t\t", socket);
+        return(-1);
+    }
+    free(buf);
+    close(infd);
+    printf("-> File received\n");
+    printf("\t->File name: %s\n", filename);
+    printf("\t->File size: %" PRIu64 " byte (copied from the server file)\n" , info->size);
+    printf("\t->File timestamp: %" PRIu64 "\n", info->mtime);
+    closeReceivedFile(fd, job);
+    jobBytes[job] += info->size;
+    jobFiles[job]++;
+    *received = info->size;
+    return(0);
+}
+
+
+//the server refused the connection at its limits: it is closed and a new one is opened after a pause,
+//doubled at every retry and spread at random so that the refused clients do not come back together.
+//Returns the new socket, -1 when the retries are over or the connection fails
+static int reconnectWhenBusy(int socket, int *retries){
+    
+    struct timespec pause;
+    unsigned ms;
+    
+    printf("-> Received BUSY message\n");
+    Close(socket);
+    if(*retries >= BUSYRETRIES){
+        printf("Server busy, giving up after %d retries\n", BUSYRETRIES);
+        return -1;
+    }
+    ms = BUSYPAUSEMS << (*retries)++;
+    ms += (unsigned)rand() % ms;
+    printf("Server busy, new connection in %u ms\t\t\t", ms);
+    pause.tv_sec = ms / 1000;
+    pause.tv_nsec = (long)(ms % 1000) * 1000000;
+    while(nanosleep(&pause, &pause) < 0 && errno == EINTR);
+    return connectToServer();
+}
+
+
+//copy len bytes of the local copy at src to dst of the new version (the same file in place, where
+//src is never before dst). Without -i the file system may share the blocks instead. Returns -1 on error
+static int copyBlocks(int oldfd, int fd, unsigned char *buf, uint64_t src, uint64_t dst, uint64_t len){
+    
+    loff_t in = src, out = dst;
+    ssize_t n;
+    
+    while(oldfd != fd && len > 0 && (n = copy_file_range(oldfd, &in, fd, &out, len, 0)) > 0){
+        len -= n;
+    }
+    src = in;
+    dst = out;
+    //in place, or copy_file_range() not supported: a piece at a time, read before it is overwritten
+    for( ; len > 0; src += n, dst += n, len -= n){
+        n = len < DELTALITERALMAX ? len : DELTALITERALMAX;
+        if(pread(oldfd, buf, n, (off_t)src) != n || pwriten(fd, (char *)buf, n, (off_t)dst) < 0){
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+
+//send LIST and print the files of the server directory (name, size, timestamp), then QUIT. Returns -1 (connection closed) on failure
+static int listDirectory(int socket){
+    
+    Rbuf rb;                            //bytes received from the server, not yet consumed
+    char fields[LISTFIELDSLENGTH];
+    char name[RCVBUFFERLENGTH];         //name of an entry, NUL terminated
+    char *listing;
+    struct fileInfo info;
+    uint64_t length, received, totalsize = 0;
+    size_t used, n;
+    ssize_t numreceived;
+    unsigned long files = 0;
+    
+    rbuf_init(&rb, socket);
+    printf("Sending LIST message\t\t\t\t\t");
+    if(sendn(socket, LIST_CMDNAME "\r\n", sizeof(LIST_CMDNAME "\r\n")-1, 0) != sizeof(LIST_CMDNAME "\r\n")-1){
+        errorHandler("Sending LIST message error. Closing connection\t", socket);
+        return(-1);
+    }
+    printf("-> Message sent\n");
+    if(waitServer(&rb) <= 0){
+        errorHandler("No response received, timeout. Closing connection\t", socket);
+        return(-1);
+    }
+    if(readReplyHeader(&rb, fields, sizeof(fields)) != 1){
+        errorHandler("Listing not available. Closing connection\t\t", socket);
+        return(-1);
+    }
+    memcpy(&length, fields, sizeof(length));
+    length = ntoh64(length);
+    if(length > SIZE_MAX || (listing = malloc(length > 0 ? length : 1)) == NULL){
+        errorHandler("Listing too large. Closing connection\t\t\t", socket);
+        return(-1);
+    }
+    for(received=0; received<length; received+=numreceived){
+        if(waitServer(&rb) <= 0){
+            free(listing);
+            errorHandler("No response received, timeout. Closing connection\t", socket);
+            return(-1);
+        }
+        if((numreceived = rbuf_read(&rb, listing+received, length-received)) <= 0){
+            free(listing);
+            errorHandler("Error while receiving listing. Closing connection\t", socket);
+            return(-1);
+        }
+    }
+    
+    printf("\n%12s %20s %s\n", "size", "timestamp", "name");
+    for(used=0; used<length; used+=n){
+        if((n = decodeListEntry(listing+used, length-used, name, sizeof(name), &info)) == 0){
+            free(listing);
+            errorHandler("Invalid listing received. Closing connection\t\t", socket);
+            return(-1);
+        }
+        printf("%12" PRIu64 " %20" PRIu64 " %s\n", info.size, info.mtime, name);
+        totalsize += info.size;
+        files++;
+    }
+    free(listing);
+    printf("\t->Files: %lu, %" PRIu64 " byte\n\n", files, totalsize);
+    
+    printf("Sending QUIT message\t\t\t\t\t");
+    if(sendn(socket, QUIT_MSG, sizeof(QUIT_MSG)-1, 0) != (sizeof(QUIT_MSG)-1)){
+        errorHandler("Sending QUIT message error. Closing connection\t", socket);
+        return(-1);
+    }
+    printf("-> Message sent\n");
+    Close(socket);
+    return(0);
+}
+
+
+//bytes received per second and per round trip time (as measured by the kernel for the connection)
+static void printThroughput(int socket, uint64_t bytes, const struct timespec *start){
+    
+    struct timespec now;
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    double elapsed;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+    printf("\n");
+    printf("Transfer statistics (window %d)\n", requestWindow);
+    printf("\t->Bytes received: %" PRIu64 " in %.3f s\n", bytes, elapsed);
+    if(elapsed > 0){
+        printf("\t->Throughput: %.2f MB/s\n", bytes / elapsed / 1e6);
+    }
+    if(getsockopt(socket, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 && ti.tcpi_rtt > 0 && elapsed > 0){
+        printf("\t->RTT: %u us (variance %u us)\n", ti.tcpi_rtt, ti.tcpi_rttvar);
+        printf("\t->Bytes per RTT: %.0f\n", bytes / elapsed * ti.tcpi_rtt / 1e6);
+    }
+}
+
+
 //function used to handle error and close socket
 void errorHandler(char *err, int s){
     printf("\n");
@@ -387,3 +1437,134 @@ void errorHandler(char *err, int s){
     return;
 }
 
+
+//wait for data from the server (or bytes already buffered), returns 0 on timeout
+static int waitServer(Rbuf *rb){
+    fd_set cset;                        //set of sockets
+    struct timeval tval;                //timeval structure
+    
+    if(rbuf_pending(rb) > 0){
+        return 1;
+    }
+    FD_ZERO(&cset);
+    FD_SET(rb->fd, &cset);
+    tval.tv_sec = WAITINGTIME;
+    tval.tv_usec = 0;
+    return Select(FD_SETSIZE, &cset, NULL, NULL, &tval);
+}
+
+
+//flush and close a received (maybe partial) file, giving it the timestamp of the server copy
+static void closeReceivedFile(int fd, int job){
+    if(futimens(fd, partialTimes[job]) < 0){
+        printf("Setting file timestamp failed\n");
+    }
+    partialFd[job] = -1;
+    close(fd);
+}
+
+
+//move at most len bytes socket -> pipe -> file at offset, returns the bytes moved,
+//0 if the server closed the connection, -1 on error (errno EINVAL or ENOSYS: nothing was consumed)
+static ssize_t spliceToFile(int socket, int fd, off_t offset, uint64_t len, int job){
+    
+    int *pipefd = jobPipe[job];
+    loff_t off = offset;
+    ssize_t n, m, done;
+    
+    if(pipefd[0] < 0){
+        if(pipe(pipefd) < 0){
+            return(-1);
+        }
+        //a larger pipe moves more per system call (best effort, the limit is pipe-max-size)
+        fcntl(pipefd[1], F_SETPIPE_SZ, SPLICECHUNK);
+    }
+    if(len > SPLICECHUNK){
+        len = SPLICECHUNK;
+    }
+    if((n = splice(socket, NULL, pipefd[1], NULL, len, SPLICE_F_MOVE)) <= 0){
+        return(n);
+    }
+    for(done=0; done<n; done+=m){
+        if((m = splice(pipefd[0], NULL, fd, &off, n-done, SPLICE_F_MOVE)) <= 0){
+            //the file does not take splice: the bytes already in the pipe are copied
+            if(m < 0 && (errno == EINVAL || errno == ENOSYS) && drainPipe(pipefd[0], fd, off, n-done) == 0){
+                return(n);
+            }
+            errno = EIO;
+            return(-1);
+        }
+    }
+    return(n);
+}
+
+
+//copy len bytes left in the pipe to the file at offset, returns -1 on error
+static int drainPipe(int pipefd, int fd, off_t offset, size_t len){
+    
+    char buffer[RCVBUFFERLENGTH];
+    ssize_t n;
+    
+    while(len > 0){
+        if((n = read(pipefd, buffer, len < sizeof(buffer) ? len : sizeof(buffer))) <= 0){
+            return(-1);
+        }
+        if(pwriten(fd, buffer, n, offset) < 0){
+            return(-1);
+        }
+        offset += n;
+        len -= n;
+    }
+    return(0);
+}
+
+
+//pwrite() all the n bytes, returns -1 on error
+static ssize_t pwriten(int fd, const char *buf, size_t n, off_t offset){
+    
+    size_t done;
+    ssize_t m;
+    
+    for(done=0; done<n; done+=m){
+        if((m = pwrite(fd, buf+done, n-done, offset+done)) < 0){
+            if(errno == EINTR){
+                m = 0;
+                continue;
+            }
+            return(-1);
+        }
+    }
+    return(n);
+}
+
+
+//SIGINT/SIGTERM: the bytes already written stay, stamped so that -r can complete them
+static void interruptHandler(int signo){
+    int i;
+    
+    for(i=0; i<jobs; i++){
+        if(partialFd[i] >= 0){
+            futimens(partialFd[i], partialTimes[i]);
+        }
+    }
+    _exit(1);
+}
+
+
+//next file of the shared queue, -1 when all the files have been requested
+static int takeFile(void){
+    int i = __atomic_fetch_add(&nextFile, 1, __ATOMIC_RELAXED);
+    return i < fileCount ? i : -1;
+}
+
+
+//-j: one connection taking files from the queue
+static void *jobThread(void *arg){
+    int job = (int)(intptr_t)arg;
+    int s;
+    
+    if((s = connectToServer()) >= 0){
+        clientServiceFunction(s, job);
+    }
+    return NULL;
+}
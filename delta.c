@@ -0,0 +1,169 @@
+/*
+ 
+ module: delta.c
+ 
+ purpose: block signatures of the DELTA command, shared by server and
+          client: the rolling weak checksum, the strong hash of a block
+          and the digest of a delta reply
+ 
+ */
+
+
+#include <stdint.h>
+#include <stddef.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "protocol.h"
+#include "delta.h"
+
+/* primes of XXH64 */
+#define PRIME64_1	0x9E3779B185EBCA87ULL
+#define PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3	0x165667B19E3779F9ULL
+#define PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define PRIME64_5	0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+
+/* rsync checksum of len bytes: s1 is the sum of the bytes, s2 the sum of
+   the byte i weighted len - i, both modulo 2^16 in the two halves.
+   With SSE2, 16 bytes at a time: psadbw sums them and pmaddwd weights them
+   16..1, s1 before each group of 16 is accumulated apart and weighted 16 */
+uint32_t deltaWeak(const unsigned char *buf, size_t len)
+{
+	uint32_t s1 = 0, s2 = 0;
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i wlo = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+	const __m128i whi = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+	__m128i vs1 = zero, vs2 = zero, vps = zero, v;
+	uint32_t lanes[4];
+
+	for ( ; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(buf + i));
+		vps = _mm_add_epi32(vps, vs1);
+		vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(v, zero));
+		vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), wlo));
+		vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), whi));
+	}
+	/* the lanes wrap modulo 2^32, only the low 16 bits are kept */
+	_mm_storeu_si128((__m128i *)lanes, vs1);
+	s1 = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	_mm_storeu_si128((__m128i *)lanes, vps);
+	s2 = 16 * (lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+	_mm_storeu_si128((__m128i *)lanes, vs2);
+	s2 += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+	for ( ; i < len; i++) {
+		s1 += buf[i];
+		s2 += s1;
+	}
+	return (s1 & 0xffff) | (s2 << 16);
+}
+
+/* checksum of the len bytes window moved one byte forward: out leaves it,
+   in enters it */
+uint32_t deltaRoll(uint32_t weak, unsigned char out, unsigned char in, size_t len)
+{
+	uint32_t s1 = weak & 0xffff, s2 = weak >> 16;
+
+	s1 = (s1 - out + in) & 0xffff;
+	s2 = (s2 - (uint32_t)len * out + s1) & 0xffff;
+	return s1 | (s2 << 16);
+}
+
+/* little endian loads, whatever the byte order of the host (the hash
+   is sent to the other side) */
+static uint64_t read64(const unsigned char *p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	       (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = ROTL64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t val)
+{
+	acc ^= round64(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* strong hash of a block: XXH64 with seed 0 */
+uint64_t deltaStrong(const unsigned char *buf, size_t len)
+{
+	const unsigned char *p = buf, *end = buf + len;
+	uint64_t v1, v2, v3, v4, h;
+
+	if (len >= 32) {
+		v1 = PRIME64_1 + PRIME64_2;
+		v2 = PRIME64_2;
+		v3 = 0;
+		v4 = -PRIME64_1;
+		do {
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+		h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	} else {
+		h = PRIME64_5;
+	}
+	h += (uint64_t)len;
+	for ( ; p + 8 <= end; p += 8) {
+		h ^= round64(0, read64(p));
+		h = ROTL64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)read32(p) * PRIME64_1;
+		h = ROTL64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	for ( ; p < end; p++) {
+		h ^= (uint64_t)*p * PRIME64_5;
+		h = ROTL64(h, 11) * PRIME64_1;
+	}
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+/* digest of a delta reply: the strong hash of every block copied and of
+   every literal sent, mixed in the order of the file */
+uint64_t deltaMix(uint64_t digest, uint64_t hash)
+{
+	digest = round64(digest, hash);
+	return digest ^ (digest >> 29);
+}
+
+/* block size for a copy of size bytes: the power of two nearest above its
+   square root, so that signatures and literals grow alike */
+uint32_t deltaBlockSize(uint64_t size)
+{
+	uint32_t b = DELTAMINBLOCK;
+
+	while (b < DELTAMAXBLOCK && (uint64_t)b * b < size)
+		b <<= 1;
+	return b;
+}
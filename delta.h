@@ -0,0 +1,23 @@
+/*
+ 
+ module: delta.h
+ 
+ purpose: definitions of functions in delta.c
+ 
+ */
+
+
+#ifndef _DELTA_H
+
+#define _DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t deltaWeak(const unsigned char *buf, size_t len);
+uint32_t deltaRoll(uint32_t weak, unsigned char out, unsigned char in, size_t len);
+uint64_t deltaStrong(const unsigned char *buf, size_t len);
+uint64_t deltaMix(uint64_t digest, uint64_t hash);
+uint32_t deltaBlockSize(uint64_t size);
+
+#endif
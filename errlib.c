@@ -94,3 +94,15 @@ void err_quit (const char *fmt, ...) {
 	va_end (ap);
 	exit (1);
 }
+
+/* Message with the syslog level chosen by the caller
+ * Print message and return */
+
+void err_log (int level, const char *fmt, ...) {
+	va_list ap;
+
+	va_start (ap, fmt);
+	err_doit (0, level, fmt, ap);
+	va_end (ap);
+	return;
+}
@@ -26,4 +26,6 @@ void err_sys (const char *fmt, ...);
 
 void err_dump (const char *fmt, ...);
 
+void err_log (int level, const char *fmt, ...);
+
 #endif
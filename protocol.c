@@ -0,0 +1,319 @@
+/*
+ 
+ module: protocol.c
+ 
+ purpose: encoding of the fields of the file transfer protocol,
+          shared by server and client
+ 
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+
+#define REPLY_OK	"+OK\r\n"
+#define REPLY_ERR	"-ERR\r\n"
+#define REPLY_NM	NM_REPLY
+#define REPLY_BUSY	BUSY_REPLY
+
+
+/* 64 bit version of htonl() */
+uint64_t hton64(uint64_t host)
+{
+	if (htonl(1) == 1)
+		return host;
+	return ((uint64_t)htonl((uint32_t)host) << 32) | htonl((uint32_t)(host >> 32));
+}
+
+uint64_t ntoh64(uint64_t net)
+{
+	return hton64(net);
+}
+
+/* writes size and timestamp in network byte order, returns the bytes written.
+   large selects the GET64 layout, otherwise the 32 bit one of GET */
+size_t encodeFileInfo(char *buf, const struct fileInfo *info, int large)
+{
+	uint32_t v32;
+	uint64_t v64;
+
+	if (!large)
+	{
+		v32 = htonl((uint32_t)info->size);
+		memcpy(buf, &v32, sizeof(v32));
+		v32 = htonl((uint32_t)info->mtime);
+		memcpy(buf + sizeof(v32), &v32, sizeof(v32));
+		return LEGACYFIELDSLENGTH;
+	}
+	v64 = hton64(info->size);
+	memcpy(buf, &v64, sizeof(v64));
+	v64 = hton64(info->mtime);
+	memcpy(buf + sizeof(v64), &v64, sizeof(v64));
+	v32 = htonl(info->mtimensec);
+	memcpy(buf + 2*sizeof(v64), &v32, sizeof(v32));
+	return GET64FIELDSLENGTH;
+}
+
+void decodeFileInfo(const char *buf, struct fileInfo *info, int large)
+{
+	uint32_t v32;
+	uint64_t v64;
+
+	if (!large)
+	{
+		memcpy(&v32, buf, sizeof(v32));
+		info->size = ntohl(v32);
+		memcpy(&v32, buf + sizeof(v32), sizeof(v32));
+		info->mtime = ntohl(v32);
+		info->mtimensec = 0;
+		return;
+	}
+	memcpy(&v64, buf, sizeof(v64));
+	info->size = ntoh64(v64);
+	memcpy(&v64, buf + sizeof(v64), sizeof(v64));
+	info->mtime = ntoh64(v64);
+	memcpy(&v32, buf + 2*sizeof(v64), sizeof(v32));
+	info->mtimensec = ntohl(v32);
+}
+
+/* offset and length of the bytes following a RGET reply */
+size_t encodeRange(char *buf, uint64_t offset, uint64_t length)
+{
+	uint64_t v64;
+
+	v64 = hton64(offset);
+	memcpy(buf, &v64, sizeof(v64));
+	v64 = hton64(length);
+	memcpy(buf + sizeof(v64), &v64, sizeof(v64));
+	return RANGEFIELDSLENGTH;
+}
+
+void decodeRange(const char *buf, uint64_t *offset, uint64_t *length)
+{
+	uint64_t v64;
+
+	memcpy(&v64, buf, sizeof(v64));
+	*offset = ntoh64(v64);
+	memcpy(&v64, buf + sizeof(v64), sizeof(v64));
+	*length = ntoh64(v64);
+}
+
+/* "GET64 name\r\n" (large) or "GET name\r\n", returns its length or -1 if
+   it does not fit in size bytes */
+int formatGetRequest(char *buf, size_t size, const char *name, int large)
+{
+	int n;
+
+	n = snprintf(buf, size, "%s%s\r\n", large ? GET64_CMDNAME : GET_CMDNAME, name);
+	if (n < 0 || (size_t)n >= size)
+		return -1;
+	return n;
+}
+
+/* reads the reply to a GET and, after "+OK\r\n", its fieldslen bytes of size
+   and timestamp (and range). Returns 1 for OK, 0 for ERR, 2 for the "+NM\r\n"
+   of an IFMOD, 3 for the BUSY_REPLY of a server at its connection limits, -1
+   for an error or an unexpected reply. It blocks: the caller handles the
+   timeouts */
+int readReplyHeader(Rbuf *rb, char *fields, size_t fieldslen)
+{
+	char reply[sizeof(REPLY_BUSY)];
+
+	if (rbuf_readn(rb, reply, 1) != 1)
+		return -1;
+	if (reply[0] == '+') {
+		/* "+NM\r\n" is as long as "+OK\r\n" */
+		if (rbuf_readn(rb, reply+1, sizeof(REPLY_OK)-2) != sizeof(REPLY_OK)-2)
+			return -1;
+		if (memcmp(reply, REPLY_NM, sizeof(REPLY_NM)-1) == 0)
+			return 2;
+		if (memcmp(reply, REPLY_OK, sizeof(REPLY_OK)-1) != 0)
+			return -1;
+		if (rbuf_readn(rb, fields, fieldslen) != (ssize_t)fieldslen)
+			return -1;
+		return 1;
+	}
+	if (reply[0] == '-') {
+		/* "-ERR b" of "-ERR busy\r\n" is as long as "-ERR\r\n" */
+		if (rbuf_readn(rb, reply+1, sizeof(REPLY_ERR)-2) != sizeof(REPLY_ERR)-2)
+			return -1;
+		if (memcmp(reply, REPLY_ERR, sizeof(REPLY_ERR)-1) == 0)
+			return 0;
+		if (memcmp(reply, REPLY_BUSY, sizeof(REPLY_ERR)-1) != 0 ||
+		    rbuf_readn(rb, reply+sizeof(REPLY_ERR)-1, sizeof(REPLY_BUSY)-sizeof(REPLY_ERR)) !=
+		    sizeof(REPLY_BUSY)-sizeof(REPLY_ERR) ||
+		    memcmp(reply, REPLY_BUSY, sizeof(REPLY_BUSY)-1) != 0)
+			return -1;
+		return 3;
+	}
+	return -1;
+}
+
+/* record of a MGET reply before the bytes of the file, info NULL for a file
+   that is not sent. Returns its length */
+size_t encodeRecordHeader(char *buf, const char *name, const struct fileInfo *info)
+{
+	uint16_t len = (uint16_t)strlen(name);
+	uint16_t v16 = htons(len);
+
+	buf[0] = (info != NULL) ? '+' : '-';
+	memcpy(buf + 1, &v16, sizeof(v16));
+	memcpy(buf + RECORDFIXEDLENGTH, name, len);
+	if (info == NULL)
+		return RECORDFIXEDLENGTH + len;
+	return RECORDFIXEDLENGTH + len + encodeFileInfo(buf + RECORDFIXEDLENGTH + len, info, 1);
+}
+
+/* reads the next record of a MGET reply up to the bytes of the file, the name
+   is stored NUL terminated. Returns 1 if the file follows, 0 if the server
+   could not send it, -1 for an error. It blocks like readReplyHeader() */
+int readRecordHeader(Rbuf *rb, char *name, size_t namesize, struct fileInfo *info)
+{
+	char fixed[RECORDFIXEDLENGTH], fields[GET64FIELDSLENGTH];
+	uint16_t len;
+
+	if (rbuf_readn(rb, fixed, sizeof(fixed)) != sizeof(fixed) || (fixed[0] != '+' && fixed[0] != '-'))
+		return -1;
+	memcpy(&len, fixed + 1, sizeof(len));
+	len = ntohs(len);
+	if (len >= namesize || rbuf_readn(rb, name, len) != len)
+		return -1;
+	name[len] = '\0';
+	if (fixed[0] == '-')
+		return 0;
+	if (rbuf_readn(rb, fields, sizeof(fields)) != sizeof(fields))
+		return -1;
+	decodeFileInfo(fields, info, 1);
+	return 1;
+}
+
+/* entry of a LIST reply, the name is namelen bytes long. Returns its length */
+size_t encodeListEntry(char *buf, const char *name, size_t namelen, const struct fileInfo *info)
+{
+	uint16_t v16 = htons((uint16_t)namelen);
+
+	encodeFileInfo(buf, info, 1);
+	memcpy(buf + GET64FIELDSLENGTH, &v16, sizeof(v16));
+	memcpy(buf + LISTFIXEDLENGTH, name, namelen);
+	return LISTFIXEDLENGTH + namelen;
+}
+
+/* decodes the entry at the beginning of the len bytes of buf, the name is
+   stored NUL terminated. Returns the length of the entry, 0 if it is
+   truncated or its name does not fit in namesize bytes */
+size_t decodeListEntry(const char *buf, size_t len, char *name, size_t namesize, struct fileInfo *info)
+{
+	uint16_t namelen;
+
+	if (len < LISTFIXEDLENGTH)
+		return 0;
+	memcpy(&namelen, buf + GET64FIELDSLENGTH, sizeof(namelen));
+	namelen = ntohs(namelen);
+	if (len - LISTFIXEDLENGTH < namelen || namelen >= namesize)
+		return 0;
+	decodeFileInfo(buf, info, 1);
+	memcpy(name, buf + LISTFIXEDLENGTH, namelen);
+	name[namelen] = '\0';
+	return LISTFIXEDLENGTH + namelen;
+}
+
+/* "DELTA size mtime nsec blocksize count inplace name\r\n", info is the copy
+   of the client. Returns its length or -1 if it does not fit in size bytes */
+int formatDeltaRequest(char *buf, size_t size, const char *name, const struct fileInfo *info,
+		       uint32_t blocksize, uint32_t count, int inplace)
+{
+	int n;
+
+	n = snprintf(buf, size, "%s%" PRIu64 " %" PRIu64 " %" PRIu32 " %" PRIu32 " %" PRIu32 " %d %s\r\n",
+		     DELTA_CMDNAME, info->size, info->mtime, info->mtimensec, blocksize, count, inplace != 0, name);
+	if (n < 0 || (size_t)n >= size)
+		return -1;
+	return n;
+}
+
+/* signature of a block of the copy of the client, returns its length */
+size_t encodeDeltaSignature(char *buf, uint32_t weak, uint64_t strong)
+{
+	uint32_t v32 = htonl(weak);
+	uint64_t v64 = hton64(strong);
+
+	memcpy(buf, &v32, sizeof(v32));
+	memcpy(buf + sizeof(v32), &v64, sizeof(v64));
+	return DELTASIGLENGTH;
+}
+
+void decodeDeltaSignature(const char *buf, uint32_t *weak, uint64_t *strong)
+{
+	uint32_t v32;
+	uint64_t v64;
+
+	memcpy(&v32, buf, sizeof(v32));
+	*weak = ntohl(v32);
+	memcpy(&v64, buf + sizeof(v32), sizeof(v64));
+	*strong = ntoh64(v64);
+}
+
+/* operation of a delta reply, before the bytes of a literal: arg is the
+   length of a literal, the first block of a copy (count blocks) or the
+   digest of the end. Returns its length */
+size_t encodeDeltaOp(char *buf, int op, uint64_t arg, uint32_t count)
+{
+	uint32_t v32;
+	uint64_t v64;
+
+	buf[0] = (char)op;
+	if (op == DELTA_END) {
+		v64 = hton64(arg);
+		memcpy(buf + 1, &v64, sizeof(v64));
+		return 1 + sizeof(v64);
+	}
+	v32 = htonl((uint32_t)arg);
+	memcpy(buf + 1, &v32, sizeof(v32));
+	if (op == DELTA_LITERAL)
+		return 1 + sizeof(v32);
+	v32 = htonl(count);
+	memcpy(buf + 1 + sizeof(v32), &v32, sizeof(v32));
+	return 1 + 2*sizeof(v32);
+}
+
+/* reads the next operation of a delta reply (the bytes of a literal are
+   left to the caller). Returns DELTA_LITERAL, DELTA_COPY or DELTA_END, -1
+   for an error or an unknown operation. It blocks like readReplyHeader() */
+int readDeltaOp(Rbuf *rb, uint64_t *arg, uint32_t *count)
+{
+	char buf[DELTAOPLENGTH];
+	uint32_t v32;
+	uint64_t v64;
+
+	if (rbuf_readn(rb, buf, 1) != 1)
+		return -1;
+	switch (buf[0]) {
+	case DELTA_LITERAL:
+		if (rbuf_readn(rb, buf + 1, sizeof(v32)) != sizeof(v32))
+			return -1;
+		memcpy(&v32, buf + 1, sizeof(v32));
+		*arg = ntohl(v32);
+		*count = 0;
+		return DELTA_LITERAL;
+	case DELTA_COPY:
+		if (rbuf_readn(rb, buf + 1, 2*sizeof(v32)) != 2*sizeof(v32))
+			return -1;
+		memcpy(&v32, buf + 1, sizeof(v32));
+		*arg = ntohl(v32);
+		memcpy(&v32, buf + 1 + sizeof(v32), sizeof(v32));
+		*count = ntohl(v32);
+		return DELTA_COPY;
+	case DELTA_END:
+		if (rbuf_readn(rb, buf + 1, sizeof(v64)) != sizeof(v64))
+			return -1;
+		memcpy(&v64, buf + 1, sizeof(v64));
+		*arg = ntoh64(v64);
+		*count = 0;
+		return DELTA_END;
+	}
+	return -1;
+}
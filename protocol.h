@@ -0,0 +1,127 @@
+/*
+ 
+ module: protocol.h
+ 
+ purpose: definitions of functions in protocol.c
+ 
+ */
+
+
+#ifndef _PROTOCOL_H
+
+#define _PROTOCOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sockwrap.h"
+
+#define GET_CMDNAME "GET "		/* request of the original protocol */
+#define GET64_CMDNAME "GET64 "	/* request of the 64 bit protocol extension */
+
+/* a server at its connection limits answers a new connection with
+   "-ERR busy\r\n" before reading any command, then closes it: nothing was
+   served, the client may try again later on a new connection */
+#define BUSY_REPLY "-ERR busy\r\n"
+
+/* range request: "RGET <offset> <length> <mtime> <nsec> <name>\r\n".
+   length 0 means up to the end of the file. If mtime is not 0 and the file
+   has a different timestamp, the range is ignored and the whole file is sent
+   (the partial copy of the client is stale). The reply is the GET64 one,
+   followed by the offset and the length of the bytes actually sent */
+#define RGET_CMDNAME "RGET "
+
+/* conditional request: "IFMOD <size> <mtime> <nsec> <name>\r\n", the size
+   and the timestamp of the copy of the client. If the file still has them
+   the reply is "+NM\r\n" alone (not modified), otherwise it is the GET64
+   reply followed by the whole file */
+#define IFMOD_CMDNAME "IFMOD "
+#define NM_REPLY "+NM\r\n"
+
+/* batch request: "MGET <name>/<name>/...\r\n" ('/' is never part of a
+   valid name). The reply is "+OK\r\n" and a 32 bit number of records,
+   then one record per name, in the order of the request: a status byte
+   ('+' or '-'), a 16 bit name length and the name, then for '+' the GET64
+   fields followed by the bytes of the file. A file that cannot be sent has
+   its '-' record only, and the batch goes on */
+#define MGET_CMDNAME "MGET "
+#define MGET_SEPARATOR '/'
+#define MGETFIELDSLENGTH (sizeof(uint32_t))
+#define RECORDFIXEDLENGTH (1+sizeof(uint16_t))
+
+/* descriptor request: "FGET <name>\r\n", only accepted on the AF_UNIX
+   socket of the server (--unix). The reply is the GET64 one without any
+   byte of the file: the descriptor of the file, opened read only, is
+   passed with the first byte of the reply (SCM_RIGHTS) and the client
+   reads the file from it */
+#define FGET_CMDNAME "FGET "
+
+/* "STATS\r\n": the reply is "+OK\r\n", a 32 bit length and the counters of
+   the server as text (Prometheus format) */
+#define STATS_CMDNAME "STATS"
+#define STATSFIELDSLENGTH (sizeof(uint32_t))
+
+/* "LIST\r\n": the reply is "+OK\r\n", a 64 bit length and the listing of
+   the served directory, one entry per regular file in no particular order:
+   the GET64 fields (size and timestamp), a 16 bit name length and the name */
+#define LIST_CMDNAME "LIST"
+#define LISTFIELDSLENGTH (sizeof(uint64_t))
+#define LISTFIXEDLENGTH (GET64FIELDSLENGTH+sizeof(uint16_t))
+
+/* delta request: "DELTA <size> <mtime> <nsec> <blocksize> <count> <inplace> <name>\r\n"
+   followed by count signatures of the copy of the client, one per whole
+   block of blocksize bytes: the 32 bit weak checksum and the 64 bit strong
+   hash of delta.c. If the file still has that size and timestamp the reply
+   is "+NM\r\n" alone, otherwise it is the GET64 reply followed by the
+   operations that rebuild the new file from the copy of the client:
+   'L', a 32 bit length and as many bytes of the file (at most
+   DELTALITERALMAX), 'C', the 32 bit index of a block and the 32 bit number
+   of consecutive blocks to copy from there, and finally 'E' with the 64 bit
+   digest of the reply (deltaMix()). With inplace 1 a block is never copied
+   from before the offset it is written to, so the copy can be rebuilt in
+   place; with 0 the client writes the new version apart */
+#define DELTA_CMDNAME "DELTA "
+#define DELTASIGLENGTH (sizeof(uint32_t)+sizeof(uint64_t))
+#define DELTAOPLENGTH (1+2*sizeof(uint32_t))	/* longest operation before its bytes */
+#define DELTA_LITERAL 'L'
+#define DELTA_COPY 'C'
+#define DELTA_END 'E'
+#define DELTAMINBLOCK 2048
+#define DELTAMAXBLOCK (1024*1024)
+#define DELTAMAXBLOCKS (1024*1024)		/* signatures of a request */
+#define DELTALITERALMAX (64*1024)
+
+/* "+OK\r\n", then the size and the timestamp of the file:
+   GET    -> 32 bit size, 32 bit seconds
+   GET64  -> 64 bit size, 64 bit seconds, 32 bit nanoseconds */
+#define LEGACYFIELDSLENGTH (2*sizeof(uint32_t))
+#define GET64FIELDSLENGTH (2*sizeof(uint64_t)+sizeof(uint32_t))
+#define RANGEFIELDSLENGTH (2*sizeof(uint64_t))
+
+struct fileInfo {
+	uint64_t	size;		/* file size in bytes */
+	uint64_t	mtime;		/* last modification, seconds since the epoch */
+	uint32_t	mtimensec;	/* last modification, nanoseconds */
+};
+
+uint64_t hton64(uint64_t host);
+uint64_t ntoh64(uint64_t net);
+size_t encodeFileInfo(char *buf, const struct fileInfo *info, int large);
+void decodeFileInfo(const char *buf, struct fileInfo *info, int large);
+size_t encodeRange(char *buf, uint64_t offset, uint64_t length);
+void decodeRange(const char *buf, uint64_t *offset, uint64_t *length);
+
+/* client side of an exchange, shared by the client and the benchmark */
+int formatGetRequest(char *buf, size_t size, const char *name, int large);
+int readReplyHeader(Rbuf *rb, char *fields, size_t fieldslen);
+size_t encodeRecordHeader(char *buf, const char *name, const struct fileInfo *info);
+int readRecordHeader(Rbuf *rb, char *name, size_t namesize, struct fileInfo *info);
+size_t encodeListEntry(char *buf, const char *name, size_t namelen, const struct fileInfo *info);
+size_t decodeListEntry(const char *buf, size_t len, char *name, size_t namesize, struct fileInfo *info);
+int formatDeltaRequest(char *buf, size_t size, const char *name, const struct fileInfo *info,
+		       uint32_t blocksize, uint32_t count, int inplace);
+size_t encodeDeltaSignature(char *buf, uint32_t weak, uint64_t strong);
+void decodeDeltaSignature(const char *buf, uint32_t *weak, uint64_t *strong);
+size_t encodeDeltaOp(char *buf, int op, uint64_t arg, uint32_t count);
+int readDeltaOp(Rbuf *rb, uint64_t *arg, uint32_t *count);
+
+#endif
@@ -0,0 +1,297 @@
+/*
+ 
+ module: admission.c
+ 
+ purpose: admission control of the connections. With --max-conns the
+          connections served at the same time are bounded, with
+          --max-per-ip those of a single client address: a connection
+          over a limit is refused at once with BUSY_MSG and closed, before
+          any process is forked or any memory is given to it, so a
+          connection storm costs one accept() and one send() per
+          connection instead of a process each.
+          
+          The counters live in an anonymous MAP_SHARED mapping created
+          before any fork and are only changed with atomic operations: the
+          total is a bounded compare and swap, every address slot packs
+          the address and its connections in one 64 bit word. No lock is
+          taken, so admissionLeave() is async signal safe.
+          
+          A connection served by a process of its own (fork engine,
+          sequential prefork worker) is held on behalf of the process
+          (admissionHold(), a shared table indexed by pid): the
+          sigchldHandler() gives it back with admissionRelease() when the
+          process terminates, however it terminates. The event driven
+          engines give it back when they close the connection.
+          
+          The length of the accept queue is sampled with TCP_INFO every
+          time an engine wakes up to accept, for the STATS report.
+          
+          An accept() that fails for lack of descriptors or memory would
+          fail again at once: every engine waits ADMITRETRYMS before the
+          next one, and admissionAcceptFailed() logs the starvation once,
+          admissionAccepted() its end.
+          
+ */
+ 
+ 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "./../sockwrap.h"
+#include "server2.h"
+#include "admission.h"
+#include "stats.h"
+#include "log.h"
+
+#define ADMITPIDMAX         4194304                 //PID_MAX_LIMIT, if pid_max cannot be read
+
+struct admissionArea {
+    uint32_t active;                    //connections admitted, counted only with --max-conns
+    uint32_t queueLength, queuePeak, backlog;
+    uint64_t ips[ADMITIPSLOTS];         //address << 32 | its connections, no connection: reusable
+};
+
+unsigned admissionMaxConns = 0;                     //--max-conns, 0: no limit
+unsigned admissionMaxPerIp = 0;                     //--max-per-ip, 0: no limit
+
+static struct admissionArea *area = NULL;
+static int *held = NULL;                            //ticket + 1 held by each pid, 0 if none
+static long heldCount = 0;
+static int acceptStarved = 0;                       //the last accept() lacked descriptors or memory
+
+
+
+//creates the shared counters before any fork; the table of the held tickets only with a limit
+int admissionInit(void){
+    
+    if((area = mmap(NULL, sizeof(*area), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED){
+        area = NULL;
+        return -1;
+    }
+    if(admissionMaxConns == 0 && admissionMaxPerIp == 0){
+        return 0;
+    }
+    
+    //one int per possible pid: only the pages of the pids actually used are ever touched
+    heldCount = readPidMax();
+    if((held = mmap(NULL, heldCount * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED){
+        held = NULL;
+        munmap(area, sizeof(*area));
+        area = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+
+//admits a connection from caddr: returns its ticket (>= 0), or ADMITREFUSED / ADMITREFUSEDADDR
+int admissionEnter(const struct sockaddr_in *caddr){
+    
+    uint32_t n, ip = caddr->sin_addr.s_addr;
+    uint64_t old, *e, *slot;
+    unsigned i, h;
+    
+    if(area == NULL || (admissionMaxConns == 0 && admissionMaxPerIp == 0)){
+        return 0;
+    }
+    if(admissionMaxConns > 0){
+        n = __atomic_load_n(&area->active, __ATOMIC_RELAXED);
+        do{
+            if(n >= admissionMaxConns){
+                return ADMITREFUSED;
+            }
+        }while(!__atomic_compare_exchange_n(&area->active, &n, n+1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    }
+    if(admissionMaxPerIp == 0){
+        return 0;
+    }
+    
+    //the slot of the address if it has one, otherwise the first reusable one: two connections
+    //claiming slots for the same address at the same time may get two, the limit is then loose
+    h = (ip * 2654435761u) >> 20;
+    for( ; ; ){
+        slot = NULL;
+        for(i=0; i<ADMITPROBES; i++){
+            e = &area->ips[(h + i) % ADMITIPSLOTS];
+            old = __atomic_load_n(e, __ATOMIC_ACQUIRE);
+            if((uint32_t)old == 0){
+                if(slot == NULL){
+                    slot = e;
+                }
+                continue;
+            }
+            if((uint32_t)(old >> 32) != ip){
+                continue;
+            }
+            if((uint32_t)old >= admissionMaxPerIp){
+                if(admissionMaxConns > 0){
+                    __atomic_fetch_sub(&area->active, 1, __ATOMIC_ACQ_REL);
+                }
+                return ADMITREFUSEDADDR;
+            }
+            if(__atomic_compare_exchange_n(e, &old, old + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+                return (int)(e - area->ips) + 1;
+            }
+            break;
+        }
+        if(i < ADMITPROBES){
+            //the count of the address changed meanwhile
+            continue;
+        }
+        if(slot == NULL){
+            //every slot around the address is taken: it is not limited
+            return 0;
+        }
+        old = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if((uint32_t)old == 0 && __atomic_compare_exchange_n(slot, &old, (uint64_t)ip << 32 | 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+            return (int)(slot - area->ips) + 1;
+        }
+    }
+}
+
+
+//gives back the ticket of a connection that is closed (async signal safe)
+void admissionLeave(int ticket){
+    
+    if(area == NULL || ticket < 0){
+        return;
+    }
+    if(admissionMaxConns > 0){
+        __atomic_fetch_sub(&area->active, 1, __ATOMIC_ACQ_REL);
+    }
+    if(ticket > 0){
+        __atomic_fetch_sub(&area->ips[ticket-1], 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+
+//refuses a connection over a limit: counted, answered with BUSY_MSG and closed
+void admissionRefuse(int socket, int ticket){
+    
+    char drain[RCVBUFFERLENGTH];
+    
+    statsAdd(ticket == ADMITREFUSEDADDR ? STAT_REFUSED_ADDR : STAT_REFUSED, 1);
+    LOG_SAMPLED(LVL_INFO, "(socket %d) Too many connections%s. Refusing connection", socket,
+                ticket == ADMITREFUSEDADDR ? " from the address" : "");
+                
+    //a command already received is read first: closing with unread bytes would reset the connection
+    //and the client could lose the reply. Nothing waits here, the socket is left as it is
+    if(recv(socket, drain, sizeof(drain), MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != EWOULDBLOCK){
+        Close(socket);
+        return;
+    }
+    if(send(socket, BUSY_MSG, sizeof(BUSY_MSG)-1, MSG_NOSIGNAL | MSG_DONTWAIT) != (sizeof(BUSY_MSG)-1)){
+        LOG_SAMPLED(LVL_WARN, "(socket %d) Sending busy message failed!", socket);
+    }
+    Close(socket);
+}
+
+
+//the ticket is given back by admissionRelease(pid), when the process pid has served its connection
+void admissionHold(pid_t pid, int ticket){
+    
+    if(held == NULL || ticket < 0){
+        return;
+    }
+    if(pid <= 0 || pid >= heldCount){
+        //pid_max raised after the start: the ticket cannot be recorded
+        admissionLeave(ticket);
+        return;
+    }
+    __atomic_store_n(&held[pid], ticket + 1, __ATOMIC_RELEASE);
+}
+
+
+//gives back the ticket held by pid, if any (async signal safe: called by the SIGCHLD handler)
+void admissionRelease(pid_t pid){
+    
+    int t;
+    
+    if(held == NULL || pid <= 0 || pid >= heldCount){
+        return;
+    }
+    if((t = __atomic_exchange_n(&held[pid], 0, __ATOMIC_ACQ_REL)) != 0){
+        admissionLeave(t - 1);
+    }
+}
+
+
+//samples the accept queue of passive_socket: on a listening socket TCP_INFO reports its length
+//in tcpi_unacked and its limit in tcpi_sacked
+void admissionSampleQueue(int passive_socket){
+    
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    uint32_t peak;
+    
+    if(area == NULL || getsockopt(passive_socket, IPPROTO_TCP, TCP_INFO, &info, &len) < 0){
+        return;
+    }
+    __atomic_store_n(&area->queueLength, info.tcpi_unacked, __ATOMIC_RELAXED);
+    __atomic_store_n(&area->backlog, info.tcpi_sacked, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&area->queuePeak, __ATOMIC_RELAXED);
+    while(info.tcpi_unacked > peak &&
+          !__atomic_compare_exchange_n(&area->queuePeak, &peak, info.tcpi_unacked, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+//an accept() failed with error: returns 1 if it lacked descriptors or memory, and has to be retried after
+//ADMITRETRYMS (logged once until an accept succeeds); other errors are logged, except the transient ones
+int admissionAcceptFailed(int error){
+    
+    if(error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM){
+        if(!__atomic_exchange_n(&acceptStarved, 1, __ATOMIC_RELAXED)){
+            LOG(LVL_WARN, "Error while accepting connection: %s. Retrying every %d ms", strerror(error), ADMITRETRYMS);
+        }
+        return 1;
+    }
+    if(error != EINTR && error != ECONNABORTED && error != EAGAIN && error != EWOULDBLOCK){
+        LOG(LVL_WARN, "Error while accepting connection: %s", strerror(error));
+    }
+    return 0;
+}
+
+
+//an accept() succeeded: ends the starvation, if any
+void admissionAccepted(void){
+    
+    if(__atomic_load_n(&acceptStarved, __ATOMIC_RELAXED) && __atomic_exchange_n(&acceptStarved, 0, __ATOMIC_RELAXED)){
+        LOG(LVL_INFO, "Accepting connections again");
+    }
+}
+
+
+void admissionGetStats(struct admissionStats *as){
+    
+    memset(as, 0, sizeof(*as));
+    if(area == NULL){
+        return;
+    }
+    as->active = __atomic_load_n(&area->active, __ATOMIC_RELAXED);
+    as->queueLength = __atomic_load_n(&area->queueLength, __ATOMIC_RELAXED);
+    as->queuePeak = __atomic_load_n(&area->queuePeak, __ATOMIC_RELAXED);
+    as->backlog = __atomic_load_n(&area->backlog, __ATOMIC_RELAXED);
+}
+
+
+//pid_max of the system: size of the tables indexed by pid (tickets held here, references of the file cache)
+long readPidMax(void){
+    
+    FILE *f;
+    long n = 0;
+    
+    if((f = fopen("/proc/sys/kernel/pid_max", "r")) != NULL){
+        if(fscanf(f, "%ld", &n) != 1){
+            n = 0;
+        }
+        fclose(f);
+    }
+    return n > 0 ? n : ADMITPIDMAX;
+}
@@ -0,0 +1,47 @@
+/*
+ 
+ module: admission.h
+ 
+ purpose: definitions of functions in admission.c
+ 
+ */
+ 
+ 
+#ifndef _ADMISSION_H
+
+#define _ADMISSION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "timerwheel.h"
+
+#define ADMITIPSLOTS        4096                    //client addresses counted at the same time
+#define ADMITPROBES         16                      //slots tried for an address, then it is not limited
+#define ADMITBATCH          64                      //connections accepted for one wake up
+#define ADMITREFUSED        -1                      //ticket: too many connections
+#define ADMITREFUSEDADDR    -2                      //ticket: too many connections from the address
+#define ADMITRETRYMS        WHEELTICKMS             //pause of the accepts while descriptors or memory lack
+
+//accept queue and admitted connections, for the STATS report
+struct admissionStats {
+    uint32_t active;                    //connections admitted and not yet closed (with --max-conns)
+    uint32_t queueLength;               //connections waiting in an accept queue at the last sample
+    uint32_t queuePeak;                 //longest accept queue sampled
+    uint32_t backlog;                   //length limit of the accept queue
+};
+
+extern unsigned admissionMaxConns, admissionMaxPerIp;
+
+int admissionInit(void);
+int admissionEnter(const struct sockaddr_in *caddr);
+void admissionLeave(int ticket);
+void admissionRefuse(int socket, int ticket);
+void admissionHold(pid_t pid, int ticket);
+void admissionRelease(pid_t pid);
+void admissionSampleQueue(int passive_socket);
+int admissionAcceptFailed(int error);
+void admissionAccepted(void);
+void admissionGetStats(struct admissionStats *as);
+
+#endif
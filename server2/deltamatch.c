@@ -0,0 +1,386 @@
+/*
+ 
+ module: deltamatch.c
+ 
+ purpose: reply of the DELTA command. The signatures of the copy of the
+          client are hashed by weak checksum, then a window of a block
+          rolls over the new version of the file one byte at a time: where
+          its weak checksum and then its strong hash match a block of the
+          client, a copy of that block is sent instead of the bytes, and
+          the window jumps past it. The bytes no block matches are sent as
+          literals. Consecutive blocks become a single copy.
+ 
+          With inplace a block is accepted only if it lies at or after the
+          offset it is written to (the client has not overwritten it yet),
+          and the block already at that offset is tried first, so that the
+          client does not even have to write it.
+ 
+          A file that is not in the cache is read with pread() into a
+          window holding the pending literal, the block and the bytes
+          read ahead. It is not mapped: a truncation while the reply is
+          built only shortens a read, where a mapping would raise SIGBUS.
+          
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include "./../sockwrap.h"
+#include "./../protocol.h"
+#include "./../delta.h"
+#include "server2.h"
+#include "deltamatch.h"
+#include "stats.h"
+#include "log.h"
+#include "timerwheel.h"
+
+#define SIGSPERREAD         1024                    //signatures read from the socket at a time
+#define DELTAREADAHEAD      (1024*1024)             //bytes of the file read past the window at least
+
+//operations of the reply not yet sent
+struct deltaOutput {
+    int socket;
+    struct shaper *shaper;              //rate limits of the connection
+    uint64_t deadline;
+    uint64_t digest;                    //deltaMix() of the blocks and literals so far
+    uint32_t runFirst, runCount;        //copy being extended, runCount 0 if none
+    size_t len;
+    char buf[DELTAOUTBUFFER+DELTAOPLENGTH];
+};
+
+//bytes of the new version of the file at hand
+struct deltaInput {
+    const unsigned char *data;          //bytes [base, base+len) of the file
+    unsigned char *buffer;              //window read from fd, NULL if the whole file is cached
+    int fd;
+    uint64_t base, len, size;
+    size_t capacity;
+    int truncated;                      //the file is shorter than announced
+};
+
+static long findBlock(const struct deltaIndex *di, const unsigned char *window, uint64_t offset, uint32_t weak);
+static int putLiteral(struct deltaOutput *out, const unsigned char *data, size_t len);
+static int putCopy(struct deltaOutput *out, const struct deltaIndex *di, uint32_t block);
+static int flushRun(struct deltaOutput *out);
+static int flushOutput(struct deltaOutput *out);
+static int fillInput(struct deltaInput *in, uint64_t keep, uint64_t upto);
+static const unsigned char *inputAt(const struct deltaInput *in, uint64_t offset);
+
+
+
+//read the signatures following a DELTA command line and hash them. Returns -1 if they cannot be read or stored
+int deltaIndexRead(struct deltaIndex *di, Rbuf *rb, const struct request *req){
+    
+    char buf[SIGSPERREAD*DELTASIGLENGTH];
+    uint32_t i, n, j, bucket;
+    
+    memset(di, 0, sizeof(*di));
+    di->blockSize = req->blockSize;
+    di->count = req->blockCount;
+    di->inPlace = req->inPlace;
+    //a bucket per signature at least
+    for(di->shift = 31; di->shift > 12 && (1u << (32 - di->shift)) < di->count; di->shift--);
+    di->weak = malloc((size_t)di->count * sizeof(*di->weak));
+    di->strong = malloc((size_t)di->count * sizeof(*di->strong));
+    di->next = malloc((size_t)di->count * sizeof(*di->next));
+    di->heads = calloc((size_t)1 << (32 - di->shift), sizeof(*di->heads));
+    if((di->count > 0 && (di->weak == NULL || di->strong == NULL || di->next == NULL)) || di->heads == NULL){
+        deltaIndexFree(di);
+        return -1;
+    }
+    
+    for(i=0; i<di->count; i+=n){
+        n = di->count - i < SIGSPERREAD ? di->count - i : SIGSPERREAD;
+        if(rbuf_readn(rb, buf, (size_t)n*DELTASIGLENGTH) != (ssize_t)(n*DELTASIGLENGTH)){
+            deltaIndexFree(di);
+            return -1;
+        }
+        for(j=0; j<n; j++){
+            decodeDeltaSignature(buf + j*DELTASIGLENGTH, &di->weak[i+j], &di->strong[i+j]);
+            //inserted at the head: a bucket lists the higher blocks first
+            bucket = (di->weak[i+j] * 2654435761u) >> di->shift;
+            di->next[i+j] = di->heads[bucket];
+            di->heads[bucket] = i+j+1;
+        }
+    }
+    return 0;
+}
+
+
+void deltaIndexFree(struct deltaIndex *di){
+    free(di->weak);
+    free(di->strong);
+    free(di->heads);
+    free(di->next);
+    di->weak = NULL;
+    di->strong = NULL;
+    di->heads = NULL;
+    di->next = NULL;
+}
+
+
+//operations rebuilding the file from the blocks of the client, within the transfer deadline and the rate limits.
+//reused counts the bytes copied instead of sent. Returns -1 if the connection has been closed
+int deltaSend(int socket, struct shaper *sh, const struct requestedFile *rf, const struct deltaIndex *di, uint64_t deadline, uint64_t *reused){
+    
+    struct deltaOutput *out;
+    struct deltaInput in;               //new version of the file, cached or read in windows
+    uint64_t size = rf->st.st_size, pos, lit, len;
+    uint32_t B = di->blockSize, weak = 0;
+    long block;
+    int n = 0, error;
+    
+    *reused = 0;
+    in.data = (const unsigned char *)rf->cached;
+    in.buffer = NULL;
+    in.fd = rf->fd;
+    in.base = 0;
+    in.len = (in.data != NULL) ? size : 0;
+    in.size = size;
+    in.capacity = DELTALITERALMAX + B + DELTAREADAHEAD;
+    if(size < in.capacity){
+        in.capacity = size + 1;
+    }
+    in.truncated = 0;
+    if((out = malloc(sizeof(*out))) == NULL || (in.data == NULL && (in.data = in.buffer = malloc(in.capacity)) == NULL)){
+        LOG(LVL_ERROR, "DELTA command received. Out of memory. Closing connection");
+        free(out);
+        Close(socket);
+        return -1;
+    }
+    out->socket = socket;
+    out->shaper = sh;
+    out->deadline = deadline;
+    out->digest = 0;
+    out->runCount = 0;
+    out->len = 0;
+    if(in.buffer != NULL){
+        posix_fadvise(in.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    
+    pos = lit = 0;
+    if(di->count > 0 && size >= B && (n = fillInput(&in, 0, B)) == 0){
+        weak = deltaWeak(inputAt(&in, 0), B);
+    }
+    while(di->count > 0 && pos + B <= size && n == 0){
+        //the pending literal, the window and the byte rolled in next
+        if((n = fillInput(&in, lit, pos + B < size ? pos + B + 1 : size)) < 0){
+            break;
+        }
+        if((block = findBlock(di, inputAt(&in, pos), pos, weak)) >= 0){
+            //the bytes before the block go as a literal, then the window jumps past it
+            if(pos > lit && (n = putLiteral(out, inputAt(&in, lit), pos - lit)) < 0){
+                break;
+            }
+            if((n = putCopy(out, di, (uint32_t)block)) < 0){
+                break;
+            }
+            *reused += B;
+            pos += B;
+            lit = pos;
+            if(pos + B <= size){
+                if((n = fillInput(&in, lit, pos + B)) < 0){
+                    break;
+                }
+                weak = deltaWeak(inputAt(&in, pos), B);
+            }
+            continue;
+        }
+        //a long run without matches is sent as it goes, the client starts writing
+        if(pos - lit >= DELTALITERALMAX){
+            if((n = putLiteral(out, inputAt(&in, lit), pos - lit)) < 0){
+                break;
+            }
+            lit = pos;
+        }
+        if(pos + B < size){
+            weak = deltaRoll(weak, *inputAt(&in, pos), *inputAt(&in, pos + B), B);
+        }
+        pos++;
+    }
+    //the bytes after the last block, a window at a time, then the digest
+    while(n == 0 && size > lit){
+        len = (size - lit < DELTALITERALMAX) ? size - lit : DELTALITERALMAX;
+        if((n = fillInput(&in, lit, lit + len)) == 0){
+            n = putLiteral(out, inputAt(&in, lit), len);
+            lit += len;
+        }
+    }
+    if(n == 0 && (n = flushRun(out)) == 0){
+        out->len += encodeDeltaOp(out->buf + out->len, DELTA_END, out->digest, 0);
+        n = flushOutput(out);
+    }
+    error = errno;
+    
+    free(in.buffer);
+    free(out);
+    if(n < 0){
+        if(in.truncated){
+            statsAdd(STAT_ERR_SEND, 1);
+            LOG(LVL_WARN, "File truncated while sending. Closing connection");
+        }else if(error == ETIMEDOUT || error == EAGAIN || error == EWOULDBLOCK){
+            statsAdd(STAT_TIMEOUTS, 1);
+            LOG(LVL_INFO, "%s. Closing connection", deadlineMessage(DEADLINE_TRANSFER));
+        }else{
+            statsAdd(STAT_ERR_SEND, 1);
+            LOG(LVL_WARN, "Sending delta failed: %s. Closing connection", strerror(error));
+        }
+        Close(socket);
+        return -1;
+    }
+    statsAdd(STAT_BYTES_REUSED, *reused);
+    return 0;
+}
+
+
+//block of the client equal to the window at offset, -1 if none
+static long findBlock(const struct deltaIndex *di, const unsigned char *window, uint64_t offset, uint32_t weak){
+    
+    uint64_t strong = 0, same = offset / di->blockSize;
+    uint32_t i, steps;
+    int hashed = 0;
+    
+    //the block already at this offset: in place it costs no write at all
+    if(offset % di->blockSize == 0 && same < di->count && di->weak[same] == weak){
+        strong = deltaStrong(window, di->blockSize);
+        hashed = 1;
+        if(strong == di->strong[same]){
+            return (long)same;
+        }
+    }
+    //the strong hash only for an equal weak checksum, computed once
+    for(i = di->heads[(weak * 2654435761u) >> di->shift], steps = 0; i != 0 && steps < DELTAMAXCHAIN; i = di->next[i-1], steps++){
+        if(di->inPlace && (uint64_t)(i-1) * di->blockSize < offset){
+            //lower blocks follow: all of them already overwritten by the client
+            break;
+        }
+        if(di->weak[i-1] != weak){
+            continue;
+        }
+        if(!hashed){
+            strong = deltaStrong(window, di->blockSize);
+            hashed = 1;
+        }
+        if(strong == di->strong[i-1]){
+            return (long)(i-1);
+        }
+    }
+    return -1;
+}
+
+
+//len bytes of the file, in literals of DELTALITERALMAX bytes at most. Returns -1 if sending failed
+static int putLiteral(struct deltaOutput *out, const unsigned char *data, size_t len){
+    
+    size_t n;
+    
+    if(flushRun(out) < 0){
+        return -1;
+    }
+    for( ; len > 0; data += n, len -= n){
+        n = len < DELTALITERALMAX ? len : DELTALITERALMAX;
+        if(out->len + DELTAOPLENGTH + n > DELTAOUTBUFFER && flushOutput(out) < 0){
+            return -1;
+        }
+        out->len += encodeDeltaOp(out->buf + out->len, DELTA_LITERAL, n, 0);
+        memcpy(out->buf + out->len, data, n);
+        out->len += n;
+        out->digest = deltaMix(out->digest, deltaStrong(data, n));
+    }
+    return 0;
+}
+
+
+//copy of a block, appended to the current run if it follows its last block. Returns -1 if sending failed
+static int putCopy(struct deltaOutput *out, const struct deltaIndex *di, uint32_t block){
+    if(out->runCount > 0 && out->runFirst + out->runCount == block){
+        out->runCount++;
+    }else{
+        if(flushRun(out) < 0){
+            return -1;
+        }
+        out->runFirst = block;
+        out->runCount = 1;
+    }
+    out->digest = deltaMix(out->digest, di->strong[block]);
+    return 0;
+}
+
+
+static int flushRun(struct deltaOutput *out){
+    if(out->runCount == 0){
+        return 0;
+    }
+    if(out->len + DELTAOPLENGTH > DELTAOUTBUFFER && flushOutput(out) < 0){
+        return -1;
+    }
+    out->len += encodeDeltaOp(out->buf + out->len, DELTA_COPY, out->runFirst, out->runCount);
+    out->runCount = 0;
+    return 0;
+}
+
+
+//send the operations gathered so far, once the rate limits allow it. Returns -1 (errno ETIMEDOUT past the deadline) on failure
+static int flushOutput(struct deltaOutput *out){
+    
+    unsigned delay;
+    
+    while(shaperGrant(out->shaper, &delay) == 0){
+        poll(NULL, 0, (int)delay);
+    }
+    if(sendn(out->socket, out->buf, out->len, 0) != (ssize_t)out->len){
+        return -1;
+    }
+    shaperCharge(out->shaper, out->len);
+    statsAdd(STAT_BYTES_SENT, out->len);
+    out->len = 0;
+    if(transferTimeout > 0 && wheelNowMs() >= out->deadline){
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+
+//make the bytes [keep, upto) of the file available, reading ahead; the ones before keep are dropped.
+//Returns -1 if reading failed or the file is shorter than announced (truncated while sending)
+static int fillInput(struct deltaInput *in, uint64_t keep, uint64_t upto){
+    
+    uint64_t end;
+    ssize_t n;
+    
+    if(upto <= in->base + in->len){
+        return 0;
+    }
+    memmove(in->buffer, in->buffer + (keep - in->base), in->base + in->len - keep);
+    in->len -= keep - in->base;
+    in->base = keep;
+    end = (in->size - in->base < in->capacity) ? in->size : in->base + in->capacity;
+    while(in->base + in->len < end){
+        if((n = pread(in->fd, in->buffer + in->len, end - in->base - in->len, in->base + in->len)) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(n == 0){
+            in->truncated = 1;
+            errno = EIO;
+            return -1;
+        }
+        in->len += n;
+    }
+    return 0;
+}
+
+
+//the byte at offset of the file, already made available by fillInput()
+static const unsigned char *inputAt(const struct deltaInput *in, uint64_t offset){
+    return in->data + (offset - in->base);
+}
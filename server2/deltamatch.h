@@ -0,0 +1,38 @@
+/*
+ 
+ module: deltamatch.h
+ 
+ purpose: definitions of functions in deltamatch.c
+ 
+ */
+
+
+#ifndef _DELTAMATCH_H
+
+#define _DELTAMATCH_H
+
+#include <stdint.h>
+#include "./../sockwrap.h"
+#include "request.h"
+#include "shaper.h"
+
+#define DELTAOUTBUFFER      (2*DELTALITERALMAX)     //operations gathered before a send
+#define DELTAMAXCHAIN       256                     //signatures of a bucket compared at an offset
+
+//signatures of the copy of the client, hashed by weak checksum
+struct deltaIndex {
+    uint32_t blockSize;
+    uint32_t count;                     //signatures, one per whole block
+    int inPlace;                        //a block is copied only to its offset or before it
+    uint32_t *weak;
+    uint64_t *strong;
+    uint32_t *heads;                    //first signature of a bucket + 1, 0 if empty
+    uint32_t *next;                     //next signature of the same bucket + 1, lower blocks follow
+    unsigned shift;                     //buckets: 2^(32-shift)
+};
+
+int deltaIndexRead(struct deltaIndex *di, Rbuf *rb, const struct request *req);
+int deltaSend(int socket, struct shaper *sh, const struct requestedFile *rf, const struct deltaIndex *di, uint64_t deadline, uint64_t *reused);
+void deltaIndexFree(struct deltaIndex *di);
+
+#endif
@@ -0,0 +1,556 @@
+/*
+ 
+ module: dirindex.c
+ 
+ purpose: index of the served directory (--index-max=files): name, size
+          and timestamp of every regular file, built by dirIndexInit() at
+          startup and kept current by a thread reading the inotify events
+          of the directory. It answers the LIST command with a copy of a
+          prebuilt buffer, and the existence check of the requests: a
+          missing file costs no path lookup. The index is published a few
+          milliseconds after the events, so it only vouches for a missing
+          file when no event is waiting to be read (FIONREAD on the
+          inotify descriptor, shared by every process) and none read by
+          the indexer is still unpublished: a file created just before
+          its request is found by the file system. The size and the
+          timestamp of a file being sent still come from its descriptor:
+          inotify reports a change a few milliseconds after it happened,
+          and the validators of IFMOD and RGET, like the keys of the file
+          cache, must be exact.
+ 
+          The index is published in an anonymous MAP_SHARED mapping
+          created before any fork, so every process of every engine reads
+          the same one. The mapping holds two areas: the indexer thread
+          keeps the files in a private hash table and, once a burst of
+          events has settled, rewrites the area not in use and switches
+          the readers to it. An area is the LIST reply already encoded,
+          followed by an open addressing table of the names and by the
+          offset of every file in the listing. The readers take no lock: they
+          read the sequence number of the area (odd while it is being
+          written) before and after using it, and retry if it moved.
+ 
+          Symbolic links are listed with the size and timestamp of their
+          target, but a change of the target is not reported by inotify:
+          their lookup falls back to the file system. A directory with
+          more files than --index-max, or whose names do not fit the
+          area, is not published: lookups fall back to the file system
+          and LIST is refused, until enough files are removed.
+ 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include "./../protocol.h"
+#include "server2.h"
+#include "dirindex.h"
+#include "log.h"
+#include "timerwheel.h"
+
+#define INDEXEVENTS         (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | \
+                             IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#define RESCANEVENTS        (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)
+#define EVENTBUFFERLENGTH   65536
+#define SETTLEMS            10                      //events gathered before the index is published...
+#define MAXDELAYMS          100                     //...but a file written without pause is republished this often
+#define INDEX_LINK          1                       //symbolic link: its target is checked by the file system
+
+//a file of the directory, as known by the indexer thread
+struct indexFile {
+    struct indexFile *next;             //chain of the bucket
+    uint32_t hash;
+    struct fileInfo info;
+    uint32_t flags;
+    uint16_t namelen;
+    char name[];
+};
+
+//slot of the name table of an area
+struct indexSlot {
+    uint32_t hash;
+    uint32_t entry;                     //index of the file + 1, 0 if free
+};
+
+//entry of the listing of a file
+struct indexMeta {
+    uint64_t offset;                    //of the LIST entry of the file
+    uint32_t flags;
+};
+
+//published index: this header, slots[nslots], meta[count] and the listing
+struct indexArea {
+    uint64_t seq;                       //odd while the area is being written
+    int complete;                       //0: too many files, nothing is published
+    uint32_t count;                     //files
+    uint32_t nslots;                    //a power of 2, at least twice count
+    uint64_t listLength;                //bytes of the listing
+};
+
+struct indexHeader {
+    int active;                         //area read by the lookups
+    int pending;                        //events read by the indexer, not yet published
+    uint64_t publications;
+};
+
+size_t dirIndexMaxFiles = DIRINDEXMAXFILES;         //--index-max, 0 disables the index
+
+static struct indexHeader *published = NULL;
+static char *areas[2];
+static size_t areaSize;
+
+//private to the indexer thread (and to dirIndexInit() before it starts)
+static struct indexFile **buckets;
+static uint32_t nbuckets;
+static uint32_t fileCount;
+static uint64_t nameBytes;                          //names of all the files
+static int inotifyFd = -1;
+static int wasComplete = 1;
+
+static uint32_t hashName(const char *name);
+static void indexName(const char *name);
+static void removeFile(const char *name, uint32_t hash);
+static void scanDirectory(void);
+static int readEvents(void);
+static void publish(void);
+static void *indexerThread(void *arg);
+static const struct indexArea *readArea(uint64_t *seq, uint32_t *nslots, uint32_t *count, uint64_t *len);
+static int areaUnchanged(const struct indexArea *a, uint64_t seq);
+static struct indexSlot *areaSlots(const struct indexArea *a);
+static struct indexMeta *areaMeta(const struct indexArea *a, uint32_t nslots);
+static char *areaListing(const struct indexArea *a, uint32_t nslots, uint32_t count);
+static int indexCurrent(uint64_t publications);
+
+
+
+int dirIndexInit(void){
+    
+    size_t perFile;
+    char *region;
+    pthread_t tid;
+    pthread_attr_t attr;
+    sigset_t all, old;
+    
+    if(dirIndexMaxFiles == 0){
+        return 0;
+    }
+    if(dirIndexMaxFiles > UINT32_MAX/4){
+        dirIndexMaxFiles = UINT32_MAX/4;
+    }
+    //the worst case of the name table is four slots per file (just over a power of 2)
+    perFile = 4*sizeof(struct indexSlot) + sizeof(struct indexMeta) + LISTFIXEDLENGTH + DIRINDEXNAMEBYTES;
+    areaSize = sizeof(struct indexArea) + dirIndexMaxFiles*perFile;
+    areaSize = (areaSize + sysconf(_SC_PAGESIZE) - 1) / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE);
+    //only the pages actually written take memory
+    region = mmap(NULL, sysconf(_SC_PAGESIZE) + 2*areaSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(region == MAP_FAILED){
+        return -1;
+    }
+    areas[0] = region + sysconf(_SC_PAGESIZE);
+    areas[1] = areas[0] + areaSize;
+    
+    for(nbuckets=1; nbuckets<dirIndexMaxFiles; nbuckets<<=1)
+        ;
+    if((buckets = calloc(nbuckets, sizeof(struct indexFile *))) == NULL){
+        munmap(region, sysconf(_SC_PAGESIZE) + 2*areaSize);
+        return -1;
+    }
+    //watching before scanning: a file changed in between is seen by both
+    if((inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 || inotify_add_watch(inotifyFd, ".", INDEXEVENTS) < 0){
+        if(inotifyFd >= 0){
+            close(inotifyFd);
+        }
+        free(buckets);
+        munmap(region, sysconf(_SC_PAGESIZE) + 2*areaSize);
+        return -1;
+    }
+    published = (struct indexHeader *)region;
+    scanDirectory();
+    publish();
+    LOG(LVL_INFO, "Indexing the directory: %u files\t\t\t\t-> Done", (unsigned)fileCount);
+    
+    //the signals of the server are handled by its own threads, never by the indexer
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&tid, &attr, indexerThread, NULL) != 0){
+        //the index would go stale: better none
+        published = NULL;
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+
+//is the name a regular file of the directory? DIRINDEX_FOUND, DIRINDEX_MISSING or DIRINDEX_UNKNOWN
+int dirIndexLookup(const char *filename){
+    
+    const struct indexArea *a;
+    const struct indexSlot *slots;
+    const struct indexMeta *m;
+    const char *listing;
+    char name[NAME_MAX+1];
+    struct fileInfo info;
+    uint64_t seq, len, publications;
+    uint32_t hash, i, probes, nslots, count, entry;
+    int result;
+    
+    if(published == NULL){
+        return DIRINDEX_UNKNOWN;
+    }
+    if(strlen(filename) > NAME_MAX){
+        return DIRINDEX_MISSING;
+    }
+    hash = hashName(filename);
+    for( ; ; ){
+        publications = __atomic_load_n(&published->publications, __ATOMIC_ACQUIRE);
+        if((a = readArea(&seq, &nslots, &count, &len)) == NULL){
+            continue;
+        }
+        result = a->complete ? DIRINDEX_MISSING : DIRINDEX_UNKNOWN;
+        slots = areaSlots(a);
+        listing = areaListing(a, nslots, count);
+        for(i = hash & (nslots-1), probes = 0; a->complete && probes < nslots && (entry = slots[i].entry) != 0;
+            i = (i+1) & (nslots-1), probes++){
+            //an entry out of the area can only be read while the area is rewritten
+            if(slots[i].hash != hash || entry > count){
+                continue;
+            }
+            m = areaMeta(a, nslots) + (entry-1);
+            if(m->offset >= len || decodeListEntry(listing + m->offset, len - m->offset, name, sizeof(name), &info) == 0 ||
+               strcmp(name, filename) != 0){
+                continue;
+            }
+            result = (m->flags & INDEX_LINK) ? DIRINDEX_UNKNOWN : DIRINDEX_FOUND;
+            break;
+        }
+        if(areaUnchanged(a, seq)){
+            //a missing file may just not be published yet
+            if(result == DIRINDEX_MISSING && !indexCurrent(publications)){
+                result = DIRINDEX_UNKNOWN;
+            }
+            return result;
+        }
+    }
+}
+
+
+//1 if the area published as publications has every change of the directory: no event waits in the
+//inotify queue, none is held by the indexer, and nothing was published since
+static int indexCurrent(uint64_t publications){
+    
+    int queued;
+    
+    //the indexer raises pending before it reads the queue and clears it after publishing
+    if(ioctl(inotifyFd, FIONREAD, &queued) < 0 || queued > 0){
+        return 0;
+    }
+    return __atomic_load_n(&published->pending, __ATOMIC_ACQUIRE) == 0 &&
+           __atomic_load_n(&published->publications, __ATOMIC_ACQUIRE) == publications;
+}
+
+
+//copy of the listing (the LIST reply after its length), NULL without index or memory
+char *dirIndexList(size_t *length){
+    
+    const struct indexArea *a;
+    char *copy;
+    uint64_t seq, len;
+    uint32_t nslots, count;
+    
+    if(published == NULL){
+        return NULL;
+    }
+    for( ; ; ){
+        if((a = readArea(&seq, &nslots, &count, &len)) == NULL){
+            continue;
+        }
+        copy = NULL;
+        if(a->complete && (copy = malloc(len > 0 ? len : 1)) != NULL){
+            memcpy(copy, areaListing(a, nslots, count), len);
+        }
+        if(areaUnchanged(a, seq)){
+            break;
+        }
+        free(copy);
+    }
+    *length = len;
+    return copy;
+}
+
+
+//the area in use and its sizes, NULL if it is being rewritten under the reader
+static const struct indexArea *readArea(uint64_t *seq, uint32_t *nslots, uint32_t *count, uint64_t *len){
+    
+    const struct indexArea *a = (const struct indexArea *)areas[__atomic_load_n(&published->active, __ATOMIC_ACQUIRE)];
+    
+    if((*seq = __atomic_load_n(&a->seq, __ATOMIC_ACQUIRE)) & 1){
+        return NULL;
+    }
+    *nslots = a->nslots;
+    *count = a->count;
+    *len = a->listLength;
+    //sizes read while the writer is at work would lead out of the area
+    if(*nslots == 0 || (*nslots & (*nslots-1)) != 0 || *count > *nslots ||
+       sizeof(struct indexArea) + (uint64_t)*nslots*sizeof(struct indexSlot) + (uint64_t)*count*sizeof(struct indexMeta) + *len > areaSize){
+        return NULL;
+    }
+    return a;
+}
+
+
+//1 if the writer did not touch the area since readArea()
+static int areaUnchanged(const struct indexArea *a, uint64_t seq){
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&a->seq, __ATOMIC_RELAXED) == seq;
+}
+
+
+//FNV-1a, as the file cache
+static uint32_t hashName(const char *name){
+    uint32_t h = 2166136261u;
+    
+    while(*name){
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h;
+}
+
+
+//bring the file in line with the directory: added, updated or removed
+static void indexName(const char *name){
+    
+    struct stat st;
+    struct indexFile *f;
+    uint32_t hash = hashName(name), flags = 0;
+    size_t len = strlen(name);
+    
+    if(!isValidFilename(name) || len > NAME_MAX || fstatat(AT_FDCWD, name, &st, AT_SYMLINK_NOFOLLOW) != 0){
+        removeFile(name, hash);
+        return;
+    }
+    if(S_ISLNK(st.st_mode)){
+        flags = INDEX_LINK;
+        if(stat(name, &st) != 0){
+            removeFile(name, hash);
+            return;
+        }
+    }
+    if(!S_ISREG(st.st_mode)){
+        removeFile(name, hash);
+        return;
+    }
+    
+    for(f=buckets[hash & (nbuckets-1)]; f!=NULL; f=f->next){
+        if(f->hash == hash && strcmp(f->name, name) == 0){
+            break;
+        }
+    }
+    if(f == NULL){
+        if((f = malloc(sizeof(*f) + len + 1)) == NULL){
+            LOG(LVL_ERROR, "Directory index: out of memory, %s not indexed", name);
+            return;
+        }
+        f->hash = hash;
+        f->namelen = (uint16_t)len;
+        memcpy(f->name, name, len + 1);
+        f->next = buckets[hash & (nbuckets-1)];
+        buckets[hash & (nbuckets-1)] = f;
+        fileCount++;
+        nameBytes += len;
+    }
+    f->info.size = st.st_size;
+    f->info.mtime = st.st_mtim.tv_sec;
+    f->info.mtimensec = st.st_mtim.tv_nsec;
+    f->flags = flags;
+}
+
+
+static void removeFile(const char *name, uint32_t hash){
+    
+    struct indexFile **p, *f;
+    
+    for(p=&buckets[hash & (nbuckets-1)]; (f = *p) != NULL; p=&f->next){
+        if(f->hash == hash && strcmp(f->name, name) == 0){
+            *p = f->next;
+            fileCount--;
+            nameBytes -= f->namelen;
+            free(f);
+            return;
+        }
+    }
+}
+
+
+//forget every file and read the directory again (startup, lost events)
+static void scanDirectory(void){
+    
+    DIR *dir;
+    struct dirent *d;
+    struct indexFile *f;
+    uint32_t i;
+    
+    for(i=0; i<nbuckets; i++){
+        while((f = buckets[i]) != NULL){
+            buckets[i] = f->next;
+            free(f);
+        }
+    }
+    fileCount = 0;
+    nameBytes = 0;
+    if((dir = opendir(".")) == NULL){
+        LOG(LVL_ERROR, "Directory index: reading the directory failed: %s", strerror(errno));
+        return;
+    }
+    while((d = readdir(dir)) != NULL){
+        indexName(d->d_name);
+    }
+    closedir(dir);
+}
+
+
+//apply the pending events, returns 1 if the directory must be scanned again
+static int readEvents(void){
+    
+    char buf[EVENTBUFFERLENGTH] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+    int rescan = 0;
+    
+    while((n = read(inotifyFd, buf, sizeof(buf))) > 0){
+        for(p=buf; p<buf+n; p+=sizeof(struct inotify_event)+ev->len){
+            ev = (const struct inotify_event *)p;
+            if(ev->mask & RESCANEVENTS){
+                rescan = 1;
+            }else if(ev->len > 0){
+                indexName(ev->name);
+            }
+        }
+    }
+    return rescan;
+}
+
+
+//rewrite the area not in use and switch the readers to it
+static void publish(void){
+    
+    int next = !published->active;
+    struct indexArea *a = (struct indexArea *)areas[next];
+    struct indexSlot *slots;
+    struct indexMeta *meta;
+    struct indexFile *f;
+    char *listing;
+    uint32_t nslots, entry, i, b;
+    uint64_t offset, seq = a->seq;
+    size_t need;
+    
+    for(nslots=16; nslots<2*fileCount; nslots<<=1)
+        ;
+    need = sizeof(struct indexArea) + nslots*sizeof(struct indexSlot) + fileCount*sizeof(struct indexMeta) +
+           fileCount*LISTFIXEDLENGTH + nameBytes;
+           
+    __atomic_store_n(&a->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    a->complete = fileCount <= dirIndexMaxFiles && need <= areaSize;
+    a->count = 0;
+    a->nslots = a->complete ? nslots : 1;
+    a->listLength = 0;
+    if(a->complete){
+        a->count = fileCount;
+        a->listLength = fileCount*LISTFIXEDLENGTH + nameBytes;
+        slots = areaSlots(a);
+        meta = areaMeta(a, nslots);
+        listing = areaListing(a, nslots, fileCount);
+        memset(slots, 0, nslots*sizeof(struct indexSlot));
+        entry = 0;
+        offset = 0;
+        for(b=0; b<nbuckets; b++){
+            for(f=buckets[b]; f!=NULL; f=f->next){
+                meta[entry].offset = offset;
+                meta[entry].flags = f->flags;
+                offset += encodeListEntry(listing + offset, f->name, f->namelen, &f->info);
+                for(i = f->hash & (nslots-1); slots[i].entry != 0; i = (i+1) & (nslots-1))
+                    ;
+                slots[i].hash = f->hash;
+                slots[i].entry = ++entry;
+            }
+        }
+    }
+    __atomic_store_n(&a->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&published->active, next, __ATOMIC_RELEASE);
+    __atomic_store_n(&published->publications, published->publications + 1, __ATOMIC_RELEASE);
+    
+    if(a->complete != wasComplete){
+        if(a->complete){
+            LOG(LVL_INFO, "Directory index: %u files, published again", (unsigned)fileCount);
+        }else{
+            LOG(LVL_WARN, "Directory index: %u files (%zu bytes) exceed --index-max, lookups use the file system", (unsigned)fileCount, need);
+        }
+        wasComplete = a->complete;
+    }
+}
+
+
+//applies the events of the directory, publishing once a burst has settled
+static void *indexerThread(void *arg){
+    
+    struct pollfd pfd;
+    uint64_t first;
+    int rescan;
+    
+    pfd.fd = inotifyFd;
+    pfd.events = POLLIN;
+    for( ; ; ){
+        if(poll(&pfd, 1, -1) <= 0){
+            continue;
+        }
+        //the events about to be read are in neither the queue nor the area until published
+        __atomic_store_n(&published->pending, 1, __ATOMIC_SEQ_CST);
+        first = wheelNowMs();
+        rescan = 0;
+        do{
+            rescan |= readEvents();
+        }while(wheelNowMs() - first < MAXDELAYMS && poll(&pfd, 1, SETTLEMS) > 0);
+        if(rescan){
+            LOG(LVL_INFO, "Directory index: events lost, scanning the directory again");
+            scanDirectory();
+        }
+        publish();
+        __atomic_store_n(&published->pending, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+
+static struct indexSlot *areaSlots(const struct indexArea *a){
+    return (struct indexSlot *)((char *)a + sizeof(struct indexArea));
+}
+
+
+static struct indexMeta *areaMeta(const struct indexArea *a, uint32_t nslots){
+    return (struct indexMeta *)(areaSlots(a) + nslots);
+}
+
+
+static char *areaListing(const struct indexArea *a, uint32_t nslots, uint32_t count){
+    return (char *)(areaMeta(a, nslots) + count);
+}
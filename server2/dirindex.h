@@ -0,0 +1,29 @@
+/*
+ 
+ module: dirindex.h
+ 
+ purpose: definitions of functions in dirindex.c
+ 
+ */
+
+
+#ifndef _DIRINDEX_H
+
+#define _DIRINDEX_H
+
+#include <stddef.h>
+
+#define DIRINDEXMAXFILES    (1024*1024)             //default --index-max
+#define DIRINDEXNAMEBYTES   48                      //room of the published index for the average name
+
+#define DIRINDEX_UNKNOWN    -1                      //no index, or a name it does not vouch for: ask the file system
+#define DIRINDEX_MISSING    0                       //not a regular file of the directory
+#define DIRINDEX_FOUND      1
+
+extern size_t dirIndexMaxFiles;
+
+int dirIndexInit(void);
+int dirIndexLookup(const char *filename);
+char *dirIndexList(size_t *length);
+
+#endif
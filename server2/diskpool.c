@@ -0,0 +1,366 @@
+/*
+ 
+ module: diskpool.c
+ 
+ purpose: pool of threads doing the blocking disk operations of the
+          threaded engine (thread_engine.c): open and fstat of a
+          requested file (and of the next one of a MGET), pread() of its
+          chunks and readahead of the following ones. A network thread
+          never touches the disk, so a slow disk delays only the
+          transfers reading from it.
+ 
+          Every worker has a bounded queue of jobs. A job is pushed on
+          the queue of a worker chosen by the submitter, and a worker
+          with an empty queue steals from the queues of the others, so a
+          long read does not keep the jobs behind it waiting. Idle
+          workers sleep on a futex, woken by the next submission.
+ 
+          A finished job goes back to the network thread that submitted
+          it through the completion queue of that thread, with an
+          eventfd registered in its epoll set. The eventfd is written
+          only if the thread is blocked (or about to block) in
+          epoll_wait(): a busy thread finds the completions when it
+          looks for them after its events, without any system call.
+ 
+          Every queue is a bounded multi producer, multi consumer ring
+          (the one of log.c): a slot carries a sequence number telling
+          whether it is free or published, and the positions are taken
+          with a compare and swap. Nothing is locked. A full job queue
+          is reported to the submitter, which keeps the job until a
+          completion frees a place; a completion queue is as long as the
+          jobs a network thread may have in flight, so it never fills.
+ 
+ */
+
+
+#define _GNU_SOURCE                                 //readahead(), syscall()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "./../errlib.h"
+#include "server2.h"
+#include "diskpool.h"
+#include "stats.h"
+#include "log.h"
+
+struct queueSlot {
+    uint64_t seq;                       //position + 1 when published, position when free
+    struct diskJob *job;
+};
+
+struct jobQueue {
+    uint64_t tail __attribute__((aligned(64)));     //next slot for the producers
+    uint64_t head __attribute__((aligned(64)));     //next slot for the consumers
+    uint64_t mask;
+    struct queueSlot *slots;
+};
+
+struct diskWorker {
+    struct jobQueue queue;
+    int sleeping;                       //waiting on its futex
+    int wakeWord;                       //futex of the worker
+    int index;
+} __attribute__((aligned(64)));
+
+struct completionQueue {
+    struct jobQueue queue;
+    int eventfd;                        //readable when completions are waiting
+    int waiting;                        //the network thread may block in epoll_wait()
+} __attribute__((aligned(64)));
+
+int diskWorkers = DISKWORKERS;                      //--disk-threads
+
+static struct diskWorker *workers = NULL;
+static struct completionQueue *completions = NULL;
+static unsigned nextWorker;                         //submissions spread over the queues
+
+static int queueInit(struct jobQueue *q, uint64_t length);
+static int queuePush(struct jobQueue *q, struct diskJob *job);
+static struct diskJob *queuePop(struct jobQueue *q);
+static void *workerThread(void *arg);
+static struct diskJob *takeJob(struct diskWorker *w);
+static void runJob(struct diskJob *job);
+static void complete(struct diskJob *job);
+static void wakeWorker(int first);
+
+
+
+//starts the workers and the completion queues of the network threads
+int diskPoolStart(int completionQueues){
+    
+    pthread_t tid;
+    pthread_attr_t attr;
+    sigset_t all, old;
+    int i;
+    
+    if(posix_memalign((void **)&workers, 64, diskWorkers * sizeof(struct diskWorker)) != 0 ||
+       posix_memalign((void **)&completions, 64, completionQueues * sizeof(struct completionQueue)) != 0){
+        return -1;
+    }
+    memset(workers, 0, diskWorkers * sizeof(struct diskWorker));
+    memset(completions, 0, completionQueues * sizeof(struct completionQueue));
+    for(i=0; i<completionQueues; i++){
+        if(queueInit(&completions[i].queue, COMPLETIONLENGTH) < 0 ||
+           (completions[i].eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0){
+            return -1;
+        }
+    }
+    //every queue exists before the first worker may steal from it
+    for(i=0; i<diskWorkers; i++){
+        workers[i].index = i;
+        if(queueInit(&workers[i].queue, DISKQUEUELENGTH) < 0){
+            return -1;
+        }
+    }
+    
+    //the signals of the server are handled by the main thread, never by a worker
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for(i=0; i<diskWorkers; i++){
+        if(pthread_create(&tid, &attr, workerThread, &workers[i]) != 0){
+            pthread_attr_destroy(&attr);
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            return -1;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+
+//queues a job, -1 if the queues of all the workers are full
+int diskSubmit(struct diskJob *job){
+    
+    unsigned first = __atomic_fetch_add(&nextWorker, 1, __ATOMIC_RELAXED) % diskWorkers;
+    int i, w;
+    
+    for(i=0; i<diskWorkers; i++){
+        w = (first + i) % diskWorkers;
+        if(queuePush(&workers[w].queue, job) == 0){
+            wakeWorker(w);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+//next finished job of a network thread, NULL if none
+struct diskJob *diskNextCompletion(int queue){
+    return queuePop(&completions[queue].queue);
+}
+
+
+int diskCompletionFd(int queue){
+    return completions[queue].eventfd;
+}
+
+
+//the network thread is going to block: returns 0 if completions are already waiting, it must not
+int diskCompletionIdle(int queue){
+    
+    struct completionQueue *cq = &completions[queue];
+    struct jobQueue *q = &cq->queue;
+    uint64_t head;
+    
+    __atomic_store_n(&cq->waiting, 1, __ATOMIC_SEQ_CST);
+    //a completion published before the flag was set is seen here, the later ones write the eventfd
+    head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    if(__atomic_load_n(&q->slots[head & q->mask].seq, __ATOMIC_SEQ_CST) == head+1){
+        __atomic_store_n(&cq->waiting, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+
+void diskCompletionAwake(int queue){
+    __atomic_store_n(&completions[queue].waiting, 0, __ATOMIC_RELAXED);
+}
+
+
+static int queueInit(struct jobQueue *q, uint64_t length){
+    
+    uint64_t p;
+    
+    if((q->slots = malloc(length * sizeof(struct queueSlot))) == NULL){
+        return -1;
+    }
+    for(p=0; p<length; p++){
+        q->slots[p].seq = p;
+    }
+    q->mask = length-1;
+    q->head = q->tail = 0;
+    return 0;
+}
+
+
+//-1 if the queue is full
+static int queuePush(struct jobQueue *q, struct diskJob *job){
+    
+    struct queueSlot *s;
+    uint64_t p = __atomic_load_n(&q->tail, __ATOMIC_RELAXED), seq;
+    
+    for( ; ; ){
+        s = &q->slots[p & q->mask];
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if(seq == p){
+            if(__atomic_compare_exchange_n(&q->tail, &p, p+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                s->job = job;
+                __atomic_store_n(&s->seq, p+1, __ATOMIC_SEQ_CST);
+                return 0;
+            }
+        }else if((int64_t)(seq - p) < 0){
+            return -1;
+        }else{
+            p = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+//NULL if the queue is empty
+static struct diskJob *queuePop(struct jobQueue *q){
+    
+    struct queueSlot *s;
+    struct diskJob *job;
+    uint64_t p = __atomic_load_n(&q->head, __ATOMIC_RELAXED), seq;
+    
+    for( ; ; ){
+        s = &q->slots[p & q->mask];
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if(seq == p+1){
+            if(__atomic_compare_exchange_n(&q->head, &p, p+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                job = s->job;
+                //free again for the producer one lap later
+                __atomic_store_n(&s->seq, p+q->mask+1, __ATOMIC_RELEASE);
+                return job;
+            }
+        }else if((int64_t)(seq - (p+1)) < 0){
+            return NULL;
+        }else{
+            p = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+static void *workerThread(void *arg){
+    
+    struct diskWorker *w = arg;
+    struct diskJob *job;
+    int word;
+    
+    statsAttach();
+    for( ; ; ){
+        if((job = takeJob(w)) != NULL){
+            runJob(job);
+            complete(job);
+            continue;
+        }
+        word = __atomic_load_n(&w->wakeWord, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        //a job queued before the flag was set is seen here, the later ones wake the futex
+        if((job = takeJob(w)) != NULL){
+            __atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+            runJob(job);
+            complete(job);
+            continue;
+        }
+        syscall(SYS_futex, &w->wakeWord, FUTEX_WAIT_PRIVATE, word, NULL, NULL, 0);
+        __atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+
+//a job of the own queue, or one stolen from the queue of another worker
+static struct diskJob *takeJob(struct diskWorker *w){
+    
+    struct diskJob *job;
+    int i;
+    
+    if((job = queuePop(&w->queue)) != NULL){
+        return job;
+    }
+    for(i=1; i<diskWorkers; i++){
+        if((job = queuePop(&workers[(w->index + i) % diskWorkers].queue)) != NULL){
+            return job;
+        }
+    }
+    return NULL;
+}
+
+
+static void runJob(struct diskJob *job){
+    
+    ssize_t n;
+    
+    switch(job->op){
+        
+        case DISK_OPEN:
+            //a MGET record also opens the next file of the batch and reads its first bytes ahead
+            job->result = (job->batch != NULL) ? batchOpen(job->batch, job->filename, job->rf) : openRequestedFile(job->filename, job->rf);
+            break;
+            
+        case DISK_READ:
+            while((n = pread(job->fd, job->buf, job->length, job->offset)) < 0 && errno == EINTR)
+                ;
+            job->result = n;
+            job->error = (n < 0) ? errno : 0;
+            //the next chunks are brought into the page cache while this one is being sent
+            if(n > 0 && job->prefetch > 0){
+                readahead(job->fd, job->offset + n, job->prefetch);
+            }
+            break;
+    }
+}
+
+
+//hands the job back to its network thread: the eventfd is written only if the thread may be blocked
+static void complete(struct diskJob *job){
+    
+    struct completionQueue *cq = &completions[job->owner];
+    uint64_t one = 1;
+    
+    while(queuePush(&cq->queue, job) < 0){
+        //not expected: the network thread bounds its jobs in flight to the length of the queue
+        sched_yield();
+    }
+    if(__atomic_load_n(&cq->waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&cq->waiting, 0, __ATOMIC_SEQ_CST)){
+        if(write(cq->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+            LOG(LVL_ERROR, "Waking network thread %d failed: %s", job->owner, strerror(errno));
+        }
+    }
+}
+
+
+//wakes a sleeping worker, the one of the queue first: any of them would steal the job
+static void wakeWorker(int first){
+    
+    struct diskWorker *w;
+    int i;
+    
+    for(i=0; i<diskWorkers; i++){
+        w = &workers[(first + i) % diskWorkers];
+        if(__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&w->sleeping, 0, __ATOMIC_SEQ_CST)){
+            __atomic_fetch_add(&w->wakeWord, 1, __ATOMIC_SEQ_CST);
+            syscall(SYS_futex, &w->wakeWord, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+            return;
+        }
+    }
+}
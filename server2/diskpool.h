@@ -0,0 +1,53 @@
+/*
+ 
+ module: diskpool.h
+ 
+ purpose: definitions of functions in diskpool.c
+ 
+ */
+
+
+#ifndef _DISKPOOL_H
+
+#define _DISKPOOL_H
+
+#include <sys/types.h>
+#include "request.h"
+
+#define DISKWORKERS         4                       //default --disk-threads
+#define MAXDISKWORKERS      64
+#define DISKQUEUELENGTH     1024                    //jobs waiting in the queue of a worker, a power of 2
+#define COMPLETIONLENGTH    4096                    //jobs in flight of a network thread, a power of 2
+
+typedef enum {
+    DISK_OPEN,                                      //openRequestedFile() or batchOpen(): open, fstat, cache lookup
+    DISK_READ                                       //pread() of a chunk, readahead of the next bytes
+} diskOp;
+
+//a blocking operation, embedded in the connection it belongs to
+struct diskJob {
+    diskOp op;
+    int owner;                          //completion queue of the job (network thread)
+    void *data;                         //connection of the job
+    const char *filename;               //DISK_OPEN: file to open...
+    struct requestedFile *rf;           //...and where to store it
+    struct batch *batch;                //DISK_OPEN of a MGET record: batchOpen() of this batch
+    int fd;                             //DISK_READ: file to read...
+    off_t offset;                       //...from this byte...
+    char *buf;                          //...into this buffer
+    size_t length;
+    size_t prefetch;                    //DISK_READ: bytes after the chunk to read ahead
+    ssize_t result;                     //openRequestedFile() result, or bytes read (-1: error)
+    int error;                          //errno of a failed read
+};
+
+extern int diskWorkers;
+
+int diskPoolStart(int completionQueues);
+int diskSubmit(struct diskJob *job);
+struct diskJob *diskNextCompletion(int queue);
+int diskCompletionFd(int queue);
+int diskCompletionIdle(int queue);
+void diskCompletionAwake(int queue);
+
+#endif
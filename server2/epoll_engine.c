@@ -0,0 +1,569 @@
+/*
+ 
+ module: epoll_engine.c
+ 
+ purpose: single process, event driven server engine (--mode=epoll).
+          Every connection is a non blocking socket registered in an
+          edge-triggered epoll set and driven by a small state machine:
+ 
+            CONN_READ_CMD    -> waiting for a complete command line
+            CONN_SEND_HEADER -> sending "+OK\r\n", file size and timestamp
+            CONN_SEND_BODY   -> streaming the bytes of the requested file
+ 
+          A header followed by a body is not sent on its own: it is framed
+          in the transfer and leaves with the first bytes of the body.
+          
+          A MGET goes through the last two states once for its header and
+          once for the record of every file, then back to CONN_READ_CMD.
+          
+          With edge-triggered notifications a connection is always driven
+          until the socket returns EAGAIN, so no event is ever lost.
+ 
+          Every connection has one deadline in a timer wheel (timerwheel.c):
+          idle while waiting for a command, header once a command has
+          started to arrive, transfer while a reply is being sent. A body
+          over its rate limits (shaper.c) waits for a second timer of the
+          connection, the throttle one, and its socket events are ignored
+          meanwhile.
+ 
+          The passive socket is drained in batches of ADMITBATCH
+          connections, the ready connections are served in between, so
+          a connection storm does not starve the transfers in progress.
+          A connection over the limits of admission.c is refused as soon
+          as it is accepted.
+          
+ */
+
+
+#define _GNU_SOURCE                                 //accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include "./../errlib.h"
+#include "./../sockwrap.h"
+#include "server2.h"
+#include "epoll_engine.h"
+#include "transfer.h"
+#include "request.h"
+#include "filecache.h"
+#include "stats.h"
+#include "log.h"
+#include "timerwheel.h"
+#include "shaper.h"
+#include "admission.h"
+
+#define MAXEVENTS           256                     //events returned by a single epoll_wait()
+
+typedef enum {
+    CONN_READ_CMD,
+    CONN_SEND_HEADER,
+    CONN_SEND_BODY
+} connState;
+
+struct connection {
+    int socket;                         //connected socket
+    connState state;                    //current state of the connection
+    char rcvbuffer[RCVBUFFERLENGTH];    //received bytes not yet consumed
+    size_t rcvlen;                      //number of bytes inside rcvbuffer
+    char header[MAXHEADERLENGTH];       //reply header of the current GET
+    size_t headerlen, headersent;
+    int sending;                        //a file is being sent, rf is open
+    struct requestedFile rf;            //file being sent
+    struct fileTransfer transfer;       //state of the body transfer
+    struct batch batch;                 //MGET in progress, names NULL otherwise
+    struct timer timer;                 //current deadline
+    deadlineKind deadline;
+    struct shaper shaper;               //rate limits of the connection
+    struct timer throttle;              //armed while the body waits for its rate limits
+    int ticket;                         //admission of the connection (admission.c)
+    struct connection *prev, *next;     //list of open connections
+};
+
+static struct connection *connections = NULL;
+static struct timerWheel wheel;
+
+static int setNonBlocking(int fd);
+static int acceptConnections(int epfd, int passive_socket);
+static void driveConnection(struct connection *c);
+static int processCommand(struct connection *c, char *line);
+static void nextRecord(struct connection *c);
+static void closeConnection(struct connection *c, const char *reason, int sendErr);
+static int throttled(struct connection *c);
+static void setDeadline(struct connection *c, deadlineKind kind);
+static void deadlineExpired(struct timer *t);
+
+
+
+void epollServerLoop(int passive_socket){
+    
+    int epfd;                           //epoll instance
+    struct epoll_event ev, events[MAXEVENTS];
+    int n, i, timeout, more;
+    int acceptPending = 0;              //the last batch was full, more connections may be queued
+    uint64_t acceptRetry = 0;           //the accepts lacked descriptors or memory: not before then
+    uint64_t now;
+    
+    if(setNonBlocking(passive_socket) < 0){
+        err_sys("(%s) error - fcntl() failed", prog_name);
+    }
+    if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+        err_sys("(%s) error - epoll_create1() failed", prog_name);
+    }
+    
+    //the passive socket is registered with a NULL pointer, connections with their structure
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, passive_socket, &ev) < 0){
+        err_sys("(%s) error - epoll_ctl() failed", prog_name);
+    }
+    wheelInit(&wheel);
+    
+    for( ; ; ){
+        
+        //waking up at the next tick of the timer wheel if any deadline is armed
+        timeout = wheelTimeout(&wheel);
+        if(acceptRetry != 0){
+            now = wheelNowMs();
+            if(timeout < 0 || now + timeout > acceptRetry){
+                timeout = (now < acceptRetry) ? (int)(acceptRetry - now) : 0;
+            }
+        }else if(acceptPending){
+            timeout = 0;
+        }
+        if((n = epoll_wait(epfd, events, MAXEVENTS, timeout)) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            err_sys("(%s) error - epoll_wait() failed", prog_name);
+        }
+        
+        for(i=0; i<n; i++){
+            if(events[i].data.ptr == NULL){
+                acceptPending = 1;
+            }else{
+                driveConnection((struct connection *)events[i].data.ptr);
+            }
+        }
+        
+        //edge triggered: the queue is drained until EAGAIN, a batch per loop. A queue left behind for lack of
+        //descriptors or memory raises no new edge: it stays pending and is tried again after a pause
+        if(acceptPending && (acceptRetry == 0 || wheelNowMs() >= acceptRetry)){
+            acceptRetry = 0;
+            if((more = acceptConnections(epfd, passive_socket)) < 0){
+                acceptRetry = wheelNowMs() + ADMITRETRYMS;
+            }else{
+                acceptPending = more;
+            }
+        }
+        
+        wheelAdvance(&wheel, deadlineExpired);
+    }
+}
+
+
+//accept the pending connections, at most a batch: returns 1 if the queue may not be empty yet,
+//-1 if it could not be drained for lack of descriptors or memory
+static int acceptConnections(int epfd, int passive_socket){
+    
+    int conn_socket, ticket, i;
+    struct sockaddr_in caddr;
+    socklen_t addrlen;
+    char addr[LOGADDRLENGTH];
+    struct connection *c;
+    struct epoll_event ev;
+    
+    admissionSampleQueue(passive_socket);
+    for(i=0; i<ADMITBATCH; i++){
+        addrlen = sizeof(struct sockaddr_in);
+        if((conn_socket = accept4(passive_socket, (struct sockaddr *)&caddr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0){
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            return admissionAcceptFailed(errno) ? -1 : 0;
+        }
+        admissionAccepted();
+        
+        if((ticket = admissionEnter(&caddr)) < 0){
+            admissionRefuse(conn_socket, ticket);
+            continue;
+        }
+        if((c = calloc(1, sizeof(struct connection))) == NULL){
+            LOG(LVL_ERROR, "Out of memory. Closing connection");
+            admissionLeave(ticket);
+            Close(conn_socket);
+            continue;
+        }
+        c->socket = conn_socket;
+        c->ticket = ticket;
+        transferSetNoDelay(conn_socket);
+        c->state = CONN_READ_CMD;
+        timerInit(&c->timer, c);
+        timerInit(&c->throttle, c);
+        shaperOpen(&c->shaper, conn_socket, &caddr);
+        setDeadline(c, DEADLINE_IDLE);
+        
+        //readable and writable transitions are both reported, the state decides what to do
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, conn_socket, &ev) < 0){
+            LOG(LVL_ERROR, "Error while registering connection. Closing connection");
+            timerCancel(&wheel, &c->timer);
+            shaperClose(&c->shaper);
+            admissionLeave(ticket);
+            Close(conn_socket);
+            free(c);
+            continue;
+        }
+        
+        c->next = connections;
+        if(connections != NULL){
+            connections->prev = c;
+        }
+        connections = c;
+        statsAdd(STAT_CONN_ACCEPTED, 1);
+        
+        LOG_SAMPLED(LVL_INFO, "Accepted connection from %s on socket %d", logFormatAddr(addr, &caddr), conn_socket);
+        
+        //data may already be waiting, its edge could have been raised before registration
+        driveConnection(c);
+    }
+    return 1;
+}
+
+
+//advance the state machine of a connection until the socket would block
+static void driveConnection(struct connection *c){
+    
+    ssize_t n;
+    char *eol;
+    size_t linelen;
+    char line[RCVBUFFERLENGTH];
+    
+    for( ; ; ){
+        switch(c->state){
+                
+            case CONN_READ_CMD:
+                //a complete command is already buffered: consume it
+                if((eol = memchr(c->rcvbuffer, '\n', c->rcvlen)) != NULL){
+                    linelen = eol - c->rcvbuffer + 1;
+                    memcpy(line, c->rcvbuffer, linelen);
+                    line[linelen] = '\0';
+                    c->rcvlen -= linelen;
+                    memmove(c->rcvbuffer, c->rcvbuffer+linelen, c->rcvlen);
+                    if(processCommand(c, line) < 0){
+                        return;
+                    }
+                    break;
+                }
+                if(c->rcvlen >= RCVBUFFERLENGTH-1){
+                    statsAdd(STAT_ERR_COMMAND, 1);
+                    closeConnection(c, "Command too long", 1);
+                    return;
+                }
+                n = recv(c->socket, c->rcvbuffer+c->rcvlen, RCVBUFFERLENGTH-1-c->rcvlen, 0);
+                if(n > 0){
+                    c->rcvlen += n;
+                    break;
+                }
+                if(n == 0){
+                    closeConnection(c, "Connection closed by party", 0);
+                    return;
+                }
+                if(errno == EINTR){
+                    break;
+                }
+                if(errno != EAGAIN && errno != EWOULDBLOCK){
+                    statsAdd(STAT_ERR_RECV, 1);
+                    closeConnection(c, "Reading error", 1);
+                    return;
+                }
+                //waiting for a command, or for the rest of one: the header deadline runs from its first byte
+                setDeadline(c, c->rcvlen == 0 ? DEADLINE_IDLE : DEADLINE_HEADER);
+                return;
+                
+            case CONN_SEND_HEADER:
+                //a reply with a body: its header leaves with the first bytes of the body (transfer.c)
+                if(c->sending){
+                    transferFrame(&c->transfer, c->header, c->headerlen);
+                    c->state = CONN_SEND_BODY;
+                    break;
+                }
+                n = send(c->socket, c->header+c->headersent, c->headerlen-c->headersent, MSG_NOSIGNAL);
+                if(n < 0){
+                    if(errno == EINTR){
+                        break;
+                    }
+                    if(errno != EAGAIN && errno != EWOULDBLOCK){
+                        statsAdd(STAT_ERR_SEND, 1);
+                        closeConnection(c, "Sending reply header failed", 0);
+                    }
+                    return;
+                }
+                c->headersent += n;
+                if(c->headersent == c->headerlen){
+                    //header of a MGET, or record of a file it cannot send
+                    nextRecord(c);
+                }
+                break;
+                
+            case CONN_SEND_BODY:
+                if(throttled(c)){
+                    return;
+                }
+                if((n = transferSend(&c->transfer, c->socket)) == 0){
+                    LOG_SAMPLED(LVL_INFO, "(socket %d) File sent (%s)", c->socket, transferMethodName(c->transfer.method));
+                    shaperIdle(&c->shaper);
+                    if(c->rf.generated == NULL){
+                        statsAdd(STAT_GETS, 1);
+                    }
+                    if(fileCacheEnabled()){
+                        printCacheStats();
+                    }
+                    transferRelease(&c->transfer);
+                    closeRequestedFile(&c->rf);
+                    c->sending = 0;
+                    c->state = CONN_READ_CMD;
+                    c->deadline = DEADLINE_NONE;
+                    if(c->batch.names != NULL){
+                        nextRecord(c);
+                    }
+                    break;
+                }
+                if(n < 0){
+                    if(errno == EINTR){
+                        break;
+                    }
+                    if(errno != EAGAIN && errno != EWOULDBLOCK){
+                        statsAdd(STAT_ERR_SEND, 1);
+                        closeConnection(c, "Sending file failed", 0);
+                    }
+                    return;
+                }
+                if(c->rf.generated == NULL){
+                    statsAdd(STAT_BYTES_SENT, n);
+                    shaperCharge(&c->shaper, n);
+                }
+                break;
+        }
+    }
+}
+
+
+//handle a complete command line, returns -1 if the connection has been closed
+static int processCommand(struct connection *c, char *line){
+    
+    char *filename;
+    struct request req;
+    struct stat *st;
+    int n;
+    
+    if(parseRequest(line, &req) == REQ_QUIT){
+        LOG_SAMPLED(LVL_INFO, "(socket %d) QUIT command received", c->socket);
+        closeConnection(c, "Closing connection", 0);
+        return -1;
+    }
+    
+    if(req.type == REQ_STATS || req.type == REQ_LIST){
+        //the counters as text, or the listing of the directory index, sent from memory like a cached file
+        if(req.type == REQ_STATS ? openStatsReply(&c->rf) < 0 : openListReply(&c->rf) < 0){
+            closeConnection(c, req.type == REQ_STATS ? "Out of memory" : "Listing not available", 1);
+            return -1;
+        }
+        LOG_SAMPLED(LVL_INFO, "(socket %d) %s command received", c->socket, req.type == REQ_STATS ? "STATS" : "LIST");
+        requestTransferInit(&c->transfer, &c->rf, 0, c->rf.st.st_size);
+        c->sending = 1;
+        c->headerlen = req.type == REQ_STATS ? buildStatsHeader(c->header, &c->rf) : buildListHeader(c->header, &c->rf);
+        c->headersent = 0;
+        c->state = CONN_SEND_HEADER;
+        setDeadline(c, DEADLINE_TRANSFER);
+        return 0;
+    }
+    if(req.type == REQ_MGET){
+        if(batchStart(&c->batch, req.filename) < 0){
+            statsAdd(STAT_ERR_COMMAND, 1);
+            closeConnection(c, "Invalid MGET command received", 1);
+            return -1;
+        }
+        LOG_SAMPLED(LVL_INFO, "(socket %d) MGET command received: %u files", c->socket, (unsigned)c->batch.left);
+        c->headerlen = buildBatchHeader(c->header, &c->batch);
+        c->headersent = 0;
+        c->state = CONN_SEND_HEADER;
+        setDeadline(c, DEADLINE_TRANSFER);
+        return 0;
+    }
+    //DELTA is served by the process per connection engines only: matching the signatures walks
+    //the whole file in one go, which would stall every other connection of the loop
+    if(req.type != REQ_GET && req.type != REQ_GET64 && req.type != REQ_RGET && req.type != REQ_IFMOD){
+        statsAdd(STAT_ERR_COMMAND, 1);
+        closeConnection(c, "Invalid command received", 1);
+        return -1;
+    }
+    filename = req.filename;
+    if(!isValidFilename(filename)){
+        statsAdd(STAT_ERR_FILENAME, 1);
+        closeConnection(c, "Invalid file error", 1);
+        return -1;
+    }
+    
+    if((n = openRequestedFile(filename, &c->rf)) != 0){
+        statsAdd(n == OPEN_FAILED ? STAT_ERR_OPEN : STAT_ERR_STAT, 1);
+        closeConnection(c, n == OPEN_FAILED ? "Opening file error" : "Getting file statistics error", 1);
+        return -1;
+    }
+    st = &c->rf.st;
+    n = resolveRange(&req, st);
+    requestTransferInit(&c->transfer, &c->rf, req.start, req.end);
+    c->sending = 1;
+    if(!replyFitsRequest(&req, st)){
+        statsAdd(STAT_ERR_TOO_LARGE, 1);
+        closeConnection(c, "File too large for GET, GET64 required", 1);
+        return -1;
+    }
+    if(n < 0){
+        statsAdd(STAT_ERR_RANGE, 1);
+        closeConnection(c, "Range out of the file", 1);
+        return -1;
+    }
+    LOG_SAMPLED(LVL_INFO, "(socket %d) GET command received: %s", c->socket, filename);
+    statsFileHit(filename);
+    
+    //preparing reply header: ok message, file size and timestamp in network byte order
+    c->headerlen = buildReplyHeader(c->header, &req, st);
+    c->headersent = 0;
+    c->state = CONN_SEND_HEADER;
+    setDeadline(c, DEADLINE_TRANSFER);
+    return 0;
+}
+
+
+//record of the next file of the MGET in progress (the file is opened here, the one after it read ahead),
+//or back to the commands after the last one: the transfer deadline keeps running for the whole batch
+static void nextRecord(struct connection *c){
+    
+    const char *name;
+    
+    if((name = batchNextName(&c->batch)) == NULL){
+        batchEnd(&c->batch);
+        c->state = CONN_READ_CMD;
+        c->deadline = DEADLINE_NONE;
+        return;
+    }
+    if(batchOpen(&c->batch, name, &c->rf) == 0){
+        requestTransferInit(&c->transfer, &c->rf, 0, c->rf.st.st_size);
+        c->sending = 1;
+        c->headerlen = buildRecordHeader(c->header, name, &c->rf.st);
+    }else{
+        LOG_SAMPLED(LVL_INFO, "(socket %d) MGET file not available: %s", c->socket, name);
+        c->headerlen = buildRecordHeader(c->header, name, NULL);
+    }
+    c->headersent = 0;
+    c->state = CONN_SEND_HEADER;
+    c->deadline = DEADLINE_TRANSFER;
+}
+
+
+//close a connection, optionally informing the client with an error message
+static void closeConnection(struct connection *c, const char *reason, int sendErr){
+    
+    if(sendErr){
+        LOG(LVL_WARN, "(socket %d) %s. Closing connection", c->socket, reason);
+        //best effort: the socket is non blocking and the connection is closed anyway
+        if(send(c->socket, ERR_MSG, sizeof(ERR_MSG)-1, MSG_NOSIGNAL) != (sizeof(ERR_MSG)-1)){
+            LOG(LVL_WARN, "(socket %d) Sending error message failed!", c->socket);
+        }
+    }else{
+        LOG_SAMPLED(LVL_INFO, "(socket %d) %s. Closing connection", c->socket, reason);
+    }
+    if(c->sending){
+        transferRelease(&c->transfer);
+        closeRequestedFile(&c->rf);
+    }
+    batchEnd(&c->batch);
+    //closing the descriptor also removes it from the epoll set
+    timerCancel(&wheel, &c->timer);
+    timerCancel(&wheel, &c->throttle);
+    shaperClose(&c->shaper);
+    admissionLeave(c->ticket);
+    Close(c->socket);
+    statsAdd(STAT_CONN_CLOSED, 1);
+    
+    if(c->prev != NULL){
+        c->prev->next = c->next;
+    }else{
+        connections = c->next;
+    }
+    if(c->next != NULL){
+        c->next->prev = c->prev;
+    }
+    free(c);
+}
+
+
+//arms the deadline of the connection, unless it is already running (0 seconds: no deadline)
+static void setDeadline(struct connection *c, deadlineKind kind){
+    
+    unsigned seconds = deadlineSeconds(kind);
+    
+    if(c->deadline == kind && timerArmed(&c->timer)){
+        return;
+    }
+    c->deadline = kind;
+    if(seconds == 0){
+        timerCancel(&wheel, &c->timer);
+    }else{
+        timerArm(&wheel, &c->timer, seconds);
+    }
+}
+
+
+//sets the size of the next step of the body; 1 if it has to wait for the throttle timer first
+static int throttled(struct connection *c){
+    
+    unsigned delay;
+    
+    //the counters and the listing are not file bodies, they are never shaped; nothing to send, nothing to wait for
+    if(c->rf.generated != NULL || transferComplete(&c->transfer)){
+        c->transfer.limit = 0;
+        return 0;
+    }
+    if((c->transfer.limit = shaperGrant(&c->shaper, &delay)) > 0){
+        return 0;
+    }
+    if(!timerArmed(&c->throttle)){
+        timerArmMs(&wheel, &c->throttle, delay);
+    }
+    return 1;
+}
+
+
+static void deadlineExpired(struct timer *t){
+    
+    struct connection *c = t->data;
+    
+    //the rate limits allow the body to go on
+    if(t == &c->throttle){
+        driveConnection(c);
+        return;
+    }
+    statsAdd(STAT_TIMEOUTS, 1);
+    closeConnection(c, deadlineMessage(c->deadline), 0);
+}
+
+
+static int setNonBlocking(int fd){
+    int flags;
+    
+    if((flags = fcntl(fd, F_GETFL, 0)) == -1){
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
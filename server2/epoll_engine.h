@@ -0,0 +1,16 @@
+/*
+ 
+ module: epoll_engine.h
+ 
+ purpose: definitions of functions in epoll_engine.c
+ 
+ */
+
+
+#ifndef _EPOLL_ENGINE_H
+
+#define _EPOLL_ENGINE_H
+
+void epollServerLoop(int passive_socket);
+
+#endif
@@ -0,0 +1,569 @@
+/*
+ 
+ module: filecache.c
+ 
+ purpose: cache of the hot files, shared by every process of the server
+          (--cache=bytes). The cache lives in an anonymous MAP_SHARED
+          mapping created by fileCacheInit() before any fork, so forked
+          children and prefork workers all see the same files: a file
+          read once from disk is then served from memory to everybody.
+ 
+          The memory is split in CACHEBLOCKSIZE blocks and every file
+          takes a contiguous run of them. When there is no room, a CLOCK
+          hand walks the entries giving a second chance to the recently
+          used ones and evicts the first unused one it finds.
+ 
+          An entry is keyed by name and is valid only while the device,
+          inode, size and modification time of the file are unchanged.
+          The entries are found through a table of CACHEBUCKETS chains
+          indexed by the hash of the name, the free ones are kept on a
+          list. An entry is never evicted while a process is sending it
+          (reference count), and a process shared robust mutex protects
+          the index, so a process dying while holding it cannot block
+          the others.
+          
+          Every reference is also recorded on behalf of its process, in a
+          table keyed by pid and entry, and the references of every pid
+          are counted in a table indexed by pid (as the tickets of
+          admission.c). When a process dies while sending, or while
+          loading a file, the SIGCHLD handler of its parent marks its pid
+          with fileCacheReap(), without any lock: the next process taking
+          the lock gives back its references, frees the entries left
+          stale and the files it did not finish loading.
+ 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include "server2.h"
+#include "filecache.h"
+
+#define ENTRY_FREE          0
+#define ENTRY_LOADING       1                       //blocks reserved, file being read
+#define ENTRY_READY         2
+#define ENTRY_STALE         3                       //changed on disk, freed by the last user
+#define CACHEBUCKETS        (2*CACHEMAXENTRIES)     //chains of the index, a power of 2
+#define CACHEREFSLOTS       (2*CACHEMAXENTRIES)     //(pid, entry) references held at the same time, a power of 2
+#define REFSDEAD            0x80000000u             //pid terminated, its references not yet given back
+
+struct cacheEntry {
+    int state;
+    uint32_t hash;                      //hash of the name, compared before the name
+    char name[NAME_MAX+1];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint32_t firstBlock, nblocks;       //memory taken by the file
+    int refcnt;                         //processes sending the file right now
+    int referenced;                     //CLOCK second chance bit
+    int next;                           //chain of the bucket (READY, LOADING) or free list (FREE), -1 at the end
+};
+
+//references of a process to an entry
+struct cacheRef {
+    pid_t pid;                          //0: free slot
+    int entry;
+    uint32_t count;
+};
+
+struct cacheHeader {
+    pthread_mutex_t lock;
+    uint32_t nblocks;                   //blocks of the data area
+    uint32_t hand;                      //CLOCK hand, index of the next entry to check
+    int freeList;                       //first free entry, -1 if none
+    uint32_t reaping;                   //pids marked by fileCacheReap(), not yet given back
+    struct cacheStats stats;
+    int buckets[CACHEBUCKETS];          //first entry of every chain, -1 if none
+    struct cacheRef refs[CACHEREFSLOTS];            //open addressing, linear probing
+    struct cacheEntry entries[CACHEMAXENTRIES];
+    unsigned char used[];               //one byte per block: 1 if taken
+};
+
+size_t fileCacheBudget = 0;                         //--cache, 0 disables the cache
+size_t fileCacheMaxFile = 0;                        //--cache-max-file, 0 means budget/8
+
+static struct cacheHeader *cache = NULL;
+static char *cacheData = NULL;
+static uint32_t *pidRefs = NULL;                    //references held by each pid, REFSDEAD once it terminated
+static long pidRefsCount = 0;
+static pid_t self;                                  //getpid() is a system call, the pid is kept here
+
+static void lockCache(void);
+static void atforkChild(void);
+static uint32_t hashName(const char *name);
+static struct cacheEntry *findEntry(const char *filename, uint32_t hash);
+static void linkEntry(struct cacheEntry *e);
+static void unlinkEntry(struct cacheEntry *e);
+static int sameFile(const struct cacheEntry *e, const struct stat *st);
+static void freeEntry(struct cacheEntry *e);
+static long allocBlocks(uint32_t count);
+static struct cacheRef *findRef(pid_t pid, int entry, int insert);
+static void deleteRef(struct cacheRef *r);
+static int acquireEntry(struct cacheEntry *e);
+static void dropRef(struct cacheEntry *e, uint32_t count);
+static void reapDead(void);
+
+
+
+int fileCacheInit(void){
+    
+    size_t headerSize, nblocks;
+    pthread_mutexattr_t attr;
+    void *region;
+    int i;
+    
+    if(fileCacheBudget == 0){
+        return 0;
+    }
+    nblocks = (fileCacheBudget + CACHEBLOCKSIZE - 1) / CACHEBLOCKSIZE;
+    if(fileCacheMaxFile == 0){
+        fileCacheMaxFile = fileCacheBudget / 8;
+    }
+    
+    //header, block map and data area in a single mapping shared with every child
+    headerSize = sizeof(struct cacheHeader) + nblocks;
+    headerSize = (headerSize + CACHEBLOCKSIZE - 1) / CACHEBLOCKSIZE * CACHEBLOCKSIZE;
+    region = mmap(NULL, headerSize + nblocks*CACHEBLOCKSIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED){
+        return -1;
+    }
+    cache = region;
+    cacheData = (char *)region + headerSize;
+    cache->nblocks = (uint32_t)nblocks;
+    cache->stats.budget = (uint64_t)nblocks * CACHEBLOCKSIZE;
+    for(i=0; i<CACHEBUCKETS; i++){
+        cache->buckets[i] = -1;
+    }
+    for(i=0; i<CACHEMAXENTRIES; i++){
+        cache->entries[i].next = i+1 < CACHEMAXENTRIES ? i+1 : -1;
+    }
+    cache->freeList = 0;
+    
+    //one counter per possible pid: only the pages of the pids actually used are ever touched
+    pidRefsCount = readPidMax();
+    pidRefs = mmap(NULL, pidRefsCount * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(pidRefs == MAP_FAILED || pthread_atfork(NULL, NULL, atforkChild) != 0){
+        if(pidRefs != MAP_FAILED){
+            munmap(pidRefs, pidRefsCount * sizeof(uint32_t));
+        }
+        pidRefs = NULL;
+        munmap(region, headerSize + nblocks*CACHEBLOCKSIZE);
+        cache = NULL;
+        return -1;
+    }
+    self = getpid();
+    
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if((errno = pthread_mutex_init(&cache->lock, &attr)) != 0){
+        munmap(pidRefs, pidRefsCount * sizeof(uint32_t));
+        pidRefs = NULL;
+        munmap(region, headerSize + nblocks*CACHEBLOCKSIZE);
+        cache = NULL;
+        return -1;
+    }
+    pthread_mutexattr_destroy(&attr);
+    return 0;
+}
+
+
+int fileCacheEnabled(void){
+    return cache != NULL;
+}
+
+
+//cached content of the file described by st, NULL on miss. A hit must be released
+const char *fileCacheLookup(const char *filename, const struct stat *st, int *handle){
+    
+    struct cacheEntry *e;
+    const char *data = NULL;
+    
+    if(cache == NULL){
+        return NULL;
+    }
+    lockCache();
+    if((e = findEntry(filename, hashName(filename))) != NULL){
+        if(e->state == ENTRY_READY && sameFile(e, st)){
+            //no room to record the reference: served from disk
+            if(acquireEntry(e) == 0){
+                e->referenced = 1;
+                cache->stats.hits++;
+                *handle = (int)(e - cache->entries);
+                data = cacheData + (size_t)e->firstBlock*CACHEBLOCKSIZE;
+            }
+        }else if(e->state == ENTRY_READY){
+            //the file changed on disk after it was cached: a new version can be loaded at once
+            cache->stats.invalidations++;
+            if(e->refcnt > 0){
+                unlinkEntry(e);
+                e->state = ENTRY_STALE;
+            }else{
+                freeEntry(e);
+            }
+        }
+    }
+    if(data == NULL){
+        cache->stats.misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return data;
+}
+
+
+//load a file in the cache, NULL if it cannot be cached. The entry is returned already acquired
+const char *fileCacheInsert(const char *filename, int fd, const struct stat *st, int *handle){
+    
+    struct cacheEntry *e;
+    uint32_t count, hash;
+    long first;
+    char *data;
+    size_t done;
+    ssize_t n;
+    
+    if(cache == NULL || st->st_size == 0 || (size_t)st->st_size > fileCacheMaxFile || strlen(filename) > NAME_MAX){
+        return NULL;
+    }
+    count = (uint32_t)((st->st_size + CACHEBLOCKSIZE - 1) / CACHEBLOCKSIZE);
+    hash = hashName(filename);
+    
+    //reserving an entry and the memory, the file is read without holding the lock
+    lockCache();
+    if(findEntry(filename, hash) != NULL){
+        //already cached (or being loaded) by another process
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    if((first = allocBlocks(count)) < 0 || cache->freeList < 0){
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    e = &cache->entries[cache->freeList];
+    cache->freeList = e->next;
+    memset(e, 0, sizeof(*e));
+    e->state = ENTRY_LOADING;
+    e->hash = hash;
+    strcpy(e->name, filename);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->firstBlock = (uint32_t)first;
+    e->nblocks = count;
+    e->referenced = 1;
+    memset(cache->used+first, 1, count);
+    cache->stats.bytesUsed += (uint64_t)count*CACHEBLOCKSIZE;
+    linkEntry(e);
+    //the loader holds the entry: if it dies, the entry is freed on its behalf
+    if(acquireEntry(e) < 0){
+        freeEntry(e);
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    
+    data = cacheData + (size_t)first*CACHEBLOCKSIZE;
+    for(done=0; done<(size_t)st->st_size; done+=n){
+        if((n = pread(fd, data+done, st->st_size-done, done)) <= 0){
+            if(n < 0 && errno == EINTR){
+                n = 0;
+                continue;
+            }
+            lockCache();
+            dropRef(e, 1);
+            freeEntry(e);
+            pthread_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+    }
+    
+    lockCache();
+    e->state = ENTRY_READY;
+    cache->stats.insertions++;
+    pthread_mutex_unlock(&cache->lock);
+    *handle = (int)(e - cache->entries);
+    return data;
+}
+
+
+void fileCacheRelease(int handle){
+    
+    struct cacheEntry *e;
+    
+    if(cache == NULL || handle < 0){
+        return;
+    }
+    e = &cache->entries[handle];
+    lockCache();
+    dropRef(e, 1);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+//pid terminated: its references are given back by the next process taking the lock
+//(async signal safe: called by the SIGCHLD handlers, which must not take the lock)
+void fileCacheReap(pid_t pid){
+    
+    uint32_t n;
+    
+    if(cache == NULL || pid <= 0 || pid >= pidRefsCount){
+        return;
+    }
+    n = __atomic_load_n(&pidRefs[pid], __ATOMIC_ACQUIRE);
+    //the usual case: every reference was released before exiting
+    if(n == 0 || (n & REFSDEAD)){
+        return;
+    }
+    __atomic_or_fetch(&pidRefs[pid], REFSDEAD, __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&cache->reaping, 1, __ATOMIC_RELEASE);
+}
+
+
+void fileCacheGetStats(struct cacheStats *stats){
+    if(cache == NULL){
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    lockCache();
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+static void lockCache(void){
+    //the previous owner died: the index is only changed by short sections, keep it
+    if(pthread_mutex_lock(&cache->lock) == EOWNERDEAD){
+        pthread_mutex_consistent(&cache->lock);
+    }
+    if(__atomic_load_n(&cache->reaping, __ATOMIC_ACQUIRE) > 0){
+        reapDead();
+    }
+}
+
+
+static void atforkChild(void){
+    self = getpid();
+}
+
+
+//FNV-1a
+static uint32_t hashName(const char *name){
+    uint32_t h = 2166136261u;
+    
+    while(*name){
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    }
+    return h;
+}
+
+
+//the READY or LOADING entry of the name, NULL if none. Called with the lock held
+static struct cacheEntry *findEntry(const char *filename, uint32_t hash){
+    int i;
+    struct cacheEntry *e;
+    
+    for(i=cache->buckets[hash & (CACHEBUCKETS-1)]; i>=0; i=e->next){
+        e = &cache->entries[i];
+        if(e->hash == hash && strcmp(e->name, filename) == 0){
+            return e;
+        }
+    }
+    return NULL;
+}
+
+
+static void linkEntry(struct cacheEntry *e){
+    int *head = &cache->buckets[e->hash & (CACHEBUCKETS-1)];
+    
+    e->next = *head;
+    *head = (int)(e - cache->entries);
+}
+
+
+//out of its chain: only READY and LOADING entries are linked
+static void unlinkEntry(struct cacheEntry *e){
+    int *p, i = (int)(e - cache->entries);
+    
+    for(p=&cache->buckets[e->hash & (CACHEBUCKETS-1)]; *p>=0; p=&cache->entries[*p].next){
+        if(*p == i){
+            *p = e->next;
+            return;
+        }
+    }
+}
+
+
+static int sameFile(const struct cacheEntry *e, const struct stat *st){
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+
+//called with the lock held
+static void freeEntry(struct cacheEntry *e){
+    if(e->state != ENTRY_STALE){
+        unlinkEntry(e);
+    }
+    memset(cache->used+e->firstBlock, 0, e->nblocks);
+    cache->stats.bytesUsed -= (uint64_t)e->nblocks*CACHEBLOCKSIZE;
+    e->state = ENTRY_FREE;
+    e->next = cache->freeList;
+    cache->freeList = (int)(e - cache->entries);
+}
+
+
+//first run of count free blocks, evicting with the CLOCK policy when needed. Called with the lock held
+static long allocBlocks(uint32_t count){
+    
+    uint32_t b, run, checked;
+    struct cacheEntry *e;
+    
+    if(count > cache->nblocks){
+        return -1;
+    }
+    for( ; ; ){
+        for(b=0, run=0; b<cache->nblocks; b++){
+            run = cache->used[b] ? 0 : run+1;
+            if(run == count){
+                return (long)(b - count + 1);
+            }
+        }
+        
+        //no room: two turns of the hand clear every second chance bit
+        for(checked=0; checked<2*CACHEMAXENTRIES; checked++){
+            e = &cache->entries[cache->hand];
+            cache->hand = (cache->hand + 1) % CACHEMAXENTRIES;
+            if(e->state != ENTRY_READY || e->refcnt > 0){
+                continue;
+            }
+            if(e->referenced){
+                e->referenced = 0;
+                continue;
+            }
+            freeEntry(e);
+            cache->stats.evictions++;
+            break;
+        }
+        if(checked == 2*CACHEMAXENTRIES){
+            //every cached file is being sent right now
+            return -1;
+        }
+    }
+}
+
+
+//slot of the references of pid to entry: the existing one, else a free one if insert, else NULL.
+//Called with the lock held
+static struct cacheRef *findRef(pid_t pid, int entry, int insert){
+    
+    uint32_t i, probes;
+    struct cacheRef *r;
+    
+    for(i = ((uint32_t)pid * 2654435761u ^ (uint32_t)entry) & (CACHEREFSLOTS-1), probes = 0; probes < CACHEREFSLOTS;
+        i = (i+1) & (CACHEREFSLOTS-1), probes++){
+        r = &cache->refs[i];
+        if(r->pid == 0){
+            return insert ? r : NULL;
+        }
+        if(r->pid == pid && r->entry == entry){
+            return r;
+        }
+    }
+    return NULL;
+}
+
+
+//frees the slot and moves back the following ones of its cluster, so that no probe sequence breaks
+static void deleteRef(struct cacheRef *r){
+    
+    uint32_t i = (uint32_t)(r - cache->refs), j, home;
+    
+    for(j = (i+1) & (CACHEREFSLOTS-1); cache->refs[j].pid != 0; j = (j+1) & (CACHEREFSLOTS-1)){
+        home = ((uint32_t)cache->refs[j].pid * 2654435761u ^ (uint32_t)cache->refs[j].entry) & (CACHEREFSLOTS-1);
+        //the slot j can move to i only if i lies on its probe sequence, between home and j
+        if(((j - home) & (CACHEREFSLOTS-1)) >= ((j - i) & (CACHEREFSLOTS-1))){
+            cache->refs[i] = cache->refs[j];
+            i = j;
+        }
+    }
+    cache->refs[i].pid = 0;
+}
+
+
+//a reference of this process to the entry, -1 if it cannot be recorded. Called with the lock held
+static int acquireEntry(struct cacheEntry *e){
+    
+    struct cacheRef *r;
+    
+    if(self >= pidRefsCount || (r = findRef(self, (int)(e - cache->entries), 1)) == NULL){
+        return -1;
+    }
+    if(r->pid == 0){
+        r->pid = self;
+        r->entry = (int)(e - cache->entries);
+        r->count = 0;
+    }
+    r->count++;
+    __atomic_add_fetch(&pidRefs[self], 1, __ATOMIC_RELAXED);
+    e->refcnt++;
+    return 0;
+}
+
+
+//gives back count references of this process to the entry. Called with the lock held
+static void dropRef(struct cacheEntry *e, uint32_t count){
+    
+    struct cacheRef *r;
+    
+    if((r = findRef(self, (int)(e - cache->entries), 0)) != NULL){
+        __atomic_sub_fetch(&pidRefs[self], count, __ATOMIC_RELAXED);
+        if((r->count -= count) == 0){
+            deleteRef(r);
+        }
+    }
+    if((e->refcnt -= count) == 0 && e->state == ENTRY_STALE){
+        freeEntry(e);
+    }
+}
+
+
+//gives back the references of the pids marked by fileCacheReap(): a file left loading is freed,
+//a stale one as well once unused. Called with the lock held
+static void reapDead(void){
+    
+    struct cacheRef *r;
+    struct cacheEntry *e;
+    uint32_t i, count;
+    pid_t pid;
+    
+    for(i=0; i<CACHEREFSLOTS; ){
+        r = &cache->refs[i];
+        if(r->pid == 0 || !(__atomic_load_n(&pidRefs[r->pid], __ATOMIC_ACQUIRE) & REFSDEAD)){
+            i++;
+            continue;
+        }
+        pid = r->pid;
+        count = r->count;
+        e = &cache->entries[r->entry];
+        //the slot is refilled by the next ones of its cluster: i is checked again
+        deleteRef(r);
+        if(__atomic_sub_fetch(&pidRefs[pid], count, __ATOMIC_ACQ_REL) == REFSDEAD){
+            __atomic_store_n(&pidRefs[pid], 0, __ATOMIC_RELEASE);
+            __atomic_sub_fetch(&cache->reaping, 1, __ATOMIC_RELEASE);
+        }
+        e->refcnt -= count;
+        if(e->state == ENTRY_LOADING || (e->refcnt == 0 && e->state == ENTRY_STALE)){
+            freeEntry(e);
+        }
+    }
+}
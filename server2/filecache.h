@@ -0,0 +1,42 @@
+/*
+ 
+ module: filecache.h
+ 
+ purpose: definitions of functions in filecache.c
+ 
+ */
+
+
+#ifndef _FILECACHE_H
+
+#define _FILECACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define CACHEBLOCKSIZE      (64*1024)               //allocation unit of the cache memory
+#define CACHEMAXENTRIES     4096                    //maximum number of cached files
+
+struct cacheStats {
+    uint64_t hits;                      //requests served from memory
+    uint64_t misses;                    //requests served from disk
+    uint64_t insertions;                //files loaded in the cache
+    uint64_t evictions;                 //files removed to make room
+    uint64_t invalidations;             //files removed because changed on disk
+    uint64_t bytesUsed;                 //bytes of memory holding cached files
+    uint64_t budget;                    //maximum bytes of memory
+};
+
+extern size_t fileCacheBudget;
+extern size_t fileCacheMaxFile;
+
+int fileCacheInit(void);
+int fileCacheEnabled(void);
+const char *fileCacheLookup(const char *filename, const struct stat *st, int *handle);
+const char *fileCacheInsert(const char *filename, int fd, const struct stat *st, int *handle);
+void fileCacheRelease(int handle);
+void fileCacheReap(pid_t pid);
+void fileCacheGetStats(struct cacheStats *stats);
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ 
+ module: localserver.c
+ 
+ purpose: AF_UNIX listener for the clients running on the same host
+          (--unix=path), served by a dedicated process next to the TCP
+          engine, whatever engine that is. Every connection gets a
+          process of its own, as in the fork engine, running
+          serverServiceFunction(): all the commands are served as over
+          TCP, and the FGET command, only accepted here, is answered with
+          the descriptor of the file instead of its bytes (SCM_RIGHTS), so
+          a local transfer copies nothing through the socket.
+          
+          The local clients count as 127.0.0.1 for the connection limits
+          and the rate limits. The socket file is removed before binding
+          (a server that crashed leaves it behind) and when the process
+          terminates.
+ 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "./../errlib.h"
+#include "./../sockwrap.h"
+#include "server2.h"
+#include "localserver.h"
+#include "admission.h"
+#include "filecache.h"
+#include "shaper.h"
+#include "stats.h"
+#include "log.h"
+
+const char *localPath = NULL;                       //--unix, NULL: no local listener
+
+static void localServerLoop(int passive_socket);
+static void localSigchldHandler(int signo);
+static void localSigtermHandler(int signo);
+
+
+
+//binds the socket at localPath and forks the process serving it, before any engine starts
+void localServerStart(int backlog){
+    
+    struct sockaddr_un uaddr;
+    int passive_socket;
+    pid_t pid;
+    
+    if(localPath == NULL){
+        return;
+    }
+    if(strlen(localPath) >= sizeof(uaddr.sun_path)){
+        err_quit("(%s) error - local socket path too long: %s", prog_name, localPath);
+    }
+    bzero(&uaddr, sizeof(uaddr));
+    uaddr.sun_family = AF_UNIX;
+    strcpy(uaddr.sun_path, localPath);
+    
+    passive_socket = Socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(localPath);
+    Bind(passive_socket, (struct sockaddr *)&uaddr, sizeof(uaddr));
+    Listen(passive_socket, backlog);
+    if((pid = fork()) < 0){
+        err_sys("(%s) error - fork() failed", prog_name);
+    }
+    if(pid > 0){
+        Close(passive_socket);
+        LOG(LVL_INFO, "Listening at local socket %s\t\t\t-> Done (process %d)", localPath, pid);
+        return;
+    }
+    //the listener must not outlive the server
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    Signal(SIGCHLD, localSigchldHandler);
+    Signal(SIGTERM, localSigtermHandler);
+    signal(SIGPIPE, SIG_IGN);
+    logDeferWriter();
+    localServerLoop(passive_socket);
+    exit(0);
+}
+
+
+
+static void localServerLoop(int passive_socket){
+    
+    struct sockaddr_in caddr;           //address the connection is counted as
+    sigset_t chldmask, oldmask;
+    pid_t childPid;
+    int s, ticket;
+    
+    bzero(&caddr, sizeof(caddr));
+    caddr.sin_family = AF_INET;
+    caddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sigemptyset(&chldmask);
+    sigaddset(&chldmask, SIGCHLD);
+    for( ; ; ){
+        if((s = accept(passive_socket, NULL, NULL)) < 0){
+            //no descriptor or memory left: accept() would fail again at once
+            if(admissionAcceptFailed(errno)){
+                poll(NULL, 0, ADMITRETRYMS);
+            }
+            continue;
+        }
+        admissionAccepted();
+        if((ticket = admissionEnter(&caddr)) < 0){
+            admissionRefuse(s, ticket);
+            continue;
+        }
+        
+        //the child cannot be reaped before its ticket is recorded
+        sigprocmask(SIG_BLOCK, &chldmask, &oldmask);
+        if((childPid = Fork()) == 0){
+            sigprocmask(SIG_SETMASK, &oldmask, NULL);
+            Signal(SIGTERM, SIG_DFL);
+            statsAttach();
+            logDeferWriter();
+            LOG_SAMPLED(LVL_INFO, "Accepted local connection. Assigning server tasks to process");
+            Close(passive_socket);
+            serverServiceFunction(s, &caddr);
+            exit(0);
+        }
+        admissionHold(childPid, ticket);
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        Close(s);
+    }
+}
+
+
+static void localSigchldHandler(int signo){
+    
+    pid_t pid;
+    int saved = errno;
+    
+    while((pid = waitpid(-1, NULL, WNOHANG)) > 0){
+        admissionRelease(pid);
+        fileCacheReap(pid);
+        shaperRelease(pid);
+    }
+    errno = saved;
+}
+
+
+//the socket file goes with the listener
+static void localSigtermHandler(int signo){
+    unlink(localPath);
+    _exit(0);
+}
@@ -0,0 +1,18 @@
+/*
+ 
+ module: localserver.h
+ 
+ purpose: definitions of functions in localserver.c
+ 
+ */
+
+
+#ifndef _LOCALSERVER_H
+
+#define _LOCALSERVER_H
+
+extern const char *localPath;
+
+void localServerStart(int backlog);
+
+#endif
@@ -0,0 +1,464 @@
+/*
+ 
+ module: log.c
+ 
+ purpose: asynchronous logger of the server. A message is formatted by
+          the caller into a record of a ring owned by its process and
+          is written to stdout (or to syslog through errlib.c when
+          daemon_proc is set) by a writer thread, so serving a request
+          never waits for the terminal or the disk.
+ 
+          The ring is a bounded multi producer queue: a producer takes a
+          record with a compare and swap on the tail and publishes it
+          with its sequence number, the writer consumes the records in
+          order. Nothing is locked: when the ring is full the record is
+          dropped and counted, and the writer reports the drops. The
+          writer sleeps on a futex: an idle writer is woken by the next
+          record, a busy one gathers records for LOGBATCHMS and is woken
+          early only if the ring is half full.
+ 
+          The writer thread of a process is started by its first record,
+          so a forked child gets its own one (its copy of the parent's
+          ring is emptied by the fork handler) and the records left at
+          exit() are flushed by an atexit handler. A child serving a
+          single connection calls logDeferWriter(): its few records are
+          simply written at exit(), a thread per connection would cost
+          more than the records themselves.
+ 
+ */
+
+
+#define _GNU_SOURCE                                 //syscall()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "./../errlib.h"
+#include "log.h"
+
+#define LOGOUTBUFFER        65536                   //records written with one write()
+#define LOGBATCHMS          5                       //records gathered by the writer before a write()
+#define FLUSHSPINS          10000                   //a record never published (dead thread) does not block exit()
+#define WRITER_NONE         0
+#define WRITER_RUNNING      1
+#define WRITER_INLINE       2                       //no thread: the producers write the records themselves
+#define WRITER_DEFERRED     3                       //short lived process: the records wait for exit()
+#define DEFERMS             1000                    //a deferred process still lasting starts its writer...
+#define DEFERRECORDS        (LOGRECORDS/8)          //...as well as one with many records waiting
+#define WAIT_NONE           0                       //the writer is draining
+#define WAIT_IDLE           1                       //the ring was empty: the next record wakes the writer
+#define WAIT_BATCH          2                       //gathering records: only a filling ring wakes the writer
+
+struct logRecord {
+    uint64_t seq;                       //position of the record + 1 when published
+    struct timespec ts;
+    int level;
+    uint32_t len;
+    char text[LOGLINELENGTH];
+};
+
+static const char *levelNames[] = {"ERROR", "WARN ", "INFO ", "DEBUG"};
+static const int syslogLevels[] = {LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG};
+
+int logThreshold = LVL_INFO;                        //--log-level
+unsigned logSampleRate = 1;                         //--log-sample
+
+static struct logRecord ring[LOGRECORDS];
+static uint64_t tail;                               //next record for the producers
+static uint64_t head;                               //next record for the consumer
+static uint64_t dropped, droppedReported;
+static int consuming;                               //a consumer is draining the ring
+static int writerState = WRITER_NONE;
+static int writerWait;
+static int wakeWord;                                //futex of the writer
+static int initialized = 0;
+static struct timespec deferStart;                  //logDeferWriter() time
+static pid_t logPid;                                //getpid() is a system call, the pid is kept here
+static char out[LOGOUTBUFFER];                      //used only by the consumer
+
+static void resetRing(void);
+static void atforkChild(void);
+static void publish(struct logRecord *r, uint64_t pos);
+static struct logRecord *reserve(uint64_t *pos);
+static void startWriter(void);
+static void *writerThread(void *arg);
+static int drain(void);
+static size_t formatPrefix(char *buf, const struct logRecord *r);
+static void writeOut(const char *buf, size_t len);
+
+
+
+//prepares the ring of the main process: to be called before any record and any fork
+int logInit(void){
+    
+    resetRing();
+    if(pthread_atfork(NULL, NULL, atforkChild) != 0 || atexit(logFlush) != 0){
+        return -1;
+    }
+    __atomic_store_n(&initialized, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+//"error", "warn", "info" or "debug", -1 if unknown
+int logParseLevel(const char *name){
+    
+    static const char *names[] = {"error", "warn", "info", "debug"};
+    int i;
+    
+    for(i=0; i<(int)(sizeof(names)/sizeof(names[0])); i++){
+        if(strcmp(name, names[i]) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+void logWrite(logLevel level, const char *fmt, ...){
+    
+    struct logRecord *r;
+    uint64_t pos;
+    va_list ap;
+    int n;
+    
+    if(!initialized){
+        //nothing to queue to yet
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+        printf("\n");
+        return;
+    }
+    if((r = reserve(&pos)) == NULL){
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &r->ts);
+    r->level = level;
+    va_start(ap, fmt);
+    n = vsnprintf(r->text, LOGLINELENGTH, fmt, ap);
+    va_end(ap);
+    r->len = (n < 0) ? 0 : (n >= LOGLINELENGTH ? LOGLINELENGTH-1 : (uint32_t)n);
+    publish(r, pos);
+    
+    switch(__atomic_load_n(&writerState, __ATOMIC_ACQUIRE)){
+        case WRITER_NONE:
+            startWriter();
+            break;
+        case WRITER_DEFERRED:
+            if(pos - __atomic_load_n(&head, __ATOMIC_RELAXED) >= DEFERRECORDS ||
+               (r->ts.tv_sec - deferStart.tv_sec) * 1000 + (r->ts.tv_nsec - deferStart.tv_nsec) / 1000000 >= DEFERMS){
+                n = WRITER_DEFERRED;
+                if(__atomic_compare_exchange_n(&writerState, &n, WRITER_NONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+                    startWriter();
+                }
+            }
+            break;
+    }
+    if(__atomic_load_n(&writerState, __ATOMIC_ACQUIRE) == WRITER_INLINE){
+        drain();
+    }
+}
+
+
+//for signal handlers: no formatting function and no thread creation, msg followed by value if value >= 0
+void logSignalSafe(logLevel level, const char *msg, long value){
+    
+    struct logRecord *r;
+    uint64_t pos;
+    char digits[24];
+    size_t len, n = 0;
+    
+    if((int)level > logThreshold || !initialized || (r = reserve(&pos)) == NULL){
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &r->ts);
+    r->level = level;
+    len = strlen(msg);
+    if(len > LOGLINELENGTH-sizeof(digits)-1){
+        len = LOGLINELENGTH-sizeof(digits)-1;
+    }
+    memcpy(r->text, msg, len);
+    if(value >= 0){
+        do{
+            digits[n++] = '0' + value % 10;
+            value /= 10;
+        }while(value > 0);
+        r->text[len++] = ' ';
+        while(n > 0){
+            r->text[len++] = digits[--n];
+        }
+    }
+    r->len = len;
+    publish(r, pos);
+}
+
+
+//for a process living as long as one connection: no thread is started for its few records,
+//they are written by exit() (the writer is started anyway if the process lasts or logs a lot)
+void logDeferWriter(void){
+    
+    int expected = WRITER_NONE;
+    
+    clock_gettime(CLOCK_REALTIME, &deferStart);
+    __atomic_compare_exchange_n(&writerState, &expected, WRITER_DEFERRED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+
+//1 if the next sampled record is to be kept
+int logSample(unsigned *counter){
+    return logSampleRate <= 1 || __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED) % logSampleRate == 0;
+}
+
+
+//writes every published record, before exit() or when asked
+void logFlush(void){
+    
+    int spins;
+    
+    if(!initialized){
+        fflush(stdout);
+        return;
+    }
+    for(spins=0; spins<FLUSHSPINS; spins++){
+        drain();
+        if(__atomic_load_n(&head, __ATOMIC_ACQUIRE) == __atomic_load_n(&tail, __ATOMIC_ACQUIRE)){
+            break;
+        }
+        sched_yield();
+    }
+}
+
+
+//"a.b.c.d:port" in buf (LOGADDRLENGTH bytes)
+char *logFormatAddr(char *buf, const struct sockaddr_in *a){
+    
+    char ip[INET_ADDRSTRLEN];
+    
+    if(inet_ntop(AF_INET, &a->sin_addr, ip, sizeof(ip)) == NULL){
+        strcpy(ip, "?");
+    }
+    snprintf(buf, LOGADDRLENGTH, "%s:%u", ip, ntohs(a->sin_port));
+    return buf;
+}
+
+
+static void resetRing(void){
+    
+    uint64_t i;
+    
+    for(i=0; i<LOGRECORDS; i++){
+        ring[i].seq = i;
+    }
+    tail = head = 0;
+    dropped = droppedReported = 0;
+    consuming = 0;
+    writerWait = WAIT_NONE;
+    writerState = WRITER_NONE;
+    logPid = getpid();
+}
+
+
+//the child has no writer thread, and the records of the parent are written by the parent:
+//they are skipped one by one, rewriting the whole ring would copy all its pages in every child
+static void atforkChild(void){
+    
+    uint64_t p;
+    
+    for(p=head; p!=tail; p++){
+        ring[p & (LOGRECORDS-1)].seq = p+LOGRECORDS;
+    }
+    head = tail;
+    dropped = droppedReported = 0;
+    consuming = 0;
+    writerWait = WAIT_NONE;
+    writerState = WRITER_NONE;
+    logPid = getpid();
+}
+
+
+//a free record, NULL (and counted) if the ring is full
+static struct logRecord *reserve(uint64_t *pos){
+    
+    struct logRecord *r;
+    uint64_t p = __atomic_load_n(&tail, __ATOMIC_RELAXED), seq;
+    
+    for( ; ; ){
+        r = &ring[p & (LOGRECORDS-1)];
+        seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+        if(seq == p){
+            if(__atomic_compare_exchange_n(&tail, &p, p+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                *pos = p;
+                return r;
+            }
+        }else if((int64_t)(seq - p) < 0){
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }else{
+            p = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+//the record becomes visible to the writer: a system call only if the writer is idle or the ring is filling
+static void publish(struct logRecord *r, uint64_t pos){
+    
+    int wait;
+    
+    __atomic_store_n(&r->seq, pos+1, __ATOMIC_SEQ_CST);
+    wait = __atomic_load_n(&writerWait, __ATOMIC_SEQ_CST);
+    if(wait == WAIT_IDLE || (wait == WAIT_BATCH && pos - __atomic_load_n(&head, __ATOMIC_RELAXED) >= LOGRECORDS/2)){
+        if(__atomic_exchange_n(&writerWait, WAIT_NONE, __ATOMIC_SEQ_CST) != WAIT_NONE){
+            __atomic_fetch_add(&wakeWord, 1, __ATOMIC_SEQ_CST);
+            syscall(SYS_futex, &wakeWord, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        }
+    }
+}
+
+
+static void startWriter(void){
+    
+    int expected = WRITER_NONE;
+    pthread_t tid;
+    pthread_attr_t attr;
+    sigset_t all, old;
+    
+    if(!__atomic_compare_exchange_n(&writerState, &expected, WRITER_RUNNING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+        return;
+    }
+    //the signals of the server are handled by its own threads, never by the writer
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&tid, &attr, writerThread, NULL) != 0){
+        __atomic_store_n(&writerState, WRITER_INLINE, __ATOMIC_RELEASE);
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+
+static void *writerThread(void *arg){
+    
+    struct timespec batch = {0, LOGBATCHMS * 1000000L};
+    int word;
+    
+    for( ; ; ){
+        word = __atomic_load_n(&wakeWord, __ATOMIC_SEQ_CST);
+        if(drain() > 0){
+            //under load the records are written in batches, not one write() per record
+            __atomic_store_n(&writerWait, WAIT_BATCH, __ATOMIC_SEQ_CST);
+            syscall(SYS_futex, &wakeWord, FUTEX_WAIT_PRIVATE, word, &batch, NULL, 0);
+        }else{
+            __atomic_store_n(&writerWait, WAIT_IDLE, __ATOMIC_SEQ_CST);
+            //a record published before the flag was set is seen here, the later ones wake the futex
+            if(__atomic_load_n(&ring[head & (LOGRECORDS-1)].seq, __ATOMIC_SEQ_CST) != head+1){
+                syscall(SYS_futex, &wakeWord, FUTEX_WAIT_PRIVATE, word, NULL, NULL, 0);
+            }
+        }
+        __atomic_store_n(&writerWait, WAIT_NONE, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+
+//writes the published records in order, returns how many (one consumer at a time)
+static int drain(void){
+    
+    struct logRecord *r;
+    uint64_t lost;
+    size_t len = 0;
+    int n = 0, expected = 0;
+    
+    if(!__atomic_compare_exchange_n(&consuming, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        return 0;
+    }
+    for( ; ; ){
+        r = &ring[head & (LOGRECORDS-1)];
+        if(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != head+1){
+            break;
+        }
+        if(daemon_proc){
+            err_log(syslogLevels[r->level], "[%d] %.*s", (int)logPid, (int)r->len, r->text);
+        }else{
+            if(len + LOGLINELENGTH + 64 > sizeof(out)){
+                writeOut(out, len);
+                len = 0;
+            }
+            len += formatPrefix(out+len, r);
+            memcpy(out+len, r->text, r->len);
+            len += r->len;
+            out[len++] = '\n';
+        }
+        __atomic_store_n(&r->seq, head+LOGRECORDS, __ATOMIC_RELEASE);
+        __atomic_store_n(&head, head+1, __ATOMIC_RELEASE);
+        n++;
+    }
+    lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    if(lost != droppedReported){
+        if(daemon_proc){
+            err_log(LOG_WARNING, "[%d] %llu log records dropped, the ring was full", (int)logPid, (unsigned long long)(lost - droppedReported));
+        }else{
+            len += snprintf(out+len, sizeof(out)-len, "%s [%d] %llu log records dropped, the ring was full\n",
+                            levelNames[LVL_WARN], (int)logPid, (unsigned long long)(lost - droppedReported));
+        }
+        droppedReported = lost;
+    }
+    if(len > 0){
+        writeOut(out, len);
+    }
+    __atomic_store_n(&consuming, 0, __ATOMIC_RELEASE);
+    return n;
+}
+
+
+//"YYYY-MM-DD hh:mm:ss.uuuuuu LEVEL [pid] " in UTC (localtime_r takes a lock a fork could leave held)
+static size_t formatPrefix(char *buf, const struct logRecord *r){
+    
+    long days = r->ts.tv_sec / 86400, secs = r->ts.tv_sec % 86400;
+    long era, doe, yoe, doy, mp, y, m, d;
+    
+    //civil date from days since 1970-01-01 (H. Hinnant)
+    days += 719468;
+    era = days / 146097;
+    doe = days - era * 146097;
+    yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    y = yoe + era * 400;
+    doy = doe - (365*yoe + yoe/4 - yoe/100);
+    mp = (5*doy + 2) / 153;
+    d = doy - (153*mp + 2)/5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y += (m <= 2);
+    return sprintf(buf, "%04ld-%02ld-%02ld %02ld:%02ld:%02ld.%06ld %s [%d] ", y, m, d, secs / 3600, secs / 60 % 60, secs % 60,
+                   r->ts.tv_nsec / 1000, levelNames[r->level], (int)logPid);
+}
+
+
+static void writeOut(const char *buf, size_t len){
+    
+    ssize_t n;
+    
+    while(len > 0){
+        if((n = write(STDOUT_FILENO, buf, len)) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ 
+ module: log.h
+ 
+ purpose: definitions of functions in log.c
+ 
+ */
+
+
+#ifndef _LOG_H
+
+#define _LOG_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+//levels selectable with --log-level (the names of syslog.h are taken)
+typedef enum {
+    LVL_ERROR,                                      //a request or a process failed
+    LVL_WARN,                                       //something unusual, the server goes on
+    LVL_INFO,                                       //startup steps, connections and commands
+    LVL_DEBUG                                       //details of every transfer
+} logLevel;
+
+#define LOGRECORDS          1024                    //records of the ring of a process, a power of 2
+#define LOGLINELENGTH       224                     //longer messages are truncated
+#define LOGADDRLENGTH       32                      //"255.255.255.255:65535"
+
+extern int logThreshold;                            //records above this level are not built at all
+extern unsigned logSampleRate;                      //one of every n sampled records is kept
+
+//record a message if its level is enabled: the check costs no call
+#define LOG(level, ...) do{ if((int)(level) <= logThreshold) logWrite((level), __VA_ARGS__); }while(0)
+
+//high volume events (one per command, transfer or connection): only one of every logSampleRate is kept
+#define LOG_SAMPLED(level, ...) do{ static unsigned sample_; \
+                                    if((int)(level) <= logThreshold && logSample(&sample_)) logWrite((level), __VA_ARGS__); }while(0)
+
+int logInit(void);
+int logParseLevel(const char *name);
+void logWrite(logLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void logSignalSafe(logLevel level, const char *msg, long value);
+void logDeferWriter(void);
+int logSample(unsigned *counter);
+void logFlush(void);
+char *logFormatAddr(char *buf, const struct sockaddr_in *a);
+
+#endif
@@ -0,0 +1,282 @@
+/*
+ 
+ module: prefork.c
+ 
+ purpose: prefork server engine (--mode=prefork). The master creates one
+          listening socket per worker, all bound to the same port with
+          SO_REUSEPORT so that the kernel shards the incoming connections,
+          then forks the workers once at boot. Nothing is forked on the
+          accept path.
+ 
+          The master keeps every socket open and only supervises: when a
+          worker dies, sigchldHandler() reports it through
+          preforkChildExited() and the master starts a new worker on the
+          same socket, so the connections queued there are not lost.
+          A worker that cannot be forked is retried by a SIGALRM, after
+          a delay doubled at every failure.
+ 
+ */
+
+
+#define _GNU_SOURCE                                 //sched_setaffinity(), CPU_SET
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "./../errlib.h"
+#include "./../sockwrap.h"
+#include "server2.h"
+#include "epoll_engine.h"
+#include "uring_engine.h"
+#include "prefork.h"
+#include "stats.h"
+#include "admission.h"
+#include "log.h"
+
+int preforkWorkers = 0;                             //--workers, 0 means one per online CPU
+int preforkPin = 0;                                 //--pin
+workerMode preforkWorkerMode = WORKER_SEQUENTIAL;   //--worker-mode
+
+struct worker {
+    int passive_socket;                 //SO_REUSEPORT socket owned by the worker
+    volatile pid_t pid;                 //0 when the worker has to be (re)started
+};
+
+#define MINRESPAWNDELAY     1                       //seconds before retrying a failed fork...
+#define MAXRESPAWNDELAY     32                      //...doubled up to this at every failure
+
+static struct worker workers[MAXWORKERS];
+static unsigned int respawnDelay = MINRESPAWNDELAY;
+static volatile sig_atomic_t respawnPending = 0;
+static volatile sig_atomic_t stopRequested = 0;
+static sigset_t inheritedMask;                      //mask of the master before it blocked its own signals
+
+static int startWorker(int index);
+static void retryLater(void);
+static void workerLoop(int index);
+static void pinToCpu(int index);
+static void sigtermHandler(int signo);
+static void sigalrmHandler(int signo);
+
+
+
+void preforkServerLoop(struct sockaddr_in *saddr, int backlog){
+    
+    int i, failed = 0, on = 1;
+    sigset_t chldmask;
+    char addr[LOGADDRLENGTH];
+    
+    if(preforkWorkers == 0){
+        preforkWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if(preforkWorkers <= 0){
+            preforkWorkers = 1;
+        }else if(preforkWorkers > MAXWORKERS){
+            preforkWorkers = MAXWORKERS;
+        }
+    }
+    
+    //creating one listening socket per worker, all bound to the same address
+    for(i=0; i<preforkWorkers; i++){
+        workers[i].passive_socket = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        Setsockopt(workers[i].passive_socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        Bind(workers[i].passive_socket, (struct sockaddr *)saddr, sizeof(*saddr));
+        Listen(workers[i].passive_socket, backlog);
+        workers[i].pid = 0;
+    }
+    LOG(LVL_INFO, "Listening on address: %s with %d SO_REUSEPORT sockets", logFormatAddr(addr, saddr), preforkWorkers);
+    
+    Signal(SIGTERM, sigtermHandler);
+    Signal(SIGINT, sigtermHandler);
+    Signal(SIGALRM, sigalrmHandler);
+    
+    //SIGCHLD is only delivered inside sigsuspend(), so no notification is lost
+    sigemptyset(&chldmask);
+    sigaddset(&chldmask, SIGCHLD);
+    sigaddset(&chldmask, SIGTERM);
+    sigaddset(&chldmask, SIGINT);
+    sigaddset(&chldmask, SIGALRM);
+    sigprocmask(SIG_BLOCK, &chldmask, &inheritedMask);
+    
+    for(i=0; i<preforkWorkers; i++){
+        if(startWorker(i) < 0){
+            failed = 1;
+        }
+    }
+    if(failed){
+        retryLater();
+    }
+    
+    //supervision loop
+    while(!stopRequested){
+        sigsuspend(&inheritedMask);
+        if(respawnPending){
+            respawnPending = 0;
+            failed = 0;
+            for(i=0; i<preforkWorkers; i++){
+                if(workers[i].pid == 0){
+                    LOG(LVL_WARN, "Worker %d not running. Respawning it", i);
+                    if(startWorker(i) < 0){
+                        failed = 1;
+                    }
+                }
+            }
+            if(failed){
+                retryLater();
+            }
+        }
+    }
+    
+    //stopping the workers before exiting
+    alarm(0);
+    for(i=0; i<preforkWorkers; i++){
+        if(workers[i].pid > 0){
+            kill(workers[i].pid, SIGTERM);
+        }
+    }
+    LOG(LVL_INFO, "Stopping %d workers\t\t\t\t\t-> Done", preforkWorkers);
+}
+
+
+//called by the SIGCHLD handler for every child that has been waited for
+void preforkChildExited(pid_t pid){
+    int i;
+    
+    for(i=0; i<preforkWorkers; i++){
+        if(workers[i].pid == pid){
+            workers[i].pid = 0;
+            respawnPending = 1;
+            return;
+        }
+    }
+}
+
+
+//returns -1 if the worker could not be forked
+static int startWorker(int index){
+    pid_t pid;
+    
+    if((pid = fork()) < 0){
+        LOG(LVL_ERROR, "Error while creating worker %d: %s", index, strerror(errno));
+        return -1;
+    }
+    if(pid > 0){
+        workers[index].pid = pid;
+        respawnDelay = MINRESPAWNDELAY;
+        LOG(LVL_INFO, "Worker %d started (process %d)", index, pid);
+        return 0;
+    }
+    
+    //worker process: default signal dispositions for the master only signals
+    Signal(SIGTERM, SIG_DFL);
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGALRM, SIG_DFL);
+    //...and the mask it inherited: SIGHUP stays blocked, it belongs to the reload thread (shaper.c)
+    sigprocmask(SIG_SETMASK, &inheritedMask, NULL);
+    statsAttach();
+    workerLoop(index);
+    exit(0);
+}
+
+
+//some worker could not be forked: the alarm tries again, unless a SIGCHLD comes first
+static void retryLater(void){
+    LOG(LVL_WARN, "Retrying to start the missing workers in %u s", respawnDelay);
+    alarm(respawnDelay);
+    if(respawnDelay < MAXRESPAWNDELAY){
+        respawnDelay *= 2;
+    }
+}
+
+
+static void workerLoop(int index){
+    
+    int i, conn_socket, ticket;
+    int passive_socket = workers[index].passive_socket;
+    struct sockaddr_in caddr;
+    socklen_t addrlen;
+    char addr[LOGADDRLENGTH];
+    
+    //the sockets of the other workers belong to them
+    for(i=0; i<preforkWorkers; i++){
+        if(i != index){
+            Close(workers[i].passive_socket);
+        }
+    }
+    if(preforkPin){
+        pinToCpu(index);
+    }
+    
+    if(preforkWorkerMode == WORKER_EPOLL){
+        epollServerLoop(passive_socket);
+        return;
+    }
+    if(preforkWorkerMode == WORKER_URING){
+        uringServerLoop(passive_socket);
+        return;
+    }
+    
+    //sequential worker: the connections of this socket are served one after the other
+    for( ; ; ){
+        addrlen = sizeof(struct sockaddr_in);
+        if((conn_socket = accept(passive_socket, (struct sockaddr *)&caddr, &addrlen)) < 0){
+            //no descriptor or memory left: accept() would fail again at once
+            if(admissionAcceptFailed(errno)){
+                poll(NULL, 0, ADMITRETRYMS);
+            }
+            continue;
+        }
+        admissionAccepted();
+        admissionSampleQueue(passive_socket);
+        if((ticket = admissionEnter(&caddr)) < 0){
+            admissionRefuse(conn_socket, ticket);
+            continue;
+        }
+        LOG_SAMPLED(LVL_INFO, "Accepted connection from %s", logFormatAddr(addr, &caddr));
+        //held by the worker: the master gives it back if the worker dies while serving
+        admissionHold(getpid(), ticket);
+        serverServiceFunction(conn_socket, &caddr);
+        admissionRelease(getpid());
+    }
+}
+
+
+//bind the worker to the index-th CPU it is allowed to run on
+static void pinToCpu(int index){
+    cpu_set_t allowed, target;
+    int cpu, count, n;
+    
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || (count = CPU_COUNT(&allowed)) == 0){
+        return;
+    }
+    n = index % count;
+    for(cpu=0; cpu<CPU_SETSIZE; cpu++){
+        if(CPU_ISSET(cpu, &allowed) && n-- == 0){
+            CPU_ZERO(&target);
+            CPU_SET(cpu, &target);
+            if(sched_setaffinity(0, sizeof(target), &target) != 0){
+                LOG(LVL_WARN, "Pinning to CPU %d failed: %s", cpu, strerror(errno));
+            }else{
+                LOG(LVL_INFO, "Worker %d pinned to CPU %d", index, cpu);
+            }
+            return;
+        }
+    }
+}
+
+
+static void sigtermHandler(int signo){
+    stopRequested = 1;
+}
+
+
+//a worker could not be forked: the supervision loop tries again
+static void sigalrmHandler(int signo){
+    respawnPending = 1;
+}
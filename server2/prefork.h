@@ -0,0 +1,33 @@
+/*
+ 
+ module: prefork.h
+ 
+ purpose: definitions of functions in prefork.c
+ 
+ */
+
+
+#ifndef _PREFORK_H
+
+#define _PREFORK_H
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#define MAXWORKERS          256                     //maximum number of prefork workers
+
+//how every worker serves the connections of its socket
+typedef enum {
+    WORKER_SEQUENTIAL,                              //accept + serverServiceFunction(), one at a time
+    WORKER_EPOLL,                                   //private epoll event loop
+    WORKER_URING                                    //private io_uring event loop
+} workerMode;
+
+extern int preforkWorkers;
+extern int preforkPin;
+extern workerMode preforkWorkerMode;
+
+void preforkServerLoop(struct sockaddr_in *saddr, int backlog);
+void preforkChildExited(pid_t pid);
+
+#endif
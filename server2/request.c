@@ -0,0 +1,397 @@
+/*
+ 
+ module: request.c
+ 
+ purpose: parsing of the command lines, building of the reply headers
+          and opening of the requested files, shared by every server engine
+ 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "server2.h"
+#include "request.h"
+#include "filecache.h"
+#include "stats.h"
+#include "dirindex.h"
+
+static int openBatchFile(const char *filename, struct requestedFile *rf);
+
+
+//split a complete command line (CR LF included), the line is modified in place
+requestType parseRequest(char *line, struct request *req){
+    
+    size_t len = strlen(line);
+    int n;
+    
+    req->type = REQ_INVALID;
+    req->filename = NULL;
+    if(strncmp(line, QUIT_CMD, sizeof(QUIT_CMD)-1)==0){
+        req->type = REQ_QUIT;
+        return req->type;
+    }
+    if(len < 2 || line[len-2] != '\r' || line[len-1] != '\n'){
+        return req->type;
+    }
+    //remove carriage return and line feed character
+    line[len-2] = '\0';
+    
+    if(strncmp(line, RGET_CMDNAME, sizeof(RGET_CMDNAME)-1)==0){
+        //numbers first, so that the name can contain any character
+        n = 0;
+        if(sscanf(line+(sizeof(RGET_CMDNAME)-1), "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu32 " %n",
+                  &req->offset, &req->length, &req->ifMtime, &req->ifMtimeNsec, &n) == 4 && n > 0){
+            req->type = REQ_RGET;
+            req->filename = line+(sizeof(RGET_CMDNAME)-1)+n;
+        }
+    }else if(strncmp(line, IFMOD_CMDNAME, sizeof(IFMOD_CMDNAME)-1)==0){
+        n = 0;
+        if(sscanf(line+(sizeof(IFMOD_CMDNAME)-1), "%" SCNu64 " %" SCNu64 " %" SCNu32 " %n",
+                  &req->ifSize, &req->ifMtime, &req->ifMtimeNsec, &n) == 3 && n > 0){
+            req->type = REQ_IFMOD;
+            req->filename = line+(sizeof(IFMOD_CMDNAME)-1)+n;
+        }
+    }else if(strncmp(line, DELTA_CMDNAME, sizeof(DELTA_CMDNAME)-1)==0){
+        n = 0;
+        if(sscanf(line+(sizeof(DELTA_CMDNAME)-1), "%" SCNu64 " %" SCNu64 " %" SCNu32 " %" SCNu32 " %" SCNu32 " %d %n",
+                  &req->ifSize, &req->ifMtime, &req->ifMtimeNsec, &req->blockSize, &req->blockCount, &req->inPlace, &n) == 6 && n > 0){
+            req->type = REQ_DELTA;
+            req->filename = line+(sizeof(DELTA_CMDNAME)-1)+n;
+        }
+    }else if(strncmp(line, GET64_CMDNAME, sizeof(GET64_CMDNAME)-1)==0){
+        req->type = REQ_GET64;
+        req->filename = line+(sizeof(GET64_CMDNAME)-1);
+    }else if(strncmp(line, FGET_CMDNAME, sizeof(FGET_CMDNAME)-1)==0){
+        req->type = REQ_FGET;
+        req->filename = line+(sizeof(FGET_CMDNAME)-1);
+    }else if(strncmp(line, MGET_CMDNAME, sizeof(MGET_CMDNAME)-1)==0){
+        //the names are split by batchStart()
+        req->type = REQ_MGET;
+        req->filename = line+(sizeof(MGET_CMDNAME)-1);
+    }else if(strcmp(line, STATS_CMDNAME)==0){
+        req->type = REQ_STATS;
+    }else if(strcmp(line, LIST_CMDNAME)==0){
+        req->type = REQ_LIST;
+    }else if(strncmp(line, GET_CMD, sizeof(GET_CMD)-1)==0){
+        req->type = REQ_GET;
+        req->filename = line+(sizeof(GET_CMD)-1);
+    }
+    return req->type;
+}
+
+
+//the 32 bit fields of GET cannot describe files of 4 GB or more
+int replyFitsRequest(const struct request *req, const struct stat *st){
+    return req->type != REQ_GET || (uint64_t)st->st_size <= UINT32_MAX;
+}
+
+
+//bytes of the file to send: the whole file, the range of a RGET or nothing for an unchanged IFMOD (or DELTA). Returns -1 for an invalid range
+int resolveRange(struct request *req, const struct stat *st){
+    
+    req->start = 0;
+    req->end = st->st_size;
+    req->notModified = 0;
+    if(req->type == REQ_IFMOD || req->type == REQ_DELTA){
+        //same size and timestamp as the copy of the client: no body at all
+        if(req->ifSize == (uint64_t)st->st_size && req->ifMtime == (uint64_t)st->st_mtim.tv_sec
+           && req->ifMtimeNsec == (uint32_t)st->st_mtim.tv_nsec){
+            req->notModified = 1;
+            req->end = 0;
+            statsAdd(STAT_NOT_MODIFIED, 1);
+        }
+        return 0;
+    }
+    if(req->type != REQ_RGET){
+        return 0;
+    }
+    //the file changed since the client got its partial copy: the whole file is sent
+    if(req->ifMtime != 0 && (req->ifMtime != (uint64_t)st->st_mtim.tv_sec || req->ifMtimeNsec != (uint32_t)st->st_mtim.tv_nsec)){
+        return 0;
+    }
+    if(req->offset > (uint64_t)st->st_size){
+        return -1;
+    }
+    req->start = req->offset;
+    if(req->length != 0 && req->length < (uint64_t)st->st_size - req->offset){
+        req->end = req->offset + req->length;
+    }
+    return 0;
+}
+
+
+//"+OK\r\n" followed by size and timestamp in the layout of the request (and the range of a RGET),
+//or "+NM\r\n" alone for an unchanged IFMOD or DELTA. Returns its length
+size_t buildReplyHeader(char *header, const struct request *req, const struct stat *st){
+    
+    struct fileInfo info;
+    size_t len;
+    
+    if(req->notModified){
+        memcpy(header, NM_MSG, sizeof(NM_MSG)-1);
+        return sizeof(NM_MSG)-1;
+    }
+    info.size = st->st_size;
+    info.mtime = st->st_mtim.tv_sec;
+    info.mtimensec = st->st_mtim.tv_nsec;
+    memcpy(header, OK_MSG, sizeof(OK_MSG)-1);
+    len = sizeof(OK_MSG)-1 + encodeFileInfo(header+sizeof(OK_MSG)-1, &info, req->type != REQ_GET);
+    if(req->type == REQ_RGET){
+        len += encodeRange(header+len, req->start, req->end - req->start);
+    }
+    return len;
+}
+
+
+//open the requested file, or find it in the file cache. Returns 0, OPEN_FAILED or STAT_FAILED
+int openRequestedFile(const char *filename, struct requestedFile *rf){
+    
+    rf->fd = -1;
+    rf->cached = NULL;
+    rf->cacheHandle = -1;
+    rf->generated = NULL;
+    
+    //the directory index knows the files: a missing one is refused without a path lookup (the index
+    //only says so when it has every change of the directory, a file just created is opened)
+    if(dirIndexLookup(filename) == DIRINDEX_MISSING){
+        return OPEN_FAILED;
+    }
+    
+    //cache hit: a stat() is enough, the file is not even opened
+    if(fileCacheEnabled()){
+        if(stat(filename, &rf->st) != 0){
+            return OPEN_FAILED;
+        }
+        if(S_ISREG(rf->st.st_mode) && (rf->cached = fileCacheLookup(filename, &rf->st, &rf->cacheHandle)) != NULL){
+            return 0;
+        }
+    }
+    
+    if((rf->fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0){
+        return OPEN_FAILED;
+    }
+    if(fstat(rf->fd, &rf->st) != 0){
+        close(rf->fd);
+        rf->fd = -1;
+        return STAT_FAILED;
+    }
+    //cache miss: the file is loaded, if it is small enough and there is room
+    if(fileCacheEnabled() && S_ISREG(rf->st.st_mode)){
+        rf->cached = fileCacheInsert(filename, rf->fd, &rf->st, &rf->cacheHandle);
+    }
+    return 0;
+}
+
+
+void closeRequestedFile(struct requestedFile *rf){
+    if(rf->fd >= 0){
+        close(rf->fd);
+        rf->fd = -1;
+    }
+    if(rf->generated != NULL){
+        free(rf->generated);
+        rf->generated = NULL;
+        rf->cached = NULL;
+    }else if(rf->cached != NULL){
+        fileCacheRelease(rf->cacheHandle);
+        rf->cached = NULL;
+        rf->cacheHandle = -1;
+    }
+}
+
+
+//the reply of STATS, sent from memory like a cached file of st.st_size bytes. Returns -1 without memory
+int openStatsReply(struct requestedFile *rf){
+    
+    memset(rf, 0, sizeof(*rf));
+    rf->fd = -1;
+    rf->cacheHandle = -1;
+    if((rf->generated = malloc(STATSMAXTEXT)) == NULL){
+        return -1;
+    }
+    rf->cached = rf->generated;
+    rf->st.st_size = statsFormat(rf->generated, STATSMAXTEXT);
+    statsAdd(STAT_STATS, 1);
+    return 0;
+}
+
+
+//"+OK\r\n" followed by the length of the STATS text
+size_t buildStatsHeader(char *header, const struct requestedFile *rf){
+    
+    uint32_t len = htonl((uint32_t)rf->st.st_size);
+    
+    memcpy(header, OK_MSG, sizeof(OK_MSG)-1);
+    memcpy(header+sizeof(OK_MSG)-1, &len, sizeof(len));
+    return sizeof(OK_MSG)-1 + sizeof(len);
+}
+
+
+//the reply of LIST, a copy of the listing of the directory index. Returns -1 without index or memory
+int openListReply(struct requestedFile *rf){
+    
+    size_t len;
+    
+    memset(rf, 0, sizeof(*rf));
+    rf->fd = -1;
+    rf->cacheHandle = -1;
+    if((rf->generated = dirIndexList(&len)) == NULL){
+        return -1;
+    }
+    rf->cached = rf->generated;
+    rf->st.st_size = len;
+    statsAdd(STAT_LISTS, 1);
+    return 0;
+}
+
+
+//"+OK\r\n" followed by the 64 bit length of the listing
+size_t buildListHeader(char *header, const struct requestedFile *rf){
+    
+    uint64_t len = hton64((uint64_t)rf->st.st_size);
+    
+    memcpy(header, OK_MSG, sizeof(OK_MSG)-1);
+    memcpy(header+sizeof(OK_MSG)-1, &len, sizeof(len));
+    return sizeof(OK_MSG)-1 + sizeof(len);
+}
+
+
+//copy the names of a MGET (the request points inside a line about to be reused). Returns -1 for an empty list or without memory
+int batchStart(struct batch *b, const char *names){
+    
+    char *p;
+    
+    b->aheadName = NULL;
+    b->left = 0;
+    if(names[0] == '\0' || (b->names = strdup(names)) == NULL){
+        b->names = NULL;
+        return -1;
+    }
+    b->next = b->names;
+    b->end = b->names + strlen(b->names);
+    b->left = 1;
+    for(p=b->names; (p = strchr(p, MGET_SEPARATOR)) != NULL; p++){
+        *p = '\0';
+        b->left++;
+    }
+    return 0;
+}
+
+
+//name of the next record, NULL when all of them have been served
+const char *batchNextName(struct batch *b){
+    
+    const char *name = b->next;
+    
+    if(b->left == 0){
+        return NULL;
+    }
+    b->left--;
+    b->next += strlen(name) + 1;
+    return name;
+}
+
+
+//open a file of the batch (already done if it was the next one), then the file after it,
+//whose first bytes are read ahead while this one is sent. Returns 0, OPEN_FAILED, STAT_FAILED or NOT_SENDABLE
+int batchOpen(struct batch *b, const char *name, struct requestedFile *rf){
+    
+    int n;
+    
+    if(b->aheadName == name){
+        *rf = b->ahead;
+        n = b->aheadResult;
+        b->aheadName = NULL;
+    }else{
+        n = openBatchFile(name, rf);
+    }
+    if(n == 0){
+        statsFileHit(name);
+    }else{
+        statsAdd(n == OPEN_FAILED ? STAT_ERR_OPEN : (n == STAT_FAILED ? STAT_ERR_STAT : STAT_ERR_FILENAME), 1);
+    }
+    
+    if(b->left > 0 && b->aheadName == NULL){
+        b->aheadName = b->next;
+        b->aheadResult = openBatchFile(b->next, &b->ahead);
+        if(b->aheadResult == 0 && b->ahead.cached == NULL){
+            posix_fadvise(b->ahead.fd, 0, BATCHPREFETCH, POSIX_FADV_WILLNEED);
+        }
+    }
+    return n;
+}
+
+
+//"+OK\r\n" followed by the number of records of the batch
+size_t buildBatchHeader(char *header, const struct batch *b){
+    
+    uint32_t count = htonl(b->left);
+    
+    memcpy(header, OK_MSG, sizeof(OK_MSG)-1);
+    memcpy(header+sizeof(OK_MSG)-1, &count, sizeof(count));
+    return sizeof(OK_MSG)-1 + sizeof(count);
+}
+
+
+//record of a file of the batch, with the GET64 fields if it is sent (st not NULL). Returns its length
+size_t buildRecordHeader(char *header, const char *name, const struct stat *st){
+    
+    struct fileInfo info;
+    
+    if(st == NULL){
+        return encodeRecordHeader(header, name, NULL);
+    }
+    info.size = st->st_size;
+    info.mtime = st->st_mtim.tv_sec;
+    info.mtimensec = st->st_mtim.tv_nsec;
+    return encodeRecordHeader(header, name, &info);
+}
+
+
+//release the file opened in advance and the names, also for a batch interrupted by an error
+void batchEnd(struct batch *b){
+    if(b->aheadName != NULL && b->aheadResult == 0){
+        closeRequestedFile(&b->ahead);
+    }
+    b->aheadName = NULL;
+    free(b->names);
+    b->names = NULL;
+}
+
+
+//like openRequestedFile(), but only regular files with a valid name: an error here is a '-' record, not the end of the connection
+static int openBatchFile(const char *filename, struct requestedFile *rf){
+    
+    int n;
+    
+    if(!isValidFilename(filename)){
+        rf->fd = -1;
+        rf->cached = NULL;
+        rf->cacheHandle = -1;
+        rf->generated = NULL;
+        return NOT_SENDABLE;
+    }
+    if((n = openRequestedFile(filename, rf)) == 0 && !S_ISREG(rf->st.st_mode)){
+        closeRequestedFile(rf);
+        return NOT_SENDABLE;
+    }
+    return n;
+}
+
+
+//body of the reply: from the cache if the file is there, from the descriptor otherwise
+void requestTransferInit(struct fileTransfer *t, const struct requestedFile *rf, off_t offset, off_t end){
+    if(rf->cached != NULL){
+        transferInitMemory(t, rf->cached, offset, end);
+    }else{
+        transferInit(t, rf->fd, offset, end);
+    }
+}
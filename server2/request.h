@@ -0,0 +1,92 @@
+/*
+ 
+ module: request.h
+ 
+ purpose: definitions of functions in request.c
+ 
+ */
+
+
+#ifndef _REQUEST_H
+
+#define _REQUEST_H
+
+#include <sys/stat.h>
+#include "./../protocol.h"
+#include "transfer.h"
+#include "server2.h"
+
+//longest reply header: a MGET record with the longest name a command line can carry
+//(longer than "+OK\r\n" followed by the GET64 fields and the range)
+#define MAXHEADERLENGTH     (RECORDFIXEDLENGTH+RCVBUFFERLENGTH+GET64FIELDSLENGTH)
+#define BATCHPREFETCH       (256*1024)              //bytes of the next file of a MGET read ahead
+
+typedef enum {
+    REQ_INVALID,                                    //unknown or malformed command
+    REQ_QUIT,                                       //QUIT
+    REQ_GET,                                        //GET name, 32 bit reply fields
+    REQ_GET64,                                      //GET64 name, 64 bit reply fields
+    REQ_FGET,                                       //FGET name, GET64 reply with the descriptor of the file (AF_UNIX)
+    REQ_RGET,                                       //RGET offset length mtime nsec name
+    REQ_IFMOD,                                      //IFMOD size mtime nsec name, GET64 if modified
+    REQ_MGET,                                       //MGET name/name/..., a record per file
+    REQ_STATS,                                      //STATS, counters of the server
+    REQ_LIST,                                       //LIST, files of the directory index
+    REQ_DELTA                                       //DELTA size mtime nsec blocksize count inplace name, then the signatures
+} requestType;
+
+struct request {
+    requestType type;
+    char *filename;                     //points inside the parsed line
+    uint64_t offset, length;            //RGET: requested range, length 0 up to the end
+    uint64_t ifMtime;                   //RGET: the range is valid for this version only
+    uint32_t ifMtimeNsec;               //IFMOD: with ifSize, the version of the client copy
+    uint64_t ifSize;
+    uint32_t blockSize, blockCount;     //DELTA: signatures following the command line
+    int inPlace;                        //DELTA: blocks copied only from the offset they are written to or after
+    int notModified;                    //IFMOD, DELTA: the client copy is up to date, set by resolveRange()
+    off_t start, end;                   //bytes of the file to send, set by resolveRange()
+};
+
+//file opened to answer a request: a descriptor, or its content in the file cache
+struct requestedFile {
+    int fd;                             //-1 when served from the cache
+    struct stat st;
+    const char *cached;                 //content in the file cache, NULL if not cached
+    int cacheHandle;
+    char *generated;                    //reply built in memory (STATS, LIST), also pointed by cached
+};
+
+//files of a MGET being served: the next one is opened while the current one is sent
+struct batch {
+    char *names;                        //copy of the names, NULL when no MGET is in progress
+    char *next, *end;                   //next name to serve, end of the names
+    uint32_t left;                      //records not yet started
+    const char *aheadName;              //file opened in advance, NULL if none
+    int aheadResult;                    //its openRequestedFile() result
+    struct requestedFile ahead;
+};
+
+#define OPEN_FAILED         -1
+#define STAT_FAILED         -2
+#define NOT_SENDABLE        -3                      //invalid name or not a regular file (MGET)
+
+requestType parseRequest(char *line, struct request *req);
+int replyFitsRequest(const struct request *req, const struct stat *st);
+int resolveRange(struct request *req, const struct stat *st);
+size_t buildReplyHeader(char *header, const struct request *req, const struct stat *st);
+int openRequestedFile(const char *filename, struct requestedFile *rf);
+int openStatsReply(struct requestedFile *rf);
+size_t buildStatsHeader(char *header, const struct requestedFile *rf);
+int openListReply(struct requestedFile *rf);
+size_t buildListHeader(char *header, const struct requestedFile *rf);
+void closeRequestedFile(struct requestedFile *rf);
+int batchStart(struct batch *b, const char *names);
+const char *batchNextName(struct batch *b);
+int batchOpen(struct batch *b, const char *name, struct requestedFile *rf);
+size_t buildBatchHeader(char *header, const struct batch *b);
+size_t buildRecordHeader(char *header, const char *name, const struct stat *st);
+void batchEnd(struct batch *b);
+void requestTransferInit(struct fileTransfer *t, const struct requestedFile *rf, off_t offset, off_t end);
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ 
+ module: server2.h
+ 
+ purpose: definitions shared by the server2 modules (protocol strings,
+          buffer sizes and the functions every server engine relies on)
+ 
+ */
+
+
+#ifndef _SERVER2_H
+
+#define _SERVER2_H
+
+#include <netinet/in.h>
+
+#define RCVBUFFERLENGTH     4098                    //receive buffer length
+#define SNDBUFFERLENGTH     4097                    //send buffer length
+#define MAXWAITINGTIME      60                      //default --idle-timeout: waiting time for a new command
+#define HEADERTIMEOUT       10                      //default --header-timeout: time to complete a command line
+#define TRANSFERTIMEOUT     0                       //default --transfer-timeout: time to send a whole reply, 0 = none
+
+static const char GET_CMD[]     =   "GET ";         //Get message string
+static const char QUIT_CMD[]    =   "QUIT\r\n";     //Quit message string
+static const char ERR_MSG[]     =   "-ERR\r\n";     //Err message string
+static const char OK_MSG[]      =   "+OK\r\n";      //Ok message string
+static const char NM_MSG[]      =   "+NM\r\n";      //Not modified message string (IFMOD)
+static const char BUSY_MSG[]    =   "-ERR busy\r\n";  //Refused connection string (connection limits)
+
+//server engines selectable with --mode
+typedef enum {
+    MODE_FORK,                                      //one child process per connection
+    MODE_EPOLL,                                     //single process, edge-triggered epoll loop
+    MODE_PREFORK,                                   //workers started at boot, SO_REUSEPORT sockets
+    MODE_URING,                                     //single process, io_uring submission queues
+    MODE_THREADS                                    //network threads, disk I/O in a pool of threads
+} serverMode;
+
+//deadline armed for a connection by the event driven engines
+typedef enum {
+    DEADLINE_NONE,
+    DEADLINE_IDLE,                                  //no command (--idle-timeout)
+    DEADLINE_HEADER,                                //command line not completed (--header-timeout)
+    DEADLINE_TRANSFER                               //reply not completely sent (--transfer-timeout)
+} deadlineKind;
+
+extern char *prog_name;
+extern unsigned idleTimeout, headerTimeout, transferTimeout;       //seconds, 0 disables the deadline
+
+int isValidFilename(const char *filename);
+long readPidMax(void);
+void printCacheStats(void);
+void serverServiceFunction(int socketNumber, const struct sockaddr_in *caddr);
+unsigned deadlineSeconds(deadlineKind kind);
+const char *deadlineMessage(deadlineKind kind);
+
+#endif
@@ -11,11 +11,37 @@
  
  First, after a check on the command line argument, the server port number is read from command line and is converted in a network byte order through the htons() function. The socket is then created through the Socket() function (with parameters AF_INET as family, SOCK_STREAM as type and IPPROTO_TCP as protocol). The socket just created is binded to any local IP address by setting s_addr to INADDR_ANY. The Bind() function is used to do this operation. Now the server listen to connection requests from clients by the Listen() function. The signal handler for any SIGPIPE signal (e.g. when clients lose connection before the end of the process) is initialized. The signal handler for SIGCHLD signal (to avoid zombie process) is initialized too. An infinite loop is created to accept connections (Accept() function) and to give the handle (through the serverServiceFunction() funtion) of those connections to different child processes (created each time through the fork() function). After given tasks to the child, the parent closes the connected socket and loop again.
  
- The serverServiceFunction() function, that receives as parameter the connected socket, enter an infinite loop where it reads and handles all the requests coming from client. A select structure is initialize to handle possible timeout. The readline_unbuffered() function is used to read client commands. If the number of bytes read are equal to zero the connection is closed by party on socket and the child process returns; if the number of bytes is negative something goes wrong, an error is printed and child process returns; if what is read is equal to the QUIT_CMD the connection will be closed and the child process returns; if what is read is equal to the GET_CMD the serverServiceFunction() checks if the file requested is a valid file (checks if it contains some invalid characters, e.g. if it a directory and not a file name, checks if it is in the current directory). If it is, it proceeds by opening the file and getting its statistics (file size and timestamp) whit the stat() function and a st stat structure. The two statistics information are converted in a network byte order and sent to the client (an OK_MSG with attached file size and timestamp) through the sendn() function. After that, the bytes of the file, previosly opened, are sent to the client (with the sendn() function ) BUFFERLENGTH per BUFFERLENGTH bytes until the EOF is reached. Every time, the file pointer is switched through the fseek() function. Each time a function fails, there is an error or an invalid command is received, an ERR_MSG is sent to the client, the connection is closed and the child process return. Each process identify himself by printing its pid every time it does a print in the standard output.
+ The serverServiceFunction() function, that receives as parameter the connected socket, enter an infinite loop where it reads and handles all the requests coming from client. The next command is waited for with poll() (no FD_SETSIZE limit on the descriptor number) for at most --idle-timeout seconds (60 by default). The rbuf_readline() function (sockwrap.c) is used to read client commands: it reads whatever the kernel has in one system call and keeps the bytes after the newline in the per-connection Rbuf, so commands sent back to back are not lost and no poll() is needed when one is already buffered. SO_RCVTIMEO bounds every read of a command line to --header-timeout seconds, and a reply must be completely sent in --transfer-timeout seconds (no limit by default; SO_SNDTIMEO bounds a stalled send). If the number of bytes read are equal to zero the connection is closed by party on socket and the child process returns; if the number of bytes is negative something goes wrong, an error is printed and child process returns; if what is read is equal to the QUIT_CMD the connection will be closed and the child process returns; if what is read is equal to the GET_CMD the serverServiceFunction() checks if the file requested is a valid file (checks if it contains some invalid characters, e.g. if it a directory and not a file name, checks if it is in the current directory). If it is, it proceeds by opening the file and getting its statistics (file size and timestamp) whit the stat() function and a st stat structure. The two statistics information are converted in a network byte order and sent to the client (an OK_MSG with attached file size and timestamp) through the sendn() function. The GET64 command (protocol.h) asks for the same file with a 64 bit size, a 64 bit timestamp and its nanoseconds, so files of 4 GB or more can be transferred; the plain GET of the old clients is still served, but it is refused with an ERR_MSG for a file whose size does not fit in 32 bits instead of sending a truncated size. The RGET command (protocol.h) carries an offset, a length and the timestamp of the partial copy of the client: resolveRange() (request.c) keeps the range only if the file still has that timestamp (otherwise the whole file is sent again), an offset beyond the end of the file is refused with an ERR_MSG, and the GET64 reply is followed by the offset and the length of the bytes actually sent. The IFMOD command (protocol.h) carries the size and the timestamp of the copy of the client: if the file still has both, resolveRange() leaves nothing to send and the reply is the NM_MSG ("+NM\r\n") alone, otherwise the GET64 reply and the whole file are sent. The MGET command (protocol.h) carries a list of names separated by '/': the serveBatch() function answers with an OK_MSG and the number of records, then one record per file in the order of the list (a status, the name and, for a file that can be sent, its size, timestamp and bytes). While a file is being sent, batchOpen() (request.c) has already opened and stated the next one of the list and asked the kernel with posix_fadvise() to read its first bytes, so thousands of small files are not served one round trip and one open at a time; a missing file, or one that is not a regular file, only gets a '-' record and the connection goes on. The event driven engines walk the records in the same way, and in --mode=threads the pool opens them. After that, the bytes of the file, previosly opened, are sent to the client through the transferSend() function (transfer.c): the body goes from the file descriptor to the socket with sendfile(), without being copied in user space, falling back to splice() through a pipe and then to a pread()/send() copy loop if the file does not support them. Each step moves at most --chunk bytes (1 MB by default), and --send forces one of the three methods. The reply header is not sent on its own: transferFrame() hands it to the transfer, which writes it in the same system call as the first bytes of the body (sendmsg() of two iovecs, or MSG_MORE right before sendfile() and splice()), and every connected socket has TCP_NODELAY, so the reply of a small file is a single segment and no reply waits for a delayed ACK. Each time a function fails, there is an error or an invalid command is received, an ERR_MSG is sent to the client, the connection is closed and the child process return. Each process identify himself by printing its pid every time it does a print in the standard output.
  
- The sigchldHandler() function, the signal handler for SIGCHLD signal, perform a loop of non blocking waitpid() using the WNOHANG constant (specifies that waitpid should return immediately instead of waiting, if there is no child process ready to be noticed, if the child is running the caller does not block it). A loop is performed to handle more than one SIGCHLD signal from dying children process.
+ The server can also be started with the --mode=epoll option (default is --mode=fork). In that case no child process is created: the epollServerLoop() function (epoll_engine.c) serves every connection from a single process through an edge-triggered epoll loop, where each non blocking connection moves through a small state machine (read command, send header, send body). The deadlines of the connections (idle, command header, whole transfer) are kept in a hierarchical timer wheel (timerwheel.c): arming and cancelling one is a list operation, and the loop wakes up only at the ticks of the wheel, whatever the number of connections. The fork mode is kept to compare the two engines.
  
- The sigpipeHandler() function, the signal handler for SIGPIPE signal, print an error message.
+ The --mode=uring option selects the uringServerLoop() function (uring_engine.c): a single process drives accept, recv of the commands, read of the files and send of the replies through an io_uring submission queue, so a batch of operations costs one system call. If the kernel does not support io_uring the epoll engine is used instead.
+ 
+ With --mode=prefork no process is created on the accept path: the preforkServerLoop() function (prefork.c) starts --workers processes at boot (default: one per online CPU), each one with its own listening socket bound to the same port with SO_REUSEPORT, so the kernel spreads the incoming connections across them. The sockets are created by the master, so a crashed worker is replaced (the sigchldHandler() notifies the master) without losing its queue of pending connections. Every worker serves its connections sequentially with serverServiceFunction() or, with --worker-mode=epoll, through its own epoll loop; --pin binds each worker to one CPU.
+ 
+ With --mode=threads the threadServerLoop() function (thread_engine.c) serves the connections from a single process with --threads network threads (default: one per online CPU), each one with its own epoll loop and timer wheel; the passive socket is registered in every loop with EPOLLEXCLUSIVE, so a connection wakes one thread only and stays with it. The network threads never wait for the disk: opening a file and reading its chunks are jobs of a pool of --disk-threads threads (diskpool.c, 4 by default). Every pool thread has a bounded queue and an idle one steals the jobs of the others; a finished job goes back to its network thread through a lock-free completion queue and an eventfd, written only if the thread is sleeping. The body is read into two buffers, one filled by the pool while the other is sent, so a slow disk delays only the transfers reading from it, and the cached files are sent from memory.
+ 
+ With --cache=bytes the hot files are kept in memory (filecache.c): the cache is a shared mapping created before any fork, so every child and worker serves from it the files read once by any of them. The files larger than --cache-max-file (default: an eighth of the cache) are not cached, the least recently used ones are evicted with a CLOCK policy when the budget is reached, and an entry is dropped as soon as the size or the modification time of the file changes. The hit ratio, evictions and invalidations are printed after every cached transfer.
+ 
+ With --index-max=files (1048576 by default, 0 disables it) the served directory is indexed at startup (dirindex.c): name, size and timestamp of every regular file are published in a shared mapping created before any fork, and a thread of the main process applies the inotify events of the directory, rewriting the index once a burst of events has settled. The LIST command (protocol.h) is answered with a copy of the listing already encoded in the index, after an OK_MSG and a 64 bit length, so listing a large directory never costs a readdir() and a stat() per file. The GET path asks the index first, so a missing file is refused without any system call; the size and timestamp of a file being sent still come from its descriptor, because inotify reports a change a few milliseconds late and the validators of IFMOD and RGET must be exact. Symbolic links, and a directory with more files than --index-max, are left to the file system.
+ 
+ The DELTA command (protocol.h) carries the size and timestamp of the copy of the client, followed by the signatures of its blocks (weak rolling checksum and XXH64 strong hash, delta.c, the weak one computed 16 bytes at a time with SSE2). The serveDelta() function reads them all (also when the reply is going to be the NM_MSG of an unchanged file), then deltaSend() (deltamatch.c) rolls a window of a block over the new version, from the file cache or read with pread() (a file truncated meanwhile closes the connection instead of raising SIGBUS): where a block of the client matches, a copy of it is sent instead of its bytes, and only what no block matches goes as literals. With the inplace flag a block is copied only to its own offset or before it, so the client can rewrite its copy in place; the digest at the end lets the client check the rebuilt file. DELTA is served by the fork and the sequential prefork workers only: the scan of a whole file would stall an event loop, so the other engines refuse it and the client falls back to GET64.
+ 
+ With --rate-conn, --rate-ip and --rate-total (bytes per second) the bodies are shaped (shaper.c): every connection and every client address, keyed by the address returned by accept(), has a token bucket, and the total rate is shared among the transfers in progress in proportion to their weights (weighted fair share, the weights of the addresses come from the shaping file). Before every step the engines ask shaperGrant() how much they may send: a step is about 50 ms of the rate, so the transfers are interleaved in small quanta, and a transfer whose bucket is empty waits, sleeping in the process engines and on a timer of the wheel in the event driven ones, without holding back the other connections. --pacing also hands the rate of the connection to the kernel (SO_MAX_PACING_RATE), so the packets of a step are spread instead of sent in a burst. The limits and the buckets of the addresses live in a shared mapping created before any fork; with --shaping-file they are read from a file ("conn-rate n", "ip-rate n", "total-rate n", "pacing on|off", "weight address[/bits] n") that a thread of the main process reads again on SIGHUP, so they change without a restart. The STATS counter server2_throttled_total reports the steps delayed.
+ 
+ With --max-conns and --max-per-ip (0, the default, means no limit) the connections served at the same time are bounded, in total and per client address (admission.c). A connection over a limit is answered with BUSY_MSG ("-ERR busy") and closed as soon as it is accepted: no process is forked and nothing is allocated for it, so a connection storm is refused at the cost of an accept() and a send() per connection. The counts live in a shared mapping created before any fork and are changed with atomic operations only; a child of the fork engine holds the ticket of its connection until the sigchldHandler() gives it back, whatever the way it terminates. The fork engine waits for the passive socket with poll() and drains up to ADMITBATCH connections per wake up from the non blocking socket, the epoll engine does the same between the events of the ready connections. At every wake up the accept queue is sampled with TCP_INFO: its length, the longest one seen and its limit (--backlog, 1024 by default) are reported by STATS, with the connections refused in server2_connections_refused_total.
+ 
+ With --tls=user or --tls=ktls (and --tls-cert, --tls-key, PEM files; the key may be in the certificate file) every connection starts with a TLS handshake, done by OpenSSL in tls_start() (tlswrap.c, the server is built with -DHAVE_OPENSSL -lssl -lcrypto). With --tls=ktls only TLS 1.2 with AES-GCM is offered and OpenSSL hands the keys of both directions to the kernel (the "tls" upper layer protocol of the socket): the session is then dropped and the connected socket is served as before, sendfile() included, the kernel encrypting the records, so the body still never enters user space. With --tls=user, or when the kernel cannot take the session (no tls module, another cipher), a relay thread of the process keeps the session and the connection is served on one end of a socketpair, which the relay encrypts to the client; before the process exits tls_drain() waits for the relay to deliver the end of the reply. The handshake blocks for at most --header-timeout seconds, so TLS is only served by --mode=fork and by --mode=prefork with --worker-mode=seq. The STATS report counts the sessions of each kind and the failed handshakes.
+ 
+ With --unix=path the server also listens on a AF_UNIX socket at path, for the clients running on the same host: localServerStart() (localserver.c) binds it and forks a process that accepts its connections next to the TCP engine, whatever the --mode, and serves each one in a process of its own with serverServiceFunction(), without TLS. Every command is served as over TCP, and the FGET command (protocol.h), accepted only there, is answered by passFile(): after the same validation of the name as a GET, the GET64 reply header is sent with write_fd() (sockwrap.c) carrying the read only descriptor of the file (SCM_RIGHTS), and no byte of the file crosses the socket. Only regular files are passed, a file found in the file cache is opened for the purpose. The local clients count as 127.0.0.1 for the connection and rate limits.
+ 
+ Every engine keeps live counters (stats.c): connections accepted and active, files and bytes sent, errors by type, timeouts and the requests of each file. They live in a shared mapping created before any fork, and every process adds to its own slot with atomic additions, so no lock is taken while serving. The STATS command (protocol.h) returns them as text, after an OK_MSG and a 32 bit length; with --metrics-port the same report is served over HTTP by a dedicated process, in the Prometheus text format.
+ 
+ Nothing is printed with printf() while serving: the LOG() macro (log.c) formats the message into a record of a lock-free ring of the process and a writer thread, started by the first record, writes the records to stdout with a timestamp, the level and the pid (or to syslog through errlib.c when daemon_proc is set). --log-level drops the records above a level before they are built, and --log-sample=n keeps one of every n records of the high volume events (connections, commands, transfers). The records still in the ring are written at exit().
+ 
+ The sigchldHandler() function, the signal handler for SIGCHLD signal, perform a loop of non blocking waitpid() using the WNOHANG constant (specifies that waitpid should return immediately instead of waiting, if there is no child process ready to be noticed, if the child is running the caller does not block it). A loop is performed to handle more than one SIGCHLD signal from dying children process. Being a signal handler, it logs with logSignalSafe(), which queues the record without any formatting function.
+ 
+ The sigpipeHandler() function, the signal handler for SIGPIPE signal, logs an error message in the same way.
 ************************************************************ */
 
 
@@ -30,20 +56,45 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
 #include "./../errlib.h"
 #include "./../sockwrap.h"
-
-#define RCVBUFFERLENGTH     4098                    //receive buffer length
-#define SNDBUFFERLENGTH     4097                    //send buffer length
-#define MAXWAITINGTIME      60                      //waiting time for messages from client
-
-static const char GET_CMD[]     =   "GET ";         //Get message string
-static const char QUIT_CMD[]    =   "QUIT\r\n";     //Quit message string
-static const char ERR_MSG[]     =   "-ERR\r\n";     //Err message string
-static const char OK_MSG[]      =   "+OK\r\n";      //Ok message string
+#include "server2.h"
+#include "epoll_engine.h"
+#include "transfer.h"
+#include "prefork.h"
+#include "uring_engine.h"
+#include "thread_engine.h"
+#include "diskpool.h"
+#include "request.h"
+#include "filecache.h"
+#include "stats.h"
+#include "dirindex.h"
+#include "deltamatch.h"
+#include "shaper.h"
+#include "admission.h"
+#include "localserver.h"
+#include "./../tlswrap.h"
+#include "log.h"
+#include "timerwheel.h"
 
 char *prog_name;
-void serverServiceFunction(int socketNumber);
+unsigned idleTimeout = MAXWAITINGTIME;                  //--idle-timeout
+unsigned headerTimeout = HEADERTIMEOUT;                 //--header-timeout
+unsigned transferTimeout = TRANSFERTIMEOUT;             //--transfer-timeout
+static void *tlsContext = NULL;                         //--tls: every connection starts with a handshake
+static void serveConnection(int socketNumber, struct shaper *sh, int local);
+static int passFile(int socket, struct requestedFile *rf, const char *filename, const char *header, size_t headerlen);
+static int serveBatch(int socket, struct shaper *sh, const struct request *req);
+static int serveDelta(int socket, struct shaper *sh, Rbuf *rb, struct request *req);
+static int refuseRequest(int socket, statCounter counter, const char *message);
+static int sendBody(int socket, struct shaper *sh, const struct requestedFile *rf, const char *header, size_t headerlen,
+                    off_t start, off_t end, uint64_t deadline);
+static ssize_t shapedSend(struct shaper *sh, struct fileTransfer *transfer, int socket);
+static void usage(void);
+static void setSocketTimeout(int socket, int option, unsigned seconds);
 static void sigchldHandler(int);
 static void sigpipeHandler(int);
 
@@ -59,267 +110,643 @@ int main(int argc, char **argv){
     struct sockaddr_in saddr, caddr;    //server and client addresses structure
     int backlog = 1024;                 //maximum length of pending request queue
     pid_t childPid;                     //Id used to identify the children process
+    int ticket;                         //admission of the connection (admission.c)
+    sigset_t chldmask, oldmask;
+    struct pollfd pfd;                  //passive socket, waited for with poll()
+    int i;
+    char addr[LOGADDRLENGTH];           //printable address
+    serverMode mode = MODE_FORK;        //engine used to serve the connections
+    int opt;
+    int tlsFlags = 0;                   //--tls: TLS_KTLS or 0
+    const char *tlsCert = NULL, *tlsKey = NULL;
+    static struct option longOptions[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"chunk", required_argument, NULL, 'c'},
+        {"send", required_argument, NULL, 's'},
+        {"workers", required_argument, NULL, 'w'},
+        {"worker-mode", required_argument, NULL, 'W'},
+        {"pin", no_argument, NULL, 'p'},
+        {"threads", required_argument, NULL, 't'},
+        {"disk-threads", required_argument, NULL, 'D'},
+        {"cache", required_argument, NULL, 'C'},
+        {"cache-max-file", required_argument, NULL, 'F'},
+        {"metrics-port", required_argument, NULL, 'M'},
+        {"log-level", required_argument, NULL, 'L'},
+        {"log-sample", required_argument, NULL, 'S'},
+        {"idle-timeout", required_argument, NULL, 'I'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"transfer-timeout", required_argument, NULL, 'T'},
+        {"index-max", required_argument, NULL, 'X'},
+        {"rate-conn", required_argument, NULL, 'r'},
+        {"rate-ip", required_argument, NULL, 'i'},
+        {"rate-total", required_argument, NULL, 'g'},
+        {"pacing", no_argument, NULL, 'a'},
+        {"shaping-file", required_argument, NULL, 'f'},
+        {"max-conns", required_argument, NULL, 'n'},
+        {"max-per-ip", required_argument, NULL, 'P'},
+        {"backlog", required_argument, NULL, 'B'},
+        {"tls", required_argument, NULL, 'E'},
+        {"tls-cert", required_argument, NULL, 'k'},
+        {"tls-key", required_argument, NULL, 'y'},
+        {"unix", required_argument, NULL, 'U'},
+        {NULL, 0, NULL, 0}
+    };
     
     //assigning program name
     prog_name = argv[0];
-    printf("\n");
+    
+    //reading options passed by command line
+    while((opt = getopt_long(argc, argv, "m:c:s:w:W:pt:D:C:F:M:L:S:I:H:T:X:r:i:g:af:n:P:B:E:k:y:U:", longOptions, NULL)) != -1){
+        switch(opt){
+            case 'm':
+                if(strcmp(optarg, "fork")==0){
+                    mode = MODE_FORK;
+                }else if(strcmp(optarg, "epoll")==0){
+                    mode = MODE_EPOLL;
+                }else if(strcmp(optarg, "prefork")==0){
+                    mode = MODE_PREFORK;
+                }else if(strcmp(optarg, "uring")==0){
+                    mode = MODE_URING;
+                }else if(strcmp(optarg, "threads")==0){
+                    mode = MODE_THREADS;
+                }else{
+                    usage();
+                }
+                break;
+            case 'w':
+                if(sscanf(optarg, "%d", &preforkWorkers)!=1 || preforkWorkers<=0 || preforkWorkers>MAXWORKERS){
+                    usage();
+                }
+                break;
+            case 'W':
+                if(strcmp(optarg, "seq")==0){
+                    preforkWorkerMode = WORKER_SEQUENTIAL;
+                }else if(strcmp(optarg, "epoll")==0){
+                    preforkWorkerMode = WORKER_EPOLL;
+                }else if(strcmp(optarg, "uring")==0){
+                    preforkWorkerMode = WORKER_URING;
+                }else{
+                    usage();
+                }
+                break;
+            case 'p':
+                preforkPin = 1;
+                break;
+            case 't':
+                if(sscanf(optarg, "%d", &netThreads)!=1 || netThreads<=0 || netThreads>MAXNETTHREADS){
+                    usage();
+                }
+                break;
+            case 'D':
+                if(sscanf(optarg, "%d", &diskWorkers)!=1 || diskWorkers<=0 || diskWorkers>MAXDISKWORKERS){
+                    usage();
+                }
+                break;
+            case 'C':
+                if(sscanf(optarg, "%zu", &fileCacheBudget)!=1){
+                    usage();
+                }
+                break;
+            case 'F':
+                if(sscanf(optarg, "%zu", &fileCacheMaxFile)!=1){
+                    usage();
+                }
+                break;
+            case 'M':
+                if(sscanf(optarg, "%d", &metricsPort)!=1 || metricsPort<=0 || metricsPort>65535){
+                    usage();
+                }
+                break;
+            case 'L':
+                if((logThreshold = logParseLevel(optarg)) < 0){
+                    usage();
+                }
+                break;
+            case 'S':
+                if(sscanf(optarg, "%u", &logSampleRate)!=1 || logSampleRate==0){
+                    usage();
+                }
+                break;
+            case 'I':
+                if(sscanf(optarg, "%u", &idleTimeout)!=1){
+                    usage();
+                }
+                break;
+            case 'H':
+                if(sscanf(optarg, "%u", &headerTimeout)!=1){
+                    usage();
+                }
+                break;
+            case 'T':
+                if(sscanf(optarg, "%u", &transferTimeout)!=1){
+                    usage();
+                }
+                break;
+            case 'X':
+                if(sscanf(optarg, "%zu", &dirIndexMaxFiles)!=1){
+                    usage();
+                }
+                break;
+            case 'r':
+                if(sscanf(optarg, "%" SCNu64, &shaperConnRate)!=1){
+                    usage();
+                }
+                break;
+            case 'i':
+                if(sscanf(optarg, "%" SCNu64, &shaperIpRate)!=1){
+                    usage();
+                }
+                break;
+            case 'g':
+                if(sscanf(optarg, "%" SCNu64, &shaperTotalRate)!=1){
+                    usage();
+                }
+                break;
+            case 'a':
+                shaperPacing = 1;
+                break;
+            case 'f':
+                shaperFile = optarg;
+                break;
+            case 'n':
+                if(sscanf(optarg, "%u", &admissionMaxConns)!=1){
+                    usage();
+                }
+                break;
+            case 'P':
+                if(sscanf(optarg, "%u", &admissionMaxPerIp)!=1){
+                    usage();
+                }
+                break;
+            case 'B':
+                if(sscanf(optarg, "%d", &backlog)!=1 || backlog<=0){
+                    usage();
+                }
+                break;
+            case 'E':
+                if(strcmp(optarg, "user")==0){
+                    tlsFlags = TLS_SERVER;
+                }else if(strcmp(optarg, "ktls")==0){
+                    tlsFlags = TLS_SERVER | TLS_KTLS;
+                }else{
+                    usage();
+                }
+                break;
+            case 'k':
+                tlsCert = optarg;
+                break;
+            case 'y':
+                tlsKey = optarg;
+                break;
+            case 'U':
+                localPath = optarg;
+                break;
+            case 'c':
+                if(sscanf(optarg, "%zu", &transferChunkSize)!=1 || transferChunkSize==0){
+                    usage();
+                }
+                break;
+            case 's':
+                if(strcmp(optarg, "sendfile")==0){
+                    transferPreferredMethod = XFER_SENDFILE;
+                }else if(strcmp(optarg, "splice")==0){
+                    transferPreferredMethod = XFER_SPLICE;
+                }else if(strcmp(optarg, "copy")==0){
+                    transferPreferredMethod = XFER_COPY;
+                }else{
+                    usage();
+                }
+                break;
+            default:
+                usage();
+        }
+    }
     
     //checking arguments passed by command line
-    if(argc!=2){
-        printf("Command line error. Requested port number. Try again!\n");
-        exit(1);
+    if(argc-optind!=1){
+        usage();
+    }
+    //the handshake blocks: TLS is served by the engines with a process per connection
+    if(tlsFlags != 0 && (tlsCert == NULL || (mode != MODE_FORK && (mode != MODE_PREFORK || preforkWorkerMode != WORKER_SEQUENTIAL)))){
+        usage();
+    }
+    
+    //every process logs through its own ring, drained by a writer thread
+    if(logInit() < 0){
+        err_sys("(%s) error - logger creation failed", prog_name);
     }
     
     //reading server port number from command line
-    if(sscanf(argv[1], "%" SCNu16, &lport_h)!=1){
+    if(sscanf(argv[optind], "%" SCNu16, &lport_h)!=1){
         err_sys("Invalid port number");
     }
     lport_n = htons(lport_h);
     
-    //creating the socket
-    printf("Creating the socket \t\t\t\t\t");
-    passive_socket = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    printf("-> Done. Socket number: %d\n", passive_socket);
-    
-    //binding the socket to any local IP address
+    //preparing the address structure: any local IP address
     bzero(&saddr, sizeof(saddr));
     saddr.sin_family        =   AF_INET;
     saddr.sin_port          =   lport_n;
     saddr.sin_addr.s_addr   =   INADDR_ANY;
-    showAddr("Binding to address:", &saddr);
+    
+    //shared file cache, created before any process is forked
+    if(fileCacheBudget > 0){
+        if(fileCacheInit() < 0){
+            err_sys("(%s) error - file cache creation failed", prog_name);
+        }
+        LOG(LVL_INFO, "Creating file cache of %zu bytes\t\t\t-> Done", fileCacheBudget);
+    }
+    
+    //index of the served directory, shared by every process and kept current by inotify
+    if(dirIndexInit() < 0){
+        LOG(LVL_WARN, "Directory index not available: %s. Lookups use the file system", strerror(errno));
+    }
+    
+    //rate limits shared by every process, the shaping file is read again on SIGHUP
+    if(shaperInit() < 0){
+        err_sys("(%s) error - rate limits not available", prog_name);
+    }
+    
+    //connection limits shared by every process, checked before anything is spent on a connection
+    if(admissionInit() < 0){
+        err_sys("(%s) error - connection limits not available", prog_name);
+    }
+    
+    //certificate and key are loaded once, before any fork
+    if(tlsFlags != 0){
+        if((tlsContext = tls_context(tlsFlags, tlsCert, tlsKey != NULL ? tlsKey : tlsCert, NULL)) == NULL){
+            err_quit("(%s) error - TLS not available: %s", prog_name, tls_strerror());
+        }
+        LOG(LVL_INFO, "Loading TLS certificate %s\t\t\t-> Done", tlsCert);
+    }
+    
+    //live counters shared by every process, optionally exported over HTTP
+    if(statsInit() < 0){
+        err_sys("(%s) error - statistics creation failed", prog_name);
+    }
+    metricsServerStart();
+    
+    //local clients: a listener of its own, next to whatever engine serves TCP
+    localServerStart(backlog);
+    
+    //prefork engine: every worker owns its SO_REUSEPORT socket, the master only supervises
+    if(mode == MODE_PREFORK){
+        Signal(SIGCHLD, sigchldHandler);
+        Signal(SIGPIPE, sigpipeHandler);
+        preforkServerLoop(&saddr, backlog);
+        exit(0);
+    }
+    
+    //creating the socket
+    passive_socket = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    LOG(LVL_INFO, "Creating the socket \t\t\t\t\t-> Done. Socket number: %d", passive_socket);
+    
+    //binding the socket
     Bind(passive_socket, (struct sockaddr *)&saddr, sizeof(saddr));
-    printf("\t-> Done\n");
+    LOG(LVL_INFO, "Binding to address: %s\t\t\t-> Done", logFormatAddr(addr, &saddr));
     
     //listening to connection requests
-    printf("Listening at socket: %d with backlog: %d\t\t", passive_socket, backlog);
     Listen(passive_socket, backlog);
-    printf("-> Done\n");
-    printf("\n");
+    LOG(LVL_INFO, "Listening at socket: %d with backlog: %d\t\t-> Done", passive_socket, backlog);
     
     //initializing signal handler to avoid zombie process
     Signal(SIGCHLD, sigchldHandler);
     //initializing signal handler to handle broken pipe
     Signal(SIGPIPE, sigpipeHandler);
     
-    //main server loop
+    //event driven engine: a single process serves every connection
+    if(mode == MODE_EPOLL){
+        LOG(LVL_INFO, "Starting epoll event loop");
+        epollServerLoop(passive_socket);
+        exit(0);
+    }
+    
+    //io_uring engine: a single process, batched submissions (epoll if not supported)
+    if(mode == MODE_URING){
+        LOG(LVL_INFO, "Starting io_uring event loop");
+        uringServerLoop(passive_socket);
+        exit(0);
+    }
+    
+    //threaded engine: network threads own the connections, a pool of threads reads the disk
+    if(mode == MODE_THREADS){
+        LOG(LVL_INFO, "Starting threaded engine");
+        threadServerLoop(passive_socket);
+        exit(0);
+    }
+    
+    //main server loop: the passive socket is non blocking, every wake up drains a batch of the queue
+    if(fcntl(passive_socket, F_SETFL, fcntl(passive_socket, F_GETFL, 0) | O_NONBLOCK) < 0){
+        err_sys("(%s) error - fcntl() failed", prog_name);
+    }
+    sigemptyset(&chldmask);
+    sigaddset(&chldmask, SIGCHLD);
+    pfd.fd = passive_socket;
+    pfd.events = POLLIN;
     for( ; ; ){
         
-        addrlen = sizeof(struct sockaddr_in);
-        if((conn_socket = accept(passive_socket, (struct sockaddr *)&caddr, &addrlen)) < 0){
-            if(errno == EINTR){
-                //return to for
-                continue;
-            }else{
-                printf("\n");
-                printf("Error while accepting connection. Closing socket\t");
-                Close(conn_socket);
-                printf("-> Socket close");
+        if(poll(&pfd, 1, -1) < 0){
+            if(errno != EINTR){
+                LOG(LVL_WARN, "Error while waiting for connections: %s", strerror(errno));
             }
+            continue;
         }
+        admissionSampleQueue(passive_socket);
         
-        if((childPid = Fork()) == 0){
-            //child process
+        for(i=0; i<ADMITBATCH; i++){
+            addrlen = sizeof(struct sockaddr_in);
+            //on Linux the connected socket does not inherit O_NONBLOCK: the child serves it blocking
+            if((conn_socket = accept(passive_socket, (struct sockaddr *)&caddr, &addrlen)) < 0){
+                if(errno == EINTR || errno == ECONNABORTED){
+                    continue;
+                }
+                //no descriptor or memory left: the socket is still readable, poll() would return at once
+                if(admissionAcceptFailed(errno)){
+                    poll(NULL, 0, ADMITRETRYMS);
+                }
+                break;
+            }
+            admissionAccepted();
             
-            //initializing signal handler to handle broken pipe
-            Signal(SIGPIPE, sigpipeHandler);
-            printf("\n");
+            //over a limit: answered and closed here, no process is created
+            if((ticket = admissionEnter(&caddr)) < 0){
+                admissionRefuse(conn_socket, ticket);
+                continue;
+            }
             
-            //doing server tasks and exiting
-            showAddr("Accepted connection from", &caddr);
-            printf("\n");
-            printf("Assigning server tasks to process\n\n");
-            Close(passive_socket);
-            serverServiceFunction(conn_socket);
-            exit(0);
+            //the child cannot be reaped before its ticket is recorded
+            sigprocmask(SIG_BLOCK, &chldmask, &oldmask);
+            if((childPid = Fork()) == 0){
+                //child process
+                sigprocmask(SIG_SETMASK, &oldmask, NULL);
+                
+                //initializing signal handler to handle broken pipe
+                Signal(SIGPIPE, sigpipeHandler);
+                statsAttach();
+                logDeferWriter();
+                
+                //doing server tasks and exiting
+                LOG_SAMPLED(LVL_INFO, "Accepted connection from %s. Assigning server tasks to process", logFormatAddr(addr, &caddr));
+                Close(passive_socket);
+                serverServiceFunction(conn_socket, &caddr);
+                exit(0);
+            }
+            admissionHold(childPid, ticket);
+            sigprocmask(SIG_SETMASK, &oldmask, NULL);
+            
+            //parent close connected socket
+            Close(conn_socket);
         }
-        
-        //parent close connected socket
-        Close(conn_socket);
     }
 }
 
 
 
-void serverServiceFunction(int socketNumber){
+//serve a connection until it is closed, counting it in the statistics; caddr keys the rate limits of its address
+void serverServiceFunction(int socketNumber, const struct sockaddr_in *caddr){
+    
+    struct shaper sh;                   //rate limits of the connection
+    int socket = socketNumber;          //socket of the plain bytes (--tls: kernel TLS or a relay)
+    int offloaded;
+    struct sockaddr_storage laddr;
+    socklen_t laddrlen = sizeof(laddr);
+    int local;                          //AF_UNIX connection of the local listener: no TLS, FGET served
+    
+    statsAdd(STAT_CONN_ACCEPTED, 1);
+    local = getsockname(socketNumber, (struct sockaddr *)&laddr, &laddrlen) == 0 && laddr.ss_family == AF_UNIX;
+    if(!local){
+        transferSetNoDelay(socketNumber);
+    }
+    if(tlsContext != NULL && !local){
+        if((socket = tls_start(tlsContext, socketNumber, NULL, headerTimeout, &offloaded)) < 0){
+            statsAdd(STAT_ERR_TLS, 1);
+            LOG_SAMPLED(LVL_WARN, "(socket %d) TLS handshake failed: %s. Closing connection", socketNumber, tls_strerror());
+            Close(socketNumber);
+            statsAdd(STAT_CONN_CLOSED, 1);
+            return;
+        }
+        statsAdd(offloaded ? STAT_TLS_KERNEL : STAT_TLS_USER, 1);
+    }
+    //--pacing applies to the TCP socket, also when the bytes go through a relay
+    shaperOpen(&sh, socketNumber, caddr);
+    //the only connection of this process: given back by the parent if the process dies
+    shaperHold(&sh);
+    serveConnection(socket, &sh, local);
+    shaperClose(&sh);
+    //the relay still holds the end of the reply: the process must not exit before it is delivered
+    tls_drain();
+    statsAdd(STAT_CONN_CLOSED, 1);
+}
+
+
+
+static void serveConnection(int socketNumber, struct shaper *sh, int local){
     
     int socket = socketNumber;          //socket
     int n;                              //number of bytes received
     char buffer[RCVBUFFERLENGTH];       //receive buffer
-    char sndbuffer[SNDBUFFERLENGTH];    //send buffer
-    FILE *fp;                           //file pointer
-    char *filename;                     //used to store the name of the file
-    struct stat st;                     //stat structure
-    uint32_t filesize;                  //size of the file, 32 bit unsigned integer
-    uint32_t time;                      //timestamp of the last file modification, 32 uint
-    uint32_t sentsize;                  //number of bytes already sent
-    uint32_t numreadchar;               //number of character read from file
-    fd_set cset;                        //set of socket
-    struct timeval tval;                //timeval structure
+    Rbuf rb;                            //bytes received from the client, not yet consumed
+    struct requestedFile rf;            //requested file: descriptor or cached content
+    struct request req;                 //parsed command
+    char header[MAXHEADERLENGTH];       //ok message with attached file size and timestamp
+    size_t headerlen;
+    struct pollfd pfd;                  //socket waited for with poll(), no FD_SETSIZE limit
     int m;
     
     
+    rbuf_init(&rb, socket);
+    //one process per connection: the socket timeouts bound every read of a command and every send of a reply
+    setSocketTimeout(socket, SO_RCVTIMEO, headerTimeout);
+    setSocketTimeout(socket, SO_SNDTIMEO, transferTimeout);
     for( ; ; ){
         
-        //setting select structure to handle read timeout
-        FD_ZERO(&cset);
-        FD_SET(socket, &cset);
-        tval.tv_sec = MAXWAITINGTIME;
-        tval.tv_usec = 0;
-        if((m = Select(FD_SETSIZE, &cset, NULL, NULL, &tval)) > 0) {
+        //waiting for a command at most --idle-timeout seconds
+        pfd.fd = socket;
+        pfd.events = POLLIN;
+        //a command already buffered does not need to wait for the socket
+        if(rbuf_pending(&rb) > 0 || (m = Poll(&pfd, 1, idleTimeout ? (int)idleTimeout*1000 : -1)) > 0) {
             
-            //read line unbuffered from client
-            n = (int)readline_unbuffered(socket, buffer, RCVBUFFERLENGTH);
+            //read line buffered from client (one recv for the whole line)
+            n = (int)rbuf_readline(&rb, buffer, RCVBUFFERLENGTH);
             
         }else {
             //timeout. no message received from client in the maximum waiting time
-            printf("Timeout. No message received from client. Closing connection\t");
+            statsAdd(STAT_TIMEOUTS, 1);
             Close(socket);
-            printf("-> Connection closed\n");
+            LOG(LVL_INFO, "%s. Connection closed", deadlineMessage(DEADLINE_IDLE));
             return;
         }
        
         if(n == 0){
             //connection closed by party on socket, close connection and terminate
-            printf("(process %d) Connection closed by party on socket %d\n", getpid(), socket);
+            LOG_SAMPLED(LVL_INFO, "Connection closed by party on socket %d", socket);
             Close(socket);
             return;
             
+        }else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            //the command line has not been completed in --header-timeout seconds
+            statsAdd(STAT_TIMEOUTS, 1);
+            Close(socket);
+            LOG(LVL_INFO, "%s. Connection closed", deadlineMessage(DEADLINE_HEADER));
+            return;
+            
         }else if(n < 0){
             //reading error, informs client, close connection and terminate
-            printf("(process %d) Reading error. Closing connection\t", getpid());
+            statsAdd(STAT_ERR_RECV, 1);
+            LOG(LVL_WARN, "Reading error. Closing connection");
             if((sendn(socket, ERR_MSG, sizeof(ERR_MSG)-1, 0))!=(sizeof(ERR_MSG)-1)){
-                printf("\n");
-                printf("(process %d) Sending error message failed!\t\t\t", getpid());
+                LOG(LVL_WARN, "Sending error message failed!");
             }
             Close(socket);
-            printf("-> Connection closed\n");
             return;
             
-        } else if(strncmp(buffer, QUIT_CMD, sizeof(QUIT_CMD)-1)==0){
+        } else if(parseRequest(buffer, &req) == REQ_QUIT){
             //check if it is QUIT command, if it is close connection and terminate
-            printf("(process %d) QUIT command received:\n", getpid());
-            printf("(process %d) Closing connection\t\t\t", getpid());
+            LOG_SAMPLED(LVL_INFO, "QUIT command received. Closing connection");
             Close(socket);
-            printf("-> Connection closed\n");
             return;
             
-        } else if(strncmp(buffer, GET_CMD, sizeof(GET_CMD)-1)==0){
-            //check if it is GET command
+        } else if(req.type == REQ_GET || req.type == REQ_GET64 || req.type == REQ_RGET || req.type == REQ_IFMOD ||
+                  (req.type == REQ_FGET && local)){
+            //check if it is GET (or GET64, RGET, IFMOD, FGET on the local socket) command
             
-            //remove carriage return and line feed character, replace them with \0
-            buffer[strlen(buffer) - 2] = '\0';
             //check if it is a valid file or a directory
-            filename = strdup(buffer+(sizeof(GET_CMD)-1));
-            if(filename[0] == '.' || filename[0] == '~' || (strchr(filename, '/') != NULL)){
+            if(!isValidFilename(req.filename)){
                 //invalid file, print error and stop execution
-                printf("\n");
-                printf("(process %d) Invalid file error. Closing connection\t", getpid());
+                statsAdd(STAT_ERR_FILENAME, 1);
+                LOG(LVL_WARN, "Invalid file error. Closing connection");
                 if((sendn(socket, ERR_MSG, sizeof(ERR_MSG)-1, 0))!=(sizeof(ERR_MSG)-1)){
-                    printf("\n");
-                    printf("(process %d) Sending error message failed!\t\t\t", getpid());
+                    LOG(LVL_WARN, "Sending error message failed!");
                 }
                 Close(socket);
-                printf("-> Connection closed\n");
                 return;
             }
             
             //check if the file is in the current directory otherwise inform client and exit
-            if((fp=fopen(filename, "r"))==NULL){
-                printf("(process %d) Opening file error. Closing connection\t", getpid());
+            //(open it and get its statistics, or find it in the file cache)
+            if((m = openRequestedFile(req.filename, &rf)) == OPEN_FAILED){
+                statsAdd(STAT_ERR_OPEN, 1);
+                LOG(LVL_WARN, "Opening file error. Closing connection");
                 if((sendn(socket, ERR_MSG, sizeof(ERR_MSG)-1, 0))!=(sizeof(ERR_MSG)-1)){
-                    printf("\n");
-                    printf("(process %d) Sending error message failed!\t\t", getpid());
+                    LOG(LVL_WARN, "Sending error message failed!");
                 }
                 Close(socket);
-                printf("-> Connection closed\n");
                 return;
             }
-            printf("(process %d) GET command received:\n", getpid());
+            LOG_SAMPLED(LVL_INFO, "GET command received: %s", req.filename);
             
             //getting file statistic
-            if(stat(filename, &st)!=0){
-                printf("(process %d) Getting file statistics error. Closing connection\t", getpid());
+            if(m == STAT_FAILED){
+                statsAdd(STAT_ERR_STAT, 1);
+                LOG(LVL_WARN, "Getting file statistics error. Closing connection");
                 if((sendn(socket, ERR_MSG, sizeof(ERR_MSG)-1, 0))!=(sizeof(ERR_MSG)-1)){
-                    printf("\n");
-                    printf("(process %d) Sending error message failed!\t\t\t", getpid());
+                    LOG(LVL_WARN, "Sending error message failed!");
                 }
                 Close(socket);
-                printf("-> Connection closed\n");
                 return;
             }
             
-            //getting file size in network order byte
-            filesize = htonl(st.st_size);
-            //getting timestamp in network order byte
-            time = htonl(st.st_mtime);
-            
-            //sending ok reply message to client with attached file size and timestap
-            if((sendn(socket, OK_MSG, sizeof(OK_MSG)-1, 0))!=(sizeof(OK_MSG)-1)){
-                printf("(process %d) Sending ok message failed. Closing connection\t", getpid());
+            //files of 4 GB or more can only be described by the GET64 reply
+            if(!replyFitsRequest(&req, &rf.st)){
+                statsAdd(STAT_ERR_TOO_LARGE, 1);
+                LOG(LVL_WARN, "File too large for GET, GET64 required. Closing connection");
                 if((sendn(socket, ERR_MSG, sizeof(ERR_MSG)-1, 0))!=(sizeof(ERR_MSG)-1)){
-                    printf("\n");
-                    printf("(process %d) Sending error message failed!\t\t", getpid());
+                    LOG(LVL_WARN, "Sending error message failed!");
                 }
+                closeRequestedFile(&rf);
                 Close(socket);
-                printf("-> Connection closed\n");
                 return;
             }
             
-            //sending file size to client
-            if((sendn(socket, &filesize, sizeof(uint32_t), 0))!=sizeof(uint32_t)){
-                printf("(process %d) Sending filesize failed. Closing connection\t", getpid());
+            //a RGET must start inside the file
+            if(resolveRange(&req, &rf.st) < 0){
+                statsAdd(STAT_ERR_RANGE, 1);
+                LOG(LVL_WARN, "Range out of the file. Closing connection");
+                if((sendn(socket, ERR_MSG, sizeof(ERR_MSG)-1, 0))!=(sizeof(ERR_MSG)-1)){
+                    LOG(LVL_WARN, "Sending error message failed!");
+                }
+                closeRequestedFile(&rf);
                 Close(socket);
-                printf("-> Connection closed\n");
                 return;
             }
             
-            //sending timestamp of the last file modification to client
-            if((sendn(socket, &time, sizeof(uint32_t), 0))!=sizeof(uint32_t)){
-                printf("(process %d) Sending timestap failed. Closing connection\t", getpid());
+            //sending ok reply message to client with attached file size and timestap (network byte order),
+            //then the bytes of the requested file (sendfile, splice, copy or from the cache): the header leaves
+            //in the same segment as the first of them
+            statsFileHit(req.filename);
+            headerlen = buildReplyHeader(header, &req, &rf.st);
+            
+            //FGET: the client reads the file from the descriptor passed with the reply, no byte is sent
+            if(req.type == REQ_FGET){
+                if(passFile(socket, &rf, req.filename, header, headerlen) < 0){
+                    closeRequestedFile(&rf);
+                    return;
+                }
+                closeRequestedFile(&rf);
+                continue;
+            }
+            if(sendBody(socket, sh, &rf, header, headerlen, req.start, req.end, wheelNowMs() + (uint64_t)transferTimeout*1000) < 0){
+                closeRequestedFile(&rf);
+                return;
+            }
+            statsAdd(STAT_GETS, 1);
+            closeRequestedFile(&rf);
+            if(fileCacheEnabled()){
+                printCacheStats();
+            }
+            
+        } else if(req.type == REQ_MGET){
+            //a record for every file of the list, a missing file does not close the connection
+            if(serveBatch(socket, sh, &req) < 0){
+                return;
+            }
+            
+        } else if(req.type == REQ_DELTA){
+            //the signatures of the client copy follow the command line, only the changes are sent
+            if(serveDelta(socket, sh, &rb, &req) < 0){
+                return;
+            }
+            
+        } else if(req.type == REQ_STATS){
+            //counters of all the processes of the server, as text
+            if(openStatsReply(&rf) < 0){
+                LOG(LVL_ERROR, "STATS command received. Out of memory. Closing connection");
+                sendn(socket, ERR_MSG, sizeof(ERR_MSG)-1, 0);
                 Close(socket);
-                printf("-> Connection closed\n");
                 return;
             }
+            //the header leaves in the same segment as the text, which is neither shaped nor counted as a file body
+            headerlen = buildStatsHeader(header, &rf);
+            if(sendBody(socket, sh, &rf, header, headerlen, 0, rf.st.st_size, wheelNowMs() + (uint64_t)transferTimeout*1000) < 0){
+                closeRequestedFile(&rf);
+                return;
+            }
+            closeRequestedFile(&rf);
+            LOG(LVL_INFO, "STATS command received. Statistics sent");
             
-            //sending bytes of the requested file to client
-            printf("(process %d) Sending file to client\t\t\t", getpid());
-            sentsize = 0;
-            while(sentsize<st.st_size){
-                //switching file pointer
-                if(fseek(fp, sentsize, SEEK_SET)==-1){
-                    printf("\n");
-                    printf("(process %d) Error in switching file pointer. Closing Connection\t", getpid());
-                    Close(socket);
-                    fclose(fp);
-                    printf("-> Connection closed\n");
-                    return;
-                }
-                //reading bytes from file
-                numreadchar = (uint32_t)fread(sndbuffer, sizeof(char), SNDBUFFERLENGTH, fp);
-                //sending read bytes to the client
-                if(sendn(socket, sndbuffer, numreadchar, 0) != numreadchar){
-                    printf("\n");
-                    printf("(process %d) Sending file failed. Closing connection\t", getpid());
-                    Close(socket);
-                    fclose(fp);
-                    printf("-> Connection closed\n");
-                    return;
-                }
-                //updating number of bytes sent
-                sentsize += numreadchar;
+        } else if(req.type == REQ_LIST){
+            //files of the directory, a copy of the listing kept by the directory index
+            if(openListReply(&rf) < 0){
+                LOG(LVL_WARN, "LIST command received. Listing not available. Closing connection");
+                sendn(socket, ERR_MSG, sizeof(ERR_MSG)-1, 0);
+                Close(socket);
+                return;
+            }
+            headerlen = buildListHeader(header, &rf);
+            if(sendBody(socket, sh, &rf, header, headerlen, 0, rf.st.st_size, wheelNowMs() + (uint64_t)transferTimeout*1000) < 0){
+                closeRequestedFile(&rf);
+                return;
             }
-            printf("-> File sent\n");
-            fclose(fp);
+            closeRequestedFile(&rf);
+            LOG(LVL_INFO, "LIST command received. Listing of %" PRIu64 " bytes sent", (uint64_t)rf.st.st_size);
             
         } else{
             //other problems, invalid commands, reply with error message, close connection
-            printf("(process %d) Invalid command received. Closing connection\t", getpid());
+            statsAdd(STAT_ERR_COMMAND, 1);
+            LOG(LVL_WARN, "Invalid command received. Closing connection");
             if((sendn(socket, ERR_MSG, sizeof(ERR_MSG)-1, 0))!=(sizeof(ERR_MSG)-1)){
-                printf("\n");
-                printf("(process %d) Sending error message failed. Closing connection\t", getpid());
+                LOG(LVL_WARN, "Sending error message failed!");
             }
             Close(socket);
-            printf("-> Connection closed\n");
             return;
         }
     }
@@ -327,15 +754,332 @@ void serverServiceFunction(int socketNumber){
 }
 
 
+//FGET: the reply header carries the descriptor of the file (SCM_RIGHTS). Only a regular file is passed: the
+//descriptor of a directory would open its whole tree to the client. Returns -1 if the connection has been closed
+static int passFile(int socket, struct requestedFile *rf, const char *filename, const char *header, size_t headerlen){
+    
+    int fd = rf->fd;
+    
+    //a file served from the file cache has no descriptor: one is opened here, closed once passed
+    if(!S_ISREG(rf->st.st_mode) || (fd < 0 && (fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)){
+        statsAdd(STAT_ERR_OPEN, 1);
+        LOG(LVL_WARN, "FGET of a file that cannot be passed. Closing connection");
+        if((sendn(socket, ERR_MSG, sizeof(ERR_MSG)-1, 0))!=(sizeof(ERR_MSG)-1)){
+            LOG(LVL_WARN, "Sending error message failed!");
+        }
+        Close(socket);
+        return -1;
+    }
+    if(write_fd(socket, header, headerlen, fd) != (ssize_t)headerlen){
+        statsAdd(STAT_ERR_SEND, 1);
+        LOG(LVL_WARN, "Passing the file descriptor failed: %s. Closing connection", strerror(errno));
+        if(fd != rf->fd){
+            close(fd);
+        }
+        Close(socket);
+        return -1;
+    }
+    if(fd != rf->fd){
+        close(fd);
+    }
+    statsAdd(STAT_GETS, 1);
+    statsAdd(STAT_PASSED, 1);
+    LOG_SAMPLED(LVL_INFO, "FGET command received: %s. Descriptor passed", filename);
+    return 0;
+}
+
+
+//MGET: "+OK\r\n" and the number of records, then the record and the bytes of every file. Returns -1 if the connection has been closed
+static int serveBatch(int socket, struct shaper *sh, const struct request *req){
+    
+    struct batch batch;                 //names of the request, next file opened in advance
+    struct requestedFile rf;
+    char header[MAXHEADERLENGTH];
+    size_t headerlen;
+    const char *name;
+    uint64_t deadline;                  //the transfer deadline covers the whole batch
+    int found;
+    
+    if(batchStart(&batch, req->filename) < 0){
+        statsAdd(STAT_ERR_COMMAND, 1);
+        LOG(LVL_WARN, "Invalid MGET command received. Closing connection");
+        if((sendn(socket, ERR_MSG, sizeof(ERR_MSG)-1, 0))!=(sizeof(ERR_MSG)-1)){
+            LOG(LVL_WARN, "Sending error message failed!");
+        }
+        Close(socket);
+        return -1;
+    }
+    LOG_SAMPLED(LVL_INFO, "MGET command received: %" PRIu32 " files", batch.left);
+    deadline = wheelNowMs() + (uint64_t)transferTimeout*1000;
+    headerlen = buildBatchHeader(header, &batch);
+    //MSG_MORE: the first record follows at once, in the same segment
+    if((sendn(socket, header, headerlen, MSG_MORE))!=headerlen){
+        statsAdd(STAT_ERR_SEND, 1);
+        LOG(LVL_WARN, "Sending ok message failed. Closing connection");
+        batchEnd(&batch);
+        Close(socket);
+        return -1;
+    }
+    
+    while((name = batchNextName(&batch)) != NULL){
+        //the next file is opened and read ahead by batchOpen() while this one is sent
+        found = batchOpen(&batch, name, &rf) == 0;
+        headerlen = buildRecordHeader(header, name, found ? &rf.st : NULL);
+        if(!found){
+            LOG_SAMPLED(LVL_INFO, "MGET file not available: %s", name);
+            if((sendn(socket, header, headerlen, 0))!=headerlen){
+                statsAdd(STAT_ERR_SEND, 1);
+                LOG(LVL_WARN, "Sending MGET record failed. Closing connection");
+                batchEnd(&batch);
+                Close(socket);
+                return -1;
+            }
+            continue;
+        }
+        //the record header is framed with the bytes of the file
+        if(sendBody(socket, sh, &rf, header, headerlen, 0, rf.st.st_size, deadline) < 0){
+            closeRequestedFile(&rf);
+            batchEnd(&batch);
+            return -1;
+        }
+        statsAdd(STAT_GETS, 1);
+        closeRequestedFile(&rf);
+    }
+    batchEnd(&batch);
+    if(fileCacheEnabled()){
+        printCacheStats();
+    }
+    return 0;
+}
+
+
+//DELTA: the signatures, then "+NM\r\n" for an unchanged file, or the GET64 reply and the operations
+//rebuilding the file from the blocks of the client (deltamatch.c). Returns -1 if the connection has been closed
+static int serveDelta(int socket, struct shaper *sh, Rbuf *rb, struct request *req){
+    
+    struct deltaIndex di;               //signatures of the client copy
+    struct requestedFile rf;
+    char header[MAXHEADERLENGTH];
+    size_t headerlen;
+    uint64_t reused;                    //bytes copied by the client instead of sent
+    int m;
+    
+    if(req->blockSize < DELTAMINBLOCK || req->blockSize > DELTAMAXBLOCK || req->blockCount > DELTAMAXBLOCKS){
+        return refuseRequest(socket, STAT_ERR_COMMAND, "Invalid DELTA command received");
+    }
+    //read in any case, also for "+NM" the signatures must be consumed
+    if(deltaIndexRead(&di, rb, req) < 0){
+        statsAdd(STAT_ERR_RECV, 1);
+        LOG(LVL_WARN, "Reading block signatures failed. Closing connection");
+        Close(socket);
+        return -1;
+    }
+    LOG_SAMPLED(LVL_INFO, "DELTA command received: %s (%" PRIu32 " blocks of %" PRIu32 " bytes)", req->filename, di.count, di.blockSize);
+    
+    if(!isValidFilename(req->filename)){
+        deltaIndexFree(&di);
+        return refuseRequest(socket, STAT_ERR_FILENAME, "Invalid file error");
+    }
+    if((m = openRequestedFile(req->filename, &rf)) != 0){
+        deltaIndexFree(&di);
+        return m == OPEN_FAILED ? refuseRequest(socket, STAT_ERR_OPEN, "Opening file error")
+                                : refuseRequest(socket, STAT_ERR_STAT, "Getting file statistics error");
+    }
+    //the operations address the bytes of a regular file
+    if(!S_ISREG(rf.st.st_mode)){
+        closeRequestedFile(&rf);
+        deltaIndexFree(&di);
+        return refuseRequest(socket, STAT_ERR_FILENAME, "Not a regular file");
+    }
+    resolveRange(req, &rf.st);
+    
+    statsFileHit(req->filename);
+    headerlen = buildReplyHeader(header, req, &rf.st);
+    if((sendn(socket, header, headerlen, req->notModified ? 0 : MSG_MORE))!=headerlen){
+        statsAdd(STAT_ERR_SEND, 1);
+        LOG(LVL_WARN, "Sending ok message failed. Closing connection");
+        closeRequestedFile(&rf);
+        deltaIndexFree(&di);
+        Close(socket);
+        return -1;
+    }
+    if(!req->notModified){
+        if(deltaSend(socket, sh, &rf, &di, wheelNowMs() + (uint64_t)transferTimeout*1000, &reused) < 0){
+            closeRequestedFile(&rf);
+            deltaIndexFree(&di);
+            return -1;
+        }
+        shaperIdle(sh);
+        statsAdd(STAT_DELTAS, 1);
+        LOG_SAMPLED(LVL_INFO, "Delta sent, %" PRIu64 " of %" PRIu64 " bytes reused from the client copy", reused, (uint64_t)rf.st.st_size);
+    }
+    closeRequestedFile(&rf);
+    deltaIndexFree(&di);
+    return 0;
+}
+
+
+//count the error, send ERR_MSG and close the connection. Returns -1
+static int refuseRequest(int socket, statCounter counter, const char *message){
+    statsAdd(counter, 1);
+    LOG(LVL_WARN, "%s. Closing connection", message);
+    if((sendn(socket, ERR_MSG, sizeof(ERR_MSG)-1, 0))!=(sizeof(ERR_MSG)-1)){
+        LOG(LVL_WARN, "Sending error message failed!");
+    }
+    Close(socket);
+    return -1;
+}
+
+
+//the reply header framed with bytes start to end of the file (sendfile, splice, copy or from the cache), within the
+//transfer deadline and the rate limits. Returns -1 if the connection has been closed
+static int sendBody(int socket, struct shaper *sh, const struct requestedFile *rf, const char *header, size_t headerlen,
+                    off_t start, off_t end, uint64_t deadline){
+    
+    struct fileTransfer transfer;       //state of the body transfer
+    ssize_t sent;                       //bytes sent by a single transfer step
+    int file = rf->generated == NULL;   //the counters and the listing are not file bodies: never shaped nor counted
+    
+    requestTransferInit(&transfer, rf, start, end);
+    transferFrame(&transfer, header, headerlen);
+    while((sent = file ? shapedSend(sh, &transfer, socket) : transferSend(&transfer, socket)) != 0){
+        if(sent > 0 && file){
+            statsAdd(STAT_BYTES_SENT, sent);
+        }
+        if(transferTimeout > 0 && (sent < 0 ? (errno == EAGAIN || errno == EWOULDBLOCK) : wheelNowMs() >= deadline)){
+            statsAdd(STAT_TIMEOUTS, 1);
+            LOG(LVL_INFO, "%s. Closing connection", deadlineMessage(DEADLINE_TRANSFER));
+            Close(socket);
+            transferRelease(&transfer);
+            return -1;
+        }
+        if(sent < 0 && errno != EINTR){
+            statsAdd(STAT_ERR_SEND, 1);
+            LOG(LVL_WARN, "Sending file failed. Closing connection");
+            Close(socket);
+            transferRelease(&transfer);
+            return -1;
+        }
+    }
+    if(file){
+        LOG_SAMPLED(LVL_INFO, "File sent (%s)", transferMethodName(transfer.method));
+        shaperIdle(sh);
+    }
+    transferRelease(&transfer);
+    return 0;
+}
+
+
+//a transfer step no larger than the rate limits allow, after sleeping while they allow none
+static ssize_t shapedSend(struct shaper *sh, struct fileTransfer *transfer, int socket){
+    
+    unsigned delay;
+    ssize_t sent;
+    
+    while(!transferComplete(transfer) && (transfer->limit = shaperGrant(sh, &delay)) == 0){
+        poll(NULL, 0, (int)delay);
+    }
+    if((sent = transferSend(transfer, socket)) > 0){
+        shaperCharge(sh, sent);
+    }
+    return sent;
+}
+
+
+//check if the requested name is a file of the current directory (not a directory or a path)
+int isValidFilename(const char *filename){
+    if(filename[0] == '\0' || filename[0] == '.' || filename[0] == '~' || (strchr(filename, '/') != NULL)){
+        return 0;
+    }
+    return 1;
+}
+
+
+//print the counters of the shared file cache
+void printCacheStats(void){
+    struct cacheStats cs;
+    
+    fileCacheGetStats(&cs);
+    LOG_SAMPLED(LVL_INFO, "Cache: %" PRIu64 " hits, %" PRIu64 " misses (hit ratio %.1f%%), %" PRIu64 " evictions, %" PRIu64 " invalidations, %" PRIu64 "/%" PRIu64 " bytes used",
+           cs.hits, cs.misses, (cs.hits+cs.misses) ? 100.0*cs.hits/(cs.hits+cs.misses) : 0.0,
+           cs.evictions, cs.invalidations, cs.bytesUsed, cs.budget);
+}
+
+
+//seconds of a deadline, 0 if disabled
+unsigned deadlineSeconds(deadlineKind kind){
+    switch(kind){
+        case DEADLINE_IDLE:
+            return idleTimeout;
+        case DEADLINE_HEADER:
+            return headerTimeout;
+        case DEADLINE_TRANSFER:
+            return transferTimeout;
+        default:
+            return 0;
+    }
+}
+
+
+const char *deadlineMessage(deadlineKind kind){
+    switch(kind){
+        case DEADLINE_IDLE:
+            return "Timeout. No message received from client";
+        case DEADLINE_HEADER:
+            return "Timeout. Command line not completed";
+        case DEADLINE_TRANSFER:
+            return "Timeout. Reply not sent in time";
+        default:
+            return "Timeout";
+    }
+}
+
+
+//SO_RCVTIMEO or SO_SNDTIMEO of a blocking socket (0: no timeout)
+static void setSocketTimeout(int socket, int option, unsigned seconds){
+    struct timeval tval;
+    
+    if(seconds == 0){
+        return;
+    }
+    tval.tv_sec = seconds;
+    tval.tv_usec = 0;
+    if(setsockopt(socket, SOL_SOCKET, option, &tval, sizeof(tval)) < 0){
+        LOG(LVL_WARN, "Setting socket timeout failed: %s", strerror(errno));
+    }
+}
+
+
+//print command line usage and exit
+static void usage(void){
+    printf("Command line error. Usage: %s [--mode=fork|epoll|uring|prefork|threads] [--workers=n] [--worker-mode=seq|epoll|uring] [--pin]\n"
+           "\t[--threads=n] [--disk-threads=n]\n"
+           "\t[--chunk=bytes] [--send=sendfile|splice|copy] [--cache=bytes] [--cache-max-file=bytes] [--index-max=files]\n"
+           "\t[--metrics-port=port] [--log-level=error|warn|info|debug] [--log-sample=n]\n"
+           "\t[--idle-timeout=s] [--header-timeout=s] [--transfer-timeout=s]\n"
+           "\t[--rate-conn=bytes/s] [--rate-ip=bytes/s] [--rate-total=bytes/s] [--pacing] [--shaping-file=path]\n"
+           "\t[--max-conns=n] [--max-per-ip=n] [--backlog=n]\n"
+           "\t[--tls=user|ktls --tls-cert=pem [--tls-key=pem]] (fork or prefork with seq workers) [--unix=path] <port>\n", prog_name);
+    exit(1);
+}
+
+
 //signal handler for SIGCHLD signal
 static void sigchldHandler(int signo){
     pid_t pid;
     int stat;
     
     //option WNOHANG: if the child is running the caller does not block it
+    //printf() is not async signal safe: the record is queued without formatting
     while ((pid = waitpid(-1, &stat, WNOHANG))>0){
-        printf("\n");
-        printf("-> Server process %d terminated\n\n", pid);
+        logSignalSafe(LVL_DEBUG, "Server process terminated:", pid);
+        //the connection served by the process no longer counts against the limits
+        admissionRelease(pid);
+        //and the cached files it was sending are no longer pinned
+        fileCacheReap(pid);
+        shaperRelease(pid);
+        //a prefork worker is never expected to terminate: the master respawns it
+        preforkChildExited(pid);
     }
     return;
 }
@@ -343,7 +1087,7 @@ static void sigchldHandler(int signo){
 
 //signal handler for SIGPIPE signal
 static void sigpipeHandler(int signo){
-    printf("-> Broken pipe!\n");
+    logSignalSafe(LVL_WARN, "Broken pipe!", -1);
     return;
 }
 
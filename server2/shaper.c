@@ -0,0 +1,574 @@
+/*
+ 
+ module: shaper.c
+ 
+ purpose: bandwidth shaping of the file bodies. Every connection has a
+          token bucket of --rate-conn bytes per second, every client
+          address one of --rate-ip shared by all its connections, and
+          --rate-total is split among the transfers in progress by weight
+          (weighted fair share): a transfer of weight w gets
+          total * w / (sum of the weights of the transfers in progress).
+          The weights are given per address by the shaping file. The
+          transfers of an address share its rate equally in the same way,
+          its bucket only catches what their own buckets let through.
+          
+          The engines ask shaperGrant() before every send step: it
+          returns the size of the step (about SHAPERQUANTUMMS of the
+          rate, so the transfers are interleaved in small quanta), or 0
+          and the milliseconds to wait when a bucket is empty. The bytes
+          actually sent are charged afterwards, a bucket can go in debt
+          and then waits longer. With --pacing the rate of the connection
+          is also given to the kernel with SO_MAX_PACING_RATE, which
+          spreads the packets of a step instead of sending them in a
+          burst.
+          
+          The configuration, the address buckets and the sum of the
+          active weights live in an anonymous MAP_SHARED mapping created
+          before any fork, so the limits hold across the processes of the
+          fork and prefork engines as well. The configuration is read
+          without any lock under a sequence number (odd while written);
+          the address buckets are protected by a process shared robust
+          mutex. With --shaping-file a thread of the main process reads
+          the file again on SIGHUP and publishes the new limits: every
+          connection applies them at its next send step.
+          
+          A connection served by a process of its own (fork engine,
+          sequential prefork worker, local listener) is also recorded on
+          behalf of the process (shaperHold(), a shared word per pid
+          packing its address bucket, its weight and whether it is
+          transferring): the SIGCHLD handlers give the bucket and the
+          weight back with shaperRelease() when the process dies while
+          serving, so its share is not counted forever. The references of
+          the buckets are therefore changed with atomic operations.
+          
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "server2.h"
+#include "shaper.h"
+#include "transfer.h"
+#include "stats.h"
+#include "log.h"
+
+#define SHAPERLINELENGTH    256
+#define HELDACTIVE          0x10000u                //held word: slot + 1 in the low 16 bits, then this bit, then the weight
+
+struct shaperConfig {
+    uint64_t connRate, ipRate, totalRate;           //bytes per second, 0: no limit
+    int pacing;
+    unsigned nweights;
+    struct {
+        uint32_t net, mask;             //network byte order
+        uint32_t weight;
+    } weights[SHAPERMAXWEIGHTS];        //first match, weight 1 if none
+};
+
+struct ipBucket {
+    uint32_t ip;
+    uint32_t refs;                      //connections of the address, 0: reusable
+    uint32_t active;                    //its transfers in progress, they share the rate equally
+    int64_t tokens;
+    uint64_t last;                      //0: full
+};
+
+struct shaperArea {
+    uint64_t seq;                       //odd while the configuration is being written
+    struct shaperConfig config;
+    uint64_t activeWeight;              //weights of the transfers in progress, all processes
+    pthread_mutex_t lock;               //address buckets
+    struct ipBucket ips[SHAPERIPSLOTS];
+};
+
+uint64_t shaperConnRate = 0;                        //--rate-conn, bytes per second
+uint64_t shaperIpRate = 0;                          //--rate-ip
+uint64_t shaperTotalRate = 0;                       //--rate-total
+int shaperPacing = 0;                               //--pacing
+const char *shaperFile = NULL;                      //--shaping-file, read again on SIGHUP
+
+static struct shaperArea *area = NULL;
+static uint64_t *held = NULL;                       //packed state of the connection held by each pid, 0 if none
+static long heldCount = 0;
+
+static int loadConfig(struct shaperConfig *c);
+static void publishConfig(const struct shaperConfig *c);
+static void *reloadThread(void *arg);
+static void applyConfig(struct shaper *s);
+static unsigned refill(int64_t *tokens, uint64_t *last, uint64_t rate, uint64_t now);
+static size_t quantum(uint64_t rate);
+static void pace(struct shaper *s, uint64_t rate);
+static void lockBuckets(void);
+static uint64_t nowNs(void);
+static void recordHeld(const struct shaper *s);
+
+
+
+//creates the shared limits before any fork; nothing is created (and nothing is shaped) without any limit
+int shaperInit(void){
+    
+    struct shaperConfig config;
+    pthread_mutexattr_t attr;
+    pthread_t tid;
+    pthread_attr_t tattr;
+    sigset_t set, old;
+    
+    if(shaperConnRate == 0 && shaperIpRate == 0 && shaperTotalRate == 0 && shaperFile == NULL){
+        return 0;
+    }
+    if(loadConfig(&config) < 0){
+        return -1;
+    }
+    if((area = mmap(NULL, sizeof(*area), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED){
+        area = NULL;
+        return -1;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if((errno = pthread_mutex_init(&area->lock, &attr)) != 0){
+        munmap(area, sizeof(*area));
+        area = NULL;
+        return -1;
+    }
+    pthread_mutexattr_destroy(&attr);
+    //one word per possible pid: only the pages of the pids actually used are ever touched
+    heldCount = readPidMax();
+    if((held = mmap(NULL, heldCount * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED){
+        held = NULL;
+        heldCount = 0;
+    }
+    publishConfig(&config);
+    if(shaperFile == NULL){
+        return 0;
+    }
+    
+    //SIGHUP is taken by the reload thread only: blocked here, in every process forked later too
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &old);
+    pthread_attr_init(&tattr);
+    pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&tid, &tattr, reloadThread, NULL) != 0){
+        LOG(LVL_WARN, "Shaping file reload not available: limits fixed until restart");
+    }
+    pthread_attr_destroy(&tattr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+
+//rate limits of a new connection: takes the bucket of its address
+void shaperOpen(struct shaper *s, int socket, const struct sockaddr_in *caddr){
+    
+    struct ipBucket *b, *bucket = NULL;
+    uint32_t i, h;
+    
+    memset(s, 0, sizeof(*s));
+    s->socket = socket;
+    s->slot = -1;
+    s->paced = ~0U;
+    s->weight = 1;
+    if(area == NULL){
+        return;
+    }
+    s->ip = caddr->sin_addr.s_addr;
+    
+    //the bucket of the address if it has one (even unused: a reconnection gets no new burst), else a reusable one
+    h = (ntohl(s->ip) * 2654435761u) % SHAPERIPSLOTS;
+    lockBuckets();
+    for(i=0; i<SHAPERPROBES; i++){
+        b = &area->ips[(h + i) % SHAPERIPSLOTS];
+        if(b->ip == s->ip && (__atomic_load_n(&b->refs, __ATOMIC_RELAXED) > 0 || b->last != 0)){
+            bucket = b;
+            break;
+        }
+        if(__atomic_load_n(&b->refs, __ATOMIC_RELAXED) == 0 && bucket == NULL){
+            bucket = b;
+        }
+    }
+    if(bucket != NULL){
+        if(bucket->ip != s->ip){
+            bucket->ip = s->ip;
+            bucket->last = 0;
+        }
+        __atomic_add_fetch(&bucket->refs, 1, __ATOMIC_RELAXED);
+        s->slot = (int)(bucket - area->ips);
+    }
+    pthread_mutex_unlock(&area->lock);
+    if(s->slot < 0){
+        LOG(LVL_DEBUG, "(socket %d) No rate bucket left for the address, limited per connection only", socket);
+    }
+}
+
+
+//bytes the connection may send now (at most transferChunkSize), 0 if it must wait *delay milliseconds
+size_t shaperGrant(struct shaper *s, unsigned *delay){
+    
+    uint64_t now, rate, share, active;
+    unsigned wait, w;
+    size_t bytes;
+    struct ipBucket *b;
+    
+    if(area == NULL){
+        return transferChunkSize;
+    }
+    if(__atomic_load_n(&area->seq, __ATOMIC_ACQUIRE) != s->seq){
+        applyConfig(s);
+    }
+    if(!s->active){
+        s->active = 1;
+        __atomic_fetch_add(&area->activeWeight, s->weight, __ATOMIC_RELAXED);
+        if(s->slot >= 0){
+            __atomic_fetch_add(&area->ips[s->slot].active, 1, __ATOMIC_RELAXED);
+        }
+        recordHeld(s);
+    }
+    now = nowNs();
+    
+    //the share of the rate of the address, then of the total rate by weight: the bucket of the
+    //connection paces it, so the transfers of an engine serving many of them take turns
+    rate = s->connRate;
+    if(s->ipRate > 0 && s->slot >= 0){
+        active = __atomic_load_n(&area->ips[s->slot].active, __ATOMIC_RELAXED);
+        share = s->ipRate / (active > 1 ? active : 1);
+        if(rate == 0 || share < rate){
+            rate = share;
+        }
+    }
+    if(s->totalRate > 0){
+        active = __atomic_load_n(&area->activeWeight, __ATOMIC_RELAXED);
+        share = s->totalRate * s->weight / (active > s->weight ? active : s->weight);
+        share = share > 0 ? share : 1;
+        if(rate == 0 || share < rate){
+            rate = share;
+        }
+    }
+    wait = refill(&s->tokens, &s->last, rate, now);
+    bytes = quantum(rate);
+    if(s->ipRate > 0 && s->slot >= 0){
+        b = &area->ips[s->slot];
+        lockBuckets();
+        w = refill(&b->tokens, &b->last, s->ipRate, now);
+        pthread_mutex_unlock(&area->lock);
+        wait = w > wait ? w : wait;
+        bytes = quantum(s->ipRate) < bytes ? quantum(s->ipRate) : bytes;
+    }
+    pace(s, rate);
+    if(wait > 0){
+        statsAdd(STAT_THROTTLED, 1);
+        *delay = wait;
+        return 0;
+    }
+    return bytes;
+}
+
+
+//bytes sent after a grant, taken from the buckets even if they go in debt
+void shaperCharge(struct shaper *s, size_t bytes){
+    if(area == NULL || bytes == 0){
+        return;
+    }
+    s->tokens -= (int64_t)bytes;
+    if(s->ipRate > 0 && s->slot >= 0){
+        lockBuckets();
+        area->ips[s->slot].tokens -= (int64_t)bytes;
+        pthread_mutex_unlock(&area->lock);
+    }
+}
+
+
+//the transfer is over: its weight leaves the fair share of the others
+void shaperIdle(struct shaper *s){
+    if(area != NULL && s->active){
+        //the record first: a process dying in between must not give the weight back twice
+        s->active = 0;
+        recordHeld(s);
+        __atomic_fetch_sub(&area->activeWeight, s->weight, __ATOMIC_RELAXED);
+        if(s->slot >= 0){
+            __atomic_fetch_sub(&area->ips[s->slot].active, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+void shaperClose(struct shaper *s){
+    
+    shaperIdle(s);
+    if(area != NULL && s->holder > 0){
+        __atomic_store_n(&held[s->holder], 0, __ATOMIC_RELEASE);
+        s->holder = 0;
+    }
+    if(area != NULL && s->slot >= 0){
+        __atomic_sub_fetch(&area->ips[s->slot].refs, 1, __ATOMIC_RELAXED);
+        s->slot = -1;
+    }
+}
+
+
+//the connection is the only one of this process: if the process dies while serving it,
+//shaperRelease() gives back its bucket and its weight
+void shaperHold(struct shaper *s){
+    
+    pid_t pid = getpid();
+    
+    if(area == NULL || held == NULL || pid >= heldCount){
+        return;
+    }
+    s->holder = pid;
+    recordHeld(s);
+}
+
+
+//gives back what the connection of pid still holds, if any (async signal safe: called by the SIGCHLD handlers)
+void shaperRelease(pid_t pid){
+    
+    uint64_t h;
+    int slot;
+    
+    if(held == NULL || pid <= 0 || pid >= heldCount){
+        return;
+    }
+    if((h = __atomic_exchange_n(&held[pid], 0, __ATOMIC_ACQ_REL)) == 0){
+        return;
+    }
+    slot = (int)(h & 0xffff) - 1;
+    if(h & HELDACTIVE){
+        __atomic_fetch_sub(&area->activeWeight, h >> 32, __ATOMIC_RELAXED);
+        if(slot >= 0){
+            __atomic_fetch_sub(&area->ips[slot].active, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if(slot >= 0){
+        __atomic_sub_fetch(&area->ips[slot].refs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+//the command line limits, overridden by the lines of the shaping file if any. Returns -1 if it cannot be read
+static int loadConfig(struct shaperConfig *c){
+    
+    FILE *f;
+    char line[SHAPERLINELENGTH], key[32], value[64], *p;
+    unsigned lineno = 0, bits, weight;
+    struct in_addr net;
+    uint64_t *rate;
+    int n;
+    
+    memset(c, 0, sizeof(*c));
+    c->connRate = shaperConnRate;
+    c->ipRate = shaperIpRate;
+    c->totalRate = shaperTotalRate;
+    c->pacing = shaperPacing;
+    if(shaperFile == NULL){
+        return 0;
+    }
+    if((f = fopen(shaperFile, "r")) == NULL){
+        LOG(LVL_ERROR, "Opening shaping file %s failed: %s", shaperFile, strerror(errno));
+        return -1;
+    }
+    
+    //"conn-rate n", "ip-rate n", "total-rate n", "pacing on|off", "weight address[/bits] n", '#' starts a comment
+    while(fgets(line, sizeof(line), f) != NULL){
+        lineno++;
+        if((p = strchr(line, '#')) != NULL){
+            *p = '\0';
+        }
+        if((n = sscanf(line, "%31s %63s %u", key, value, &weight)) <= 0){
+            continue;
+        }
+        rate = strcmp(key, "conn-rate") == 0 ? &c->connRate : strcmp(key, "ip-rate") == 0 ? &c->ipRate :
+               strcmp(key, "total-rate") == 0 ? &c->totalRate : NULL;
+        if(rate != NULL && n == 2 && sscanf(value, "%" SCNu64, rate) == 1){
+            continue;
+        }
+        if(strcmp(key, "pacing") == 0 && n == 2 && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0)){
+            c->pacing = strcmp(value, "on") == 0;
+            continue;
+        }
+        if(strcmp(key, "weight") == 0 && n == 3 && weight > 0 && weight <= SHAPERMAXWEIGHT && c->nweights < SHAPERMAXWEIGHTS){
+            bits = 32;
+            if((p = strchr(value, '/')) != NULL){
+                *p++ = '\0';
+                if(sscanf(p, "%u", &bits) != 1 || bits > 32){
+                    bits = 33;
+                }
+            }
+            if(bits <= 32 && inet_pton(AF_INET, value, &net) == 1){
+                c->weights[c->nweights].mask = bits == 0 ? 0 : htonl(0xffffffffu << (32 - bits));
+                c->weights[c->nweights].net = net.s_addr & c->weights[c->nweights].mask;
+                c->weights[c->nweights].weight = weight;
+                c->nweights++;
+                continue;
+            }
+        }
+        LOG(LVL_ERROR, "Shaping file %s, line %u: invalid setting", shaperFile, lineno);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+
+//single writer: shaperInit(), then the reload thread
+static void publishConfig(const struct shaperConfig *c){
+    
+    uint64_t seq = area->seq;
+    
+    __atomic_store_n(&area->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    area->config = *c;
+    __atomic_store_n(&area->seq, seq + 2, __ATOMIC_RELEASE);
+    LOG(LVL_INFO, "Rate limits: %" PRIu64 " B/s per connection, %" PRIu64 " B/s per address, %" PRIu64 " B/s in total, %u weights%s",
+        c->connRate, c->ipRate, c->totalRate, c->nweights, c->pacing ? ", kernel pacing" : "");
+}
+
+
+//SIGHUP: the shaping file is read again, a file with errors leaves the limits as they are
+static void *reloadThread(void *arg){
+    
+    struct shaperConfig config;
+    sigset_t set;
+    int sig;
+    
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    for( ; ; ){
+        if(sigwait(&set, &sig) != 0){
+            continue;
+        }
+        if(loadConfig(&config) < 0){
+            LOG(LVL_WARN, "Shaping file not reloaded, the current limits are kept");
+            continue;
+        }
+        publishConfig(&config);
+    }
+    return NULL;
+}
+
+
+//copy of the current configuration, read again if it changed meanwhile
+static void applyConfig(struct shaper *s){
+    
+    const struct shaperConfig *c = &area->config;
+    uint64_t seq;
+    uint32_t weight;
+    unsigned i;
+    
+    do{
+        //the writer holds the odd number for a few stores only
+        while((seq = __atomic_load_n(&area->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        s->connRate = c->connRate;
+        s->ipRate = c->ipRate;
+        s->totalRate = c->totalRate;
+        s->pacing = c->pacing;
+        weight = 1;
+        for(i=0; i<c->nweights && i<SHAPERMAXWEIGHTS; i++){
+            if((s->ip & c->weights[i].mask) == c->weights[i].net){
+                weight = c->weights[i].weight;
+                break;
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }while(__atomic_load_n(&area->seq, __ATOMIC_RELAXED) != seq);
+    
+    if(s->active){
+        __atomic_fetch_add(&area->activeWeight, (uint64_t)weight - s->weight, __ATOMIC_RELAXED);
+    }
+    s->weight = weight;
+    s->seq = seq;
+    recordHeld(s);
+}
+
+
+//adds the tokens earned since the last refill, up to the burst. Returns the milliseconds before the bucket has tokens again
+static unsigned refill(int64_t *tokens, uint64_t *last, uint64_t rate, uint64_t now){
+    
+    int64_t burst;
+    
+    if(rate == 0){
+        *tokens = 0;
+        *last = now;
+        return 0;
+    }
+    burst = (int64_t)(rate * SHAPERBURSTMS / 1000);
+    burst = burst > SHAPERMINQUANTUM ? burst : SHAPERMINQUANTUM;
+    if(*last == 0 || now - *last >= (uint64_t)SHAPERBURSTMS * 1000000 * 4){
+        *tokens = burst;
+    }else{
+        *tokens += (int64_t)((double)(now - *last) * rate / 1e9);
+    }
+    *tokens = *tokens < burst ? *tokens : burst;
+    *last = now;
+    if(*tokens > 0){
+        return 0;
+    }
+    return (unsigned)(((uint64_t)(1 - *tokens) * 1000 + rate - 1) / rate);
+}
+
+
+//a send step of about SHAPERQUANTUMMS at the given rate
+static size_t quantum(uint64_t rate){
+    
+    uint64_t q = rate * SHAPERQUANTUMMS / 1000;
+    
+    if(rate == 0 || q >= transferChunkSize){
+        return transferChunkSize;
+    }
+    return q > SHAPERMINQUANTUM ? (size_t)q : (transferChunkSize < SHAPERMINQUANTUM ? transferChunkSize : SHAPERMINQUANTUM);
+}
+
+
+//--pacing: the kernel spreads the packets at the rate of the connection (set again only when it changes)
+static void pace(struct shaper *s, uint64_t rate){
+    
+    unsigned value = (s->pacing && rate > 0) ? (rate < UINT32_MAX ? (unsigned)rate : UINT32_MAX - 1) : ~0U;
+    
+    if(value == s->paced){
+        return;
+    }
+    if(setsockopt(s->socket, SOL_SOCKET, SO_MAX_PACING_RATE, &value, sizeof(value)) < 0){
+        LOG(LVL_DEBUG, "(socket %d) Setting the pacing rate failed: %s", s->socket, strerror(errno));
+    }
+    s->paced = value;
+}
+
+
+static void lockBuckets(void){
+    //the previous owner died: a bucket is only changed by short sections, keep it
+    if(pthread_mutex_lock(&area->lock) == EOWNERDEAD){
+        pthread_mutex_consistent(&area->lock);
+    }
+}
+
+
+static uint64_t nowNs(void){
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+//the state of a held connection, as shaperRelease() must undo it
+static void recordHeld(const struct shaper *s){
+    if(s->holder > 0){
+        __atomic_store_n(&held[s->holder], (uint64_t)s->weight << 32 | (s->active ? HELDACTIVE : 0) | (uint64_t)(s->slot + 1),
+                         __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ 
+ module: shaper.h
+ 
+ purpose: definitions of functions in shaper.c
+ 
+ */
+
+
+#ifndef _SHAPER_H
+
+#define _SHAPER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#define SHAPERIPSLOTS       4096                    //client addresses with a bucket at the same time
+#define SHAPERPROBES        16                      //slots tried for an address, then it goes unlimited
+#define SHAPERMAXWEIGHTS    64                      //weight lines of the shaping file
+#define SHAPERMAXWEIGHT     1000
+#define SHAPERBURSTMS       250                     //tokens a bucket keeps, in milliseconds of its rate
+#define SHAPERQUANTUMMS     50                      //bytes of a send step, in milliseconds of the rate
+#define SHAPERMINQUANTUM    (16*1024)
+
+//rate limits of a connection, embedded in the connection of every engine
+struct shaper {
+    uint32_t ip;                        //client address, network byte order
+    int socket;
+    int slot;                           //bucket of the address, -1 if none
+    uint64_t seq;                       //configuration applied, 0 if none yet
+    uint64_t connRate, ipRate, totalRate;           //bytes per second, 0: no limit
+    int pacing;
+    uint32_t weight;
+    int active;                         //a transfer is in progress, its weight is counted
+    int64_t tokens;                     //bucket of the connection, negative while in debt
+    uint64_t last;                      //nanoseconds of its last refill, 0: full
+    unsigned paced;                     //SO_MAX_PACING_RATE of the socket, ~0U if not set
+    pid_t holder;                       //process recorded as holding it (shaperHold()), 0 if none
+};
+
+extern uint64_t shaperConnRate, shaperIpRate, shaperTotalRate;
+extern int shaperPacing;
+extern const char *shaperFile;
+
+int shaperInit(void);
+void shaperOpen(struct shaper *s, int socket, const struct sockaddr_in *caddr);
+size_t shaperGrant(struct shaper *s, unsigned *delay);
+void shaperCharge(struct shaper *s, size_t bytes);
+void shaperIdle(struct shaper *s);
+void shaperClose(struct shaper *s);
+void shaperHold(struct shaper *s);
+void shaperRelease(pid_t pid);
+
+#endif
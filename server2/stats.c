@@ -0,0 +1,345 @@
+/*
+ 
+ module: stats.c
+ 
+ purpose: live counters of the server, shared by all its processes.
+          The counters live in an anonymous MAP_SHARED mapping created by
+          statsInit() before any fork. Every process (or thread of the
+          threaded engine) adds to the slot chosen by statsAttach()
+          (thread id based, one cache line each) with
+          relaxed atomic additions: no lock is ever taken on the hot
+          path, and two processes sharing a slot only cost a contended
+          cache line. A reader sums the slots.
+ 
+          Per file hit counts are kept in an open addressing table:
+          a free entry is claimed with a compare and swap, so the table
+          is lock free as well. Files not fitting in the table are only
+          counted in the "other" total.
+ 
+          The report, in the Prometheus text format, is the reply of the
+          STATS command and, with --metrics-port, the page served over
+          HTTP by a dedicated process.
+ 
+ */
+
+
+#define _GNU_SOURCE                                 //prctl(), syscall()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include "./../errlib.h"
+#include "./../sockwrap.h"
+#include "server2.h"
+#include "stats.h"
+#include "filecache.h"
+#include "admission.h"
+#include "log.h"
+
+#define STATSNAMELENGTH     128                     //longer names are only counted in the total
+#define FILE_FREE           0
+#define FILE_CLAIMED        1                       //name being written
+#define FILE_READY          2
+#define CLAIMSPINS          100                     //a process died while claiming: the entry is skipped
+
+struct statsSlot {
+    uint64_t counter[STAT_COUNT];
+} __attribute__((aligned(64)));
+
+struct fileHits {
+    int state;
+    uint32_t hash;
+    uint64_t hits;
+    char name[STATSNAMELENGTH];
+};
+
+struct statsArea {
+    struct statsSlot slots[STATSSLOTS];
+    uint64_t otherFileHits;             //files not fitting in the table
+    struct fileHits files[STATSFILES];
+};
+
+//names of the counters in the report, in the order of statCounter
+static const struct {
+    const char *name;
+    const char *label;                  //type of error or refusal, NULL for the other counters
+} counterNames[STAT_COUNT] = {
+    {"server2_connections_accepted_total", NULL},
+    {"server2_connections_closed_total", NULL},
+    {"server2_connections_refused_total", "max_conns"},
+    {"server2_connections_refused_total", "max_per_ip"},
+    {"server2_tls_sessions_total", "user"},
+    {"server2_tls_sessions_total", "kernel"},
+    {"server2_gets_total", NULL},
+    {"server2_descriptors_passed_total", NULL},
+    {"server2_stats_total", NULL},
+    {"server2_lists_total", NULL},
+    {"server2_not_modified_total", NULL},
+    {"server2_deltas_total", NULL},
+    {"server2_bytes_sent_total", NULL},
+    {"server2_bytes_reused_total", NULL},
+    {"server2_timeouts_total", NULL},
+    {"server2_throttled_total", NULL},
+    {"server2_errors_total", "invalid_command"},
+    {"server2_errors_total", "invalid_filename"},
+    {"server2_errors_total", "open_failed"},
+    {"server2_errors_total", "stat_failed"},
+    {"server2_errors_total", "too_large_for_get"},
+    {"server2_errors_total", "invalid_range"},
+    {"server2_errors_total", "send_failed"},
+    {"server2_errors_total", "receive_failed"},
+    {"server2_errors_total", "tls_handshake"},
+};
+
+int metricsPort = 0;                                //--metrics-port, 0 disables the endpoint
+
+static struct statsArea *area = NULL;
+static __thread struct statsSlot *slot = NULL;      //slot of this process (or thread)
+
+static uint32_t hashName(const char *name);
+static int compareHits(const void *a, const void *b);
+static void metricsServerLoop(int passive_socket);
+
+
+
+//creates the shared counters, before any fork
+int statsInit(void){
+    
+    if((area = mmap(NULL, sizeof(*area), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED){
+        area = NULL;
+        return -1;
+    }
+    slot = &area->slots[0];
+    return 0;
+}
+
+
+//called by a new process or thread: from now on it adds to its own slot (the tid of a process is its pid)
+void statsAttach(void){
+    if(area != NULL){
+        slot = &area->slots[syscall(SYS_gettid) % STATSSLOTS];
+    }
+}
+
+
+void statsAdd(statCounter counter, uint64_t value){
+    if(slot != NULL){
+        __atomic_fetch_add(&slot->counter[counter], value, __ATOMIC_RELAXED);
+    }
+}
+
+
+//one more request of filename
+void statsFileHit(const char *filename){
+    
+    uint32_t hash, i, probe;
+    struct fileHits *f;
+    int expected, spin;
+    
+    if(area == NULL){
+        return;
+    }
+    if(strlen(filename) >= STATSNAMELENGTH){
+        __atomic_fetch_add(&area->otherFileHits, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    hash = hashName(filename);
+    for(probe=0; probe<STATSFILES; probe++){
+        i = (hash + probe) % STATSFILES;
+        f = &area->files[i];
+        expected = FILE_FREE;
+        if(__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) == FILE_FREE &&
+           __atomic_compare_exchange_n(&f->state, &expected, FILE_CLAIMED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+            //the entry is ours: name first, then it becomes visible
+            strcpy(f->name, filename);
+            f->hash = hash;
+            __atomic_fetch_add(&f->hits, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&f->state, FILE_READY, __ATOMIC_RELEASE);
+            return;
+        }
+        //an entry being claimed right now may be the same name: its owner is only copying the name
+        for(spin=0; spin<CLAIMSPINS && __atomic_load_n(&f->state, __ATOMIC_ACQUIRE) == FILE_CLAIMED; spin++){
+            sched_yield();
+        }
+        if(__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) == FILE_READY && f->hash == hash && strcmp(f->name, filename) == 0){
+            __atomic_fetch_add(&f->hits, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    __atomic_fetch_add(&area->otherFileHits, 1, __ATOMIC_RELAXED);
+}
+
+
+//the report in the Prometheus text format, returns its length (truncated to size-1)
+size_t statsFormat(char *buf, size_t size){
+    
+    uint64_t total[STAT_COUNT];
+    struct fileHits *top[STATSFILES];
+    struct cacheStats cs;
+    struct admissionStats as;
+    const char *p;
+    size_t len = 0;
+    int i, j, nfiles = 0;
+    
+#define EMIT(...) do{ int n_ = snprintf(buf+len, size-len, __VA_ARGS__); \
+                      len = (n_ < 0 || (size_t)n_ >= size-len) ? size-1 : len+n_; }while(0)
+    
+    if(size == 0){
+        return 0;
+    }
+    buf[0] = '\0';
+    memset(total, 0, sizeof(total));
+    if(area != NULL){
+        for(i=0; i<STATSSLOTS; i++){
+            for(j=0; j<STAT_COUNT; j++){
+                total[j] += __atomic_load_n(&area->slots[i].counter[j], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    
+    for(i=0; i<STAT_COUNT; i++){
+        if(i == 0 || strcmp(counterNames[i].name, counterNames[i-1].name) != 0){
+            EMIT("# TYPE %s counter\n", counterNames[i].name);
+        }
+        if(counterNames[i].label != NULL){
+            EMIT("%s{type=\"%s\"} %" PRIu64 "\n", counterNames[i].name, counterNames[i].label, total[i]);
+        }else{
+            EMIT("%s %" PRIu64 "\n", counterNames[i].name, total[i]);
+        }
+    }
+    EMIT("# TYPE server2_connections_active gauge\n");
+    EMIT("server2_connections_active %" PRIu64 "\n",
+         total[STAT_CONN_ACCEPTED] > total[STAT_CONN_CLOSED] ? total[STAT_CONN_ACCEPTED] - total[STAT_CONN_CLOSED] : 0);
+    admissionGetStats(&as);
+    if(admissionMaxConns > 0){
+        EMIT("# TYPE server2_connections_admitted gauge\nserver2_connections_admitted %" PRIu32 "\n", as.active);
+    }
+    EMIT("# TYPE server2_accept_queue_length gauge\nserver2_accept_queue_length %" PRIu32 "\n", as.queueLength);
+    EMIT("# TYPE server2_accept_queue_peak gauge\nserver2_accept_queue_peak %" PRIu32 "\n", as.queuePeak);
+    EMIT("# TYPE server2_accept_queue_backlog gauge\nserver2_accept_queue_backlog %" PRIu32 "\n", as.backlog);
+    
+    if(fileCacheEnabled()){
+        fileCacheGetStats(&cs);
+        EMIT("# TYPE server2_cache_hits_total counter\nserver2_cache_hits_total %" PRIu64 "\n", cs.hits);
+        EMIT("# TYPE server2_cache_misses_total counter\nserver2_cache_misses_total %" PRIu64 "\n", cs.misses);
+        EMIT("# TYPE server2_cache_evictions_total counter\nserver2_cache_evictions_total %" PRIu64 "\n", cs.evictions);
+        EMIT("# TYPE server2_cache_invalidations_total counter\nserver2_cache_invalidations_total %" PRIu64 "\n", cs.invalidations);
+        EMIT("# TYPE server2_cache_bytes gauge\nserver2_cache_bytes %" PRIu64 "\n", cs.bytesUsed);
+    }
+    
+    //the most requested files
+    if(area != NULL){
+        for(i=0; i<STATSFILES; i++){
+            if(__atomic_load_n(&area->files[i].state, __ATOMIC_ACQUIRE) == FILE_READY){
+                top[nfiles++] = &area->files[i];
+            }
+        }
+        qsort(top, nfiles, sizeof(top[0]), compareHits);
+        EMIT("# TYPE server2_file_requests_total counter\n");
+        for(i=0; i<nfiles && i<STATSTOPFILES; i++){
+            EMIT("server2_file_requests_total{file=\"");
+            for(p = top[i]->name; *p != '\0'; p++){
+                if(*p == '"' || *p == '\\'){
+                    EMIT("\\%c", *p);
+                }else{
+                    EMIT("%c", *p);
+                }
+            }
+            EMIT("\"} %" PRIu64 "\n", __atomic_load_n(&top[i]->hits, __ATOMIC_RELAXED));
+        }
+        EMIT("server2_file_requests_total{file=\"\"} %" PRIu64 "\n", __atomic_load_n(&area->otherFileHits, __ATOMIC_RELAXED));
+    }
+#undef EMIT
+    return len;
+}
+
+
+//--metrics-port: a process serving the report over HTTP, ends with the server
+void metricsServerStart(void){
+    
+    struct sockaddr_in maddr;
+    int passive_socket;
+    pid_t pid;
+    
+    if(metricsPort == 0){
+        return;
+    }
+    bzero(&maddr, sizeof(maddr));
+    maddr.sin_family = AF_INET;
+    maddr.sin_port = htons(metricsPort);
+    maddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    
+    passive_socket = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    Bind(passive_socket, (struct sockaddr *)&maddr, sizeof(maddr));
+    Listen(passive_socket, 16);
+    if((pid = fork()) < 0){
+        err_sys("(%s) error - fork() failed", prog_name);
+    }
+    if(pid > 0){
+        Close(passive_socket);
+        LOG(LVL_INFO, "Creating metrics endpoint on port %d\t\t\t-> Done (process %d)", metricsPort, pid);
+        return;
+    }
+    //the endpoint must not outlive the server
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    metricsServerLoop(passive_socket);
+    exit(0);
+}
+
+
+//one request at a time: whatever the request is, the answer is the report
+static void metricsServerLoop(int passive_socket){
+    
+    static char report[STATSMAXTEXT];
+    char request[RCVBUFFERLENGTH];
+    char header[256];
+    struct timeval tval;
+    size_t len, headerlen;
+    int s;
+    
+    for( ; ; ){
+        if((s = accept(passive_socket, NULL, NULL)) < 0){
+            continue;
+        }
+        tval.tv_sec = 5;
+        tval.tv_usec = 0;
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tval, sizeof(tval));
+        //the request line is read and ignored
+        if(recv(s, request, sizeof(request), 0) > 0){
+            len = statsFormat(report, sizeof(report));
+            headerlen = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+            if(sendn(s, header, headerlen, MSG_NOSIGNAL) == headerlen){
+                sendn(s, report, len, MSG_NOSIGNAL);
+            }
+        }
+        close(s);
+    }
+}
+
+
+//FNV-1a
+static uint32_t hashName(const char *name){
+    uint32_t h = 2166136261u;
+    
+    for( ; *name != '\0'; name++){
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+
+static int compareHits(const void *a, const void *b){
+    uint64_t x = (*(struct fileHits * const *)a)->hits, y = (*(struct fileHits * const *)b)->hits;
+    return (x < y) - (x > y);
+}
@@ -0,0 +1,61 @@
+/*
+ 
+ module: stats.h
+ 
+ purpose: definitions of functions in stats.c
+ 
+ */
+
+
+#ifndef _STATS_H
+
+#define _STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//counters of the server, summed over the slots of all the processes
+typedef enum {
+    STAT_CONN_ACCEPTED,                             //connections accepted
+    STAT_CONN_CLOSED,                               //connections closed (active = accepted - closed)
+    STAT_REFUSED,                                   //connections refused by --max-conns
+    STAT_REFUSED_ADDR,                              //connections refused by --max-per-ip
+    STAT_TLS_USER,                                  //--tls: sessions relayed in user space
+    STAT_TLS_KERNEL,                                //--tls: sessions offloaded to kernel TLS
+    STAT_GETS,                                      //files completely sent
+    STAT_PASSED,                                    //files passed as a descriptor (FGET), no byte sent
+    STAT_STATS,                                     //STATS commands served
+    STAT_LISTS,                                     //LIST commands served
+    STAT_NOT_MODIFIED,                              //IFMOD answered with "+NM", no body sent
+    STAT_DELTAS,                                    //DELTA replies completely sent
+    STAT_BYTES_SENT,                                //bytes of file bodies sent
+    STAT_BYTES_REUSED,                              //bytes of DELTA replies copied from the client copy, not sent
+    STAT_TIMEOUTS,                                  //connections closed for inactivity
+    STAT_THROTTLED,                                 //send steps delayed by the rate limits
+    STAT_ERR_COMMAND,                               //invalid or too long command
+    STAT_ERR_FILENAME,                              //invalid file name
+    STAT_ERR_OPEN,                                  //file cannot be opened
+    STAT_ERR_STAT,                                  //file statistics not available
+    STAT_ERR_TOO_LARGE,                             //file of 4 GB or more asked with GET
+    STAT_ERR_RANGE,                                 //RGET range out of the file
+    STAT_ERR_SEND,                                  //sending the reply failed
+    STAT_ERR_RECV,                                  //reading the command failed
+    STAT_ERR_TLS,                                   //TLS handshake failed
+    STAT_COUNT
+} statCounter;
+
+#define STATSSLOTS          64                      //counter slots, a process takes one by pid
+#define STATSFILES          1024                    //files whose hits are counted
+#define STATSTOPFILES       64                      //files reported, the most requested ones
+#define STATSMAXTEXT        16384                   //maximum length of the report
+
+extern int metricsPort;
+
+int statsInit(void);
+void statsAttach(void);
+void statsAdd(statCounter counter, uint64_t value);
+void statsFileHit(const char *filename);
+size_t statsFormat(char *buf, size_t size);
+void metricsServerStart(void);
+
+#endif
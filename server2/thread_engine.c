@@ -0,0 +1,895 @@
+/*
+ 
+ module: thread_engine.c
+ 
+ purpose: multi threaded server engine (--mode=threads). A few network
+          threads (--threads, one per online CPU by default) own the
+          connections: each one has its own epoll set, timer wheel and
+          connections, and the passive socket is registered in all the
+          sets with EPOLLEXCLUSIVE, so a new connection wakes one thread
+          only and stays with it. No process is created per connection.
+          When accept() lacks descriptors or memory, the thread takes the
+          passive socket out of its set for ADMITRETRYMS: the socket is
+          level triggered and would wake it again at once.
+ 
+          A network thread never blocks on the disk. Opening a file and
+          reading its chunks are jobs of the disk pool (diskpool.c); the
+          connection waits in its state while the thread serves the
+          others, and the finished job comes back through the completion
+          queue of the thread:
+ 
+            CONN_READ_CMD    -> waiting for a complete command line
+            CONN_OPENING     -> the pool is opening the requested file
+            CONN_SEND_HEADER -> sending "+OK\r\n", file size and timestamp
+            CONN_SEND_BODY   -> streaming the bytes of the requested file
+ 
+          A header followed by a body is not sent on its own: it is framed
+          in the transfer and leaves with the first bytes of the body.
+          
+          A MGET goes through the last three states for the record of
+          every file: the job opening a file also opens the next one and
+          reads its first bytes ahead, so the following record rarely
+          waits for the disk.
+          
+          The body is read into two buffers: the pool fills one while
+          the thread sends the other, so a fast client is limited by the
+          disk only when the page cache does not have the file. Files in
+          the file cache and the STATS report are sent from memory
+          without any job. A body over its rate limits (shaper.c) waits
+          for the throttle timer of the connection in the wheel of its
+          thread.
+ 
+          Every connection has at most one job in flight: a connection
+          closed meanwhile (timeout, error) is freed when its job comes
+          back. The jobs in flight of a thread are bounded by the length
+          of its completion queue; beyond that, or when the queues of the
+          pool are full, the connection waits in a list of the thread
+          and its job is submitted when a completion frees a place.
+ 
+ */
+
+
+#define _GNU_SOURCE                                 //accept4(), EPOLLEXCLUSIVE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include "./../errlib.h"
+#include "./../sockwrap.h"
+#include "server2.h"
+#include "thread_engine.h"
+#include "diskpool.h"
+#include "transfer.h"
+#include "request.h"
+#include "filecache.h"
+#include "stats.h"
+#include "log.h"
+#include "timerwheel.h"
+#include "shaper.h"
+#include "admission.h"
+
+#define MAXEVENTS           256                     //events returned by a single epoll_wait()
+#define ACCEPTBATCH         64                      //connections accepted for one event, then the other threads
+
+typedef enum {
+    CONN_READ_CMD,
+    CONN_OPENING,
+    CONN_SEND_HEADER,
+    CONN_SEND_BODY
+} connState;
+
+struct netThread;
+
+struct connection {
+    int socket;                         //connected socket
+    connState state;                    //current state of the connection
+    struct netThread *thread;           //owner of the connection
+    char rcvbuffer[RCVBUFFERLENGTH];    //received bytes not yet consumed
+    size_t rcvlen;                      //number of bytes inside rcvbuffer
+    char line[RCVBUFFERLENGTH];         //command being served, the request points inside
+    struct request req;
+    char header[MAXHEADERLENGTH];       //reply header of the current GET
+    size_t headerlen, headersent;
+    int sending;                        //a file is being sent, rf is open
+    struct requestedFile rf;            //file being sent
+    struct fileTransfer transfer;       //body sent from memory (file cache, STATS)
+    struct batch batch;                 //MGET in progress, names NULL otherwise
+    char *buf[2];                       //body read by the disk pool: one is sent...
+    size_t avail[2];                    //...while the other is filled
+    int cur, rd;                        //buffer being sent, buffer to fill next
+    size_t pos;                         //bytes of the current buffer already sent
+    off_t offset, end;                  //next byte of the file to read, end of the body
+    struct diskJob job;                 //operation given to the disk pool
+    int inflight;                       //the job is submitted or waiting to be
+    int closed;                         //socket closed, freed when the job comes back
+    struct connection *nextDeferred;    //list of the jobs waiting to be submitted
+    struct timer timer;                 //current deadline
+    deadlineKind deadline;
+    struct shaper shaper;               //rate limits of the connection
+    struct timer throttle;              //armed while the body waits for its rate limits
+    int ticket;                         //admission of the connection (admission.c)
+};
+
+struct netThread {
+    int index;                          //also the completion queue of the thread
+    int epfd;
+    int passive_socket;
+    struct timerWheel wheel;
+    unsigned inflight;                  //jobs submitted, not yet come back
+    struct connection *deferredHead, *deferredTail;
+    uint64_t acceptRetry;               //the passive socket is out of the set until then, 0 if in it
+};
+
+int netThreads = 0;                                 //--threads, 0 means one per online CPU
+
+static struct netThread *threads;
+
+static void *networkThread(void *arg);
+static int setNonBlocking(int fd);
+static void watchPassive(struct netThread *t);
+static void acceptConnections(struct netThread *t);
+static void driveConnection(struct connection *c);
+static int processCommand(struct connection *c, char *line);
+static int startReply(struct connection *c);
+static int startRecord(struct connection *c, int result);
+static int startReads(struct connection *c, off_t start, off_t end);
+static void nextRecord(struct connection *c);
+static int throttled(struct connection *c);
+static ssize_t sendBuffered(struct connection *c);
+static void readNext(struct connection *c);
+static void submitJob(struct connection *c);
+static void submitDeferred(struct netThread *t);
+static void handleCompletions(struct netThread *t);
+static void finishTransfer(struct connection *c);
+static void closeConnection(struct connection *c, const char *reason, int sendErr);
+static void releaseConnection(struct connection *c);
+static void setDeadline(struct connection *c, deadlineKind kind);
+static void deadlineExpired(struct timer *t);
+
+
+
+void threadServerLoop(int passive_socket){
+    
+    pthread_t tid;
+    pthread_attr_t attr;
+    sigset_t all, old;
+    int i;
+    
+    if(netThreads == 0){
+        netThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if(netThreads <= 0){
+            netThreads = 1;
+        }else if(netThreads > MAXNETTHREADS){
+            netThreads = MAXNETTHREADS;
+        }
+    }
+    if(setNonBlocking(passive_socket) < 0){
+        err_sys("(%s) error - fcntl() failed", prog_name);
+    }
+    if(diskPoolStart(netThreads) < 0){
+        err_sys("(%s) error - disk pool creation failed", prog_name);
+    }
+    if((threads = calloc(netThreads, sizeof(struct netThread))) == NULL){
+        err_sys("(%s) error - out of memory", prog_name);
+    }
+    LOG(LVL_INFO, "Starting %d network threads and %d disk threads", netThreads, diskWorkers);
+    
+    //the signals of the server are handled by the main thread, which is network thread 0
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for(i=0; i<netThreads; i++){
+        threads[i].index = i;
+        threads[i].passive_socket = passive_socket;
+        if(i > 0 && pthread_create(&tid, &attr, networkThread, &threads[i]) != 0){
+            err_sys("(%s) error - pthread_create() failed", prog_name);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    networkThread(&threads[0]);
+}
+
+
+static void *networkThread(void *arg){
+    
+    struct netThread *t = arg;
+    struct epoll_event ev, events[MAXEVENTS];
+    int n, i, timeout;
+    uint64_t count;
+    
+    statsAttach();
+    if((t->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+        err_sys("(%s) error - epoll_create1() failed", prog_name);
+    }
+    
+    watchPassive(t);
+    //the completions of the disk pool are announced by the eventfd of the thread
+    ev.events = EPOLLIN;
+    ev.data.ptr = t;
+    if(epoll_ctl(t->epfd, EPOLL_CTL_ADD, diskCompletionFd(t->index), &ev) < 0){
+        err_sys("(%s) error - epoll_ctl() failed", prog_name);
+    }
+    wheelInit(&t->wheel);
+    
+    for( ; ; ){
+        
+        //waking up at the next tick of the timer wheel if any deadline is armed
+        timeout = wheelTimeout(&t->wheel);
+        if(t->acceptRetry != 0 && (timeout < 0 || timeout > ADMITRETRYMS)){
+            timeout = ADMITRETRYMS;
+        }
+        if(!diskCompletionIdle(t->index)){
+            timeout = 0;
+        }
+        n = epoll_wait(t->epfd, events, MAXEVENTS, timeout);
+        diskCompletionAwake(t->index);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            err_sys("(%s) error - epoll_wait() failed", prog_name);
+        }
+        
+        for(i=0; i<n; i++){
+            if(events[i].data.ptr == NULL){
+                acceptConnections(t);
+            }else if(events[i].data.ptr == t){
+                if(read(diskCompletionFd(t->index), &count, sizeof(count)) < 0 && errno != EAGAIN){
+                    LOG(LVL_WARN, "Reading the eventfd of the thread failed: %s", strerror(errno));
+                }
+            }else{
+                driveConnection((struct connection *)events[i].data.ptr);
+            }
+        }
+        
+        handleCompletions(t);
+        submitDeferred(t);
+        wheelAdvance(&t->wheel, deadlineExpired);
+        
+        //the accepts lacked descriptors or memory: the socket is level triggered, watched again after a pause
+        if(t->acceptRetry != 0 && wheelNowMs() >= t->acceptRetry){
+            t->acceptRetry = 0;
+            watchPassive(t);
+        }
+    }
+    return NULL;
+}
+
+
+//a new connection wakes only one of the threads waiting on the passive socket
+static void watchPassive(struct netThread *t){
+    
+    struct epoll_event ev;
+    
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->passive_socket, &ev) < 0){
+        err_sys("(%s) error - epoll_ctl() failed", prog_name);
+    }
+}
+
+
+//accept the pending connections, at most a batch: the other threads take the rest
+static void acceptConnections(struct netThread *t){
+    
+    int conn_socket, ticket, i;
+    struct sockaddr_in caddr;
+    socklen_t addrlen;
+    char addr[LOGADDRLENGTH];
+    struct connection *c;
+    struct epoll_event ev;
+    
+    admissionSampleQueue(t->passive_socket);
+    for(i=0; i<ACCEPTBATCH; i++){
+        addrlen = sizeof(struct sockaddr_in);
+        if((conn_socket = accept4(t->passive_socket, (struct sockaddr *)&caddr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0){
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            //no descriptor or memory left: the socket stays readable, it is left out of the set for a while
+            if(admissionAcceptFailed(errno) && epoll_ctl(t->epfd, EPOLL_CTL_DEL, t->passive_socket, NULL) == 0){
+                t->acceptRetry = wheelNowMs() + ADMITRETRYMS;
+            }
+            return;
+        }
+        admissionAccepted();
+        
+        if((ticket = admissionEnter(&caddr)) < 0){
+            admissionRefuse(conn_socket, ticket);
+            continue;
+        }
+        if((c = calloc(1, sizeof(struct connection))) == NULL){
+            LOG(LVL_ERROR, "Out of memory. Closing connection");
+            admissionLeave(ticket);
+            Close(conn_socket);
+            continue;
+        }
+        c->socket = conn_socket;
+        c->ticket = ticket;
+        transferSetNoDelay(conn_socket);
+        c->state = CONN_READ_CMD;
+        c->thread = t;
+        timerInit(&c->timer, c);
+        timerInit(&c->throttle, c);
+        shaperOpen(&c->shaper, conn_socket, &caddr);
+        setDeadline(c, DEADLINE_IDLE);
+        
+        //readable and writable transitions are both reported, the state decides what to do
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if(epoll_ctl(t->epfd, EPOLL_CTL_ADD, conn_socket, &ev) < 0){
+            LOG(LVL_ERROR, "Error while registering connection. Closing connection");
+            timerCancel(&t->wheel, &c->timer);
+            shaperClose(&c->shaper);
+            admissionLeave(ticket);
+            Close(conn_socket);
+            free(c);
+            continue;
+        }
+        statsAdd(STAT_CONN_ACCEPTED, 1);
+        
+        LOG_SAMPLED(LVL_INFO, "Accepted connection from %s on socket %d (thread %d)", logFormatAddr(addr, &caddr), conn_socket, t->index);
+        
+        //data may already be waiting, its edge could have been raised before registration
+        driveConnection(c);
+    }
+}
+
+
+//advance the state machine of a connection until the socket would block or a job is waited for
+static void driveConnection(struct connection *c){
+    
+    ssize_t n;
+    char *eol;
+    size_t linelen;
+    
+    for( ; ; ){
+        switch(c->state){
+            
+            case CONN_READ_CMD:
+                //a complete command is already buffered: consume it
+                if((eol = memchr(c->rcvbuffer, '\n', c->rcvlen)) != NULL){
+                    linelen = eol - c->rcvbuffer + 1;
+                    memcpy(c->line, c->rcvbuffer, linelen);
+                    c->line[linelen] = '\0';
+                    c->rcvlen -= linelen;
+                    memmove(c->rcvbuffer, c->rcvbuffer+linelen, c->rcvlen);
+                    if(processCommand(c, c->line) < 0){
+                        return;
+                    }
+                    break;
+                }
+                if(c->rcvlen >= RCVBUFFERLENGTH-1){
+                    statsAdd(STAT_ERR_COMMAND, 1);
+                    closeConnection(c, "Command too long", 1);
+                    return;
+                }
+                n = recv(c->socket, c->rcvbuffer+c->rcvlen, RCVBUFFERLENGTH-1-c->rcvlen, 0);
+                if(n > 0){
+                    c->rcvlen += n;
+                    break;
+                }
+                if(n == 0){
+                    closeConnection(c, "Connection closed by party", 0);
+                    return;
+                }
+                if(errno == EINTR){
+                    break;
+                }
+                if(errno != EAGAIN && errno != EWOULDBLOCK){
+                    statsAdd(STAT_ERR_RECV, 1);
+                    closeConnection(c, "Reading error", 1);
+                    return;
+                }
+                //waiting for a command, or for the rest of one: the header deadline runs from its first byte
+                setDeadline(c, c->rcvlen == 0 ? DEADLINE_IDLE : DEADLINE_HEADER);
+                return;
+                
+            case CONN_OPENING:
+                //handleCompletions() goes on when the file is open
+                return;
+                
+            case CONN_SEND_HEADER:
+                //a reply with a body: its header leaves with the first bytes of the body (transfer.c)
+                if(c->sending){
+                    transferFrame(&c->transfer, c->header, c->headerlen);
+                    c->state = CONN_SEND_BODY;
+                    break;
+                }
+                n = send(c->socket, c->header+c->headersent, c->headerlen-c->headersent, MSG_NOSIGNAL);
+                if(n < 0){
+                    if(errno == EINTR){
+                        break;
+                    }
+                    if(errno != EAGAIN && errno != EWOULDBLOCK){
+                        statsAdd(STAT_ERR_SEND, 1);
+                        closeConnection(c, "Sending reply header failed", 0);
+                    }
+                    return;
+                }
+                c->headersent += n;
+                if(c->headersent == c->headerlen){
+                    //header of a MGET, or record of a file it cannot send
+                    nextRecord(c);
+                }
+                break;
+                
+            case CONN_SEND_BODY:
+                if(throttled(c)){
+                    return;
+                }
+                n = (c->rf.cached != NULL) ? transferSend(&c->transfer, c->socket) : sendBuffered(c);
+                if(n == 0){
+                    finishTransfer(c);
+                    break;
+                }
+                if(n < 0){
+                    if(errno == EINTR){
+                        break;
+                    }
+                    //EAGAIN: the socket is full, or the next buffer is still being read
+                    if(errno != EAGAIN && errno != EWOULDBLOCK){
+                        statsAdd(STAT_ERR_SEND, 1);
+                        closeConnection(c, "Sending file failed", 0);
+                    }
+                    return;
+                }
+                if(c->rf.generated == NULL){
+                    statsAdd(STAT_BYTES_SENT, n);
+                    shaperCharge(&c->shaper, n);
+                }
+                break;
+        }
+    }
+}
+
+
+//handle a complete command line, returns -1 if the connection has been closed or waits for the pool
+static int processCommand(struct connection *c, char *line){
+    
+    struct request *req = &c->req;
+    
+    if(parseRequest(line, req) == REQ_QUIT){
+        LOG_SAMPLED(LVL_INFO, "(socket %d) QUIT command received", c->socket);
+        closeConnection(c, "Closing connection", 0);
+        return -1;
+    }
+    
+    if(req->type == REQ_STATS || req->type == REQ_LIST){
+        //the counters as text, or the listing of the directory index, sent from memory like a cached file
+        if(req->type == REQ_STATS ? openStatsReply(&c->rf) < 0 : openListReply(&c->rf) < 0){
+            closeConnection(c, req->type == REQ_STATS ? "Out of memory" : "Listing not available", 1);
+            return -1;
+        }
+        LOG_SAMPLED(LVL_INFO, "(socket %d) %s command received", c->socket, req->type == REQ_STATS ? "STATS" : "LIST");
+        requestTransferInit(&c->transfer, &c->rf, 0, c->rf.st.st_size);
+        c->sending = 1;
+        c->headerlen = req->type == REQ_STATS ? buildStatsHeader(c->header, &c->rf) : buildListHeader(c->header, &c->rf);
+        c->headersent = 0;
+        c->state = CONN_SEND_HEADER;
+        setDeadline(c, DEADLINE_TRANSFER);
+        return 0;
+    }
+    if(req->type == REQ_MGET){
+        if(batchStart(&c->batch, req->filename) < 0){
+            statsAdd(STAT_ERR_COMMAND, 1);
+            closeConnection(c, "Invalid MGET command received", 1);
+            return -1;
+        }
+        LOG_SAMPLED(LVL_INFO, "(socket %d) MGET command received: %u files", c->socket, (unsigned)c->batch.left);
+        c->headerlen = buildBatchHeader(c->header, &c->batch);
+        c->headersent = 0;
+        c->state = CONN_SEND_HEADER;
+        setDeadline(c, DEADLINE_TRANSFER);
+        return 0;
+    }
+    //DELTA is served by the process per connection engines only: matching the signatures walks
+    //the whole file in one go, which would stall every other connection of the loop
+    if(req->type != REQ_GET && req->type != REQ_GET64 && req->type != REQ_RGET && req->type != REQ_IFMOD){
+        statsAdd(STAT_ERR_COMMAND, 1);
+        closeConnection(c, "Invalid command received", 1);
+        return -1;
+    }
+    if(!isValidFilename(req->filename)){
+        statsAdd(STAT_ERR_FILENAME, 1);
+        closeConnection(c, "Invalid file error", 1);
+        return -1;
+    }
+    
+    //open and fstat may block on the disk: the pool does them, the reply goes on in startReply()
+    c->job.op = DISK_OPEN;
+    c->job.filename = req->filename;
+    c->job.rf = &c->rf;
+    c->job.batch = NULL;
+    c->state = CONN_OPENING;
+    setDeadline(c, DEADLINE_TRANSFER);
+    submitJob(c);
+    return -1;
+}
+
+
+//the requested file is open: checks the request, prepares the header and starts reading the body (-1: closed)
+static int startReply(struct connection *c){
+    
+    struct request *req = &c->req;
+    struct stat *st = &c->rf.st;
+    int n;
+    
+    n = resolveRange(req, st);
+    requestTransferInit(&c->transfer, &c->rf, req->start, req->end);
+    c->sending = 1;
+    if(!replyFitsRequest(req, st)){
+        statsAdd(STAT_ERR_TOO_LARGE, 1);
+        closeConnection(c, "File too large for GET, GET64 required", 1);
+        return -1;
+    }
+    if(n < 0){
+        statsAdd(STAT_ERR_RANGE, 1);
+        closeConnection(c, "Range out of the file", 1);
+        return -1;
+    }
+    LOG_SAMPLED(LVL_INFO, "(socket %d) GET command received: %s", c->socket, req->filename);
+    statsFileHit(req->filename);
+    if(startReads(c, req->start, req->end) < 0){
+        return -1;
+    }
+    
+    //preparing reply header: ok message, file size and timestamp in network byte order
+    c->headerlen = buildReplyHeader(c->header, req, st);
+    c->headersent = 0;
+    c->state = CONN_SEND_HEADER;
+    return 0;
+}
+
+
+//a file of the MGET has been opened by batchOpen() (result): its record, and its bytes if it can be sent (-1: closed)
+static int startRecord(struct connection *c, int result){
+    
+    if(result != 0){
+        LOG_SAMPLED(LVL_INFO, "(socket %d) MGET file not available: %s", c->socket, c->job.filename);
+        c->headerlen = buildRecordHeader(c->header, c->job.filename, NULL);
+    }else{
+        requestTransferInit(&c->transfer, &c->rf, 0, c->rf.st.st_size);
+        c->sending = 1;
+        if(startReads(c, 0, c->rf.st.st_size) < 0){
+            return -1;
+        }
+        c->headerlen = buildRecordHeader(c->header, c->job.filename, &c->rf.st);
+    }
+    c->headersent = 0;
+    c->state = CONN_SEND_HEADER;
+    return 0;
+}
+
+
+//a file not in the cache is read by the pool into two buffers of at most one chunk (-1: closed)
+static int startReads(struct connection *c, off_t start, off_t end){
+    
+    size_t size;
+    
+    if(c->rf.cached != NULL){
+        return 0;
+    }
+    c->offset = start;
+    c->end = end;
+    c->cur = c->rd = 0;
+    c->pos = c->avail[0] = c->avail[1] = 0;
+    size = (c->end - c->offset < (off_t)transferChunkSize) ? (size_t)(c->end - c->offset) : transferChunkSize;
+    if(size > 0){
+        if((c->buf[0] = malloc(2 * size)) == NULL){
+            closeConnection(c, "Out of memory", 1);
+            return -1;
+        }
+        c->buf[1] = c->buf[0] + size;
+    }
+    //the first chunk is read while the header is sent
+    readNext(c);
+    return 0;
+}
+
+
+//the pool opens the next file of the MGET in progress, or back to the commands after the last one:
+//the transfer deadline keeps running for the whole batch
+static void nextRecord(struct connection *c){
+    
+    const char *name;
+    
+    if((name = batchNextName(&c->batch)) == NULL){
+        batchEnd(&c->batch);
+        c->state = CONN_READ_CMD;
+        c->deadline = DEADLINE_NONE;
+        return;
+    }
+    c->job.op = DISK_OPEN;
+    c->job.filename = name;
+    c->job.rf = &c->rf;
+    c->job.batch = &c->batch;
+    c->state = CONN_OPENING;
+    c->deadline = DEADLINE_TRANSFER;
+    submitJob(c);
+}
+
+
+//sets the size of the next step of the body; 1 if it has to wait for the throttle timer first
+static int throttled(struct connection *c){
+    
+    unsigned delay;
+    
+    //the counters and the listing are not file bodies, they are never shaped; nothing to send, nothing to wait for
+    if(c->rf.generated != NULL || (c->rf.cached != NULL ? transferComplete(&c->transfer) : c->avail[c->cur] == 0)){
+        c->transfer.limit = 0;
+        return 0;
+    }
+    if((c->transfer.limit = shaperGrant(&c->shaper, &delay)) > 0){
+        return 0;
+    }
+    if(!timerArmed(&c->throttle)){
+        timerArmMs(&c->thread->wheel, &c->throttle, delay);
+    }
+    return 1;
+}
+
+
+//sends the buffers filled by the pool in order, at most a step of the rate limits: bytes sent,
+//0 when the body is complete, -1 and errno
+static ssize_t sendBuffered(struct connection *c){
+    
+    ssize_t n;
+    size_t len = c->avail[c->cur] - c->pos;
+    
+    if(c->avail[c->cur] == 0){
+        if(!c->inflight && c->offset >= c->end){
+            //an empty body: the framed header goes alone
+            return transferSendFramed(&c->transfer, c->socket, NULL, 0);
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    if(c->transfer.limit > 0 && len > c->transfer.limit){
+        len = c->transfer.limit;
+    }
+    if((n = transferSendFramed(&c->transfer, c->socket, c->buf[c->cur]+c->pos, len)) < 0){
+        return -1;
+    }
+    c->pos += n;
+    if(c->pos == c->avail[c->cur]){
+        //the buffer is free again: the pool can fill it while the other one is sent
+        c->avail[c->cur] = 0;
+        c->pos = 0;
+        c->cur ^= 1;
+        readNext(c);
+    }
+    return n;
+}
+
+
+//gives the next chunk of the body to the pool, if a buffer is free and no job is in flight
+static void readNext(struct connection *c){
+    
+    off_t left = c->end - c->offset;
+    size_t size = c->buf[1] - c->buf[0];
+    
+    if(c->inflight || left <= 0 || c->avail[c->rd] != 0){
+        return;
+    }
+    c->job.op = DISK_READ;
+    c->job.fd = c->rf.fd;
+    c->job.offset = c->offset;
+    c->job.buf = c->buf[c->rd];
+    c->job.length = (left < (off_t)size) ? (size_t)left : size;
+    //the chunks after this one are asked to the kernel, so the next read finds them in memory
+    left -= c->job.length;
+    c->job.prefetch = (left < 2*(off_t)size) ? (size_t)left : 2*size;
+    submitJob(c);
+}
+
+
+static void submitJob(struct connection *c){
+    
+    struct netThread *t = c->thread;
+    
+    c->inflight = 1;
+    c->job.owner = t->index;
+    c->job.data = c;
+    //the waiting jobs go first, and the completion queue of the thread must never fill
+    if(t->deferredHead == NULL && t->inflight < COMPLETIONLENGTH && diskSubmit(&c->job) == 0){
+        t->inflight++;
+        return;
+    }
+    c->nextDeferred = NULL;
+    if(t->deferredTail != NULL){
+        t->deferredTail->nextDeferred = c;
+    }else{
+        t->deferredHead = c;
+    }
+    t->deferredTail = c;
+}
+
+
+//submits the jobs waiting for a place, in order
+static void submitDeferred(struct netThread *t){
+    
+    struct connection *c;
+    
+    while((c = t->deferredHead) != NULL){
+        if(!c->closed){
+            if(t->inflight >= COMPLETIONLENGTH || diskSubmit(&c->job) < 0){
+                return;
+            }
+            t->inflight++;
+        }
+        t->deferredHead = c->nextDeferred;
+        if(t->deferredHead == NULL){
+            t->deferredTail = NULL;
+        }
+        if(c->closed){
+            c->inflight = 0;
+            releaseConnection(c);
+        }
+    }
+}
+
+
+//the jobs done by the pool: the connections waiting for them go on
+static void handleCompletions(struct netThread *t){
+    
+    struct diskJob *job;
+    struct connection *c;
+    
+    while((job = diskNextCompletion(t->index)) != NULL){
+        c = job->data;
+        c->inflight = 0;
+        t->inflight--;
+        
+        if(c->closed){
+            if(job->op == DISK_OPEN && job->result == 0){
+                closeRequestedFile(&c->rf);
+            }
+            releaseConnection(c);
+            continue;
+        }
+        
+        if(job->op == DISK_OPEN && job->batch != NULL){
+            if(startRecord(c, job->result) < 0){
+                continue;
+            }
+        }else if(job->op == DISK_OPEN){
+            if(job->result != 0){
+                statsAdd(job->result == OPEN_FAILED ? STAT_ERR_OPEN : STAT_ERR_STAT, 1);
+                closeConnection(c, job->result == OPEN_FAILED ? "Opening file error" : "Getting file statistics error", 1);
+                continue;
+            }
+            if(startReply(c) < 0){
+                continue;
+            }
+        }else{
+            //the file shrank or cannot be read: the header is gone, only closing is left
+            if(job->result <= 0){
+                statsAdd(STAT_ERR_SEND, 1);
+                closeConnection(c, job->result < 0 ? strerror(job->error) : "File truncated while sending", 0);
+                continue;
+            }
+            c->avail[c->rd] = job->result;
+            c->offset += job->result;
+            c->rd ^= 1;
+            readNext(c);
+        }
+        driveConnection(c);
+    }
+}
+
+
+static void finishTransfer(struct connection *c){
+    
+    LOG_SAMPLED(LVL_INFO, "(socket %d) File sent (%s)", c->socket, c->rf.cached != NULL ? transferMethodName(c->transfer.method) : "disk pool");
+    shaperIdle(&c->shaper);
+    if(c->rf.generated == NULL){
+        statsAdd(STAT_GETS, 1);
+    }
+    if(fileCacheEnabled()){
+        printCacheStats();
+    }
+    transferRelease(&c->transfer);
+    closeRequestedFile(&c->rf);
+    free(c->buf[0]);
+    c->buf[0] = c->buf[1] = NULL;
+    c->sending = 0;
+    c->state = CONN_READ_CMD;
+    c->deadline = DEADLINE_NONE;
+    if(c->batch.names != NULL){
+        nextRecord(c);
+    }
+}
+
+
+//close a connection, optionally informing the client with an error message
+static void closeConnection(struct connection *c, const char *reason, int sendErr){
+    
+    if(sendErr){
+        LOG(LVL_WARN, "(socket %d) %s. Closing connection", c->socket, reason);
+        //best effort: the socket is non blocking and the connection is closed anyway
+        if(send(c->socket, ERR_MSG, sizeof(ERR_MSG)-1, MSG_NOSIGNAL) != (sizeof(ERR_MSG)-1)){
+            LOG(LVL_WARN, "(socket %d) Sending error message failed!", c->socket);
+        }
+    }else{
+        LOG_SAMPLED(LVL_INFO, "(socket %d) %s. Closing connection", c->socket, reason);
+    }
+    //closing the descriptor also removes it from the epoll set
+    timerCancel(&c->thread->wheel, &c->timer);
+    timerCancel(&c->thread->wheel, &c->throttle);
+    shaperClose(&c->shaper);
+    admissionLeave(c->ticket);
+    Close(c->socket);
+    statsAdd(STAT_CONN_CLOSED, 1);
+    
+    //a job in flight still uses the connection: it is freed when the job comes back
+    if(c->inflight){
+        c->closed = 1;
+        return;
+    }
+    releaseConnection(c);
+}
+
+
+static void releaseConnection(struct connection *c){
+    if(c->sending){
+        transferRelease(&c->transfer);
+        closeRequestedFile(&c->rf);
+    }
+    batchEnd(&c->batch);
+    free(c->buf[0]);
+    free(c);
+}
+
+
+//arms the deadline of the connection, unless it is already running (0 seconds: no deadline)
+static void setDeadline(struct connection *c, deadlineKind kind){
+    
+    unsigned seconds = deadlineSeconds(kind);
+    
+    if(c->deadline == kind && timerArmed(&c->timer)){
+        return;
+    }
+    c->deadline = kind;
+    if(seconds == 0){
+        timerCancel(&c->thread->wheel, &c->timer);
+    }else{
+        timerArm(&c->thread->wheel, &c->timer, seconds);
+    }
+}
+
+
+static void deadlineExpired(struct timer *t){
+    
+    struct connection *c = t->data;
+    
+    //the rate limits allow the body to go on
+    if(t == &c->throttle){
+        driveConnection(c);
+        return;
+    }
+    statsAdd(STAT_TIMEOUTS, 1);
+    closeConnection(c, deadlineMessage(c->deadline), 0);
+}
+
+
+static int setNonBlocking(int fd){
+    int flags;
+    
+    if((flags = fcntl(fd, F_GETFL, 0)) == -1){
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
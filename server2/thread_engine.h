@@ -0,0 +1,20 @@
+/*
+ 
+ module: thread_engine.h
+ 
+ purpose: definitions of functions in thread_engine.c
+ 
+ */
+
+
+#ifndef _THREAD_ENGINE_H
+
+#define _THREAD_ENGINE_H
+
+#define MAXNETTHREADS       256                     //maximum number of network threads
+
+extern int netThreads;
+
+void threadServerLoop(int passive_socket);
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ 
+ module: timerwheel.c
+ 
+ purpose: hierarchical timer wheel for the deadlines of the connections
+          of an engine (idle, command header and whole transfer).
+ 
+          Level 0 has one slot per tick (WHEELTICKMS), level 1 one slot
+          per 64 ticks and so on. A timer goes in the lowest level whose
+          range covers its deadline, so arming and cancelling are a list
+          insertion and removal. Every 64 ticks a slot of the level above
+          is emptied and its timers are spread over the level below
+          (cascade), so every timer moves at most WHEELLEVELS-1 times.
+          The cost does not depend on the number of connections, unlike
+          a scan of all of them every second. The engines also wake the
+          transfers paused by their rate limits (shaper.c) with it.
+ 
+ */
+
+
+#include <stddef.h>
+#include <time.h>
+#include "timerwheel.h"
+
+#define WHEELMASK           (WHEELSLOTS - 1)
+
+static uint64_t nowTick(void);
+static void armTicks(struct timerWheel *w, struct timer *t, uint64_t ticks);
+static void insert(struct timerWheel *w, struct timer *t);
+static void timerUnlink(struct timer *t);
+static void cascade(struct timerWheel *w, int level, uint64_t next);
+
+
+
+//milliseconds of a monotonic clock
+uint64_t wheelNowMs(void){
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+void wheelInit(struct timerWheel *w){
+    int l, s;
+    
+    w->tick = nowTick();
+    w->armed = 0;
+    for(l=0; l<WHEELLEVELS; l++){
+        for(s=0; s<WHEELSLOTS; s++){
+            w->slots[l][s].prev = w->slots[l][s].next = &w->slots[l][s];
+        }
+    }
+}
+
+
+void timerInit(struct timer *t, void *data){
+    t->prev = t->next = NULL;
+    t->expires = 0;
+    t->data = data;
+}
+
+
+//(re)arms the timer to expire in the given seconds
+void timerArm(struct timerWheel *w, struct timer *t, unsigned seconds){
+    armTicks(w, t, ((uint64_t)seconds * 1000 + WHEELTICKMS - 1) / WHEELTICKMS);
+}
+
+
+//(re)arms the timer to expire in the given milliseconds, rounded up to the next tick
+void timerArmMs(struct timerWheel *w, struct timer *t, unsigned ms){
+    armTicks(w, t, ((uint64_t)ms + WHEELTICKMS - 1) / WHEELTICKMS);
+}
+
+
+static void armTicks(struct timerWheel *w, struct timer *t, uint64_t ticks){
+    
+    if(t->next != NULL){
+        timerUnlink(t);
+        w->armed--;
+    }
+    if(w->armed == 0){
+        //empty wheel: no tick to walk through
+        w->tick = nowTick();
+    }
+    t->expires = nowTick() + ticks;
+    insert(w, t);
+    w->armed++;
+}
+
+
+void timerCancel(struct timerWheel *w, struct timer *t){
+    if(t->next != NULL){
+        timerUnlink(t);
+        w->armed--;
+    }
+}
+
+
+int timerArmed(const struct timer *t){
+    return t->next != NULL;
+}
+
+
+//milliseconds to wait before the next call to wheelAdvance(), -1 if no timer is armed
+int wheelTimeout(const struct timerWheel *w){
+    
+    uint64_t now;
+    
+    if(w->armed == 0){
+        return -1;
+    }
+    now = wheelNowMs();
+    return (int)(WHEELTICKMS - now % WHEELTICKMS);
+}
+
+
+//expires every timer whose deadline has passed; the callback may arm, cancel or free timers
+void wheelAdvance(struct timerWheel *w, timerCallback expired){
+    
+    uint64_t now = nowTick(), next;
+    struct timer list, *t;
+    int level;
+    
+    if(w->armed == 0){
+        w->tick = now;
+        return;
+    }
+    while(w->tick < now){
+        next = w->tick + 1;
+        //entering a new range of a level: its timers move down, next still to be processed
+        for(level=1; level<WHEELLEVELS && ((next >> ((level-1)*WHEELBITS)) & WHEELMASK) == 0; level++){
+            cascade(w, level, next);
+        }
+        //the slot is detached first: timers armed by the callbacks go to later ticks
+        w->tick = next;
+        t = &w->slots[0][next & WHEELMASK];
+        if(t->next == t){
+            continue;
+        }
+        list.next = t->next;
+        list.prev = t->prev;
+        list.next->prev = list.prev->next = &list;
+        t->next = t->prev = t;
+        while((t = list.next) != &list){
+            timerUnlink(t);
+            w->armed--;
+            expired(t);
+        }
+    }
+}
+
+
+static uint64_t nowTick(void){
+    return wheelNowMs() / WHEELTICKMS;
+}
+
+
+//the slot of the lowest level covering the deadline, relative to the next tick processed
+static void insert(struct timerWheel *w, struct timer *t){
+    
+    uint64_t base = w->tick + 1, delta;
+    struct timer *head;
+    int level;
+    
+    if(t->expires < base){
+        t->expires = base;
+    }
+    delta = t->expires - base;
+    for(level=0; level<WHEELLEVELS-1 && delta >= ((uint64_t)1 << ((level+1)*WHEELBITS)); level++)
+        ;
+    if(level == WHEELLEVELS-1 && delta >= ((uint64_t)1 << (WHEELLEVELS*WHEELBITS))){
+        t->expires = base + ((uint64_t)1 << (WHEELLEVELS*WHEELBITS)) - 1;
+    }
+    head = &w->slots[level][(t->expires >> (level*WHEELBITS)) & WHEELMASK];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+
+static void timerUnlink(struct timer *t){
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+
+static void cascade(struct timerWheel *w, int level, uint64_t next){
+    
+    struct timer *head = &w->slots[level][(next >> (level*WHEELBITS)) & WHEELMASK], *t;
+    
+    while((t = head->next) != head){
+        timerUnlink(t);
+        insert(w, t);
+    }
+}
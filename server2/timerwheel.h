@@ -0,0 +1,46 @@
+/*
+ 
+ module: timerwheel.h
+ 
+ purpose: definitions of functions in timerwheel.c
+ 
+ */
+
+
+#ifndef _TIMERWHEEL_H
+
+#define _TIMERWHEEL_H
+
+#include <stdint.h>
+
+#define WHEELTICKMS         100                     //resolution of the deadlines
+#define WHEELBITS           6
+#define WHEELSLOTS          (1 << WHEELBITS)        //slots of every level
+#define WHEELLEVELS         4                       //64^4 ticks: about 19 days at 100 ms
+
+//a deadline, embedded in the structure it belongs to
+struct timer {
+    struct timer *prev, *next;          //list of the slot, NULL if not armed
+    uint64_t expires;                   //tick of the deadline
+    void *data;                         //owner, for the expiration callback
+};
+
+struct timerWheel {
+    uint64_t tick;                      //last tick processed
+    unsigned armed;                     //timers in the wheel
+    struct timer slots[WHEELLEVELS][WHEELSLOTS];    //list heads
+};
+
+typedef void (*timerCallback)(struct timer *t);
+
+uint64_t wheelNowMs(void);
+void wheelInit(struct timerWheel *w);
+void timerInit(struct timer *t, void *data);
+void timerArm(struct timerWheel *w, struct timer *t, unsigned seconds);
+void timerArmMs(struct timerWheel *w, struct timer *t, unsigned ms);
+void timerCancel(struct timerWheel *w, struct timer *t);
+int timerArmed(const struct timer *t);
+int wheelTimeout(const struct timerWheel *w);
+void wheelAdvance(struct timerWheel *w, timerCallback expired);
+
+#endif
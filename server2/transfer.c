@@ -0,0 +1,300 @@
+/*
+ 
+ module: transfer.c
+ 
+ purpose: sends the body of a file on a socket without copying it through
+          user space. sendfile() is tried first, when the file or the
+          socket does not support it the transfer degrades to splice()
+          through a pipe, and then to the pread() + send() copy loop.
+ 
+          Every call of transferSend() moves at most transferChunkSize
+          bytes, so the same code serves blocking sockets (call it until
+          the transfer is complete) and non blocking ones (call it until
+          it fails with EAGAIN). A step can be made shorter than a chunk
+          (limit) to keep a transfer within its rate (shaper.c).
+ 
+          The reply header can be framed with the body (transferFrame()):
+          it is then sent by the first step, in the same system call as
+          the first bytes of the body (sendmsg() of two iovecs) or, for
+          sendfile() and splice(), with MSG_MORE right before them, so
+          header and body leave in the same segments. The connected
+          sockets have TCP_NODELAY: every reply is written in as few
+          calls as possible, so Nagle has nothing left to coalesce and
+          would only hold back the last segment of a reply.
+          
+ */
+
+
+#define _GNU_SOURCE                                 //splice(), F_SETPIPE_SZ
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "transfer.h"
+
+size_t transferChunkSize = DEFAULTCHUNKSIZE;        //--chunk
+transferMethod transferPreferredMethod = XFER_SENDFILE;     //--send
+
+static ssize_t sendfileStep(struct fileTransfer *t, int socket);
+static ssize_t spliceStep(struct fileTransfer *t, int socket);
+static ssize_t copyStep(struct fileTransfer *t, int socket);
+static ssize_t memoryStep(struct fileTransfer *t, int socket);
+static size_t nextChunk(const struct fileTransfer *t);
+static int sendHeader(struct fileTransfer *t, int socket, int flags);
+
+
+
+const char *transferMethodName(transferMethod method){
+    switch(method){
+        case XFER_SENDFILE: return "sendfile";
+        case XFER_SPLICE:   return "splice";
+        case XFER_MEMORY:   return "cache";
+        default:            return "copy";
+    }
+}
+
+
+void transferInit(struct fileTransfer *t, int filefd, off_t offset, off_t end){
+    memset(t, 0, sizeof(*t));
+    t->filefd = filefd;
+    t->offset = offset;
+    t->end = end;
+    t->method = transferPreferredMethod;
+    t->pipefd[0] = t->pipefd[1] = -1;
+}
+
+
+//the file is already in memory: the body is sent from there
+void transferInitMemory(struct fileTransfer *t, const char *data, off_t offset, off_t end){
+    transferInit(t, -1, offset, end);
+    t->data = data;
+    t->method = XFER_MEMORY;
+}
+
+
+//the header is sent by the first step of the transfer, with the first bytes of the body (or alone if the body is empty).
+//header must stay valid until then
+void transferFrame(struct fileTransfer *t, const char *header, size_t headerlen){
+    t->header = header;
+    t->headerlen = headerlen;
+}
+
+
+//returns the bytes of the body sent on the socket, 0 when the transfer is complete, -1 on error (errno set).
+//The bytes of a framed header are not counted
+ssize_t transferSend(struct fileTransfer *t, int socket){
+    
+    ssize_t n;
+    
+    for( ; ; ){
+        if(transferComplete(t)){
+            return 0;
+        }
+        if(t->offset >= t->end && t->inpipe == 0 && t->bufpos == t->buflen){
+            //nothing left but the header
+            return transferSendFramed(t, socket, NULL, 0);
+        }
+        switch(t->method){
+            case XFER_SENDFILE:
+                //MSG_MORE: the header waits for the bytes of the body, they fill the same segment
+                n = (t->headerlen > 0 && sendHeader(t, socket, MSG_MORE) < 0) ? -1 : sendfileStep(t, socket);
+                break;
+            case XFER_SPLICE:
+                n = (t->headerlen > 0 && sendHeader(t, socket, MSG_MORE) < 0) ? -1 : spliceStep(t, socket);
+                break;
+            case XFER_MEMORY:
+                return memoryStep(t, socket);
+            default:
+                return copyStep(t, socket);
+        }
+        //EINVAL/ENOSYS: the descriptors do not support this method, degrade to the next one
+        if(n < 0 && (errno == EINVAL || errno == ENOSYS) && t->inpipe == 0){
+            t->method = (t->method == XFER_SENDFILE) ? XFER_SPLICE : XFER_COPY;
+            continue;
+        }
+        return n;
+    }
+}
+
+
+int transferComplete(const struct fileTransfer *t){
+    return t->offset >= t->end && t->inpipe == 0 && t->bufpos == t->buflen && t->headerlen == 0;
+}
+
+
+//the framed header, if any, and len bytes of buf in one system call: returns the bytes of buf sent, 0 if len is 0 and
+//the header is out, -1 with EAGAIN if the socket only took (a part of) the header
+ssize_t transferSendFramed(struct fileTransfer *t, int socket, const char *buf, size_t len){
+    
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t n;
+    
+    if(t->headerlen == 0){
+        return (len > 0) ? send(socket, buf, len, MSG_NOSIGNAL) : 0;
+    }
+    iov[0].iov_base = (void *)t->header;
+    iov[0].iov_len = t->headerlen;
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (len > 0) ? 2 : 1;
+    if((n = sendmsg(socket, &msg, MSG_NOSIGNAL)) < 0){
+        return -1;
+    }
+    if((size_t)n < t->headerlen){
+        t->header += n;
+        t->headerlen -= n;
+        errno = EAGAIN;
+        return -1;
+    }
+    n -= t->headerlen;
+    t->headerlen = 0;
+    if(n == 0 && len > 0){
+        errno = EAGAIN;
+        return -1;
+    }
+    return n;
+}
+
+
+//best effort: the replies are already written in few calls, a small last segment must not wait for an ACK
+void transferSetNoDelay(int socket){
+    int on = 1;
+    
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+
+void transferRelease(struct fileTransfer *t){
+    if(t->pipefd[0] >= 0){
+        close(t->pipefd[0]);
+        close(t->pipefd[1]);
+        t->pipefd[0] = t->pipefd[1] = -1;
+    }
+    free(t->buffer);
+    t->buffer = NULL;
+    t->buflen = t->bufpos = 0;
+    t->inpipe = 0;
+    t->headerlen = 0;
+}
+
+
+static size_t nextChunk(const struct fileTransfer *t){
+    off_t left = t->end - t->offset;
+    size_t chunk = (t->limit > 0 && t->limit < transferChunkSize) ? t->limit : transferChunkSize;
+    
+    return (left < (off_t)chunk) ? (size_t)left : chunk;
+}
+
+
+static ssize_t sendfileStep(struct fileTransfer *t, int socket){
+    ssize_t n;
+    
+    //sendfile() advances the offset by itself
+    if((n = sendfile(socket, t->filefd, &t->offset, nextChunk(t))) == 0){
+        //file shorter than announced (truncated while sending)
+        errno = EIO;
+        return -1;
+    }
+    return n;
+}
+
+
+static ssize_t spliceStep(struct fileTransfer *t, int socket){
+    ssize_t n;
+    
+    if(t->pipefd[0] < 0){
+        if(pipe2(t->pipefd, O_CLOEXEC | O_NONBLOCK) < 0){
+            t->pipefd[0] = t->pipefd[1] = -1;
+            errno = ENOSYS;
+            return -1;
+        }
+        //best effort: a pipe as large as a chunk halves the number of splice() calls
+        fcntl(t->pipefd[1], F_SETPIPE_SZ, (int)transferChunkSize);
+    }
+    
+    //filling the pipe from the file
+    if(t->inpipe == 0){
+        n = splice(t->filefd, &t->offset, t->pipefd[1], NULL, nextChunk(t), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n <= 0){
+            if(n == 0){
+                errno = EIO;
+            }
+            return -1;
+        }
+        t->inpipe = n;
+    }
+    
+    //draining the pipe into the socket, the last bytes of the body are pushed at once
+    if((n = splice(t->pipefd[0], NULL, socket, NULL, t->inpipe, SPLICE_F_MOVE | (t->offset < t->end ? SPLICE_F_MORE : 0))) < 0){
+        return -1;
+    }
+    t->inpipe -= n;
+    return n;
+}
+
+
+static ssize_t memoryStep(struct fileTransfer *t, int socket){
+    ssize_t n;
+    
+    if((n = transferSendFramed(t, socket, t->data+t->offset, nextChunk(t))) > 0){
+        t->offset += n;
+    }
+    return n;
+}
+
+
+static ssize_t copyStep(struct fileTransfer *t, int socket){
+    ssize_t n;
+    
+    if(t->buffer == NULL && (t->buffer = malloc(transferChunkSize)) == NULL){
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    //refilling the buffer from the file
+    if(t->bufpos == t->buflen){
+        if((n = pread(t->filefd, t->buffer, nextChunk(t), t->offset)) <= 0){
+            if(n == 0){
+                errno = EIO;
+            }
+            return -1;
+        }
+        t->offset += n;
+        t->buflen = n;
+        t->bufpos = 0;
+    }
+    
+    if((n = transferSendFramed(t, socket, t->buffer+t->bufpos, t->buflen-t->bufpos)) < 0){
+        return -1;
+    }
+    t->bufpos += n;
+    return n;
+}
+
+
+//the framed header alone: returns 0 once it is out, -1 on error (EAGAIN if the socket did not take all of it)
+static int sendHeader(struct fileTransfer *t, int socket, int flags){
+    ssize_t n;
+    
+    if((n = send(socket, t->header, t->headerlen, MSG_NOSIGNAL | flags)) < 0){
+        return -1;
+    }
+    t->header += n;
+    t->headerlen -= n;
+    if(t->headerlen > 0){
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ 
+ module: transfer.h
+ 
+ purpose: definitions of functions in transfer.c
+ 
+ */
+
+
+#ifndef _TRANSFER_H
+
+#define _TRANSFER_H
+
+#include <sys/types.h>
+
+#define DEFAULTCHUNKSIZE    (1024*1024)             //bytes moved by a single transfer step
+
+//ways of moving the file body to the socket, in order of preference
+typedef enum {
+    XFER_SENDFILE,                                  //sendfile(): file -> socket, no copy
+    XFER_SPLICE,                                    //splice(): file -> pipe -> socket, no copy
+    XFER_COPY,                                      //pread() + send() through a user space buffer
+    XFER_MEMORY                                     //send() straight from memory (file cache)
+} transferMethod;
+
+struct fileTransfer {
+    int filefd;                         //file being sent
+    off_t offset;                       //next byte of the file to move
+    off_t end;                          //the transfer stops at this offset
+    transferMethod method;              //method currently used, degraded on failure
+    int pipefd[2];                      //pipe used by splice, -1 if not created
+    size_t inpipe;                      //bytes inside the pipe not yet sent
+    char *buffer;                       //buffer used by the copy method
+    const char *data;                   //content of the file for the memory method
+    size_t buflen, bufpos;
+    size_t limit;                       //bytes of the next step at most (rate limits), 0: transferChunkSize
+    const char *header;                 //reply header not yet sent: it leaves with the first bytes of the body
+    size_t headerlen;
+};
+
+extern size_t transferChunkSize;
+extern transferMethod transferPreferredMethod;
+
+const char *transferMethodName(transferMethod method);
+void transferInit(struct fileTransfer *t, int filefd, off_t offset, off_t end);
+void transferInitMemory(struct fileTransfer *t, const char *data, off_t offset, off_t end);
+void transferFrame(struct fileTransfer *t, const char *header, size_t headerlen);
+ssize_t transferSendFramed(struct fileTransfer *t, int socket, const char *buf, size_t len);
+void transferSetNoDelay(int socket);
+ssize_t transferSend(struct fileTransfer *t, int socket);
+int transferComplete(const struct fileTransfer *t);
+void transferRelease(struct fileTransfer *t);
+
+#endif
@@ -0,0 +1,778 @@
+/*
+ 
+ module: uring_engine.c
+ 
+ purpose: single thread server engine built on io_uring (--mode=uring).
+          accept(), recv() of the command lines, read() of the files and
+          send() of headers and bodies are all queued in the submission
+          ring and collected from the completion ring, so a whole batch
+          of operations costs a single io_uring_enter() system call.
+ 
+          The ring is driven through the raw system calls (no liburing).
+          When the kernel lacks io_uring, or one of the needed operations,
+          the engine falls back to epollServerLoop().
+ 
+          Every connection has at most one operation in flight:
+ 
+            URING_RECV      -> recv() of a command line
+            URING_SEND      -> send() of the reply header and/or file bytes
+            URING_READ      -> read() of the next chunk of the file
+            URING_THROTTLED -> none: the body waits for its rate limits
+ 
+          The reply header is placed in front of the first chunk of the
+          file, read from the disk or copied from memory (file cache,
+          STATS, LIST), so a small file is answered with a single send(). The
+          records of a MGET are sent the same way, one file after the
+          other, before the next command line is consumed.
+ 
+          The deadlines of the connections are kept in a timer wheel
+          (timerwheel.c) advanced by a WHEELTICKMS timeout operation: an
+          expired connection gets its operation cancelled and is closed
+          when the cancelled operation completes. A body over its rate
+          limits (shaper.c) waits for the throttle timer of the
+          connection, with no operation in flight.
+ 
+          An accept that fails for lack of descriptors or memory is not
+          queued again at once, which would spin on the same error: it
+          is re-armed by the next tick (ADMITRETRYMS, admission.c).
+          
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include "./../errlib.h"
+#include "./../sockwrap.h"
+#include "server2.h"
+#include "epoll_engine.h"
+#include "transfer.h"
+#include "request.h"
+#include "filecache.h"
+#include "stats.h"
+#include "log.h"
+#include "timerwheel.h"
+#include "uring_engine.h"
+#include "shaper.h"
+#include "admission.h"
+
+#define RINGENTRIES         4096                    //submission queue entries
+#define CQENTRIES           (4*RINGENTRIES)         //completion queue entries
+
+#define TAG_ACCEPT          1                       //user_data of the accept operation
+#define TAG_TICK            2                       //user_data of the WHEELTICKMS timeout
+#define TAG_CANCEL          3                       //user_data of the cancel operations
+
+typedef enum {
+    URING_RECV,
+    URING_SEND,
+    URING_READ,
+    URING_THROTTLED
+} uringState;
+
+struct uconnection {
+    int socket;                         //connected socket
+    uringState state;                   //operation in flight
+    char rcvbuffer[RCVBUFFERLENGTH];    //received bytes not yet consumed
+    size_t rcvlen;
+    int sending;                        //a file is being sent, rf is open
+    struct requestedFile rf;            //file being sent
+    off_t offset, filesize;             //next byte of the file to read, end of the bytes to send
+    char *buffer;                       //header and file bytes read from disk
+    const char *sendbuf;                //bytes being sent: buffer, or the file in the cache
+    size_t buflen, bufpos;
+    size_t headerleft;                  //header bytes still to send, not counted as file bytes
+    struct batch batch;                 //MGET in progress, names NULL otherwise
+    struct timer timer;                 //current deadline
+    deadlineKind deadline;
+    int cancelled;                      //the deadline expired: the pending operation is being cancelled
+    struct shaper shaper;               //rate limits of the connection
+    struct timer throttle;              //armed in URING_THROTTLED
+    int ticket;                         //admission of the connection (admission.c)
+    struct uconnection *prev, *next;    //list of open connections
+};
+
+struct ring {
+    int fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned toSubmit;                  //sqes prepared and not yet submitted
+};
+
+static struct ring ring;
+static struct uconnection *connections = NULL;
+static struct sockaddr_in acceptAddr;
+static socklen_t acceptAddrlen;
+static struct __kernel_timespec tick = { 0, WHEELTICKMS * 1000000L };
+static struct timerWheel wheel;
+static int acceptDeferred = 0;                      //the accept is re-armed by the next tick
+
+static int ringSetup(void);
+static struct io_uring_sqe *getSqe(void);
+static int ringEnter(unsigned minComplete);
+static void queueAccept(int passive_socket);
+static void queueTick(void);
+static void queueRecv(struct uconnection *c);
+static void queueSend(struct uconnection *c);
+static void queueRead(struct uconnection *c);
+static void frameMemory(struct uconnection *c);
+static void handleCompletion(int passive_socket, struct io_uring_cqe *cqe);
+static void nextCommand(struct uconnection *c);
+static int processCommand(struct uconnection *c, char *line);
+static void nextRecord(struct uconnection *c);
+static void closeConnection(struct uconnection *c, const char *reason, int sendErr);
+static void setDeadline(struct uconnection *c, deadlineKind kind);
+static void deadlineExpired(struct timer *t);
+
+
+
+void uringServerLoop(int passive_socket){
+    
+    unsigned head;
+    struct io_uring_cqe cqe;
+    
+    if(ringSetup() < 0){
+        LOG(LVL_WARN, "io_uring not available (%s). Falling back to epoll", strerror(errno));
+        epollServerLoop(passive_socket);
+        return;
+    }
+    
+    wheelInit(&wheel);
+    queueAccept(passive_socket);
+    queueTick();
+    
+    for( ; ; ){
+        
+        //submitting the whole batch and waiting for at least one completion
+        if(ringEnter(1) < 0 && errno != EINTR){
+            err_sys("(%s) error - io_uring_enter() failed", prog_name);
+        }
+        
+        //consuming every available completion
+        head = *ring.cqHead;
+        while(head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)){
+            cqe = ring.cqes[head & *ring.cqMask];
+            head++;
+            __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+            handleCompletion(passive_socket, &cqe);
+            head = *ring.cqHead;
+        }
+    }
+}
+
+
+static int ringSetup(void){
+    
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    size_t sqSize, cqSize, probeSize;
+    void *sq, *cq;
+    int i, ok;
+    static const int neededOps[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL };
+    
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = CQENTRIES;
+    if((ring.fd = (int)syscall(__NR_io_uring_setup, RINGENTRIES, &p)) < 0){
+        return -1;
+    }
+    
+    //checking that the kernel supports every operation used by the engine
+    probeSize = sizeof(*probe) + IORING_OP_LAST*sizeof(struct io_uring_probe_op);
+    if((probe = calloc(1, probeSize)) == NULL){
+        close(ring.fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    ok = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for(i=0; ok && i<(int)(sizeof(neededOps)/sizeof(neededOps[0])); i++){
+        ok = neededOps[i] <= probe->last_op && (probe->ops[neededOps[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    if(!ok){
+        close(ring.fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    
+    //mapping submission and completion rings (a single mapping on recent kernels)
+    sqSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    cqSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        sqSize = cqSize = (sqSize > cqSize) ? sqSize : cqSize;
+    }
+    sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED){
+        close(ring.fd);
+        return -1;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        cq = sq;
+    }else if((cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING)) == MAP_FAILED){
+        close(ring.fd);
+        return -1;
+    }
+    ring.sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if(ring.sqes == MAP_FAILED){
+        close(ring.fd);
+        return -1;
+    }
+    
+    ring.sqHead  = (unsigned *)((char *)sq + p.sq_off.head);
+    ring.sqTail  = (unsigned *)((char *)sq + p.sq_off.tail);
+    ring.sqMask  = (unsigned *)((char *)sq + p.sq_off.ring_mask);
+    ring.sqArray = (unsigned *)((char *)sq + p.sq_off.array);
+    ring.cqHead  = (unsigned *)((char *)cq + p.cq_off.head);
+    ring.cqTail  = (unsigned *)((char *)cq + p.cq_off.tail);
+    ring.cqMask  = (unsigned *)((char *)cq + p.cq_off.ring_mask);
+    ring.cqes    = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+    ring.toSubmit = 0;
+    LOG(LVL_INFO, "io_uring ready: %u submission and %u completion entries", p.sq_entries, p.cq_entries);
+    return 0;
+}
+
+
+//next free submission entry, the queue is flushed to the kernel when it is full
+static struct io_uring_sqe *getSqe(void){
+    
+    unsigned tail = *ring.sqTail;
+    struct io_uring_sqe *sqe;
+    
+    while(tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) > *ring.sqMask){
+        if(ringEnter(0) < 0 && errno != EINTR && errno != EBUSY){
+            err_sys("(%s) error - io_uring_enter() failed", prog_name);
+        }
+    }
+    sqe = &ring.sqes[tail & *ring.sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sqArray[tail & *ring.sqMask] = tail & *ring.sqMask;
+    __atomic_store_n(ring.sqTail, tail+1, __ATOMIC_RELEASE);
+    ring.toSubmit++;
+    return sqe;
+}
+
+
+static int ringEnter(unsigned minComplete){
+    int n;
+    
+    n = (int)syscall(__NR_io_uring_enter, ring.fd, ring.toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(n >= 0){
+        ring.toSubmit -= n;
+    }
+    return n;
+}
+
+
+static void queueAccept(int passive_socket){
+    struct io_uring_sqe *sqe = getSqe();
+    
+    acceptAddrlen = sizeof(acceptAddr);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = passive_socket;
+    sqe->addr = (uintptr_t)&acceptAddr;
+    sqe->addr2 = (uintptr_t)&acceptAddrlen;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = TAG_ACCEPT;
+}
+
+
+static void queueTick(void){
+    struct io_uring_sqe *sqe = getSqe();
+    
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)&tick;
+    sqe->len = 1;
+    sqe->user_data = TAG_TICK;
+}
+
+
+static void queueRecv(struct uconnection *c){
+    struct io_uring_sqe *sqe = getSqe();
+    
+    c->state = URING_RECV;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->socket;
+    sqe->addr = (uintptr_t)(c->rcvbuffer + c->rcvlen);
+    sqe->len = RCVBUFFERLENGTH-1-c->rcvlen;
+    sqe->user_data = (uintptr_t)c;
+}
+
+
+//send the next bytes of the buffer, at most a step of the rate limits of a file body
+static void queueSend(struct uconnection *c){
+    struct io_uring_sqe *sqe;
+    size_t len = c->buflen - c->bufpos, step;
+    unsigned delay;
+    
+    if(c->sending && c->rf.generated == NULL){
+        if((step = shaperGrant(&c->shaper, &delay)) == 0){
+            c->state = URING_THROTTLED;
+            timerArmMs(&wheel, &c->throttle, delay);
+            return;
+        }
+        len = (len < step) ? len : step;
+    }
+    sqe = getSqe();
+    c->state = URING_SEND;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->socket;
+    sqe->addr = (uintptr_t)(c->sendbuf + c->bufpos);
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)c;
+}
+
+
+//read the next chunk of the file after the c->buflen bytes already in the buffer
+static void queueRead(struct uconnection *c){
+    struct io_uring_sqe *sqe = getSqe();
+    off_t left = c->filesize - c->offset;
+    size_t room = transferChunkSize - c->buflen;
+    
+    c->state = URING_READ;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = c->rf.fd;
+    sqe->off = c->offset;
+    sqe->addr = (uintptr_t)(c->buffer + c->buflen);
+    sqe->len = (left < (off_t)room) ? (unsigned)left : (unsigned)room;
+    sqe->user_data = (uintptr_t)c;
+}
+
+
+//a body in memory (file cache, STATS, LIST): its first bytes are copied after the header in the buffer,
+//so that the header leaves in the same send
+static void frameMemory(struct uconnection *c){
+    off_t left = c->filesize - c->offset;
+    size_t room = (transferChunkSize > c->buflen) ? transferChunkSize - c->buflen : 0;
+    
+    if(c->rf.cached == NULL || left <= 0 || room == 0){
+        return;
+    }
+    if(left < (off_t)room){
+        room = (size_t)left;
+    }
+    memcpy(c->buffer + c->buflen, c->rf.cached + c->offset, room);
+    c->buflen += room;
+    c->offset += room;
+}
+
+
+static void handleCompletion(int passive_socket, struct io_uring_cqe *cqe){
+    
+    struct uconnection *c;
+    size_t n;
+    int ticket;
+    char addr[LOGADDRLENGTH];
+    
+    if(cqe->user_data == TAG_ACCEPT){
+        admissionSampleQueue(passive_socket);
+        if(cqe->res >= 0){
+            admissionAccepted();
+        }
+        if(cqe->res >= 0 && (ticket = admissionEnter(&acceptAddr)) < 0){
+            admissionRefuse(cqe->res, ticket);
+        }else if(cqe->res >= 0){
+            if((c = calloc(1, sizeof(struct uconnection))) == NULL){
+                LOG(LVL_ERROR, "Out of memory. Closing connection");
+                admissionLeave(ticket);
+                Close(cqe->res);
+            }else{
+                c->socket = cqe->res;
+                c->ticket = ticket;
+                transferSetNoDelay(c->socket);
+                timerInit(&c->timer, c);
+                timerInit(&c->throttle, c);
+                shaperOpen(&c->shaper, c->socket, &acceptAddr);
+                c->next = connections;
+                if(connections != NULL){
+                    connections->prev = c;
+                }
+                connections = c;
+                statsAdd(STAT_CONN_ACCEPTED, 1);
+                LOG_SAMPLED(LVL_INFO, "Accepted connection from %s on socket %d", logFormatAddr(addr, &acceptAddr), c->socket);
+                setDeadline(c, DEADLINE_IDLE);
+                queueRecv(c);
+            }
+        }else if(admissionAcceptFailed(-cqe->res)){
+            //the tick, one ADMITRETRYMS later, queues it again
+            acceptDeferred = 1;
+            return;
+        }
+        queueAccept(passive_socket);
+        return;
+    }
+    if(cqe->user_data == TAG_TICK){
+        if(acceptDeferred){
+            acceptDeferred = 0;
+            queueAccept(passive_socket);
+        }
+        wheelAdvance(&wheel, deadlineExpired);
+        queueTick();
+        return;
+    }
+    if(cqe->user_data == TAG_CANCEL){
+        return;
+    }
+    
+    c = (struct uconnection *)(uintptr_t)cqe->user_data;
+    if(c->cancelled){
+        //cancelled or completed before the cancel: either way the connection is over
+        statsAdd(STAT_TIMEOUTS, 1);
+        closeConnection(c, deadlineMessage(c->deadline), 0);
+        return;
+    }
+    switch(c->state){
+            
+        case URING_RECV:
+            if(cqe->res == 0){
+                closeConnection(c, "Connection closed by party", 0);
+            }else if(cqe->res < 0){
+                if(cqe->res == -EINTR || cqe->res == -EAGAIN){
+                    queueRecv(c);
+                }else{
+                    statsAdd(STAT_ERR_RECV, 1);
+                    closeConnection(c, "Reading error", 1);
+                }
+            }else{
+                c->rcvlen += cqe->res;
+                nextCommand(c);
+            }
+            break;
+            
+        case URING_READ:
+            if(cqe->res <= 0){
+                closeConnection(c, "Reading file failed", 0);
+                break;
+            }
+            c->offset += cqe->res;
+            c->buflen += cqe->res;
+            queueSend(c);
+            break;
+            
+        case URING_SEND:
+            if(cqe->res < 0){
+                if(cqe->res == -EINTR || cqe->res == -EAGAIN){
+                    queueSend(c);
+                }else{
+                    statsAdd(STAT_ERR_SEND, 1);
+                    closeConnection(c, "Sending file failed", 0);
+                }
+                break;
+            }
+            c->bufpos += cqe->res;
+            if(c->rf.generated == NULL){
+                n = ((size_t)cqe->res < c->headerleft) ? (size_t)cqe->res : c->headerleft;
+                c->headerleft -= n;
+                statsAdd(STAT_BYTES_SENT, cqe->res - n);
+                shaperCharge(&c->shaper, cqe->res);
+            }
+            if(c->bufpos < c->buflen){
+                queueSend(c);
+            }else if(c->offset < c->filesize && c->rf.cached != NULL){
+                //cached file: the next chunk is sent straight from the cache memory
+                c->sendbuf = c->rf.cached + c->offset;
+                c->buflen = (c->filesize - c->offset < (off_t)transferChunkSize) ? (size_t)(c->filesize - c->offset) : transferChunkSize;
+                c->bufpos = 0;
+                c->offset += c->buflen;
+                queueSend(c);
+            }else if(c->offset < c->filesize){
+                c->sendbuf = c->buffer;
+                c->buflen = c->bufpos = 0;
+                queueRead(c);
+            }else{
+                if(c->sending){
+                    if(c->rf.generated == NULL){
+                        statsAdd(STAT_GETS, 1);
+                        shaperIdle(&c->shaper);
+                    }
+                    LOG_SAMPLED(LVL_INFO, "(socket %d) %s sent%s", c->socket, c->rf.generated != NULL ? "Reply" : "File",
+                           c->rf.cached != NULL && c->rf.generated == NULL ? " (cache)" : "");
+                    if(fileCacheEnabled()){
+                        printCacheStats();
+                    }
+                    closeRequestedFile(&c->rf);
+                    c->sending = 0;
+                }
+                if(c->batch.names != NULL){
+                    nextRecord(c);
+                    break;
+                }
+                free(c->buffer);
+                c->buffer = NULL;
+                c->deadline = DEADLINE_NONE;
+                nextCommand(c);
+            }
+            break;
+            
+        case URING_THROTTLED:
+            //no operation in flight: never completes
+            break;
+    }
+}
+
+
+//consume the next buffered command line, or receive more bytes
+static void nextCommand(struct uconnection *c){
+    
+    char *eol;
+    size_t linelen;
+    char line[RCVBUFFERLENGTH];
+    
+    if((eol = memchr(c->rcvbuffer, '\n', c->rcvlen)) == NULL){
+        if(c->rcvlen >= RCVBUFFERLENGTH-1){
+            statsAdd(STAT_ERR_COMMAND, 1);
+            closeConnection(c, "Command too long", 1);
+            return;
+        }
+        //waiting for a command, or for the rest of one: the header deadline runs from its first byte
+        setDeadline(c, c->rcvlen == 0 ? DEADLINE_IDLE : DEADLINE_HEADER);
+        queueRecv(c);
+        return;
+    }
+    
+    linelen = eol - c->rcvbuffer + 1;
+    memcpy(line, c->rcvbuffer, linelen);
+    line[linelen] = '\0';
+    c->rcvlen -= linelen;
+    memmove(c->rcvbuffer, c->rcvbuffer+linelen, c->rcvlen);
+    if(processCommand(c, line) == 0){
+        setDeadline(c, DEADLINE_TRANSFER);
+    }
+}
+
+
+//handle a complete command line, an operation is queued unless the connection is closed
+static int processCommand(struct uconnection *c, char *line){
+    
+    char *filename;
+    struct request req;
+    struct stat *st;
+    int n;
+    
+    if(parseRequest(line, &req) == REQ_QUIT){
+        LOG_SAMPLED(LVL_INFO, "(socket %d) QUIT command received", c->socket);
+        closeConnection(c, "Closing connection", 0);
+        return -1;
+    }
+    
+    if(req.type == REQ_STATS || req.type == REQ_LIST){
+        LOG_SAMPLED(LVL_INFO, "(socket %d) %s command received", c->socket, req.type == REQ_STATS ? "STATS" : "LIST");
+        if(req.type == REQ_STATS ? openStatsReply(&c->rf) < 0 : openListReply(&c->rf) < 0){
+            closeConnection(c, req.type == REQ_STATS ? "Out of memory" : "Listing not available", 1);
+            return -1;
+        }
+        c->sending = 1;
+        if((c->buffer = malloc(transferChunkSize < MAXHEADERLENGTH+1 ? MAXHEADERLENGTH+1 : transferChunkSize)) == NULL){
+            closeConnection(c, "Out of memory", 1);
+            return -1;
+        }
+        //the report is in memory: it is sent like a cached file
+        c->buflen = req.type == REQ_STATS ? buildStatsHeader(c->buffer, &c->rf) : buildListHeader(c->buffer, &c->rf);
+        c->bufpos = 0;
+        c->headerleft = c->buflen;
+        c->sendbuf = c->buffer;
+        c->offset = 0;
+        c->filesize = c->rf.st.st_size;
+        frameMemory(c);
+        queueSend(c);
+        return 0;
+    }
+    
+    if(req.type == REQ_MGET){
+        if(batchStart(&c->batch, req.filename) < 0){
+            statsAdd(STAT_ERR_COMMAND, 1);
+            closeConnection(c, "Invalid MGET command received", 1);
+            return -1;
+        }
+        //one buffer for the whole batch: every record is placed in front of the first chunk of its file
+        if((c->buffer = malloc(transferChunkSize < MAXHEADERLENGTH+1 ? MAXHEADERLENGTH+1 : transferChunkSize)) == NULL){
+            closeConnection(c, "Out of memory", 1);
+            return -1;
+        }
+        LOG_SAMPLED(LVL_INFO, "(socket %d) MGET command received: %u files", c->socket, (unsigned)c->batch.left);
+        c->buflen = buildBatchHeader(c->buffer, &c->batch);
+        c->bufpos = 0;
+        c->headerleft = c->buflen;
+        c->sendbuf = c->buffer;
+        c->offset = c->filesize = 0;
+        queueSend(c);
+        return 0;
+    }
+    //DELTA is served by the process per connection engines only: matching the signatures walks
+    //the whole file in one go, which would stall every other connection of the loop
+    if(req.type != REQ_GET && req.type != REQ_GET64 && req.type != REQ_RGET && req.type != REQ_IFMOD){
+        statsAdd(STAT_ERR_COMMAND, 1);
+        closeConnection(c, "Invalid command received", 1);
+        return -1;
+    }
+    filename = req.filename;
+    if(!isValidFilename(filename)){
+        statsAdd(STAT_ERR_FILENAME, 1);
+        closeConnection(c, "Invalid file error", 1);
+        return -1;
+    }
+    if((n = openRequestedFile(filename, &c->rf)) != 0){
+        statsAdd(n == OPEN_FAILED ? STAT_ERR_OPEN : STAT_ERR_STAT, 1);
+        closeConnection(c, n == OPEN_FAILED ? "Opening file error" : "Getting file statistics error", 1);
+        return -1;
+    }
+    c->sending = 1;
+    st = &c->rf.st;
+    if(!replyFitsRequest(&req, st)){
+        statsAdd(STAT_ERR_TOO_LARGE, 1);
+        closeConnection(c, "File too large for GET, GET64 required", 1);
+        return -1;
+    }
+    if(resolveRange(&req, st) < 0){
+        statsAdd(STAT_ERR_RANGE, 1);
+        closeConnection(c, "Range out of the file", 1);
+        return -1;
+    }
+    if((c->buffer = malloc(transferChunkSize < MAXHEADERLENGTH+1 ? MAXHEADERLENGTH+1 : transferChunkSize)) == NULL){
+        closeConnection(c, "Out of memory", 1);
+        return -1;
+    }
+    LOG_SAMPLED(LVL_INFO, "(socket %d) GET command received: %s", c->socket, filename);
+    statsFileHit(filename);
+    
+    //reply header at the beginning of the buffer, the first chunk of the file follows it
+    c->buflen = buildReplyHeader(c->buffer, &req, st);
+    c->bufpos = 0;
+    c->headerleft = c->buflen;
+    c->sendbuf = c->buffer;
+    c->offset = req.start;
+    c->filesize = req.end;
+    if(c->offset < c->filesize && transferChunkSize > c->buflen && c->rf.cached == NULL){
+        queueRead(c);
+    }else{
+        frameMemory(c);
+        queueSend(c);
+    }
+    return 0;
+}
+
+
+//record of the next file of the MGET in progress, or the next command after the last one
+static void nextRecord(struct uconnection *c){
+    
+    const char *name;
+    
+    if((name = batchNextName(&c->batch)) == NULL){
+        batchEnd(&c->batch);
+        free(c->buffer);
+        c->buffer = NULL;
+        c->deadline = DEADLINE_NONE;
+        nextCommand(c);
+        return;
+    }
+    c->offset = c->filesize = 0;
+    if(batchOpen(&c->batch, name, &c->rf) == 0){
+        c->sending = 1;
+        c->filesize = c->rf.st.st_size;
+        c->buflen = buildRecordHeader(c->buffer, name, &c->rf.st);
+    }else{
+        LOG_SAMPLED(LVL_INFO, "(socket %d) MGET file not available: %s", c->socket, name);
+        c->buflen = buildRecordHeader(c->buffer, name, NULL);
+    }
+    c->bufpos = 0;
+    c->headerleft = c->buflen;
+    c->sendbuf = c->buffer;
+    if(c->offset < c->filesize && transferChunkSize > c->buflen && c->rf.cached == NULL){
+        queueRead(c);
+    }else{
+        frameMemory(c);
+        queueSend(c);
+    }
+}
+
+
+//close a connection with no operation in flight
+static void closeConnection(struct uconnection *c, const char *reason, int sendErr){
+    
+    if(sendErr){
+        LOG(LVL_WARN, "(socket %d) %s. Closing connection", c->socket, reason);
+        if(send(c->socket, ERR_MSG, sizeof(ERR_MSG)-1, MSG_NOSIGNAL | MSG_DONTWAIT) != (sizeof(ERR_MSG)-1)){
+            LOG(LVL_WARN, "(socket %d) Sending error message failed!", c->socket);
+        }
+    }else{
+        LOG_SAMPLED(LVL_INFO, "(socket %d) %s. Closing connection", c->socket, reason);
+    }
+    if(c->sending){
+        closeRequestedFile(&c->rf);
+    }
+    free(c->buffer);
+    batchEnd(&c->batch);
+    timerCancel(&wheel, &c->timer);
+    timerCancel(&wheel, &c->throttle);
+    shaperClose(&c->shaper);
+    admissionLeave(c->ticket);
+    Close(c->socket);
+    statsAdd(STAT_CONN_CLOSED, 1);
+    
+    if(c->prev != NULL){
+        c->prev->next = c->next;
+    }else{
+        connections = c->next;
+    }
+    if(c->next != NULL){
+        c->next->prev = c->prev;
+    }
+    free(c);
+}
+
+
+//arms the deadline of the connection, unless it is already running (0 seconds: no deadline)
+static void setDeadline(struct uconnection *c, deadlineKind kind){
+    
+    unsigned seconds = deadlineSeconds(kind);
+    
+    if(c->deadline == kind && timerArmed(&c->timer)){
+        return;
+    }
+    c->deadline = kind;
+    if(seconds == 0){
+        timerCancel(&wheel, &c->timer);
+    }else{
+        timerArm(&wheel, &c->timer, seconds);
+    }
+}
+
+
+//the operation in flight completes with -ECANCELED and the connection is closed there
+static void deadlineExpired(struct timer *t){
+    
+    struct uconnection *c = t->data;
+    struct io_uring_sqe *sqe;
+    
+    //the rate limits allow the body to go on
+    if(t == &c->throttle){
+        queueSend(c);
+        return;
+    }
+    //no operation to cancel while waiting for them
+    if(c->state == URING_THROTTLED){
+        statsAdd(STAT_TIMEOUTS, 1);
+        closeConnection(c, deadlineMessage(c->deadline), 0);
+        return;
+    }
+    c->cancelled = 1;
+    sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)c;
+    sqe->user_data = TAG_CANCEL;
+}
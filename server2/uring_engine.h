@@ -0,0 +1,16 @@
+/*
+ 
+ module: uring_engine.h
+ 
+ purpose: definitions of functions in uring_engine.c
+ 
+ */
+
+
+#ifndef _URING_ENGINE_H
+
+#define _URING_ENGINE_H
+
+void uringServerLoop(int passive_socket);
+
+#endif
@@ -379,6 +379,204 @@ ssize_t Readline_unbuffered (int fd, void *ptr, size_t maxlen)
 }
 
 
+/* Reentrant buffered reading: the state lives in the Rbuf of the connection,
+   so any number of sockets can be read at the same time. Each refill drains
+   what the kernel has (up to RBUFSIZE bytes) with a single read() */
+
+void rbuf_init (Rbuf *rb, int fd)
+{
+	rb->fd = fd;
+	rb->ptr = rb->buf;
+	rb->cnt = 0;
+	rb->passing = 0;
+	rb->npassed = 0;
+}
+
+/* the same on a AF_UNIX socket whose peer passes descriptors (SCM_RIGHTS):
+   they are queued in the order they arrive, as the bytes they came with */
+void rbuf_init_fd (Rbuf *rb, int fd)
+{
+	rbuf_init(rb, fd);
+	rb->passing = 1;
+}
+
+/* oldest descriptor received and not yet taken, -1 if none: the caller owns it */
+int rbuf_takefd (Rbuf *rb)
+{
+	int fd;
+
+	if (rb->npassed == 0)
+		return -1;
+	fd = rb->passed[0];
+	memmove(rb->passed, rb->passed + 1, --rb->npassed * sizeof(int));
+	return fd;
+}
+
+static ssize_t rbuf_recv (Rbuf *rb, void *vptr, size_t n)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr	cm;
+		char		control[CMSG_SPACE(sizeof(int))];
+	} control_un;
+	ssize_t nread;
+	int fd;
+
+	if (!rb->passing)
+		return read(rb->fd, vptr, n);
+	iov.iov_base = vptr;
+	iov.iov_len = n;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control_un.control;
+	msg.msg_controllen = sizeof(control_un.control);
+	if ( (nread = recvmsg(rb->fd, &msg, MSG_CMSG_CLOEXEC)) < 0)
+		return -1;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+		    cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+		{
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+			/* a read stops after the bytes of a descriptor: the queue only
+			   holds more than one if the peer sends them unasked */
+			if (rb->npassed < RBUFFDS)
+				rb->passed[rb->npassed++] = fd;
+			else
+				close(fd);
+		}
+	return nread;
+}
+
+/* bytes already received and not yet consumed: a select() on the socket would not see them */
+size_t rbuf_pending (const Rbuf *rb)
+{
+	return rb->cnt;
+}
+
+static ssize_t rbuf_fill (Rbuf *rb)
+{
+	ssize_t n;
+again:
+	if ( (n = rbuf_recv(rb, rb->buf, sizeof(rb->buf))) < 0)
+	{
+		if (INTERRUPTED_BY_SIGNAL)
+			goto again;
+		return -1;
+	}
+	rb->ptr = rb->buf;
+	rb->cnt = n;
+	return n;
+}
+
+/* reads at most "n" bytes: the buffered ones, otherwise a single read() */
+ssize_t rbuf_read (Rbuf *rb, void *vptr, size_t n)
+{
+	ssize_t nread;
+
+	if (rb->cnt == 0)
+	{
+		/* large request and nothing buffered: read straight into the caller's buffer */
+		if (n >= sizeof(rb->buf))
+		{
+			while ( (nread = rbuf_recv(rb, vptr, n)) < 0)
+				if (!INTERRUPTED_BY_SIGNAL)
+					return -1;
+			return nread;
+		}
+		if ( (nread = rbuf_fill(rb)) <= 0)
+			return nread;
+	}
+	if (n > rb->cnt)
+		n = rb->cnt;
+	memcpy(vptr, rb->ptr, n);
+	rb->ptr += n;
+	rb->cnt -= n;
+	return n;
+}
+
+/* reads exactly "n" bytes, using the buffered ones first */
+ssize_t rbuf_readn (Rbuf *rb, void *vptr, size_t n)
+{
+	size_t nleft;
+	ssize_t nread;
+	char *ptr;
+
+	ptr = vptr;
+	nleft = n;
+	while (nleft > 0)
+	{
+		if ( (nread = rbuf_read(rb, ptr, nleft)) < 0)
+			return -1;
+		else if (nread == 0)
+			break; /* EOF */
+		nleft -= nread;
+		ptr   += nread;
+	}
+	return n - nleft;
+}
+
+ssize_t Rbuf_readn (Rbuf *rb, void *ptr, size_t nbytes)
+{
+	ssize_t n;
+
+	if ( (n = rbuf_readn(rb, ptr, nbytes)) < 0)
+		err_sys ("(%s) error - rbuf_readn() failed", prog_name);
+	return n;
+}
+
+/* like readline(), but the bytes following the newline stay in the Rbuf */
+ssize_t rbuf_readline (Rbuf *rb, void *vptr, size_t maxlen)
+{
+	size_t n, len;
+	ssize_t rc;
+	char *ptr, *eol;
+
+	ptr = vptr;
+	n = 1;
+	while (n < maxlen)
+	{
+		if (rb->cnt == 0)
+		{
+			if ( (rc = rbuf_fill(rb)) < 0)
+				return -1; /* error, errno set by read() */
+			if (rc == 0)
+			{
+				if (n == 1)
+					return 0; /* EOF, no data read */
+				break; /* EOF, some data was read */
+			}
+		}
+		/* copying up to the newline (included) with a single scan of the buffer */
+		len = rb->cnt;
+		if (len > maxlen - n)
+			len = maxlen - n;
+		if ( (eol = memchr(rb->ptr, '\n', len)) != NULL)
+			len = eol - rb->ptr + 1;
+		memcpy(ptr, rb->ptr, len);
+		ptr     += len;
+		rb->ptr += len;
+		rb->cnt -= len;
+		n       += len;
+		if (eol != NULL)
+			break;	/* newline is stored, like fgets() */
+	}
+	*ptr = 0; /* null terminate like fgets() */
+	return ptr - (char *)vptr;
+}
+
+ssize_t Rbuf_readline (Rbuf *rb, void *ptr, size_t maxlen)
+{
+	ssize_t n;
+
+	if ( (n = rbuf_readline(rb, ptr, maxlen)) < 0)
+		err_sys ("(%s) error - rbuf_readline() failed", prog_name);
+	return n;
+}
+
+
 ssize_t writen (int fd, const void *vptr, size_t n)
 {
 	size_t nleft;
@@ -445,6 +643,41 @@ void Sendn (int fd, void *ptr, size_t nbytes, int flags)
 		err_sys ("(%s) error - writen() failed", prog_name);
 }
 
+/* sends "nbytes" bytes with the descriptor sendfd attached to the first of
+   them (SCM_RIGHTS, AF_UNIX sockets only). Stevens, 15.7 */
+ssize_t write_fd (int fd, const void *ptr, size_t nbytes, int sendfd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr	cm;
+		char		control[CMSG_SPACE(sizeof(int))];
+	} control_un;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = control_un.control;
+	msg.msg_controllen = sizeof(control_un.control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(cmsg), &sendfd, sizeof(int));
+	iov.iov_base = (void *)ptr;
+	iov.iov_len = nbytes;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	while ( (n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0)
+		if (!INTERRUPTED_BY_SIGNAL)
+			return -1;
+	/* the descriptor went with the first bytes, the rest is plain */
+	if ((size_t)n < nbytes && sendn(fd, (const char *)ptr + n, nbytes - n, MSG_NOSIGNAL) < 0)
+		return -1;
+	return nbytes;
+}
+
 int Select (int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset, struct timeval *timeout)
 {
 	int n;
@@ -459,6 +692,20 @@ again:
 	return n;
 }
 
+int Poll (struct pollfd *fdarray, nfds_t nfds, int timeout)
+{
+	int n;
+again:
+	if ( (n = poll (fdarray, nfds, timeout)) < 0)
+	{
+		if (INTERRUPTED_BY_SIGNAL)
+			goto again;
+		else
+			err_sys ("(%s) error - poll() failed", prog_name);
+	}
+	return n;
+}
+
 
 pid_t Fork (void)
 {
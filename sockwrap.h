@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
+#include <poll.h>
 
 #define SA struct sockaddr
 
@@ -26,6 +27,20 @@
 
 typedef	void	Sigfunc(int);	/* for signal handlers */
 
+#define RBUFSIZE 8192
+#define RBUFFDS 4	/* descriptors an Rbuf keeps until they are taken */
+
+/* per-connection read buffer: bytes received in excess are kept for the next call */
+typedef struct {
+	int	fd;		/* descriptor the bytes are read from */
+	char	*ptr;		/* next unread byte inside buf */
+	size_t	cnt;		/* number of unread bytes */
+	int	passing;	/* read with recvmsg(): descriptors may come with the bytes */
+	int	passed[RBUFFDS];	/* descriptors received and not yet taken, oldest first */
+	int	npassed;
+	char	buf[RBUFSIZE];
+} Rbuf;
+
 int Socket (int family, int type, int protocol);
 
 void Bind (int sockfd, const SA *myaddr, socklen_t myaddrlen);
@@ -74,6 +89,24 @@ ssize_t readline (int fd, void *vptr, size_t maxlen);
 
 ssize_t Readline (int fd, void *ptr, size_t maxlen);
 
+void rbuf_init (Rbuf *rb, int fd);
+
+void rbuf_init_fd (Rbuf *rb, int fd);
+
+int rbuf_takefd (Rbuf *rb);
+
+size_t rbuf_pending (const Rbuf *rb);
+
+ssize_t rbuf_read (Rbuf *rb, void *vptr, size_t n);
+
+ssize_t rbuf_readn (Rbuf *rb, void *vptr, size_t n);
+
+ssize_t Rbuf_readn (Rbuf *rb, void *ptr, size_t nbytes);
+
+ssize_t rbuf_readline (Rbuf *rb, void *vptr, size_t maxlen);
+
+ssize_t Rbuf_readline (Rbuf *rb, void *ptr, size_t maxlen);
+
 ssize_t writen(int fd, const void *vptr, size_t n);
 
 void Writen (int fd, void *ptr, size_t nbytes);
@@ -82,8 +115,12 @@ ssize_t sendn (int fd, const void *vptr, size_t n, int flags);
 
 void Sendn (int fd, void *ptr, size_t nbytes, int flags);
 
+ssize_t write_fd (int fd, const void *ptr, size_t nbytes, int sendfd);
+
 int Select (int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset, struct timeval *timeout);
 
+int Poll (struct pollfd *fdarray, nfds_t nfds, int timeout);
+
 pid_t Fork (void);
 
 struct hostent *Gethostbyname (const char *hostname);
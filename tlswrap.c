@@ -0,0 +1,305 @@
+/*
+ 
+ module: tlswrap.c
+ 
+ purpose: TLS transport shared by server and client. The handshake is
+          done by OpenSSL on the connected socket; then, if the kernel
+          took over both directions of the records (kernel TLS), the
+          session is dropped and the socket itself is returned: read(),
+          send(), sendfile() and splice() work on it as on a plain TCP
+          socket, and the kernel encrypts the bytes. Otherwise the
+          session is kept by a relay thread and the caller gets the other
+          end of a socketpair: the relay decrypts what the peer sends into
+          it and encrypts what the caller writes into it, so the callers
+          use the same code in both cases.
+          Built without HAVE_OPENSSL every function fails with ENOTSUP.
+ 
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include "sockwrap.h"
+#include "tlswrap.h"
+
+#ifdef HAVE_OPENSSL
+
+/* session of one connection kept by a relay thread */
+struct tls_relay {
+	SSL	*ssl;
+	int	fd;		/* TCP socket, the peer is on the other side */
+	int	app;		/* end of the socketpair of the relay */
+};
+
+static pthread_mutex_t	relay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	relay_done = PTHREAD_COND_INITIALIZER;
+static int		relays = 0;	/* relay threads still running */
+
+static void *tls_relay_loop (void *arg);
+static void tls_timeout (int sockfd, unsigned seconds);
+
+/* context of the server (flags & TLS_SERVER: cert and key are loaded) or of
+   a client (cafile, or the default locations, verify the server). With
+   TLS_KTLS only TLS 1.2 with AES-GCM is negotiated: OpenSSL 3.0 offloads
+   the receive side of no other version */
+void *tls_context (int flags, const char *cert, const char *key, const char *cafile)
+{
+	SSL_CTX *ctx;
+
+	if ( (ctx = SSL_CTX_new((flags & TLS_SERVER) ? TLS_server_method() : TLS_client_method())) == NULL)
+		return NULL;
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	/* a relay never waits for a record that carries no data */
+	SSL_CTX_clear_mode(ctx, SSL_MODE_AUTO_RETRY);
+	SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+	if (flags & TLS_KTLS) {
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+		SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+		if (SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM") != 1)
+			goto failed;
+	}
+	if (flags & TLS_SERVER) {
+		/* no session tickets: nothing is sent after the handshake */
+		SSL_CTX_set_num_tickets(ctx, 0);
+		if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+		    SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+		    SSL_CTX_check_private_key(ctx) != 1)
+			goto failed;
+	} else if (!(flags & TLS_NOVERIFY)) {
+		if ((cafile != NULL ? SSL_CTX_load_verify_locations(ctx, cafile, NULL) :
+		     SSL_CTX_set_default_verify_paths(ctx)) != 1)
+			goto failed;
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	}
+	return ctx;
+
+failed:
+	SSL_CTX_free(ctx);
+	return NULL;
+}
+
+
+/* handshake on sockfd, bounded by timeout seconds (0: no bound). peer is the
+   address the certificate of the server must name (client only, NULL: any).
+   Returns the descriptor to use from now on (sockfd itself if the records are
+   offloaded to the kernel, *offloaded is then set) or -1: sockfd is then
+   still open and owned by the caller */
+int tls_start (void *ctx, int sockfd, const char *peer, unsigned timeout, int *offloaded)
+{
+	SSL *ssl;
+	struct tls_relay *r;
+	int sv[2], server, err;
+	pthread_t tid;
+	sigset_t all, old;
+
+	*offloaded = 0;
+	if ( (ssl = SSL_new(ctx)) == NULL || SSL_set_fd(ssl, sockfd) != 1)
+		goto failed;
+	server = SSL_is_server(ssl);
+	if (!server && peer != NULL) {
+		/* an address is matched against the IP names of the certificate */
+		if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), peer) != 1 &&
+		    (SSL_set1_host(ssl, peer) != 1 || SSL_set_tlsext_host_name(ssl, peer) != 1))
+			goto failed;
+	}
+	/* whole records are written: Nagle would hold the first one behind the Finished message */
+	err = 1;
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &err, sizeof(err));
+	tls_timeout(sockfd, timeout);
+	err = server ? SSL_accept(ssl) : SSL_connect(ssl);
+	tls_timeout(sockfd, 0);
+	if (err != 1)
+		goto failed;
+
+	/* both directions in the kernel and nothing left in the session: the socket is enough */
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) &&
+	    !SSL_has_pending(ssl)) {
+		SSL_free(ssl);
+		*offloaded = 1;
+		return sockfd;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		goto failed;
+	if ( (r = malloc(sizeof(*r))) == NULL) {
+		close(sv[0]);
+		close(sv[1]);
+		goto failed;
+	}
+	r->ssl = ssl;
+	r->fd = sockfd;
+	r->app = sv[1];
+	tls_timeout(sockfd, TLSSTALL);
+
+	/* the relay takes no signal: they stay with the threads of the caller */
+	pthread_mutex_lock(&relay_lock);
+	relays++;
+	pthread_mutex_unlock(&relay_lock);
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&tid, NULL, tls_relay_loop, r);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		pthread_mutex_lock(&relay_lock);
+		relays--;
+		pthread_mutex_unlock(&relay_lock);
+		close(sv[0]);
+		close(sv[1]);
+		free(r);
+		errno = err;
+		goto failed;
+	}
+	pthread_detach(tid);
+	return sv[0];
+
+failed:
+	if (ssl != NULL)
+		SSL_free(ssl);
+	return -1;
+}
+
+
+/* waits for the relays to deliver what their connections still hold:
+   called before the process exits */
+void tls_drain (void)
+{
+	pthread_mutex_lock(&relay_lock);
+	while (relays > 0)
+		pthread_cond_wait(&relay_done, &relay_lock);
+	pthread_mutex_unlock(&relay_lock);
+}
+
+
+/* reason of the last failure, OpenSSL's one if it has any */
+const char *tls_strerror (void)
+{
+	static __thread char buf[256];
+	unsigned long e;
+
+	if ( (e = ERR_get_error()) == 0)
+		return strerror(errno);
+	ERR_error_string_n(e, buf, sizeof(buf));
+	ERR_clear_error();
+	return buf;
+}
+
+
+/* moves the bytes between the session and the socketpair until the caller
+   closes its end or the connection fails. When the peer ends the session the
+   caller reads end of file and the relay goes on until it closes */
+static void *tls_relay_loop (void *arg)
+{
+	struct tls_relay *r = arg;
+	char *buf;
+	struct pollfd pfd[2];
+	int toapp = 1, n;
+
+	if ( (buf = malloc(TLSRELAYBUF)) == NULL)
+		goto done;
+	pfd[0].events = pfd[1].events = POLLIN;
+	pfd[1].fd = r->app;
+	for ( ; ; ) {
+		/* after the close_notify of the peer only the caller is waited for */
+		pfd[0].fd = toapp ? r->fd : -1;
+		pfd[0].revents = pfd[1].revents = 0;
+		/* records already read by OpenSSL do not wake poll() */
+		if (toapp && SSL_pending(r->ssl) > 0)
+			pfd[0].revents = POLLIN;
+		else if (poll(pfd, 2, -1) < 0) {
+			if (INTERRUPTED_BY_SIGNAL)
+				continue;
+			break;
+		}
+
+		if (toapp && pfd[0].revents) {
+			if ( (n = SSL_read(r->ssl, buf, TLSRELAYBUF)) > 0) {
+				if (sendn(r->app, buf, n, MSG_NOSIGNAL) != n)
+					break;
+			} else if (SSL_get_error(r->ssl, n) == SSL_ERROR_ZERO_RETURN) {
+				/* close_notify: end of file for the caller */
+				toapp = 0;
+				shutdown(r->app, SHUT_WR);
+			} else if (SSL_get_error(r->ssl, n) != SSL_ERROR_WANT_READ) {
+				break;
+			}
+		}
+
+		if (pfd[1].revents) {
+			if ( (n = read(r->app, buf, TLSRELAYBUF)) > 0) {
+				if (SSL_write(r->ssl, buf, n) != n)
+					break;
+			} else {
+				/* the caller closed the connection */
+				SSL_shutdown(r->ssl);
+				break;
+			}
+		}
+	}
+	free(buf);
+
+done:
+	close(r->app);
+	close(r->fd);
+	SSL_free(r->ssl);
+	free(r);
+	pthread_mutex_lock(&relay_lock);
+	if (--relays == 0)
+		pthread_cond_broadcast(&relay_done);
+	pthread_mutex_unlock(&relay_lock);
+	return NULL;
+}
+
+
+static void tls_timeout (int sockfd, unsigned seconds)
+{
+	struct timeval tval;
+
+	tval.tv_sec = seconds;
+	tval.tv_usec = 0;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tval, sizeof(tval));
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tval, sizeof(tval));
+}
+
+#else
+
+void *tls_context (int flags, const char *cert, const char *key, const char *cafile)
+{
+	errno = ENOTSUP;
+	return NULL;
+}
+
+
+int tls_start (void *ctx, int sockfd, const char *peer, unsigned timeout, int *offloaded)
+{
+	*offloaded = 0;
+	errno = ENOTSUP;
+	return -1;
+}
+
+
+void tls_drain (void)
+{
+}
+
+
+const char *tls_strerror (void)
+{
+	return "TLS support not compiled in (HAVE_OPENSSL)";
+}
+
+#endif
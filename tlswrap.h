@@ -0,0 +1,29 @@
+/*
+ 
+ module: tlswrap.h
+ 
+ purpose: definitions of functions in tlswrap.c
+ 
+ */
+
+
+#ifndef _TLSWRAP_H
+
+#define _TLSWRAP_H
+
+#define TLS_SERVER	1	/* accepting side: certificate and key loaded */
+#define TLS_KTLS	2	/* records offloaded to the kernel (TLS 1.2, AES-GCM) */
+#define TLS_NOVERIFY	4	/* client: the certificate of the server is not verified */
+
+#define TLSRELAYBUF	(64*1024)	/* bytes moved by one step of a relay */
+#define TLSSTALL	60		/* seconds a relay waits for a send to the peer */
+
+void *tls_context (int flags, const char *cert, const char *key, const char *cafile);
+
+int tls_start (void *ctx, int sockfd, const char *peer, unsigned timeout, int *offloaded);
+
+void tls_drain (void);
+
+const char *tls_strerror (void);
+
+#endif